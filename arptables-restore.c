@@ -0,0 +1,896 @@
+/*
+ * arptables-restore: load a table from the output of arptables-save,
+ * replacing its rules with a single commit.
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <arptables.h>
+
+#define RESTORE_MAXARGS	256
+
+static const struct option restore_opts[] = {
+	{ "counters", 0, 0, 'c' },
+	{ "test", 0, 0, 't' },
+	{ "noflush", 0, 0, 'n' },
+	{ "jobs", 1, 0, 'j' },
+	{ "binary", 0, 0, 'b' },
+	{ "portable", 0, 0, 'p' },
+	{ "diff", 2, 0, 'd' },
+	{ "update", 0, 0, 'u' },
+	{ "verbose", 0, 0, 'v' },
+	{ "wait", 2, 0, 'w' },
+	{ "wait-interval", 1, 0, 'W' },
+	{ "help", 0, 0, 'h' },
+	{ 0 }
+};
+
+static int counters = 0, testing = 0, noflush = 0, binary = 0;
+static int portable = 0, diff = 0, update = 0, verbose = 0;
+
+/* -w/-W: how long to wait for the table lock, as in arptables. */
+static int wait = 0;
+static unsigned int wait_interval = 1000000;
+
+/* --diff=file: the tables read from it, until the input's are. */
+static const char *diff_from = NULL;
+static struct old_table
+{
+	char *name;
+	arptc_handle_t handle;
+} *old_tables;
+static unsigned int num_old;
+static int loading_old = 0;
+
+/* The table being restored: NULL between tables. */
+static char *table = NULL;
+static arptc_handle_t handle = NULL;
+static struct timespec table_start;
+
+/* Run one arptables command against the table being restored. */
+static void
+run(int argc, char *argv[])
+{
+	char *cur = table;
+
+	argv[0] = (char *)program_name;
+	if (!do_command(argc, argv, &cur, &handle))
+		exit_error(OTHER_PROBLEM, "%s", arptc_strerror(errno));
+	if (strcmp(cur, table) != 0)
+		exit_error(PARAMETER_PROBLEM, "command for table `%s' "
+			   "inside table `%s'", cur, table);
+}
+
+static void
+run_args(const char *arg, ...)
+{
+	char *argv[8];
+	int argc = 1;
+	va_list args;
+
+	va_start(args, arg);
+	for (; arg && argc < 7; arg = va_arg(args, const char *))
+		argv[argc++] = (char *)arg;
+	va_end(args);
+	argv[argc] = NULL;
+	run(argc, argv);
+}
+
+static void
+lock_tables(void)
+{
+	if (arptc_lock(wait, wait_interval))
+		return;
+	if (errno == EWOULDBLOCK)
+		exit_error(RESOURCE_PROBLEM, "%s. Perhaps you want to use the "
+			   "-w option?", arptc_strerror(errno));
+	exit_error(RESOURCE_PROBLEM, "%s", arptc_strerror(errno));
+}
+
+/* Lock and read the table, as arptables does. */
+static void
+open_table(void)
+{
+	lock_tables();
+
+	handle = arptc_init(table);
+	if (!handle && (errno == ENOPROTOOPT || errno == ENOENT)
+	    && arptables_insmod("arp_tables", NULL) == 0)
+		handle = arptc_init(table);
+	if (!handle)
+		exit_error(VERSION_PROBLEM,
+			   "can't initialize arptables table `%s': %s",
+			   table, arptc_strerror(errno));
+}
+
+/* Start from empty chains with ACCEPT policies, as the table would be
+   after a reboot; the input then sets everything it cares about.
+   With --noflush, start from the table as it is. */
+static void
+start_table(const char *name)
+{
+	static const char *builtins[] = { "INPUT", "OUTPUT", "FORWARD" };
+	unsigned int i;
+
+	if (!(table = strdup(name)))
+		exit_error(OTHER_PROBLEM, "out of memory");
+
+	clock_gettime(CLOCK_MONOTONIC, &table_start);
+	open_table();
+	if (noflush)
+		return;
+
+	run_args("-F", NULL);
+	run_args("-X", NULL);
+	for (i = 0; i < sizeof(builtins) / sizeof(*builtins); i++)
+		if (arptc_builtin(builtins[i], handle))
+			run_args("-P", builtins[i], "ACCEPT", NULL);
+}
+
+/* How much of a target's data arptables compares. */
+static unsigned int
+userspacesize(const char *name)
+{
+	struct arptables_target *t = find_target(name, DONT_LOAD);
+
+	return t ? t->userspacesize : ~0U;
+}
+
+struct diff_handles
+{
+	arptc_handle_t *from, *to;
+};
+
+/* Print one step of the edit script as a line for arptables --batch. */
+static int
+print_edit(const struct arptc_edit *edit, void *data)
+{
+	struct diff_handles *h = data;
+
+	printf("-t %s ", table);
+	switch (edit->op) {
+	case ARPTC_EDIT_NEW_CHAIN:
+		printf("-N %s\n", edit->chain);
+		break;
+	case ARPTC_EDIT_POLICY:
+		printf("-P %s %s\n", edit->chain, edit->target);
+		break;
+	case ARPTC_EDIT_DELETE:
+		printf("-D %s %u\n", edit->chain, edit->rulenum + 1);
+		break;
+	case ARPTC_EDIT_INSERT:
+		print_rule("-I", edit->chain, edit->rulenum + 1, edit->rule,
+			   edit->target, counters, h->to);
+		break;
+	case ARPTC_EDIT_MOVE:
+		printf("-D %s %u\n-t %s ", edit->chain, edit->from + 1, table);
+		print_rule("-I", edit->chain, edit->rulenum + 1, edit->rule,
+			   edit->target, counters, h->from);
+		break;
+	case ARPTC_EDIT_FLUSH:
+		printf("-F %s\n", edit->chain);
+		break;
+	case ARPTC_EDIT_DELETE_CHAIN:
+		printf("-X %s\n", edit->chain);
+		break;
+	}
+	return 1;
+}
+
+struct update_state
+{
+	arptc_handle_t *kernel;
+	unsigned int done[ARPTC_EDIT_DELETE_CHAIN + 1];
+};
+
+static int
+apply_edit(const struct arptc_edit *edit, void *data)
+{
+	struct update_state *u = data;
+
+	u->done[edit->op]++;
+	return arptc_apply_edit(edit, u->kernel);
+}
+
+/* --verbose: what --update did to the table, and how long it took from
+   reading the table's first line to its commit. */
+static void
+print_update(const struct update_state *u, int committed)
+{
+	static const char *what[] = {
+		[ARPTC_EDIT_NEW_CHAIN] = "chains created",
+		[ARPTC_EDIT_POLICY] = "policies set",
+		[ARPTC_EDIT_DELETE] = "rules deleted",
+		[ARPTC_EDIT_INSERT] = "rules inserted",
+		[ARPTC_EDIT_MOVE] = "rules moved",
+		[ARPTC_EDIT_FLUSH] = "chains flushed",
+		[ARPTC_EDIT_DELETE_CHAIN] = "chains deleted",
+	};
+	struct timespec now;
+	unsigned int i, n = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	printf("%s:", table);
+	for (i = 0; i < sizeof(what) / sizeof(*what); i++)
+		if (u->done[i])
+			printf("%s %u %s", n++ ? "," : "", u->done[i], what[i]);
+	printf("%s, %s in %.3fs\n", n ? "" : " no changes",
+	       committed ? "committed" : "not committed",
+	       (now.tv_sec - table_start.tv_sec)
+	       + (now.tv_nsec - table_start.tv_nsec) / 1e9);
+}
+
+/* --diff and --update: compare the table in the kernel, or in the
+   --diff file, with the input's, and print the edit script between
+   them or apply it to the kernel table. */
+static void
+diff_table(void)
+{
+	arptc_handle_t from = NULL, kernel = NULL;
+	struct diff_handles h = { &from, &handle };
+	struct update_state u = { &kernel };
+	unsigned int i, edits = 0;
+
+	for (i = 0; i < num_old; i++)
+		if (strcmp(old_tables[i].name, table) == 0) {
+			from = old_tables[i].handle;
+			old_tables[i].handle = NULL;
+		}
+	if (diff_from && !from)
+		exit_error(PARAMETER_PROBLEM, "no table `%s' in `%s'",
+			   table, diff_from);
+	if (!from && !(from = arptc_init(table)))
+		exit_error(OTHER_PROBLEM, "can't initialize arptables table "
+			   "`%s': %s", table, arptc_strerror(errno));
+
+	if (update) {
+		if (!(kernel = arptc_init(table)))
+			exit_error(OTHER_PROBLEM, "can't initialize arptables "
+				   "table `%s': %s", table,
+				   arptc_strerror(errno));
+		if (!arptc_diff(&from, &handle, userspacesize, apply_edit,
+				&u))
+			exit_error(OTHER_PROBLEM, "can't update table `%s': "
+				   "%s", table, arptc_strerror(errno));
+		for (i = 0; i <= ARPTC_EDIT_DELETE_CHAIN; i++)
+			edits += u.done[i];
+		/* Leave a table that is already as wanted alone. */
+		if (testing || !edits)
+			arptc_free(&kernel);
+		else if (!arptc_commit(&kernel))
+			exit_error(OTHER_PROBLEM, "can't commit table `%s': "
+				   "%s", table, arptc_strerror(errno));
+		if (verbose)
+			print_update(&u, edits && !testing);
+	} else if (!arptc_diff(&from, &handle, userspacesize, print_edit,
+			       &h))
+		exit_error(OTHER_PROBLEM, "can't diff table `%s': %s",
+			   table, arptc_strerror(errno));
+
+	arptc_free(&from);
+	arptc_free(&handle);
+}
+
+static void
+end_table(void)
+{
+	struct old_table *old;
+
+	if (loading_old) {
+		if (!(old = realloc(old_tables, (num_old + 1)
+				    * sizeof(*old_tables))))
+			exit_error(OTHER_PROBLEM, "out of memory");
+		old_tables = old;
+		old_tables[num_old].name = table;
+		old_tables[num_old++].handle = handle;
+		handle = NULL;
+		table = NULL;
+		return;
+	}
+	if (diff || update)
+		diff_table();
+	else if (testing)
+		arptc_free(&handle);
+	else if (!arptc_commit(&handle))
+		exit_error(OTHER_PROBLEM, "can't commit table `%s': %s",
+			   table, arptc_strerror(errno));
+	handle = NULL;
+	free(table);
+	table = NULL;
+}
+
+/* Set a policy, with the counters from `[packets:bytes]' if there are
+   any and they are wanted. */
+static void
+set_policy(const char *chain, const char *policy, char *pcnt, char *bcnt)
+{
+	if (pcnt)
+		run_args("-P", chain, policy, "-c", pcnt, bcnt, NULL);
+	else
+		run_args("-P", chain, policy, NULL);
+}
+
+/* --noflush: the input replaces this chain's rules, and those of no
+   other chain.  Rules it keeps keep their counters, unless the input
+   gives counters itself; so does the policy, if it stays the same. */
+static void
+replace_chain(const char *chain, const char *policy, char *pcnt,
+	      char *bcnt)
+{
+	struct arpt_counters unused;
+	const char *cur;
+
+	if (!arptc_is_chain(chain, handle)) {
+		if (strcmp(policy, "-") == 0)
+			run_args("-N", chain, NULL);
+		else
+			set_policy(chain, policy, pcnt, bcnt);
+		return;
+	}
+
+	if (!(counters ? arptc_flush_entries(chain, &handle)
+		       : arptc_reload_chain(chain, &handle)))
+		exit_error(OTHER_PROBLEM, "%s", arptc_strerror(errno));
+
+	if (strcmp(policy, "-") != 0
+	    && (pcnt || !(cur = arptc_get_policy(chain, &unused, &handle))
+		|| strcmp(cur, policy) != 0))
+		set_policy(chain, policy, pcnt, bcnt);
+}
+
+/* Split `[packets:bytes]' in place. */
+static void
+policy_counters(char *arg, char **pcnt, char **bcnt)
+{
+	size_t n = strlen(arg);
+	char *colon;
+
+	if (n < 5 || arg[0] != '[' || arg[n - 1] != ']'
+	    || !(colon = strchr(arg, ':')))
+		exit_error(PARAMETER_PROBLEM, "bad policy counters `%s'", arg);
+	arg[n - 1] = *colon = '\0';
+	*pcnt = arg + 1;
+	*bcnt = colon + 1;
+	if (!**pcnt || strspn(*pcnt, "0123456789") != strlen(*pcnt)
+	    || !**bcnt || strspn(*bcnt, "0123456789") != strlen(*bcnt))
+		exit_error(PARAMETER_PROBLEM, "bad policy counters `%s:%s'",
+			   *pcnt, *bcnt);
+}
+
+/* Drop `-c packets bytes' from a rule unless counters are wanted. */
+static int
+strip_counters(int argc, char *argv[])
+{
+	int i, j;
+
+	for (i = j = 1; i < argc; i++) {
+		if ((strcmp(argv[i], "-c") == 0
+		     || strcmp(argv[i], "--set-counters") == 0)
+		    && i + 2 < argc) {
+			i += 2;
+			continue;
+		}
+		argv[j++] = argv[i];
+	}
+	argv[j] = NULL;
+	return j;
+}
+
+/* A line split into words, and if it is a rule fast_parse() knows,
+   that rule. */
+struct parsed_line
+{
+	int argc;		/* -1 if split_line() failed, with err */
+	const char *err;
+	int fast;
+	struct fast_rule rule;
+};
+
+static int
+is_rule(int argc, char *argv[])
+{
+	return argc > 1 && argv[1][0] != '#' && argv[1][0] != '*'
+		&& argv[1][0] != ':' && strcmp(argv[1], "COMMIT") != 0;
+}
+
+/* Everything about a line that doesn't need the handle; this may run
+   in a worker thread. */
+static void
+parse_line(char *line, char *argv[], struct parsed_line *p)
+{
+	p->argc = split_line(line, argv + 1, RESTORE_MAXARGS - 1, &p->err);
+	p->fast = 0;
+	if (p->argc < 0)
+		return;
+	p->argc++;
+	if (!is_rule(p->argc, argv))
+		return;
+	if (!counters)
+		p->argc = strip_counters(p->argc, argv);
+	p->fast = fast_parse(p->argc, argv, &p->rule);
+}
+
+static void
+apply_line(struct parsed_line *p, char *argv[])
+{
+	int argc = p->argc;
+
+	if (argc < 0)
+		exit_error(PARAMETER_PROBLEM, "%s", p->err);
+	if (argc == 1 || argv[1][0] == '#')
+		return;
+
+	if (argv[1][0] == '*') {
+		if (argc != 2 || !argv[1][1])
+			exit_error(PARAMETER_PROBLEM, "bad table line");
+		if (table)
+			end_table();
+		start_table(argv[1] + 1);
+		return;
+	}
+
+	if (!table)
+		exit_error(PARAMETER_PROBLEM, "no table specified");
+
+	if (strcmp(argv[1], "COMMIT") == 0) {
+		end_table();
+		return;
+	}
+
+	/* `:chain policy [packets:bytes]' for a built-in, `:chain -' for
+	   a user chain. */
+	if (argv[1][0] == ':') {
+		char *pcnt = NULL, *bcnt = NULL;
+
+		if (argc < 3 || argc > 4 || !argv[1][1]
+		    || (argc == 4 && strcmp(argv[2], "-") == 0))
+			exit_error(PARAMETER_PROBLEM, "bad chain line");
+		if (argc == 4) {
+			policy_counters(argv[3], &pcnt, &bcnt);
+			if (!counters)
+				pcnt = bcnt = NULL;
+		}
+		if (noflush)
+			replace_chain(argv[1] + 1, argv[2], pcnt, bcnt);
+		else if (strcmp(argv[2], "-") == 0)
+			run_args("-N", argv[1] + 1, NULL);
+		else
+			set_policy(argv[1] + 1, argv[2], pcnt, bcnt);
+		return;
+	}
+
+	if (!p->fast || !fast_append_rule(&p->rule, &handle))
+		run(argc, argv);
+	if (p->fast)
+		fast_free(&p->rule);
+}
+
+static void
+restore_line(char *line)
+{
+	static struct parsed_line p;
+	char *argv[RESTORE_MAXARGS];
+
+	parse_line(line, argv, &p);
+	apply_line(&p, argv);
+}
+
+/*
+ * With --jobs, a pool of threads parses the input a chunk of lines at
+ * a time, while the main thread applies the chunks to the handle in
+ * file order.  Workers stay at most `window' chunks ahead of it.
+ */
+#define CHUNK_LINES	64
+
+struct chunk
+{
+	char *start, *end;
+	unsigned int first;	/* lines before this chunk */
+	unsigned int nlines;
+	struct parsed_line *lines;
+	char **args;		/* the argv of each line in turn */
+	size_t nargs;
+	int done;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static struct chunk *chunks;
+static unsigned int nchunks, next_chunk, applied, window;
+
+static void
+parse_chunk(struct chunk *c)
+{
+	char *argv[RESTORE_MAXARGS], *line, *nl;
+	size_t maxargs = c->nlines * 16;
+	unsigned int i;
+
+	c->lines = malloc(c->nlines * sizeof(*c->lines));
+	c->args = malloc(maxargs * sizeof(*c->args));
+	if (!c->lines || !c->args)
+		exit_error(OTHER_PROBLEM, "out of memory");
+
+	for (i = 0, line = c->start; i < c->nlines; i++, line = nl + 1) {
+		if (!(nl = memchr(line, '\n', c->end - line)))
+			nl = c->end;
+		*nl = '\0';
+		parse_line(line, argv, &c->lines[i]);
+		if (c->lines[i].argc < 0)
+			continue;
+
+		if (c->nargs + c->lines[i].argc + 1 > maxargs) {
+			maxargs = 2 * (maxargs + c->lines[i].argc);
+			if (!(c->args = realloc(c->args,
+						maxargs * sizeof(*c->args))))
+				exit_error(OTHER_PROBLEM, "out of memory");
+		}
+		memcpy(c->args + c->nargs, argv,
+		       (c->lines[i].argc + 1) * sizeof(*argv));
+		c->args[c->nargs + c->lines[i].argc] = NULL;
+		c->nargs += c->lines[i].argc + 1;
+	}
+}
+
+static void *
+worker(void *unused)
+{
+	unsigned int n;
+
+	pthread_mutex_lock(&pool_lock);
+	for (;;) {
+		while (next_chunk < nchunks && next_chunk >= applied + window)
+			pthread_cond_wait(&pool_cond, &pool_lock);
+		if (next_chunk == nchunks)
+			break;
+		n = next_chunk++;
+		pthread_mutex_unlock(&pool_lock);
+
+		parse_chunk(&chunks[n]);
+
+		pthread_mutex_lock(&pool_lock);
+		chunks[n].done = 1;
+		pthread_cond_broadcast(&pool_cond);
+	}
+	pthread_mutex_unlock(&pool_lock);
+	return NULL;
+}
+
+static void
+restore_parallel(char *buf, size_t len, unsigned int jobs)
+{
+	char *end = buf + len, *p, *nl;
+	unsigned int i, n, lines = 0;
+	struct parsed_line *pl;
+	pthread_t *threads;
+	char **argv;
+
+	next_chunk = applied = 0;
+	nchunks = len / 64 / CHUNK_LINES + 1;
+	if (!(chunks = calloc(nchunks, sizeof(*chunks))))
+		exit_error(OTHER_PROBLEM, "out of memory");
+	for (n = 0, p = buf; p < end; n++) {
+		if (n == nchunks) {
+			if (!(chunks = realloc(chunks, 2 * nchunks
+					       * sizeof(*chunks))))
+				exit_error(OTHER_PROBLEM, "out of memory");
+			memset(chunks + nchunks, 0, nchunks * sizeof(*chunks));
+			nchunks *= 2;
+		}
+		chunks[n].start = p;
+		chunks[n].first = lines;
+		for (i = 0; i < CHUNK_LINES && p < end; i++) {
+			nl = memchr(p, '\n', end - p);
+			p = nl ? nl + 1 : end;
+		}
+		chunks[n].end = p;
+		chunks[n].nlines = i;
+		lines += i;
+	}
+	nchunks = n;
+
+	window = 16 * jobs;
+	if (!(threads = malloc(jobs * sizeof(*threads))))
+		exit_error(OTHER_PROBLEM, "out of memory");
+	for (i = 0; i < jobs; i++)
+		if ((errno = pthread_create(&threads[i], NULL, worker, NULL)))
+			exit_error(OTHER_PROBLEM, "can't start thread: %s",
+				   strerror(errno));
+
+	for (n = 0; n < nchunks; n++) {
+		pthread_mutex_lock(&pool_lock);
+		while (!chunks[n].done)
+			pthread_cond_wait(&pool_cond, &pool_lock);
+		pthread_mutex_unlock(&pool_lock);
+
+		argv = chunks[n].args;
+		for (i = 0; i < chunks[n].nlines; i++) {
+			pl = &chunks[n].lines[i];
+			batch_line = chunks[n].first + i + 1;
+			apply_line(pl, argv);
+			if (pl->argc > 0)
+				argv += pl->argc + 1;
+		}
+		free(chunks[n].lines);
+		free(chunks[n].args);
+
+		pthread_mutex_lock(&pool_lock);
+		applied++;
+		pthread_cond_broadcast(&pool_cond);
+		pthread_mutex_unlock(&pool_lock);
+	}
+
+	for (i = 0; i < jobs; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	free(chunks);
+}
+
+/* Map the input if it is a file, or else read all of it; the lines are
+   then split in place, without copying.  The buffer is one byte longer
+   than the input, so the last line can always be terminated. */
+static char *
+read_input(int fd, size_t *len)
+{
+	struct stat st;
+	size_t size = 0;
+	char *buf = NULL;
+	ssize_t n;
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		*len = st.st_size;
+		buf = mmap(NULL, *len + 1, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE, fd, 0);
+		if (buf != MAP_FAILED && *len % getpagesize() != 0)
+			return buf;
+		/* No spare byte at the end of the last page. */
+		if (buf != MAP_FAILED)
+			munmap(buf, *len + 1);
+		buf = NULL;
+	}
+
+	*len = 0;
+	do {
+		if (*len + 1 >= size) {
+			size = size ? size * 2 : 65536;
+			if (!(buf = realloc(buf, size)))
+				exit_error(OTHER_PROBLEM, "out of memory");
+		}
+		n = read(fd, buf + *len, size - *len - 1);
+		if (n < 0 && errno != EINTR)
+			exit_error(OTHER_PROBLEM, "read error: %s",
+				   strerror(errno));
+		if (n > 0)
+			*len += n;
+	} while (n != 0);
+	return buf;
+}
+
+/* A snapshot from arptables-save --binary goes to the kernel as it is. */
+static void
+restore_binary(void *image, size_t len)
+{
+	if (noflush)
+		exit_error(PARAMETER_PROBLEM,
+			   "--noflush doesn't work with --binary");
+	lock_tables();
+	if (!(testing ? arptc_check_snapshot(image, len)
+		      : arptc_restore_snapshot(image, len, counters)))
+		exit_error(OTHER_PROBLEM, "can't restore snapshot: %s",
+			   arptc_strerror(errno));
+	arptables_unlock();
+	exit(0);
+}
+
+/* A rule set from arptables-save --portable is decoded straight into
+   the handle, as it is read. */
+static void
+restore_portable(int fd)
+{
+	if (noflush)
+		exit_error(PARAMETER_PROBLEM,
+			   "--noflush doesn't work with --portable");
+	lock_tables();
+	if (!arptc_decode(fd, counters, &portable_targets, &handle))
+		exit_error(OTHER_PROBLEM, "can't read portable rule set: %s",
+			   arptc_strerror(errno));
+	if (testing)
+		arptc_free(&handle);
+	else if (!arptc_commit(&handle))
+		exit_error(OTHER_PROBLEM, "can't commit table: %s",
+			   arptc_strerror(errno));
+	arptables_unlock();
+	exit(0);
+}
+
+/* Look up the host names of all the rules together, before any line
+   is parsed. */
+static void
+resolve_input(const char *buf, size_t len)
+{
+	const char *line, *end = buf + len, *nl;
+
+	for (line = buf; line < end; line = nl + 1) {
+		if (!(nl = memchr(line, '\n', end - line)))
+			nl = end;
+		resolve_want(line, nl - line);
+	}
+	resolve_run();
+}
+
+/* Restore all the tables in `buf'. */
+static void
+restore_input(char *buf, size_t len, unsigned int jobs)
+{
+	char *line, *end, *nl;
+
+	batch_line = 0;
+	resolve_input(buf, len);
+	if (jobs > 1 && len > 64 * CHUNK_LINES)
+		restore_parallel(buf, len, jobs);
+	else
+		for (line = buf, end = buf + len; line < end; line = nl + 1) {
+			if (!(nl = memchr(line, '\n', end - line)))
+				nl = end;
+			*nl = '\0';
+			batch_line++;
+			restore_line(line);
+		}
+
+	/* Errors from here on aren't about any one line. */
+	batch_line = 0;
+	if (table)
+		end_table();
+}
+
+int
+main(int argc, char *argv[])
+{
+	char *buf;
+	unsigned int jobs;
+	size_t len;
+	int fd = 0, c;
+
+	program_name = "arptables-restore";
+	/* Installed as arptables-legacy-apply, it is --update --verbose. */
+	if ((buf = strrchr(argv[0], '/')))
+		buf++;
+	else
+		buf = argv[0];
+	if (strstr(buf, "-apply")) {
+		program_name = "arptables-apply";
+		update = verbose = 1;
+	}
+	c = sysconf(_SC_NPROCESSORS_ONLN);
+	jobs = c > 0 ? c : 1;
+
+	while ((c = getopt_long(argc, argv, "ctnj:bpd::uvw::W:h", restore_opts, NULL))
+	       != -1) {
+		switch (c) {
+		case 'c':
+			counters = 1;
+			break;
+		case 't':
+			testing = 1;
+			break;
+		case 'n':
+			noflush = 1;
+			break;
+		case 'j':
+			if (string_to_number(optarg, 1, 1024, &jobs) == -1)
+				exit_error(PARAMETER_PROBLEM,
+					   "invalid number of jobs `%s'", optarg);
+			break;
+		case 'b':
+			binary = 1;
+			break;
+		case 'p':
+			portable = 1;
+			break;
+		case 'd':
+			diff = 1;
+			diff_from = optarg;
+			break;
+		case 'u':
+			update = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'w': {
+			unsigned int seconds;
+
+			/* `-w 5' too: a file named 5 must be ./5. */
+			if (!optarg && optind < argc && *argv[optind]
+			    && argv[optind][strspn(argv[optind],
+						   "0123456789")] == '\0')
+				optarg = argv[optind++];
+			if (!optarg)
+				wait = ARPTC_LOCK_WAIT_FOREVER;
+			else if (string_to_number(optarg, 0, INT_MAX,
+						  &seconds) == -1)
+				exit_error(PARAMETER_PROBLEM,
+					   "wait seconds not numeric");
+			else
+				wait = seconds;
+			break;
+		}
+		case 'W':
+			if (string_to_number(optarg, 0, INT_MAX,
+					     &wait_interval) == -1)
+				exit_error(PARAMETER_PROBLEM,
+					   "wait interval not numeric");
+			break;
+		case 'h':
+			printf("Usage: %s [-c] [-t] [-n] [-b | -p] [-j jobs] "
+			       "[-d[old] | -u] [-v] [-w [secs]] [-W usecs] "
+			       "[file]\n",
+			       program_name);
+			exit(0);
+		default:
+			exit_tryhelp(PARAMETER_PROBLEM);
+		}
+	}
+	if (optind + 1 < argc)
+		exit_error(PARAMETER_PROBLEM, "unexpected argument `%s'",
+			   argv[optind + 1]);
+	if (optind < argc && strcmp(argv[optind], "-") != 0
+	    && (fd = open(argv[optind], O_RDONLY)) < 0)
+		exit_error(OTHER_PROBLEM, "can't open `%s': %s",
+			   argv[optind], strerror(errno));
+	if (binary && portable)
+		exit_error(PARAMETER_PROBLEM,
+			   "--binary and --portable don't go together");
+
+	if ((diff || update) && (binary || portable))
+		exit_error(PARAMETER_PROBLEM, "--%s only works with text input",
+			   diff ? "diff" : "update");
+	if (diff && update)
+		exit_error(PARAMETER_PROBLEM,
+			   "--diff and --update don't go together");
+
+	if (portable)
+		restore_portable(fd);
+	if (diff_from) {
+		int old_fd = open(diff_from, O_RDONLY);
+
+		if (old_fd < 0)
+			exit_error(OTHER_PROBLEM, "can't open `%s': %s",
+				   diff_from, strerror(errno));
+		buf = read_input(old_fd, &len);
+		loading_old = 1;
+		restore_input(buf, len, jobs);
+		loading_old = 0;
+		close(old_fd);
+	}
+	buf = read_input(fd, &len);
+	if (binary)
+		restore_binary(buf, len);
+	restore_input(buf, len, jobs);
+
+	arptables_unlock();
+	exit(0);
+}
@@ -0,0 +1,175 @@
+/*
+ * arptables-save: dump the rules of an arptables table in a form
+ * arptables-restore (or arptables --batch) reads back.
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <arptables.h>
+
+/* Output goes out in large blocks rather than per line. */
+#define SAVE_BUFSIZ	(1 << 20)
+
+static const struct option save_opts[] = {
+	{ "counters", 0, 0, 'c' },
+	{ "table", 1, 0, 't' },
+	{ "binary", 0, 0, 'b' },
+	{ "portable", 0, 0, 'p' },
+	{ "hashes", 0, 0, 'H' },
+	{ "help", 0, 0, 'h' },
+	{ 0 }
+};
+
+static void
+save_table(const char *table, int counters, int hashes)
+{
+	arptc_handle_t handle;
+	const struct arpt_entry *e;
+	struct arptc_cursor cursor;
+	struct arpt_counters pol;
+	const char *chain, *policy;
+	uint64_t hash;
+
+	/* A save is what gets restored at boot: never from the table
+	   cache, which may be behind the kernel. */
+	handle = arptc_init(table);
+	if (!handle)
+		exit_error(OTHER_PROBLEM, "can't initialize arptables table "
+			   "`%s': %s", table, arptc_strerror(errno));
+
+	printf("*%s\n", table);
+	for (chain = arptc_first_chain(&handle); chain;
+	     chain = arptc_next_chain(&handle)) {
+		policy = arptc_get_policy(chain, &pol, &handle);
+		printf(":%s %s", chain, policy ? policy : "-");
+		if (policy && counters)
+			printf(" [%"PRIu64":%"PRIu64"]", (uint64_t)pol.pcnt,
+			       (uint64_t)pol.bcnt);
+		printf("\n");
+	}
+	/* As comments, so the output still restores. */
+	for (chain = hashes ? arptc_first_chain(&handle) : NULL; chain;
+	     chain = arptc_next_chain(&handle)) {
+		if (!arptc_chain_hash(chain, &hash, &handle))
+			exit_error(OTHER_PROBLEM, "%s",
+				   arptc_strerror(errno));
+		printf("# hash %s %016"PRIx64"\n", chain, hash);
+	}
+
+	for (chain = arptc_first_chain(&handle); chain;
+	     chain = arptc_next_chain(&handle)) {
+		if (!arptc_cursor_init(&cursor, chain, &handle))
+			exit_error(OTHER_PROBLEM, "%s",
+				   arptc_strerror(errno));
+		while ((e = arptc_cursor_next(&cursor)))
+			save_rule(chain, e, counters, &handle);
+	}
+	printf("\n");
+
+	arptc_free(&handle);
+}
+
+/* The table as a binary snapshot, for arptables-restore --binary. */
+static void
+save_binary(const char *table, int counters)
+{
+	arptc_handle_t handle;
+
+	handle = arptc_init(table);
+	if (!handle)
+		exit_error(OTHER_PROBLEM, "can't initialize arptables table "
+			   "`%s': %s", table, arptc_strerror(errno));
+	if (!arptc_save_snapshot(STDOUT_FILENO, counters, &handle))
+		exit_error(OTHER_PROBLEM, "can't save table `%s': %s",
+			   table, arptc_strerror(errno));
+	arptc_free(&handle);
+}
+
+/* The table as a portable rule set, for arptables-restore --portable. */
+static void
+save_portable(const char *table, int counters)
+{
+	arptc_handle_t handle;
+
+	handle = arptc_init(table);
+	if (!handle)
+		exit_error(OTHER_PROBLEM, "can't initialize arptables table "
+			   "`%s': %s", table, arptc_strerror(errno));
+	if (!arptc_encode(STDOUT_FILENO, counters, &portable_targets,
+			  &handle))
+		exit_error(OTHER_PROBLEM, "can't save table `%s': %s",
+			   table, arptc_strerror(errno));
+	arptc_free(&handle);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *table = "filter";
+	int c, counters = 0, binary = 0, portable = 0, hashes = 0;
+
+	program_name = "arptables-save";
+	setvbuf(stdout, NULL, _IOFBF, SAVE_BUFSIZ);
+
+	while ((c = getopt_long(argc, argv, "ct:bpHh", save_opts, NULL)) != -1) {
+		switch (c) {
+		case 'c':
+			counters = 1;
+			break;
+		case 't':
+			table = optarg;
+			break;
+		case 'b':
+			binary = 1;
+			break;
+		case 'p':
+			portable = 1;
+			break;
+		case 'H':
+			hashes = 1;
+			break;
+		case 'h':
+			printf("Usage: %s [-c] [-H] [-b | -p] [-t table]\n",
+			       program_name);
+			exit(0);
+		default:
+			exit_tryhelp(PARAMETER_PROBLEM);
+		}
+	}
+	if (optind < argc)
+		exit_error(PARAMETER_PROBLEM, "unexpected argument `%s'",
+			   argv[optind]);
+	if (binary && portable)
+		exit_error(PARAMETER_PROBLEM,
+			   "--binary and --portable don't go together");
+
+	if (binary)
+		save_binary(table, counters);
+	else if (portable)
+		save_portable(table, counters);
+	else
+		save_table(table, counters, hashes);
+
+	if (fflush(stdout) == EOF || ferror(stdout))
+		exit_error(OTHER_PROBLEM, "write error: %s", strerror(errno));
+	exit(0);
+}
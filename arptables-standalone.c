@@ -37,10 +37,120 @@
 #include <string.h>
 #include <arptables.h>
 
+#define BATCH_MAXARGS	256
+
+static void
+batch_error(int *status, int lineno, int err, const char *msg)
+{
+	fprintf(stderr, "%s v%s: line %u: %s\n",
+		program_name, program_version, lineno, msg);
+	if (!*status)
+		*status = err;
+}
+
+/* Run one command per line of `file' against a single handle.  Lines
+ * may start with the program name; blank lines and lines starting
+ * with `#' are skipped.  A bad line doesn't stop the batch, so every
+ * error is reported, but then nothing is committed.  The whole file
+ * is read first, so that its host names are looked up together.
+ * Returns 0 or the exit status of the first error. */
+static int
+batch(const char *file, char **table, arptc_handle_t *handle)
+{
+	char *argv[BATCH_MAXARGS], *line = NULL, *first = NULL;
+	char *text = NULL, *next, *end;
+	struct arptables_ctx ctx;
+	size_t size = 0, used = 0, alloc = 0;
+	unsigned int lineno = 0;
+	FILE *in = stdin;
+	int argc, status = 0, usage = 0;
+	const char *err;
+	ssize_t len;
+
+	if (file && strcmp(file, "-") != 0 && !(in = fopen(file, "r")))
+		exit_error(OTHER_PROBLEM, "can't open `%s': %s",
+			   file, strerror(errno));
+
+	/* The lines, each ending in '\0'. */
+	while ((len = getline(&line, &size, in)) != -1) {
+		if (used + len + 1 > alloc) {
+			alloc = 2 * (used + len + 1);
+			if (!(text = realloc(text, alloc)))
+				exit_error(OTHER_PROBLEM, "out of memory");
+		}
+		resolve_want(line, len);
+		memcpy(text + used, line, len + 1);
+		used += len + 1;
+	}
+	if (ferror(in))
+		exit_error(OTHER_PROBLEM, "reading batch: %s",
+			   strerror(errno));
+	free(line);
+	if (in != stdin)
+		fclose(in);
+	resolve_run();
+
+	for (line = text, end = text + used; line < end; line = next) {
+		next = line + strlen(line) + 1;
+		batch_line = ++lineno;
+
+		argv[0] = (char *)program_name;
+		argc = split_line(line, argv + 1, BATCH_MAXARGS - 1, &err);
+		if (argc < 0) {
+			batch_error(&status, lineno, PARAMETER_PROBLEM, err);
+			continue;
+		}
+		argc++;
+		if (argc == 1 || argv[1][0] == '#')
+			continue;
+		if (strcmp(argv[1], "arptables") == 0
+		    || strcmp(argv[1], "arptables-legacy") == 0) {
+			argv[1] = argv[0];
+			argc--;
+			memmove(argv, argv + 1, argc * sizeof(*argv));
+			argv[argc] = NULL;
+		}
+		if (argc > 1 && strcmp(argv[1], "--batch") == 0) {
+			batch_error(&status, lineno, PARAMETER_PROBLEM,
+				    "--batch can't be nested");
+			continue;
+		}
+
+		if (!do_command_ctx(&ctx, argc, argv, table, handle)) {
+			batch_error(&status, lineno, ctx.error.status,
+				    ctx.error.message);
+			usage |= ctx.error.status == PARAMETER_PROBLEM;
+		}
+
+		/* One handle means one table. */
+		if (!first)
+			first = strdup(*table);
+		else if (strcmp(*table, first) != 0) {
+			snprintf(ctx.error.message, sizeof(ctx.error.message),
+				 "every command must use table `%s'", first);
+			batch_error(&status, lineno, PARAMETER_PROBLEM,
+				    ctx.error.message);
+		}
+		*table = first;
+	}
+
+	/* Errors from here on aren't about any one line. */
+	batch_line = 0;
+	free(text);
+
+	if (usage)
+		fprintf(stderr, "Try `%s -h' or '%s --help' for more "
+			"information.\n", program_name, program_name);
+	if (status)
+		fprintf(stderr, "%s: errors in batch, nothing committed\n",
+			program_name);
+	return status;
+}
+
 int
 main(int argc, char *argv[])
 {
-	int ret;
+	int ret, status;
 	char *table = "filter";
 	arptc_handle_t handle = NULL;
 
@@ -48,9 +158,21 @@ main(int argc, char *argv[])
 
 /*	init_extensions();
 */
-	ret = do_command(argc, argv, &table, &handle);
-	if (ret)
+	if (argc > 1 && strcmp(argv[1], "--batch") == 0) {
+		if (argc > 3)
+			exit_error(PARAMETER_PROBLEM,
+				   "--batch takes at most one file");
+		status = batch(argv[2], &table, &handle);
+		if (status) {
+			arptables_unlock();
+			exit(status);
+		}
+		ret = 1;
+	} else
+		ret = do_command(argc, argv, &table, &handle);
+	if (ret && handle)
 		ret = arptc_commit(&handle);
+	arptables_unlock();
 
 	if (!ret)
 		fprintf(stderr, "arptables: %s\n",
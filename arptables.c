@@ -42,6 +42,8 @@
 #include <arptables.h>
 #include <fcntl.h>
 #include <sys/wait.h>
+#include <pthread.h>
+#include <time.h>
 
 #ifndef TRUE
 #define TRUE 1
@@ -58,6 +60,11 @@
 #define PROC_SYS_MODPROBE "/proc/sys/kernel/modprobe"
 #endif
 
+/* Host lookups run at once by run_lookups(). */
+#ifndef ARPT_RESOLVERS
+#define ARPT_RESOLVERS 16
+#endif
+
 #define FMT_NUMERIC	0x0001
 #define FMT_NOCOUNTS	0x0002
 #define FMT_KILOMEGAGIGA 0x0004
@@ -67,6 +74,7 @@
 #define FMT_VIA		0x0040
 #define FMT_NONEWLINE	0x0080
 #define FMT_LINENUMBERS 0x0100
+#define FMT_SAVE	0x0200
 
 #define FMT_PRINT_RULE (FMT_NOCOUNTS | FMT_OPTIONS | FMT_VIA \
 			| FMT_NUMERIC | FMT_NOTABLE)
@@ -87,7 +95,10 @@
 #define CMD_SET_POLICY		0x0400U
 #define CMD_CHECK		0x0800U
 #define CMD_RENAME_CHAIN	0x1000U
-#define NUMBER_OF_CMD	13
+#define CMD_JSON_EXPORT		0x2000U
+#define CMD_JSON_IMPORT		0x4000U
+#define CMD_JSON		(CMD_JSON_EXPORT | CMD_JSON_IMPORT)
+#define NUMBER_OF_CMD	15
 static const char cmdflags[] = { 'I', 'D', 'D', 'R', 'A', 'L', 'F', 'Z',
 				 'N', 'X', 'P', 'E' };
 
@@ -152,6 +163,11 @@ static struct option original_opts[] = {
 	{ "line-numbers", 0, 0, '0' },
 	{ "modprobe", 1, 0, 'M' },
 	{ "set-counters", 1, 0, 'c' },
+	{ "wait", 2, 0, 'w' },
+	{ "wait-interval", 1, 0, 'W' },
+	{ "where", 1, 0, 9 },
+	{ "json-export", 0, 0, 10 },
+	{ "json-import", 2, 0, 11 },
 	{ 0 }
 };
 
@@ -165,8 +181,8 @@ arpt_get_target(struct arpt_entry *e)
 }
 #endif*/
 
-static struct option *opts = original_opts;
-static unsigned int global_option_offset = 0;
+/* Report lock wait and hold times when the lock is dropped. */
+static int lock_verbose = 0;
 
 /* Table of legal combinations of commands and options.  If any of the
  * given commands make an option legal, that option is legal (applies to
@@ -193,7 +209,9 @@ static char commands_v_options[NUMBER_OF_CMD][NUMBER_OF_OPT] =
 /*DEL_CHAIN*/ {' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' '},
 /*SET_POLICY*/{' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' '},
 /*CHECK*/     {' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' '},
-/*RENAME*/    {' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' '}
+/*RENAME*/    {' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' ',' '},
+/*JSON_EXP*/  {'x','x','x','x','x','x','x','x','x','x','x',' ','x','x','x','x'},
+/*JSON_IMP*/  {'x','x','x','x','x','x','x','x','x','x','x',' ','x','x','x','x'}
 };
 
 static int inverse_for_options[NUMBER_OF_OPT] =
@@ -277,7 +295,7 @@ int getmac_and_mask(char *from, char *to, char *mask)
 {
 	char *p;
 	int i;
-	struct ether_addr *addr;
+	struct ether_addr addr;
 
 	if (strcasecmp(from, "Unicast") == 0) {
 		memcpy(to, mac_type_unicast, ETH_ALEN);
@@ -296,14 +314,14 @@ int getmac_and_mask(char *from, char *to, char *mask)
 	}
 	if ( (p = strrchr(from, '/')) != NULL) {
 		*p = '\0';
-		if (!(addr = ether_aton(p + 1)))
+		if (!ether_aton_r(p + 1, &addr))
 			return -1;
-		memcpy(mask, addr, ETH_ALEN);
+		memcpy(mask, &addr, ETH_ALEN);
 	} else
 		memset(mask, 0xff, ETH_ALEN);
-	if (!(addr = ether_aton(from)))
+	if (!ether_aton_r(from, &addr))
 		return -1;
-	memcpy(to, addr, ETH_ALEN);
+	memcpy(to, &addr, ETH_ALEN);
 	for (i = 0; i < ETH_ALEN; i++)
 		to[i] &= mask[i];
 	return 0;
@@ -358,28 +376,123 @@ void print_mac(const unsigned char *mac, int l)
 			(j==l-1) ? "" : ":");
 }
 
-void print_mac_and_mask(const unsigned char *mac, const unsigned char *mask, int l)
+/* Rule output.  Listings and saves are formatted into this buffer,
+ * without printf(), and written out in large pieces.  Anything that
+ * prints some other way, such as an extension's print() or save(),
+ * must come after an out_flush(). */
+static struct
+{
+	size_t len;
+	char buf[1 << 16];
+} out;
+
+static void
+out_flush(void)
+{
+	if (out.len)
+		fwrite(out.buf, 1, out.len, stdout);
+	out.len = 0;
+}
+
+static void
+out_write(const char *s, size_t len)
+{
+	if (len > sizeof(out.buf) - out.len) {
+		out_flush();
+		if (len > sizeof(out.buf)) {
+			fwrite(s, 1, len, stdout);
+			return;
+		}
+	}
+	memcpy(out.buf + out.len, s, len);
+	out.len += len;
+}
+
+static void
+out_puts(const char *s)
+{
+	out_write(s, strlen(s));
+}
+
+static void
+out_char(char c)
+{
+	if (out.len == sizeof(out.buf))
+		out_flush();
+	out.buf[out.len++] = c;
+}
+
+static void
+out_uint(uint64_t n)
+{
+	char digits[20], *p = digits + sizeof(digits);
+
+	do
+		*--p = '0' + n % 10;
+	while (n /= 10);
+	out_write(p, digits + sizeof(digits) - p);
+}
+
+static void
+out_hex(unsigned int n)
+{
+	char digits[8], *p = digits + sizeof(digits);
+
+	do
+		*--p = "0123456789abcdef"[n & 15];
+	while (n >>= 4);
+	out_write(p, digits + sizeof(digits) - p);
+}
+
+static void
+out_dotted(const struct in_addr *addr)
+{
+	const unsigned char *bytep = (const unsigned char *)&addr->s_addr;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		if (i)
+			out_char('.');
+		out_uint(bytep[i]);
+	}
+}
+
+static void
+out_mac(const unsigned char *mac, int l)
+{
+	int j;
+
+	for (j = 0; j < l; j++) {
+		if (j)
+			out_char(':');
+		out_char("0123456789abcdef"[mac[j] >> 4]);
+		out_char("0123456789abcdef"[mac[j] & 15]);
+	}
+}
+
+static void
+out_mac_and_mask(const unsigned char *mac, const unsigned char *mask, int l)
 {
 	int i;
 
-	print_mac(mac, l);
+	out_mac(mac, l);
 	for (i = 0; i < l ; i++)
 		if (mask[i] != 255)
 			break;
 	if (i == l)
 		return;
-	printf("/");
-	print_mac(mask, l);
+	out_char('/');
+	out_mac(mask, l);
 }
 
 /*********************************************/
 /* ARPTABLES SPECIFIC NEW FUNCTIONS END HERE */
 /*********************************************/
 
-struct in_addr *
-dotted_to_addr(const char *dotted)
+/* dotted_to_addr() into the caller's storage, for the restore workers. */
+static int
+dotted_to_addr_r(const char *dotted, struct in_addr *addr)
 {
-	static struct in_addr addr;
 	unsigned char *addrp;
 	char *p, *q;
 	unsigned int onebyte;
@@ -388,16 +501,17 @@ dotted_to_addr(const char *dotted)
 
 	/* copy dotted string, because we need to modify it */
 	strncpy(buf, dotted, sizeof(buf) - 1);
-	addrp = (unsigned char *) &(addr.s_addr);
+	buf[sizeof(buf) - 1] = '\0';
+	addrp = (unsigned char *) &(addr->s_addr);
 
 	p = buf;
 	for (i = 0; i < 3; i++) {
 		if ((q = strchr(p, '.')) == NULL)
-			return (struct in_addr *) NULL;
+			return 0;
 
 		*q = '\0';
 		if (string_to_number(p, 0, 255, &onebyte) == -1)
-			return (struct in_addr *) NULL;
+			return 0;
 
 		addrp[i] = (unsigned char) onebyte;
 		p = q + 1;
@@ -405,10 +519,20 @@ dotted_to_addr(const char *dotted)
 
 	/* we've checked 3 bytes, now we check the last one */
 	if (string_to_number(p, 0, 255, &onebyte) == -1)
-		return (struct in_addr *) NULL;
+		return 0;
 
 	addrp[3] = (unsigned char) onebyte;
 
+	return 1;
+}
+
+struct in_addr *
+dotted_to_addr(const char *dotted)
+{
+	static struct in_addr addr;
+
+	if (!dotted_to_addr_r(dotted, &addr))
+		return (struct in_addr *) NULL;
 	return &addr;
 }
 
@@ -435,13 +559,50 @@ inaddrcpy(struct in_addr *dst, struct in_addr *src)
 	dst->s_addr = src->s_addr;
 }
 
+unsigned int batch_line = 0;
+
+/* The do_command_ctx() call errors go to, if any.  Per thread: a
+   thread that isn't in do_command_ctx() still exits on errors. */
+static __thread struct arptables_ctx *error_ctx;
+
+static void __attribute__((noreturn))
+ctx_error(int status, const char *msg, va_list *args)
+{
+	error_ctx->error.status = status;
+	if (msg) {
+		char *nl;
+
+		vsnprintf(error_ctx->error.message,
+			  sizeof(error_ctx->error.message), msg, *args);
+		if ((nl = strchr(error_ctx->error.message, '\n')))
+			*nl = '\0';
+	}
+	else if (!error_ctx->error.message[0])
+		snprintf(error_ctx->error.message,
+			 sizeof(error_ctx->error.message), "Bad command");
+	longjmp(error_ctx->jmp, 1);
+}
+
+/* Done early (-h, -V): exit, or end the do_command_ctx() call. */
+static void __attribute__((noreturn))
+exit_ok(void)
+{
+	if (error_ctx)
+		ctx_error(0, NULL, NULL);
+	exit(0);
+}
+
 void
 exit_error(enum exittype status, char *msg, ...)
 {
 	va_list args;
 
 	va_start(args, msg);
+	if (error_ctx)
+		ctx_error(status, msg, &args);
 	fprintf(stderr, "%s v%s: ", program_name, program_version);
+	if (batch_line)
+		fprintf(stderr, "line %u: ", batch_line);
 	vfprintf(stderr, msg, args);
 	va_end(args);
 	fprintf(stderr, "\n");
@@ -456,6 +617,8 @@ exit_error(enum exittype status, char *msg, ...)
 void
 exit_tryhelp(int status)
 {
+	if (error_ctx)
+		ctx_error(status, NULL, NULL);
 	fprintf(stderr, "Try `%s -h' or '%s --help' for more information.\n",
 			program_name, program_name );
 	exit(status);
@@ -529,7 +692,17 @@ exit_printhelp(void)
 "  --line-numbers		print line numbers when listing\n"
 "  --exact	-x		expand numbers (display exact values)\n"
 "  --modprobe=<command>		try to insert modules using this command\n"
-"  --set-counters -c PKTS BYTES	set the counter during insert/append\n"
+"  --set-counters -c PKTS BYTES	set the counter during insert/append/policy\n"
+"  --wait	-w [seconds]	wait for the arptables lock (forever if no\n"
+"				seconds are given)\n"
+"  --wait-interval -W usecs	poll the lock every usecs microseconds\n"
+"  --where field=value[,field=value...]\n"
+"				only list rules testing these values\n"
+"  --batch [file]		run the commands in file (default: stdin),\n"
+"				one per line, and commit them once\n"
+"  --json-export			write the table as JSON\n"
+"  --json-import [file]		replace the table with the JSON in file\n"
+"				(default: stdin), in one commit\n"
 "[!] --version	-V		print package version.\n");
 	printf(" opcode strings: \n");
         for (i = 0; i < NUMOPCODES; i++)
@@ -549,7 +722,7 @@ exit_printhelp(void)
 		printf("\n");
 		m->help();
 	}
-	exit(0);
+	exit_ok();
 }
 
 static void
@@ -611,6 +784,10 @@ add_command(unsigned int *cmd, const int newcmd, const unsigned int othercmds, i
 {
 	if (invert)
 		exit_error(PARAMETER_PROBLEM, "unexpected ! flag");
+	if (*cmd & CMD_JSON)
+		exit_error(PARAMETER_PROBLEM, "Can't use -%c with --json-%s\n",
+			   cmd2char(newcmd),
+			   *cmd & CMD_JSON_EXPORT ? "export" : "import");
 	if (*cmd & (~othercmds))
 		exit_error(PARAMETER_PROBLEM, "Can't use -%c with -%c\n",
 			   cmd2char(newcmd), cmd2char(*cmd & (~othercmds)));
@@ -686,16 +863,304 @@ host_to_addr(const char *name, unsigned int *naddr)
 	return (struct in_addr *) NULL;
 }
 
-static char *
-addr_to_host(const struct in_addr *addr)
+/* Lookups that block on the resolver, run together: run_lookups()
+ * calls lookup(0) to lookup(num - 1), each once, from up to
+ * ARPT_RESOLVERS threads, and returns when all of them are done. */
+static struct
 {
-	struct hostent *host;
+	void (*lookup)(unsigned int n);
+	unsigned int num, next;
+} lookups;
+
+static pthread_mutex_t lookups_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *
+lookup_worker(void *unused)
+{
+	unsigned int n;
+
+	for (;;) {
+		pthread_mutex_lock(&lookups_lock);
+		n = lookups.next++;
+		pthread_mutex_unlock(&lookups_lock);
+		if (n >= lookups.num)
+			return NULL;
+		lookups.lookup(n);
+	}
+}
+
+static void
+run_lookups(void (*lookup)(unsigned int n), unsigned int num)
+{
+	pthread_t threads[ARPT_RESOLVERS];
+	unsigned int i, jobs;
+
+	lookups.lookup = lookup;
+	lookups.num = num;
+	lookups.next = 0;
+	jobs = num < ARPT_RESOLVERS ? num : ARPT_RESOLVERS;
+	for (i = 0; i < jobs; i++)
+		if (pthread_create(&threads[i], NULL, lookup_worker, NULL))
+			break;
+	/* Without threads, look them up here. */
+	if (i == 0)
+		lookup_worker(NULL);
+	jobs = i;
+	for (i = 0; i < jobs; i++)
+		pthread_join(threads[i], NULL);
+}
+
+/* Forward lookups for batches and restores.  resolve_want() notes the
+ * host and network names of the -s and -d options in each command
+ * line, resolve_run() looks them all up at once, each name once and
+ * ARPT_RESOLVERS at a time, and parse_hostnetwork() and
+ * fast_hostnetwork() answer from the results.  Nothing is added once
+ * resolve_run() has run, so threads can read them freely; names that
+ * weren't noted are just looked up when they are parsed. */
+struct resolve_entry
+{
+	char *name;
+	/* Its addresses (NULL = not found). */
+	struct in_addr *addrs;
+	unsigned int naddrs;
+	/* Looked up yet. */
+	int done;
+};
+
+static struct
+{
+	/* Open addressing; size is a power of two. */
+	struct resolve_entry *slot;
+	unsigned int size, used;
+	/* What resolve_run() hands run_lookups(). */
+	struct resolve_entry **want;
+	unsigned int num_want;
+} resolved;
+
+static unsigned int
+resolve_hash(const char *name)
+{
+	unsigned int h = 2166136261U;
+
+	while (*name)
+		h = (h ^ (unsigned char)*name++) * 16777619U;
+	return h;
+}
+
+static struct resolve_entry *
+resolve_find(const char *name, int add)
+{
+	struct resolve_entry *old = resolved.slot;
+	unsigned int i, j, mask, old_size = resolved.size;
+
+	if (add && 2 * (resolved.used + 1) > resolved.size) {
+		resolved.size = resolved.size ? 2 * resolved.size : 256;
+		resolved.slot = fw_calloc(resolved.size,
+					  sizeof(*resolved.slot));
+		mask = resolved.size - 1;
+		for (i = 0; i < old_size; i++) {
+			if (!old[i].name)
+				continue;
+			for (j = resolve_hash(old[i].name) & mask;
+			     resolved.slot[j].name; j = (j + 1) & mask)
+				;
+			resolved.slot[j] = old[i];
+		}
+		free(old);
+	}
+	if (!resolved.size)
+		return NULL;
+
+	mask = resolved.size - 1;
+	for (i = resolve_hash(name) & mask; resolved.slot[i].name;
+	     i = (i + 1) & mask)
+		if (strcmp(resolved.slot[i].name, name) == 0)
+			return &resolved.slot[i];
+	if (!add)
+		return NULL;
+	if (!(resolved.slot[i].name = strdup(name)))
+		exit_error(OTHER_PROBLEM, "out of memory");
+	resolved.used++;
+	return &resolved.slot[i];
+}
+
+/* What resolve_run() found for `name', or NULL. */
+static struct resolve_entry *
+resolve_cached(const char *name)
+{
+	struct resolve_entry *e = resolve_find(name, 0);
+
+	return e && e->done ? e : NULL;
+}
+
+/* network_to_addr() and then host_to_addr(), with the reentrant calls,
+   so several threads can run it at once.  Returns a new array, or NULL
+   if `name' is neither. */
+static struct in_addr *
+resolve_lookup(const char *name, unsigned int *naddrs)
+{
+	struct hostent host, *hp;
+	struct netent net, *np;
+	struct in_addr *addrs;
+	size_t size = 1024;
+	char *buf = NULL;
+	unsigned int i;
+	int err, ret;
+
+	*naddrs = 0;
+	do {
+		if (!(buf = realloc(buf, size *= 2)))
+			return NULL;
+		ret = getnetbyname_r(name, &net, buf, size, &np, &err);
+	} while (ret == ERANGE);
+	if (ret == 0 && np && np->n_addrtype == AF_INET) {
+		free(buf);
+		if ((addrs = malloc(sizeof(struct in_addr)))) {
+			addrs->s_addr = htonl((unsigned long) np->n_net);
+			*naddrs = 1;
+		}
+		return addrs;
+	}
+
+	do {
+		if (!(buf = realloc(buf, size *= 2)))
+			return NULL;
+		ret = gethostbyname_r(name, &host, buf, size, &hp, &err);
+	} while (ret == ERANGE);
+	addrs = NULL;
+	if (ret == 0 && hp && hp->h_addrtype == AF_INET
+	    && hp->h_length == sizeof(struct in_addr)) {
+		for (i = 0; hp->h_addr_list[i]; i++)
+			;
+		if (i && (addrs = malloc(i * sizeof(struct in_addr)))) {
+			*naddrs = i;
+			for (i = 0; i < *naddrs; i++)
+				memcpy(&addrs[i], hp->h_addr_list[i],
+				       sizeof(struct in_addr));
+		}
+	}
+	free(buf);
+	return addrs;
+}
+
+/* The name in an -s or -d argument, unless parse_hostnetworkmask()
+   would ignore it or it is an address. */
+static void
+resolve_want_arg(const char *arg)
+{
+	struct in_addr addr;
+	unsigned int bits;
+	char buf[256], *p;
+
+	/* Plain addresses and masks, as in nearly every saved rule. */
+	if (arg[strspn(arg, "0123456789./")] == '\0'
+	    || strlen(arg) >= sizeof(buf))
+		return;
+	strcpy(buf, arg);
+	if ((p = strrchr(buf, '/')) != NULL) {
+		*p++ = '\0';
+		if (dotted_to_addr_r(p, &addr) ? addr.s_addr == 0L
+		    : string_to_number(p, 0, 32, &bits) == -1 || bits == 0)
+			return;
+	}
+	if (!dotted_to_addr_r(buf, &addr))
+		resolve_find(buf, 1);
+}
+
+/* Whether the value of an -s or -d option in a line might be a name,
+   before going to the trouble of splitting a copy of it: most lines
+   only have addresses.  Quotes leave it to split_line(). */
+static int
+resolve_scan(const char *p, const char *end)
+{
+	const char *w;
+	int opt = 0;
+
+	for (;;) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\n'))
+			p++;
+		if (p == end)
+			return 0;
+		for (w = p; p < end && *p != ' ' && *p != '\t' && *p != '\n';
+		     p++)
+			if (*p == '"' || *p == '\'')
+				return 1;
+
+		if (!opt)
+			opt = *w == '-' && ((p - w == 2
+					     && (w[1] == 's' || w[1] == 'd'))
+					    || (p - w > 3
+						&& memcmp(p - 3, "-ip", 3) == 0));
+		else if (p - w != 1 || *w != '!') {
+			while (w < p && ((*w >= '0' && *w <= '9')
+					 || *w == '.' || *w == '/'))
+				w++;
+			if (w < p)
+				return 1;
+			opt = 0;
+		}
+	}
+}
+
+void
+resolve_want(const char *line, size_t len)
+{
+	static const char *opts[] = {
+		"-s", "--source-ip", "--src-ip",
+		"-d", "--destination-ip", "--dst-ip", NULL
+	};
+	char *argv[256], buf[1024], *copy = buf;
+	const char *err;
+	int argc, i, j;
+
+	if (!resolve_scan(line, line + len))
+		return;
+	if (len >= sizeof(buf))
+		copy = fw_malloc(len + 1);
+	memcpy(copy, line, len);
+	copy[len] = '\0';
+	argc = split_line(copy, argv, sizeof(argv) / sizeof(*argv), &err);
+	for (i = 0; i < argc; i++) {
+		for (j = 0; opts[j]; j++)
+			if (strcmp(argv[i], opts[j]) == 0)
+				break;
+		if (!opts[j])
+			continue;
+		/* `-s ! addr' as well as `! -s addr'. */
+		if (i + 1 < argc && strcmp(argv[i + 1], "!") == 0)
+			i++;
+		if (i + 1 < argc)
+			resolve_want_arg(argv[++i]);
+	}
+	if (copy != buf)
+		free(copy);
+}
+
+static void
+resolve_nth(unsigned int n)
+{
+	struct resolve_entry *e = resolved.want[n];
+
+	e->addrs = resolve_lookup(e->name, &e->naddrs);
+	e->done = 1;
+}
 
-	if ((host = gethostbyaddr((char *) addr,
-				  sizeof(struct in_addr), AF_INET)) != NULL)
-		return (char *) host->h_name;
+void
+resolve_run(void)
+{
+	unsigned int i;
 
-	return (char *) NULL;
+	if (!resolved.used)
+		return;
+	resolved.want = fw_malloc(resolved.used * sizeof(*resolved.want));
+	resolved.num_want = 0;
+	for (i = 0; i < resolved.size; i++)
+		if (resolved.slot[i].name && !resolved.slot[i].done)
+			resolved.want[resolved.num_want++] = &resolved.slot[i];
+	run_lookups(resolve_nth, resolved.num_want);
+
+	free(resolved.want);
+	resolved.want = NULL;
 }
 
 /*
@@ -711,16 +1176,27 @@ struct in_addr *
 parse_hostnetwork(const char *name, unsigned int *naddrs)
 {
 	struct in_addr *addrp, *addrptmp;
-
-	if ((addrptmp = dotted_to_addr(name)) != NULL ||
-	    (addrptmp = network_to_addr(name)) != NULL) {
-		addrp = fw_malloc(sizeof(struct in_addr));
-		inaddrcpy(addrp, addrptmp);
-		*naddrs = 1;
-		return addrp;
+	struct resolve_entry *e;
+
+	if ((e = resolve_cached(name)) != NULL) {
+		if (e->addrs) {
+			addrp = fw_calloc(e->naddrs, sizeof(struct in_addr));
+			memcpy(addrp, e->addrs,
+			       e->naddrs * sizeof(struct in_addr));
+			*naddrs = e->naddrs;
+			return addrp;
+		}
+	} else {
+		if ((addrptmp = dotted_to_addr(name)) != NULL ||
+		    (addrptmp = network_to_addr(name)) != NULL) {
+			addrp = fw_malloc(sizeof(struct in_addr));
+			inaddrcpy(addrp, addrptmp);
+			*naddrs = 1;
+			return addrp;
+		}
+		if ((addrp = host_to_addr(name, naddrs)) != NULL)
+			return addrp;
 	}
-	if ((addrp = host_to_addr(name, naddrs)) != NULL)
-		return addrp;
 
 	exit_error(PARAMETER_PROBLEM, "host/network `%s' not found", name);
 }
@@ -853,6 +1329,157 @@ parse_interface(const char *arg, char *vianame, unsigned char *mask)
 	}
 }
 
+/* A --where query: its terms must all match. */
+struct where
+{
+	unsigned int num_terms;
+	struct arptc_query_term *terms;
+};
+
+static void
+parse_where_ip(const char *field, char *value, struct arptc_query_term *t)
+{
+	struct in_addr *addr;
+	char *p;
+
+	t->prefix = 32;
+	if ((p = strchr(value, '/')) != NULL) {
+		*p++ = '\0';
+		if (strchr(p, '.')) {
+			uint32_t mask;
+
+			if (!(addr = dotted_to_addr(p)))
+				exit_error(PARAMETER_PROBLEM,
+					   "--where %s: bad mask `%s'", field, p);
+			mask = ntohl(addr->s_addr);
+			for (t->prefix = 0; t->prefix < 32 && (mask &
+			     (0x80000000U >> t->prefix)); t->prefix++);
+			if (t->prefix < 32 && mask << t->prefix)
+				exit_error(PARAMETER_PROBLEM,
+					   "--where %s: mask `%s' isn't a prefix",
+					   field, p);
+		} else if (string_to_number(p, 0, 32, &t->prefix) == -1)
+			exit_error(PARAMETER_PROBLEM,
+				   "--where %s: bad prefix length `%s'", field, p);
+	}
+	if (!(addr = dotted_to_addr(value)))
+		exit_error(PARAMETER_PROBLEM,
+			   "--where %s: `%s' isn't an IP address", field, value);
+	t->u.ip = *addr;
+}
+
+/* xx:xx:xx:xx:xx:xx, or leading bytes followed by a `*' wildcard. */
+static void
+parse_where_mac(const char *field, char *value, struct arptc_query_term *t)
+{
+	char *p = value, *end;
+	unsigned int i;
+
+	for (i = 0; i < ETH_ALEN; i++) {
+		unsigned long byte;
+
+		if (*p == '*' && p[1] == '\0')
+			break;
+		byte = strtoul(p, &end, 16);
+		if (end == p || end - p > 2 || byte > 0xff
+		    || (*end != ':' && *end != '\0')
+		    || (*end == '\0' && i != ETH_ALEN - 1))
+			exit_error(PARAMETER_PROBLEM,
+				   "--where %s: bad MAC address `%s'",
+				   field, value);
+		t->u.mac[i] = byte;
+		p = *end ? end + 1 : end;
+	}
+	if (i == ETH_ALEN && *p != '\0')
+		exit_error(PARAMETER_PROBLEM,
+			   "--where %s: bad MAC address `%s'", field, value);
+	t->prefix = i * 8;
+}
+
+/* Parse one --where argument: comma separated field=value terms. */
+static void
+parse_where(char *arg, struct where *w)
+{
+	char *term, *value, *save = NULL;
+
+	w->num_terms = 0;
+	w->terms = NULL;
+
+	for (term = strtok_r(arg, ",", &save); term;
+	     term = strtok_r(NULL, ",", &save)) {
+		struct arptc_query_term *t;
+
+		w->terms = realloc(w->terms,
+				   (w->num_terms + 1) * sizeof(*w->terms));
+		if (!w->terms)
+			exit_error(OTHER_PROBLEM, "realloc failed");
+		t = &w->terms[w->num_terms++];
+		memset(t, 0, sizeof(*t));
+
+		if (!(value = strchr(term, '=')) || value[1] == '\0')
+			exit_error(PARAMETER_PROBLEM,
+				   "--where expects field=value, not `%s'",
+				   term);
+		*value++ = '\0';
+
+		if (!strcmp(term, "src-ip") || !strcmp(term, "source-ip")) {
+			t->field = ARPTC_QUERY_SRC_IP;
+			parse_where_ip(term, value, t);
+		} else if (!strcmp(term, "dst-ip")
+			   || !strcmp(term, "destination-ip")) {
+			t->field = ARPTC_QUERY_TGT_IP;
+			parse_where_ip(term, value, t);
+		} else if (!strcmp(term, "src-mac")
+			   || !strcmp(term, "source-mac")) {
+			t->field = ARPTC_QUERY_SRC_MAC;
+			parse_where_mac(term, value, t);
+		} else if (!strcmp(term, "dst-mac")
+			   || !strcmp(term, "destination-mac")) {
+			t->field = ARPTC_QUERY_TGT_MAC;
+			parse_where_mac(term, value, t);
+		} else if (!strcmp(term, "in-interface")
+			   || !strcmp(term, "out-interface")
+			   || !strcmp(term, "interface")) {
+			t->field = !strcmp(term, "in-interface")
+				? ARPTC_QUERY_IN_IFACE
+				: !strcmp(term, "out-interface")
+				? ARPTC_QUERY_OUT_IFACE : ARPTC_QUERY_IFACE;
+			if (strlen(value) + 1 > IFNAMSIZ)
+				exit_error(PARAMETER_PROBLEM,
+					   "interface name `%s' must be shorter"
+					   " than IFNAMSIZ (%i)", value,
+					   IFNAMSIZ-1);
+			strcpy(t->u.iface, value);
+		} else if (!strcmp(term, "opcode")) {
+			unsigned int op, i;
+
+			t->field = ARPTC_QUERY_OPCODE;
+			for (i = 0; i < NUMOPCODES; i++)
+				if (!strcasecmp(opcodes[i], value))
+					break;
+			if (i < NUMOPCODES)
+				op = i + 1;
+			else if (string_to_number(value, 0, 65535, &op) == -1)
+				exit_error(PARAMETER_PROBLEM,
+					   "--where opcode: bad opcode `%s'",
+					   value);
+			t->u.opcode = op;
+		} else if (!strcmp(term, "target") || !strcmp(term, "jump")) {
+			t->field = ARPTC_QUERY_TARGET;
+			if (strlen(value) >= sizeof(arpt_chainlabel))
+				exit_error(PARAMETER_PROBLEM,
+					   "--where target: `%s' too long",
+					   value);
+			strcpy(t->u.target, value);
+		} else
+			exit_error(PARAMETER_PROBLEM,
+				   "--where: unknown field `%s'", term);
+	}
+
+	if (!w->num_terms)
+		exit_error(PARAMETER_PROBLEM, "--where needs a field=value");
+}
+
 /* Can't be zero. */
 static int
 parse_rulenumber(const char *rule)
@@ -887,17 +1514,6 @@ parse_target(const char *targetname)
 	return targetname;
 }
 
-static char *
-addr_to_network(const struct in_addr *addr)
-{
-	struct netent *net;
-
-	if ((net = getnetbyaddr((long) ntohl(addr->s_addr), AF_INET)) != NULL)
-		return (char *) net->n_name;
-
-	return (char *) NULL;
-}
-
 char *
 addr_to_dotted(const struct in_addr *addrp)
 {
@@ -909,47 +1525,280 @@ addr_to_dotted(const struct in_addr *addrp)
 	return buf;
 }
 
-char *
-addr_to_anyname(const struct in_addr *addr)
+/* Reverse lookups for listings without -n.  Each address is looked up
+ * once an invocation: rdns_want() notes the addresses a listing will
+ * print, rdns_run() looks them all up at once, ARPT_RESOLVERS at a
+ * time, and addr_to_anyname() answers from the results.  With
+ * ARPTABLES_RDNS_CACHE set, the answers are also kept in that file for
+ * ARPTABLES_RDNS_TTL seconds, for the next invocation. */
+struct rdns_entry
 {
+	struct in_addr addr;
+	/* Host or network name (NULL = none). */
 	char *name;
+	/* When to look it up again (0 = not looked up yet). */
+	time_t expires;
+	/* In rdns.pending. */
+	int queued;
+};
 
-	if ((name = addr_to_host(addr)) != NULL ||
-	    (name = addr_to_network(addr)) != NULL)
-		return name;
+static struct
+{
+	/* Open addressing, with slot 0 kept for 0.0.0.0, which marks
+	   the free ones; size is a power of two. */
+	struct rdns_entry *slot;
+	unsigned int size, used;
+	/* Addresses for rdns_run() to look up. */
+	struct in_addr *pending;
+	unsigned int num_pending;
+	/* What rdns_run() hands run_lookups(). */
+	struct rdns_entry **want;
+	unsigned int num_want;
+	int file_read;
+} rdns;
+
+static struct rdns_entry *
+rdns_find(struct in_addr addr)
+{
+	struct rdns_entry *old = rdns.slot;
+	unsigned int i, mask, old_size = rdns.size;
+
+	if (2 * (rdns.used + 2) > rdns.size) {
+		rdns.size = rdns.size ? 2 * rdns.size : 256;
+		rdns.slot = fw_calloc(rdns.size, sizeof(*rdns.slot));
+		rdns.used = 0;
+		if (old)
+			rdns.slot[0] = old[0];
+		for (i = 1; i < old_size; i++)
+			if (old[i].addr.s_addr)
+				*rdns_find(old[i].addr) = old[i];
+		free(old);
+	}
 
-	return addr_to_dotted(addr);
+	if (!addr.s_addr)
+		return &rdns.slot[0];
+	mask = rdns.size - 1;
+	for (i = (ntohl(addr.s_addr) * 2654435761U) & mask; ;
+	     i = (i + 1) & mask) {
+		if (i == 0)
+			continue;
+		if (rdns.slot[i].addr.s_addr == addr.s_addr)
+			return &rdns.slot[i];
+		if (!rdns.slot[i].addr.s_addr) {
+			rdns.slot[i].addr = addr;
+			rdns.used++;
+			return &rdns.slot[i];
+		}
+	}
 }
 
-char *
-mask_to_dotted(const struct in_addr *mask)
+static unsigned int
+rdns_ttl(void)
 {
-	int i;
-	static char buf[20];
-	uint32_t maskaddr, bits;
-
-	maskaddr = ntohl(mask->s_addr);
-
-	if (maskaddr == 0xFFFFFFFFL)
-		/* we don't want to see "/32" */
-		return "";
+	const char *ttl = getenv("ARPTABLES_RDNS_TTL");
+	unsigned int secs;
 
-	i = 32;
-	bits = 0xFFFFFFFEL;
-	while (--i >= 0 && maskaddr != bits)
-		bits <<= 1;
-	if (i >= 0)
-		sprintf(buf, "/%d", i);
-	else
-		/* mask was not a decent combination of 1's and 0's */
-		sprintf(buf, "/%s", addr_to_dotted(mask));
+	if (!ttl || string_to_number(ttl, 0, INT_MAX, &secs) == -1)
+		return 3600;
+	return secs;
+}
 
-	return buf;
+/* addr_to_host() and then addr_to_network(), with the reentrant
+   calls, so several threads can run it at once. */
+static void
+rdns_lookup(struct rdns_entry *e)
+{
+	struct hostent host, *hp;
+	struct netent net, *np;
+	size_t size = 1024;
+	char *buf = NULL;
+	int err, ret;
+
+	e->name = NULL;
+	do {
+		if (!(buf = realloc(buf, size *= 2)))
+			return;
+		ret = gethostbyaddr_r(&e->addr, sizeof(e->addr), AF_INET,
+				      &host, buf, size, &hp, &err);
+	} while (ret == ERANGE);
+	if (ret == 0 && hp)
+		e->name = strdup(hp->h_name);
+
+	while (!e->name) {
+		ret = getnetbyaddr_r(ntohl(e->addr.s_addr), AF_INET, &net,
+				     buf, size, &np, &err);
+		if (ret != ERANGE) {
+			if (ret == 0 && np)
+				e->name = strdup(np->n_name);
+			break;
+		}
+		if (!(buf = realloc(buf, size *= 2)))
+			return;
+	}
+	free(buf);
 }
 
-int
-string_to_number(const char *s, unsigned int min, unsigned int max,
-		 unsigned int *ret)
+static void
+rdns_nth(unsigned int n)
+{
+	rdns_lookup(rdns.want[n]);
+}
+
+/* Lines of `address expires name', with `-' for no name. */
+static void
+rdns_read_file(const char *path, time_t now)
+{
+	char line[1100], dotted[16], name[1025];
+	struct rdns_entry *e;
+	struct in_addr addr;
+	long long expires;
+	FILE *f;
+
+	if (!(f = fopen(path, "r")))
+		return;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%15s %lld %1024s", dotted, &expires,
+			   name) != 3
+		    || !dotted_to_addr_r(dotted, &addr) || expires <= now)
+			continue;
+		e = rdns_find(addr);
+		if (e->expires)
+			continue;
+		e->name = strcmp(name, "-") ? strdup(name) : NULL;
+		e->expires = expires;
+	}
+	fclose(f);
+}
+
+static void
+rdns_write_file(const char *path, time_t now)
+{
+	char tmp[PATH_MAX];
+	unsigned int i;
+	FILE *f;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid())
+	    >= (int)sizeof(tmp) || !(f = fopen(tmp, "w")))
+		return;
+	for (i = 0; i < rdns.size; i++)
+		if (rdns.slot[i].expires > now)
+			fprintf(f, "%s %lld %s\n",
+				addr_to_dotted(&rdns.slot[i].addr),
+				(long long)rdns.slot[i].expires,
+				rdns.slot[i].name ? rdns.slot[i].name : "-");
+	if (fclose(f) != 0 || rename(tmp, path) != 0)
+		unlink(tmp);
+}
+
+static void
+rdns_want(const struct in_addr *addr)
+{
+	struct rdns_entry *e = rdns_find(*addr);
+
+	if (e->expires || e->queued)
+		return;
+	e->queued = 1;
+	if (!(rdns.num_pending & 255)) {
+		rdns.pending = realloc(rdns.pending, (rdns.num_pending + 256)
+				       * sizeof(*rdns.pending));
+		if (!rdns.pending)
+			exit_error(OTHER_PROBLEM, "out of memory");
+	}
+	rdns.pending[rdns.num_pending++] = *addr;
+}
+
+static void
+rdns_run(void)
+{
+	const char *path = getenv("ARPTABLES_RDNS_CACHE");
+	time_t now = time(NULL);
+	struct rdns_entry *e;
+	unsigned int i;
+
+	if (!rdns.num_pending)
+		return;
+	if (path && !rdns.file_read) {
+		rdns_read_file(path, now);
+		rdns.file_read = 1;
+	}
+
+	/* Nothing is added to the table from here on, so its slots
+	   stay put while the threads fill them in. */
+	rdns.want = fw_malloc(rdns.num_pending * sizeof(*rdns.want));
+	rdns.num_want = 0;
+	for (i = 0; i < rdns.num_pending; i++) {
+		e = rdns_find(rdns.pending[i]);
+		e->queued = 0;
+		if (!e->expires)
+			rdns.want[rdns.num_want++] = e;
+	}
+	free(rdns.pending);
+	rdns.pending = NULL;
+	rdns.num_pending = 0;
+	run_lookups(rdns_nth, rdns.num_want);
+
+	for (i = 0; i < rdns.num_want; i++)
+		rdns.want[i]->expires = now + rdns_ttl();
+	if (path && rdns.num_want)
+		rdns_write_file(path, now);
+	free(rdns.want);
+	rdns.want = NULL;
+}
+
+/* The addresses print_firewall() will name. */
+static void
+rdns_want_entry(const struct arpt_entry *fw)
+{
+	if (fw->arp.smsk.s_addr)
+		rdns_want(&fw->arp.src);
+	if (fw->arp.tmsk.s_addr)
+		rdns_want(&fw->arp.tgt);
+}
+
+char *
+addr_to_anyname(const struct in_addr *addr)
+{
+	struct rdns_entry *e = rdns_find(*addr);
+
+	if (!e->expires) {
+		rdns_lookup(e);
+		e->expires = time(NULL) + rdns_ttl();
+	}
+	if (e->name)
+		return e->name;
+
+	return addr_to_dotted(addr);
+}
+
+char *
+mask_to_dotted(const struct in_addr *mask)
+{
+	int i;
+	static char buf[20];
+	uint32_t maskaddr, bits;
+
+	maskaddr = ntohl(mask->s_addr);
+
+	if (maskaddr == 0xFFFFFFFFL)
+		/* we don't want to see "/32" */
+		return "";
+
+	i = 32;
+	bits = 0xFFFFFFFEL;
+	while (--i >= 0 && maskaddr != bits)
+		bits <<= 1;
+	if (i >= 0)
+		sprintf(buf, "/%d", i);
+	else
+		/* mask was not a decent combination of 1's and 0's */
+		sprintf(buf, "/%s", addr_to_dotted(mask));
+
+	return buf;
+}
+
+int
+string_to_number(const char *s, unsigned int min, unsigned int max,
+		 unsigned int *ret)
 {
 	long number;
 	char *end;
@@ -1023,28 +1872,79 @@ find_target(const char *name, enum arpt_tryload tryload)
 	return ptr;
 }
 
-static struct option *
-merge_options(struct option *oldopts, const struct option *newopts,
+/* What one do_command() call allocates and parses into, kept out of
+   the locals so that do_command_ctx() can free it, and roll back the
+   handle, when an error ends the call early. */
+struct command
+{
+	/* getopt_long()'s options, with those of the target merged in. */
+	struct option *opts;
+	unsigned int option_offset;
+
+	/* The -j target's: its data, flags and option offset. */
+	struct arpt_entry_target *t;
+	unsigned int tflags;
+	unsigned int target_offset;
+
+	struct in_addr *saddrs, *daddrs;
+	struct arpt_entry *e;
+	struct where *where;
+	unsigned int num_where;
+	struct json_import *json;
+
+	/* Copy the handle before a change in several steps. */
+	int rollback;
+	/* The handle before the change (NULL = not copied). */
+	arptc_handle_t undo;
+};
+
+static void json_import_free(struct json_import *ji);
+
+static void
+command_free(struct command *cmd)
+{
+	if (cmd->opts != original_opts)
+		free(cmd->opts);
+	free(cmd->t);
+	free(cmd->saddrs);
+	free(cmd->daddrs);
+	free(cmd->e);
+	while (cmd->num_where)
+		free(cmd->where[--cmd->num_where].terms);
+	free(cmd->where);
+	json_import_free(cmd->json);
+	if (cmd->undo)
+		arptc_free(&cmd->undo);
+	memset(cmd, 0, sizeof(*cmd));
+}
+
+/* Adds `newopts' to cmd->opts, numbered from *option_offset on. */
+static void
+merge_options(struct command *cmd, const struct option *newopts,
 	      unsigned int *option_offset)
 {
 	unsigned int num_old, num_new, i;
 	struct option *merge;
 
-	for (num_old = 0; oldopts[num_old].name; num_old++);
+	for (num_old = 0; cmd->opts[num_old].name; num_old++);
 	for (num_new = 0; newopts[num_new].name; num_new++);
 
-	global_option_offset += OPTION_OFFSET;
-	*option_offset = global_option_offset;
+	cmd->option_offset += OPTION_OFFSET;
+	*option_offset = cmd->option_offset;
 
 	merge = malloc(sizeof(struct option) * (num_new + num_old + 1));
-	memcpy(merge, oldopts, num_old * sizeof(struct option));
+	if (!merge)
+		exit_error(OTHER_PROBLEM, "out of memory");
+	memcpy(merge, cmd->opts, num_old * sizeof(struct option));
 	for (i = 0; i < num_new; i++) {
 		merge[num_old + i] = newopts[i];
 		merge[num_old + i].val += *option_offset;
 	}
 	memset(merge + num_old + num_new, 0, sizeof(struct option));
 
-	return merge;
+	if (cmd->opts != original_opts)
+		free(cmd->opts);
+	cmd->opts = merge;
 }
 
 void
@@ -1103,33 +2003,34 @@ register_target(struct arptables_target *me)
 	/* Prepend to list. */
 	me->next = arptables_targets;
 	arptables_targets = me;
-	me->t = NULL;
-	me->tflags = 0;
 }
 
 static void
 print_num(uint64_t number, unsigned int format)
 {
+	/* FMT() always takes the untabulated form, so no padding. */
+	const char *unit = " ";
+
 	if (format & FMT_KILOMEGAGIGA) {
 		if (number > 99999) {
 			number = (number + 500) / 1000;
+			unit = "K ";
 			if (number > 9999) {
 				number = (number + 500) / 1000;
+				unit = "M ";
 				if (number > 9999) {
 					number = (number + 500) / 1000;
+					unit = "G ";
 					if (number > 9999) {
 						number = (number + 500) / 1000;
-						printf(FMT("%4"PRIu64"T ","%"PRIu64"T "), number);
+						unit = "T ";
 					}
-					else printf(FMT("%4"PRIu64"G ","%"PRIu64"G "), number);
 				}
-				else printf(FMT("%4"PRIu64"M ","%"PRIu64"M "), number);
-			} else
-				printf(FMT("%4"PRIu64"K ","%"PRIu64"K "), number);
-		} else
-			printf(FMT("%5"PRIu64" ","%"PRIu64" "), number);
-	} else
-		printf(FMT("%8"PRIu64" ","%"PRIu64" "), number);
+			}
+		}
+	}
+	out_uint(number);
+	out_puts(unit);
 }
 
 
@@ -1138,23 +2039,28 @@ print_header(unsigned int format, const char *chain, arptc_handle_t *handle)
 {
 	struct arpt_counters counters;
 	const char *pol = arptc_get_policy(chain, &counters, handle);
-	printf("Chain %s", chain);
+	out_puts("Chain ");
+	out_puts(chain);
 	if (pol) {
-		printf(" (policy %s", pol);
+		out_puts(" (policy ");
+		out_puts(pol);
 		if (!(format & FMT_NOCOUNTS)) {
-			fputc(' ', stdout);
+			out_char(' ');
 			print_num(counters.pcnt, (format|FMT_NOTABLE));
-			fputs("packets, ", stdout);
+			out_puts("packets, ");
 			print_num(counters.bcnt, (format|FMT_NOTABLE));
-			fputs("bytes", stdout);
+			out_puts("bytes");
 		}
-		printf(")\n");
+		out_puts(")\n");
 	} else {
 		unsigned int refs;
 		if (!arptc_get_references(&refs, chain, handle))
-			printf(" (ERROR obtaining refs)\n");
-		else
-			printf(" (%u references)\n", refs);
+			out_puts(" (ERROR obtaining refs)\n");
+		else {
+			out_puts(" (");
+			out_uint(refs);
+			out_puts(" references)\n");
+		}
 	}
 
 /* I don't like this
@@ -1215,64 +2121,68 @@ print_firewall(const struct arpt_entry *fw,
 	       unsigned int format,
 	       const arptc_handle_t handle)
 {
-	struct arptables_target *target = NULL;
+	/* Rules that jump or give a verdict all have the standard
+	   target, and most of the rest share a few extensions: look
+	   each up once, not once a rule. */
+	static struct arptables_target *standard, *last;
+	struct arptables_target *target;
 	const struct arpt_entry_target *t;
-	char buf[BUFSIZ];
 	int i;
-	char iface[IFNAMSIZ+2];
-	int print_iface = 0;
-
-	if (!arptc_is_chain(targname, handle))
-		target = find_target(targname, TRY_LOAD);
-	else
-		target = find_target(ARPT_STANDARD_TARGET, LOAD_MUST_SUCCEED);
 
 	t = arpt_get_target((struct arpt_entry *)fw);
+	if (t->u.user.name[0] == '\0') {
+		if (!standard)
+			standard = find_target(ARPT_STANDARD_TARGET,
+					       LOAD_MUST_SUCCEED);
+		target = standard;
+	} else if (last && strcmp(last->name, t->u.user.name) == 0)
+		target = last;
+	else
+		target = last = find_target(t->u.user.name, TRY_LOAD);
 
-	if (format & FMT_LINENUMBERS)
-		printf("%u ", num+1);
-
-	if (!(format & FMT_NOTARGET) && targname[0] != '\0')
-		printf("-j %s ", targname);
-
-	iface[0] = '\0';
-
-	if (fw->arp.iniface[0] != '\0') {
-		strcat(iface, fw->arp.iniface);
-		print_iface = 1;
-	}
-	else if (format & FMT_VIA) {
-		print_iface = 1;
-		if (format & FMT_NUMERIC) strcat(iface, "*");
-		else strcat(iface, "any");
+	if (format & FMT_LINENUMBERS) {
+		out_uint(num+1);
+		out_char(' ');
 	}
-	if (print_iface)
-		printf("%s-i %s ", fw->arp.invflags & ARPT_INV_VIA_IN ? "! ": "", iface);
 
-	print_iface = 0;
-	iface[0] = '\0';
+	if (!(format & FMT_NOTARGET) && targname[0] != '\0') {
+		out_puts("-j ");
+		out_puts(targname);
+		out_char(' ');
+	}
 
-	if (fw->arp.outiface[0] != '\0') {
-		strcat(iface, fw->arp.outiface);
-		print_iface = 1;
+	if (fw->arp.iniface[0] != '\0' || (format & FMT_VIA)) {
+		if (fw->arp.invflags & ARPT_INV_VIA_IN)
+			out_puts("! ");
+		out_puts("-i ");
+		if (fw->arp.iniface[0] != '\0')
+			out_puts(fw->arp.iniface);
+		else
+			out_puts(format & FMT_NUMERIC ? "*" : "any");
+		out_char(' ');
 	}
-	else if (format & FMT_VIA) {
-		print_iface = 1;
-		if (format & FMT_NUMERIC) strcat(iface, "*");
-		else strcat(iface, "any");
+
+	if (fw->arp.outiface[0] != '\0' || (format & FMT_VIA)) {
+		if (fw->arp.invflags & ARPT_INV_VIA_OUT)
+			out_puts("! ");
+		out_puts("-o ");
+		if (fw->arp.outiface[0] != '\0')
+			out_puts(fw->arp.outiface);
+		else
+			out_puts(format & FMT_NUMERIC ? "*" : "any");
+		out_char(' ');
 	}
-	if (print_iface)
-		printf("%s-o %s ", fw->arp.invflags & ARPT_INV_VIA_OUT ? "! " : "", iface);
 
 	if (fw->arp.smsk.s_addr != 0L) {
-		printf("%s", fw->arp.invflags & ARPT_INV_SRCIP
-			? "! " : "");
+		if (fw->arp.invflags & ARPT_INV_SRCIP)
+			out_puts("! ");
+		out_puts("-s ");
 		if (format & FMT_NUMERIC)
-			sprintf(buf, "%s", addr_to_dotted(&(fw->arp.src)));
+			out_dotted(&(fw->arp.src));
 		else
-			sprintf(buf, "%s", addr_to_anyname(&(fw->arp.src)));
-		strncat(buf, mask_to_dotted(&(fw->arp.smsk)), sizeof(buf) - strlen(buf) -1);
-		printf("-s %s ", buf);
+			out_puts(addr_to_anyname(&(fw->arp.src)));
+		out_puts(mask_to_dotted(&(fw->arp.smsk)));
+		out_char(' ');
 	}
 
 	for (i = 0; i < ARPT_DEV_ADDR_LEN_MAX; i++)
@@ -1280,23 +2190,24 @@ print_firewall(const struct arpt_entry *fw,
 			break;
 	if (i == ARPT_DEV_ADDR_LEN_MAX)
 		goto after_devsrc;
-	printf("%s", fw->arp.invflags & ARPT_INV_SRCDEVADDR
-		? "! " : "");
-	printf("--src-mac ");
-	print_mac_and_mask((unsigned char *)fw->arp.src_devaddr.addr,
+	if (fw->arp.invflags & ARPT_INV_SRCDEVADDR)
+		out_puts("! ");
+	out_puts("--src-mac ");
+	out_mac_and_mask((unsigned char *)fw->arp.src_devaddr.addr,
 		(unsigned char *)fw->arp.src_devaddr.mask, ETH_ALEN);
-	printf(" ");
+	out_char(' ');
 after_devsrc:
 
 	if (fw->arp.tmsk.s_addr != 0L) {
-		printf("%s",fw->arp.invflags & ARPT_INV_TGTIP
-			? "! " : "");
+		if (fw->arp.invflags & ARPT_INV_TGTIP)
+			out_puts("! ");
+		out_puts("-d ");
 		if (format & FMT_NUMERIC)
-			sprintf(buf, "%s", addr_to_dotted(&(fw->arp.tgt)));
+			out_dotted(&(fw->arp.tgt));
 		else
-			sprintf(buf, "%s", addr_to_anyname(&(fw->arp.tgt)));
-		strncat(buf, mask_to_dotted(&(fw->arp.tmsk)),  sizeof(buf) - strlen(buf) -1);
-		printf("-d %s ", buf);
+			out_puts(addr_to_anyname(&(fw->arp.tgt)));
+		out_puts(mask_to_dotted(&(fw->arp.tmsk)));
+		out_char(' ');
 	}
 
 	for (i = 0; i <ARPT_DEV_ADDR_LEN_MAX; i++)
@@ -1304,63 +2215,83 @@ after_devsrc:
 			break;
 	if (i == ARPT_DEV_ADDR_LEN_MAX)
 		goto after_devdst;
-	printf("%s",fw->arp.invflags & ARPT_INV_TGTDEVADDR
-		? "! " : "");
-	printf("--dst-mac ");
-	print_mac_and_mask((unsigned char *)fw->arp.tgt_devaddr.addr,
+	if (fw->arp.invflags & ARPT_INV_TGTDEVADDR)
+		out_puts("! ");
+	out_puts("--dst-mac ");
+	out_mac_and_mask((unsigned char *)fw->arp.tgt_devaddr.addr,
 		(unsigned char *)fw->arp.tgt_devaddr.mask, ETH_ALEN);
-	printf(" ");
+	out_char(' ');
 after_devdst:
 
 	if (fw->arp.arhln_mask != 0) {
-		printf("%s",fw->arp.invflags & ARPT_INV_ARPHLN
-			? "! " : "");
-		printf("--h-length %d", fw->arp.arhln);
-		if (fw->arp.arhln_mask != 255)
-			printf("/%d", fw->arp.arhln_mask);
-		printf(" ");
+		if (fw->arp.invflags & ARPT_INV_ARPHLN)
+			out_puts("! ");
+		out_puts("--h-length ");
+		out_uint(fw->arp.arhln);
+		if (fw->arp.arhln_mask != 255) {
+			out_char('/');
+			out_uint(fw->arp.arhln_mask);
+		}
+		out_char(' ');
 	}
 
 	if (fw->arp.arpop_mask != 0) {
 		int tmp = ntohs(fw->arp.arpop);
 
-		printf("%s",fw->arp.invflags & ARPT_INV_ARPOP
-			? "! " : "");
+		if (fw->arp.invflags & ARPT_INV_ARPOP)
+			out_puts("! ");
+		out_puts("--opcode ");
 		if (tmp <= NUMOPCODES && !(format & FMT_NUMERIC))
-			printf("--opcode %s", opcodes[tmp-1]);
+			out_puts(opcodes[tmp-1]);
 		else
-			printf("--opcode %d", tmp);
-		if (fw->arp.arpop_mask != 65535)
-			printf("/%d", ntohs(fw->arp.arpop_mask));
-		printf(" ");
+			out_uint(tmp);
+		if (fw->arp.arpop_mask != 65535) {
+			out_char('/');
+			out_uint(ntohs(fw->arp.arpop_mask));
+		}
+		out_char(' ');
 	}
 
 	if (fw->arp.arhrd_mask != 0) {
 		uint16_t tmp = ntohs(fw->arp.arhrd);
 
-		printf("%s", fw->arp.invflags & ARPT_INV_ARPHRD
-			? "! " : "");
+		if (fw->arp.invflags & ARPT_INV_ARPHRD)
+			out_puts("! ");
+		out_puts("--h-type ");
 		if (tmp == 1 && !(format & FMT_NUMERIC))
-			printf("--h-type %s", "Ethernet");
+			out_puts("Ethernet");
+		else if (format & FMT_SAVE)
+			/* --h-type is parsed as hexadecimal. */
+			out_hex(tmp);
 		else
-			printf("--h-type %u", tmp);
-		if (fw->arp.arhrd_mask != 65535)
-			printf("/%d", ntohs(fw->arp.arhrd_mask));
-		printf(" ");
+			out_uint(tmp);
+		if (fw->arp.arhrd_mask != 65535) {
+			out_char('/');
+			if (format & FMT_SAVE)
+				out_hex(ntohs(fw->arp.arhrd_mask));
+			else
+				out_uint(ntohs(fw->arp.arhrd_mask));
+		}
+		out_char(' ');
 	}
 
 	if (fw->arp.arpro_mask != 0) {
 		int tmp = ntohs(fw->arp.arpro);
 
-		printf("%s", fw->arp.invflags & ARPT_INV_ARPPRO
-			? "! " : "");
+		if (fw->arp.invflags & ARPT_INV_ARPPRO)
+			out_puts("! ");
+		out_puts("--proto-type ");
 		if (tmp == 0x0800 && !(format & FMT_NUMERIC))
-			printf("--proto-type %s", "IPv4");
-		else
-			printf("--proto-type 0x%x", tmp);
-		if (fw->arp.arpro_mask != 65535)
-			printf("/%x", ntohs(fw->arp.arpro_mask));
-		printf(" ");
+			out_puts("IPv4");
+		else {
+			out_puts("0x");
+			out_hex(tmp);
+		}
+		if (fw->arp.arpro_mask != 65535) {
+			out_puts(format & FMT_SAVE ? "/0x" : "/");
+			out_hex(ntohs(fw->arp.arpro_mask));
+		}
+		out_char(' ');
 	}
 
 /* FIXME
@@ -1368,22 +2299,167 @@ after_devdst:
 */
 
 	if (target) {
-		if (target->print)
+		if (format & FMT_SAVE) {
+			if (target->save) {
+				out_flush();
+				target->save(&fw->arp, t);
+			}
+		} else if (target->print) {
 			/* Print the target information. */
+			out_flush();
 			target->print(&fw->arp, t, format & FMT_NUMERIC);
-	} else if (t->u.target_size != sizeof(*t))
-		printf("[%zu bytes of unknown target data] ",
-		       t->u.target_size - sizeof(*t));
+		}
+	} else if (t->u.target_size != sizeof(*t)) {
+		out_char('[');
+		out_uint(t->u.target_size - sizeof(*t));
+		out_puts(" bytes of unknown target data] ");
+	}
 
 	if (!(format & FMT_NOCOUNTS)) {
-		printf(", pcnt=");
+		out_puts(", pcnt=");
 		print_num(fw->counters.pcnt, format);
-		printf("-- bcnt=");
+		out_puts("-- bcnt=");
 		print_num(fw->counters.bcnt, format);
 	}
 
 	if (!(format & FMT_NONEWLINE))
-		fputc('\n', stdout);
+		out_char('\n');
+}
+
+/* Print a rule, jumping to `target', as the command `command' on
+   `chain', with the rule number `rulenum' if it isn't 0. */
+void
+print_rule(const char *command, const char *chain, unsigned int rulenum,
+	   const struct arpt_entry *e, const char *target, int counters,
+	   arptc_handle_t *handle)
+{
+	out_puts(command);
+	out_char(' ');
+	out_puts(chain);
+	out_char(' ');
+	if (rulenum) {
+		out_uint(rulenum);
+		out_char(' ');
+	}
+	print_firewall(e, target, 0,
+		       FMT_SAVE | FMT_NUMERIC | FMT_NOCOUNTS | FMT_NONEWLINE,
+		       *handle);
+	if (counters) {
+		out_puts("-c ");
+		out_uint(e->counters.pcnt);
+		out_char(' ');
+		out_uint(e->counters.bcnt);
+	}
+	out_char('\n');
+	out_flush();
+}
+
+/* Print a rule as the command that appends it. */
+void
+save_rule(const char *chain, const struct arpt_entry *e, int counters,
+	  arptc_handle_t *handle)
+{
+	print_rule("-A", chain, 0, e, arptc_get_target(e, handle), counters,
+		   handle);
+}
+
+void
+put_be32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+uint32_t
+get_be32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static int
+portable_encode(const struct arpt_entry_target *t, unsigned char *out,
+		unsigned int size)
+{
+	struct arptables_target *target;
+
+	target = find_target(t->u.user.name, TRY_LOAD);
+	if (!target || !target->portable_save
+	    || target->revision != t->u.user.revision)
+		return -1;
+	return target->portable_save(t, out, size);
+}
+
+static int
+portable_decode(const unsigned char *in, unsigned int len,
+		struct arpt_entry_target *t, unsigned int size)
+{
+	struct arptables_target *target;
+
+	target = find_target(t->u.user.name, TRY_LOAD);
+	if (!target || !target->portable_parse
+	    || target->revision != t->u.user.revision || target->size > size)
+		return 0;
+	t->u.target_size = ARPT_ALIGN(sizeof(struct arpt_entry_target))
+		+ target->size;
+	memset(t->data, 0, target->size);
+	return target->portable_parse(in, len, t) ? 1 : -1;
+}
+
+const struct arptc_target_codec portable_targets = {
+	portable_encode, portable_decode
+};
+
+/* Split a command line into words.  Quotes group words; there are no
+ * escapes.  Returns the number of words, or -1 with `err' set. */
+int
+split_line(char *line, char *argv[], int max, const char **err)
+{
+	int argc = 0;
+	char *p = line, *out;
+
+	while (*p) {
+		char quote = 0;
+
+		while (*p == ' ' || *p == '\t' || *p == '\n')
+			p++;
+		if (!*p)
+			break;
+		if (argc == max - 1) {
+			*err = "too many arguments";
+			return -1;
+		}
+
+		/* Nothing to unquote until the first quote: just find the
+		   end of the word. */
+		argv[argc++] = p;
+		while (*p && *p != ' ' && *p != '\t' && *p != '\n'
+		       && *p != '"' && *p != '\'')
+			p++;
+		for (out = p; *p; p++) {
+			if (quote) {
+				if (*p == quote)
+					quote = 0;
+				else
+					*out++ = *p;
+			} else if (*p == '"' || *p == '\'')
+				quote = *p;
+			else if (*p == ' ' || *p == '\t' || *p == '\n')
+				break;
+			else
+				*out++ = *p;
+		}
+		if (quote) {
+			*err = "unterminated quote";
+			return -1;
+		}
+		if (*p)
+			p++;
+		*out = '\0';
+	}
+	argv[argc] = NULL;
+	return argc;
 }
 
 static void
@@ -1394,6 +2470,7 @@ print_firewall_line(const struct arpt_entry *fw,
 
 	t = arpt_get_target((struct arpt_entry *)fw);
 	print_firewall(fw, t->u.user.name, 0, FMT_PRINT_RULE, h);
+	out_flush();
 }
 
 static int
@@ -1585,188 +2662,1748 @@ static int
 zero_entries(const arpt_chainlabel chain, int verbose,
 	     arptc_handle_t *handle)
 {
-	if (!chain)
-		return for_each_chain(zero_entries, verbose, 1, handle);
+	if (!chain)
+		return for_each_chain(zero_entries, verbose, 1, handle);
+
+	if (verbose)
+		fprintf(stdout, "Zeroing chain `%s'\n", chain);
+	return arptc_zero_entries(chain, handle);
+}
+
+int
+delete_chain(const arpt_chainlabel chain, int verbose,
+	     arptc_handle_t *handle)
+{
+	if (!chain)
+		return for_each_chain(delete_chain, verbose, 0, handle);
+
+	if (verbose)
+	        fprintf(stdout, "Deleting chain `%s'\n", chain);
+	return arptc_delete_chain(chain, handle);
+}
+
+static int
+list_entries(const arpt_chainlabel chain, int verbose, int numeric,
+	     int expanded, int linenumbers, arptc_handle_t *handle)
+{
+	int found = 0;
+	unsigned int format;
+	const char *this;
+
+	format = FMT_OPTIONS;
+	if (!verbose)
+		format |= FMT_NOCOUNTS;
+	else
+		format |= FMT_VIA;
+
+	if (numeric)
+		format |= FMT_NUMERIC;
+
+	if (!expanded)
+		format |= FMT_KILOMEGAGIGA;
+
+	if (linenumbers)
+		format |= FMT_LINENUMBERS;
+
+	if (!numeric) {
+		const struct arpt_entry *i;
+		struct arptc_cursor cursor;
+
+		for (this = chain ? chain : arptc_first_chain(handle);
+		     this && arptc_cursor_init(&cursor, this, handle);
+		     this = chain ? NULL : arptc_next_chain(handle))
+			while ((i = arptc_cursor_next(&cursor)))
+				rdns_want_entry(i);
+		rdns_run();
+	}
+
+	/* One chain is listed straight away, not looked for. */
+	for (this = chain ? chain : arptc_first_chain(handle);
+	     this;
+	     this = chain ? NULL : arptc_next_chain(handle)) {
+		const struct arpt_entry *i;
+		struct arptc_cursor cursor;
+		unsigned int num;
+
+		if (!arptc_cursor_init(&cursor, this, handle)) {
+			out_flush();
+			return 0;
+		}
+
+		if (found) out_char('\n');
+
+		print_header(format, this, handle);
+
+		num = 0;
+		while ((i = arptc_cursor_next(&cursor)))
+			print_firewall(i,
+				       arptc_get_target(i, handle),
+				       num++,
+				       format,
+				       *handle);
+		found = 1;
+	}
+	out_flush();
+
+	errno = ENOENT;
+	return found;
+}
+
+static int
+compare_result(const void *a, const void *b)
+{
+	const struct arpt_entry *x = ((const struct arptc_query_result *)a)->entry;
+	const struct arpt_entry *y = ((const struct arptc_query_result *)b)->entry;
+
+	return (x > y) - (x < y);
+}
+
+/* List the rules matching any of the --where queries. */
+static int
+list_where(const arpt_chainlabel chain, const struct where *where,
+	   unsigned int num_where, int verbose, int numeric, int expanded,
+	   int linenumbers, arptc_handle_t *handle)
+{
+	struct arptc_query_result *all = NULL, *res;
+	unsigned int num_all = 0, num, i, j;
+	const char *last = NULL;
+	unsigned int format;
+
+	if (chain && !arptc_is_chain(chain, *handle)) {
+		errno = ENOENT;
+		return 0;
+	}
+
+	format = FMT_OPTIONS;
+	if (!verbose)
+		format |= FMT_NOCOUNTS;
+	else
+		format |= FMT_VIA;
+
+	if (numeric)
+		format |= FMT_NUMERIC;
+
+	if (!expanded)
+		format |= FMT_KILOMEGAGIGA;
+
+	if (linenumbers)
+		format |= FMT_LINENUMBERS;
+
+	for (i = 0; i < num_where; i++) {
+		if (!arptc_query(where[i].terms, where[i].num_terms, &res,
+				 &num, handle)) {
+			free(all);
+			return 0;
+		}
+		all = realloc(all, (num_all + num + 1) * sizeof(*all));
+		if (!all)
+			exit_error(OTHER_PROBLEM, "realloc failed");
+		memcpy(all + num_all, res, num * sizeof(*res));
+		num_all += num;
+		free(res);
+	}
+
+	/* Entries are laid out in table order: sort to merge the
+	 * answers of several queries. */
+	if (num_where > 1)
+		qsort(all, num_all, sizeof(*all), compare_result);
+
+	if (!numeric) {
+		for (i = 0; i < num_all; i++)
+			if (!chain || strcmp(chain, all[i].chain) == 0)
+				rdns_want_entry(all[i].entry);
+		rdns_run();
+	}
+
+	for (i = 0; i < num_all; i++) {
+		if (i && all[i].entry == all[i-1].entry)
+			continue;
+		if (chain && strcmp(chain, all[i].chain) != 0)
+			continue;
+
+		if (!last || strcmp(last, all[i].chain) != 0) {
+			if (last)
+				out_char('\n');
+			print_header(format, all[i].chain, handle);
+			last = all[i].chain;
+		}
+		j = all[i].rulenum - 1;
+		print_firewall(all[i].entry, all[i].target, j, format,
+			       *handle);
+	}
+	out_flush();
+
+	free(all);
+	return 1;
+}
+
+static char *get_modprobe(void)
+{
+	int procfile;
+	char *ret;
+
+	procfile = open(PROC_SYS_MODPROBE, O_RDONLY);
+	if (procfile < 0)
+		return NULL;
+
+	ret = malloc(1024);
+	if (ret) {
+		int read_bytes = read(procfile, ret, 1024);
+		switch (read_bytes) {
+		case -1: goto fail;
+		case 1024: goto fail; /* Partial read.  Wierd */
+		}
+		ret[read_bytes] = '\0';
+		if (ret[strlen(ret)-1]=='\n')
+			ret[strlen(ret)-1]=0;
+		close(procfile);
+		return ret;
+	}
+ fail:
+	free(ret);
+	close(procfile);
+	return NULL;
+}
+
+int arptables_insmod(const char *modname, const char *modprobe)
+{
+	char *buf = NULL;
+	char *argv[3];
+
+	/* If they don't explicitly set it, read out of kernel */
+	if (!modprobe) {
+		buf = get_modprobe();
+		if (!buf)
+			return -1;
+		modprobe = buf;
+	}
+
+	switch (fork()) {
+	case 0:
+		argv[0] = (char *)modprobe;
+		argv[1] = (char *)modname;
+		argv[2] = NULL;
+		execv(argv[0], argv);
+
+		/* not usually reached */
+		exit(0);
+	case -1:
+		return -1;
+
+	default: /* parent */
+		wait(NULL);
+	}
+
+	free(buf);
+	return 0;
+}
+
+void arptables_unlock(void)
+{
+	const struct arptc_lock_stats *stats;
+
+	arptc_unlock();
+	if (!lock_verbose)
+		return;
+
+	stats = arptc_get_lock_stats();
+	printf("Waited %llu usec for the arptables lock, held it for "
+	       "%llu usec\n", stats->wait_usec, stats->hold_usec);
+	lock_verbose = 0;
+}
+
+static struct arpt_entry *
+generate_entry(const struct arpt_entry *fw,
+	       struct arptables_match *matches,
+	       struct arpt_entry_target *target)
+{
+	unsigned int size;
+	/*
+	struct arptables_match *m;
+	*/
+	struct arpt_entry *e;
+
+	size = sizeof(struct arpt_entry);
+	/* FIXME
+	for (m = matches; m; m = m->next) {
+		if (!m->used)
+			continue;
+
+		size += m->m->u.match_size;
+	}
+	*/
+
+	e = fw_malloc(size + target->u.target_size);
+	*e = *fw;
+	e->target_offset = size;
+	e->next_offset = size + target->u.target_size;
+
+	size = 0;
+	/* FIXME
+	for (m = matches; m; m = m->next) {
+		if (!m->used)
+			continue;
+
+		memcpy(e->elems + size, m->m, m->m->u.match_size);
+		size += m->m->u.match_size;
+	}
+	*/
+
+	memcpy(e->elems + size, target, target->u.target_size);
+
+	return e;
+}
+
+/* The options fast_parse() knows. */
+static const struct fast_opt
+{
+	const char *name;
+	int c;		/* as in original_opts */
+	unsigned int option;
+} fast_opts[] = {
+	{ "-s", 's', OPT_S_IP }, { "--source-ip", 's', OPT_S_IP },
+	{ "--src-ip", 's', OPT_S_IP },
+	{ "-d", 'd', OPT_D_IP }, { "--destination-ip", 'd', OPT_D_IP },
+	{ "--dst-ip", 'd', OPT_D_IP },
+	{ "--source-mac", 2, OPT_S_MAC }, { "--src-mac", 2, OPT_S_MAC },
+	{ "--destination-mac", 3, OPT_D_MAC }, { "--dst-mac", 3, OPT_D_MAC },
+	{ "-l", 'l', OPT_H_LENGTH }, { "--h-length", 'l', OPT_H_LENGTH },
+	{ "--opcode", 4, OPT_OPCODE }, { "--h-type", 5, OPT_H_TYPE },
+	{ "--proto-type", 6, OPT_P_TYPE },
+	{ "-i", 'i', OPT_VIANAMEIN }, { "--in-interface", 'i', OPT_VIANAMEIN },
+	{ "-o", 'o', OPT_VIANAMEOUT },
+	{ "--out-interface", 'o', OPT_VIANAMEOUT },
+	{ "-j", 'j', OPT_JUMP }, { "--jump", 'j', OPT_JUMP },
+	{ "-c", 'c', OPT_COUNTERS }, { "--set-counters", 'c', OPT_COUNTERS },
+	{ NULL, 0, 0 }
+};
+
+/* Plain decimal a.b.c.d, which is nearly every address in a saved
+   table.  Anything else (hex, octal, ...) is left to dotted_to_addr(). */
+static int
+fast_dotted(const char *s, struct in_addr *addr)
+{
+	unsigned char *addrp = (unsigned char *)&addr->s_addr;
+	unsigned int n;
+	int i, digits;
+
+	for (i = 0; i < 4; i++) {
+		for (n = 0, digits = 0; *s >= '0' && *s <= '9'; s++, digits++)
+			n = n * 10 + *s - '0';
+		if (digits == 0 || digits > 3 || n > 255
+		    || (digits > 1 && s[-digits] == '0')
+		    || *s++ != (i < 3 ? '.' : '\0'))
+			return 0;
+		addrp[i] = n;
+	}
+	return 1;
+}
+
+/* parse_hostnetwork() with the reentrant resolver calls.  A single
+   address goes to `one'; more are returned in a new array. */
+static struct in_addr *
+fast_hostnetwork(const char *name, struct in_addr *one, unsigned int *naddrs)
+{
+	struct resolve_entry *e;
+	struct in_addr *addrs;
+
+	*naddrs = 1;
+	if (fast_dotted(name, one) || dotted_to_addr_r(name, one))
+		return one;
+
+	if ((e = resolve_cached(name)) != NULL) {
+		if (!e->addrs
+		    || !(addrs = malloc(e->naddrs * sizeof(struct in_addr))))
+			return NULL;
+		memcpy(addrs, e->addrs, e->naddrs * sizeof(struct in_addr));
+		*naddrs = e->naddrs;
+	} else if (!(addrs = resolve_lookup(name, naddrs)))
+		return NULL;
+
+	if (*naddrs == 1) {
+		*one = *addrs;
+		free(addrs);
+		return one;
+	}
+	return addrs;
+}
+
+/* parse_hostnetworkmask(), returning 0 where it would exit. */
+static int
+fast_addr(const char *arg, struct in_addr **addrs, unsigned int *naddrs,
+	  struct in_addr *one, struct in_addr *mask)
+{
+	struct in_addr *a;
+	unsigned int i, j, k, bits;
+	char buf[256], *p;
+
+	if (strlen(arg) >= sizeof(buf))
+		return 0;
+	strcpy(buf, arg);
+	if ((p = strrchr(buf, '/')) != NULL) {
+		*p++ = '\0';
+		if (p[0] >= '1' && p[0] <= '9' && (p[1] == '\0'
+		    || (p[1] >= '0' && p[1] <= '9' && p[2] == '\0'))
+		    && atoi(p) <= 32)
+			mask->s_addr = htonl(0xFFFFFFFF << (32 - atoi(p)));
+		else if (!fast_dotted(p, mask) && !dotted_to_addr_r(p, mask)) {
+			if (string_to_number(p, 0, 32, &bits) == -1)
+				return 0;
+			mask->s_addr = bits ? htonl(0xFFFFFFFF << (32 - bits))
+					    : 0L;
+		}
+	} else
+		mask->s_addr = 0xFFFFFFFF;
+
+	/* if a null mask is given, the name is ignored, like in "any/0" */
+	if (mask->s_addr == 0L) {
+		one->s_addr = 0L;
+		*addrs = one;
+		*naddrs = 1;
+		return 1;
+	}
+	if (!(a = *addrs = fast_hostnetwork(buf, one, naddrs)))
+		return 0;
+	for (i = 0, j = 0; i < *naddrs; i++) {
+		a[j].s_addr = a[i].s_addr & mask->s_addr;
+		for (k = 0; k < j; k++)
+			if (a[k].s_addr == a[j].s_addr)
+				break;
+		if (k == j)
+			j++;
+	}
+	*naddrs = j;
+	return 1;
+}
+
+/* Parse a copy of `arg' with one of the value-and-mask parsers, which
+   write into their argument. */
+static int
+fast_value(int c, const char *arg, struct arpt_arp *arp)
+{
+	char buf[64];
+	int i;
+
+	if (strlen(arg) >= sizeof(buf))
+		return 0;
+	strcpy(buf, arg);
+
+	switch (c) {
+	case 2:
+		return getmac_and_mask(buf, arp->src_devaddr.addr,
+				       arp->src_devaddr.mask) == 0;
+	case 3:
+		return getmac_and_mask(buf, arp->tgt_devaddr.addr,
+				       arp->tgt_devaddr.mask) == 0;
+	case 'l':
+		return getlength_and_mask(buf, &arp->arhln,
+					  &arp->arhln_mask) == 0;
+	case 4:
+		if (!get16_and_mask(buf, &arp->arpop, &arp->arpop_mask, 10))
+			return 1;
+		for (i = 0; i < NUMOPCODES; i++)
+			if (!strcasecmp(opcodes[i], arg))
+				break;
+		if (i == NUMOPCODES)
+			return 0;
+		arp->arpop = htons(i+1);
+		return 1;
+	case 5:
+		if (!get16_and_mask(buf, &arp->arhrd, &arp->arhrd_mask, 16))
+			return 1;
+		if (strcasecmp(arg, "Ethernet"))
+			return 0;
+		arp->arhrd = htons(1);
+		return 1;
+	case 6:
+		if (!get16_and_mask(buf, &arp->arpro, &arp->arpro_mask, 0))
+			return 1;
+		if (strcasecmp(arg, "ipv4"))
+			return 0;
+		arp->arpro = htons(0x800);
+		return 1;
+	}
+	return 0;
+}
+
+/* parse_interface(), for names it wouldn't warn or exit about. */
+static int
+fast_interface(const char *arg, char *vianame, unsigned char *mask)
+{
+	size_t i, vialen = strlen(arg);
+
+	if (vialen + 1 > IFNAMSIZ)
+		return 0;
+	if (vialen && arg[vialen - 1] != '+')
+		for (i = 0; arg[i]; i++)
+			if (!isalnum(arg[i]) && arg[i] != '_'
+			    && arg[i] != '.')
+				return 0;
+	parse_interface(arg, vianame, mask);
+	return 1;
+}
+
+/* Is `name' a standard target (verdict or chain) and nothing else? */
+static int
+fast_target(const char *name, arptc_handle_t handle)
+{
+	struct arptables_target *t;
+
+	if (strcmp(name, ARPTC_LABEL_ACCEPT) == 0
+	    || strcmp(name, ARPTC_LABEL_DROP) == 0
+	    || strcmp(name, ARPTC_LABEL_QUEUE) == 0
+	    || strcmp(name, ARPTC_LABEL_RETURN) == 0)
+		return 1;
+	if (strlen(name) + 1 > sizeof(arpt_chainlabel))
+		return 0;
+	for (t = arptables_targets; t; t = t->next)
+		if (strcmp(name, t->name) == 0)
+			return 0;
+	return arptc_is_chain(name, handle);
+}
+
+/* Parse `-A chain options...' into `r', without getopt, if it uses
+ * only the built-in matches and a standard target, as the rules
+ * arptables-save writes do.  Returns 0 for anything else, and for
+ * anything wrong with the rule: do_command() then says what.  This
+ * touches no global state and may run in several threads at once. */
+int
+fast_parse(int argc, char *argv[], struct fast_rule *r)
+{
+	const struct fast_opt *o;
+	unsigned int options = 0;
+	int i, invert = 0;
+
+	memset(r, 0, sizeof(*r));
+	if (argc < 3 || (strcmp(argv[1], "-A") != 0
+			 && strcmp(argv[1], "--append") != 0))
+		return 0;
+	r->chain = argv[2];
+	r->target = "";
+	if (strlen(r->chain) > ARPT_FUNCTION_MAXNAMELEN)
+		return 0;
+
+	for (i = 3; i < argc; i++) {
+		const char *arg;
+
+		if (strcmp(argv[i], "!") == 0) {
+			if (invert)
+				goto fail;
+			invert = TRUE;
+			continue;
+		}
+		for (o = fast_opts; o->name; o++)
+			if (strcmp(argv[i], o->name) == 0)
+				break;
+		if (!o->name || i + 1 >= argc || (options & o->option))
+			goto fail;
+		options |= o->option;
+
+		/* `-s ! addr' as well as `! -s addr'. */
+		arg = argv[++i];
+		if (strcmp(arg, "!") == 0 && o->c != 'j' && o->c != 'c') {
+			if (invert || i + 1 >= argc)
+				goto fail;
+			invert = TRUE;
+			arg = argv[++i];
+		}
+		if (invert) {
+			unsigned int n;
+			for (n = 0; 1U << n != o->option; n++);
+
+			if (!inverse_for_options[n])
+				goto fail;
+			r->fw.e.arp.invflags |= inverse_for_options[n];
+		}
+
+		switch (o->c) {
+		case 's':
+			if (!fast_addr(arg, &r->saddrs, &r->nsaddrs,
+				       &r->saddr, &r->fw.e.arp.smsk))
+				goto fail;
+			break;
+		case 'd':
+			if (!fast_addr(arg, &r->daddrs, &r->ndaddrs,
+				       &r->daddr, &r->fw.e.arp.tmsk))
+				goto fail;
+			break;
+		case 'i':
+			if (!fast_interface(arg, r->fw.e.arp.iniface,
+					    r->fw.e.arp.iniface_mask))
+				goto fail;
+			break;
+		case 'o':
+			if (!fast_interface(arg, r->fw.e.arp.outiface,
+					    r->fw.e.arp.outiface_mask))
+				goto fail;
+			break;
+		case 'j':
+			r->target = arg;
+			break;
+		case 'c':
+			if (i + 1 >= argc || argv[i + 1][0] == '-'
+			    || sscanf(arg, "%"PRIu64,
+				      (uint64_t *)&r->fw.e.counters.pcnt) != 1
+			    || sscanf(argv[++i], "%"PRIu64,
+				      (uint64_t *)&r->fw.e.counters.bcnt) != 1)
+				goto fail;
+			break;
+		default:
+			if (!fast_value(o->c, arg, &r->fw.e.arp))
+				goto fail;
+			break;
+		}
+		invert = FALSE;
+	}
+	if (invert)
+		goto fail;
+
+	if ((options & OPT_VIANAMEOUT) && (strcmp(r->chain, "PREROUTING") == 0
+					   || strcmp(r->chain, "INPUT") == 0))
+		goto fail;
+	if ((options & OPT_VIANAMEIN) && (strcmp(r->chain, "POSTROUTING") == 0
+					  || strcmp(r->chain, "OUTPUT") == 0))
+		goto fail;
+
+	if (!r->saddrs)
+		fast_addr("0.0.0.0/0", &r->saddrs, &r->nsaddrs, &r->saddr,
+			  &r->fw.e.arp.smsk);
+	if (!r->daddrs)
+		fast_addr("0.0.0.0/0", &r->daddrs, &r->ndaddrs, &r->daddr,
+			  &r->fw.e.arp.tmsk);
+	return 1;
+
+fail:
+	fast_free(r);
+	return 0;
+}
+
+/* Append a rule from fast_parse() to the handle, once for each source
+ * and destination address, as do_command() would.  Returns 0, having
+ * changed nothing, if its target isn't a standard one after all. */
+int
+fast_append_rule(struct fast_rule *r, arptc_handle_t *handle)
+{
+	static struct arptables_target *standard;
+	unsigned int i, j;
+
+	if (*r->target && !fast_target(r->target, *handle))
+		return 0;
+
+	if (!standard)
+		standard = find_target(ARPT_STANDARD_TARGET,
+				       LOAD_MUST_SUCCEED);
+	r->fw.e.target_offset = sizeof(struct arpt_entry);
+	r->fw.e.next_offset = sizeof(struct arpt_entry)
+		+ sizeof(struct arpt_entry_target) + standard->size;
+	r->fw.u.t.target.u.target_size = sizeof(struct arpt_entry_target)
+		+ standard->size;
+	strncpy(r->fw.u.t.target.u.user.name, r->target,
+		sizeof(r->fw.u.t.target.u.user.name) - 1);
+	r->fw.u.t.target.u.user.revision = standard->revision;
+
+	for (i = 0; i < r->nsaddrs; i++) {
+		r->fw.e.arp.src.s_addr = r->saddrs[i].s_addr;
+		for (j = 0; j < r->ndaddrs; j++) {
+			r->fw.e.arp.tgt.s_addr = r->daddrs[j].s_addr;
+			if (!arptc_append_entry(r->chain, &r->fw.e, handle))
+				exit_error(OTHER_PROBLEM, "%s",
+					   arptc_strerror(errno));
+		}
+	}
+	return 1;
+}
+
+void
+fast_free(struct fast_rule *r)
+{
+	if (r->saddrs != &r->saddr)
+		free(r->saddrs);
+	if (r->daddrs != &r->daddr)
+		free(r->daddrs);
+	r->saddrs = r->daddrs = NULL;
+}
+
+/* fast_parse() and fast_append_rule() in one, for a single rule. */
+int
+fast_append(int argc, char *argv[], arptc_handle_t *handle)
+{
+	static struct fast_rule r;
+	int ret;
+
+	if (!fast_parse(argc, argv, &r))
+		return 0;
+	ret = fast_append_rule(&r, handle);
+	fast_free(&r);
+	return ret;
+}
+
+/*
+ * JSON import and export (--json-export, --json-import).  A document is
+ *
+ *	{ "table": "filter", "chains": [ chain, ... ] }
+ *
+ * with each chain { "name", "policy", "counters", "rules": [ rule, ... ] }
+ * (policies and their counters for built-in chains only) and each rule
+ * an object with the fields it tests, under the names of their long
+ * options, "invert" (the names of the inverted ones), "counters",
+ * "target" and "target-options", which the target extension reads and
+ * writes.  arptables.schema.json has the details.  Both directions
+ * stream: export writes as it walks the table, and import appends each
+ * rule as soon as its object ends.
+ */
+
+static void
+json_quote(FILE *out, const char *s)
+{
+	fputc('"', out);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(out, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(out, "\\u%04x", *s);
+		else
+			fputc(*s, out);
+	}
+	fputc('"', out);
+}
+
+static void
+json_member(struct json_writer *w, const char *key)
+{
+	if (w->depth) {
+		if (!w->first[w->depth - 1])
+			fputc(',', w->out);
+		if (w->depth <= w->pretty)
+			fprintf(w->out, "\n%*s", 2 * w->depth, "");
+		else if (!w->first[w->depth - 1])
+			fputc(' ', w->out);
+		w->first[w->depth - 1] = 0;
+	}
+	if (key) {
+		json_quote(w->out, key);
+		fputs(": ", w->out);
+	}
+}
+
+static void
+json_open(struct json_writer *w, const char *key, int c)
+{
+	json_member(w, key);
+	if (w->depth == JSON_MAX_DEPTH)
+		exit_error(OTHER_PROBLEM, "JSON output nested too deep");
+	fputc(c, w->out);
+	w->first[w->depth++] = 1;
+}
+
+static void
+json_close(struct json_writer *w, int c)
+{
+	w->depth--;
+	if (!w->first[w->depth] && w->depth < w->pretty)
+		fprintf(w->out, "\n%*s", 2 * w->depth, "");
+	fputc(c, w->out);
+}
+
+void
+json_begin_object(struct json_writer *w, const char *key)
+{
+	json_open(w, key, '{');
+}
+
+void
+json_end_object(struct json_writer *w)
+{
+	json_close(w, '}');
+}
+
+void
+json_begin_array(struct json_writer *w, const char *key)
+{
+	json_open(w, key, '[');
+}
+
+void
+json_end_array(struct json_writer *w)
+{
+	json_close(w, ']');
+}
+
+void
+json_string(struct json_writer *w, const char *key, const char *value)
+{
+	json_member(w, key);
+	json_quote(w->out, value);
+}
+
+void
+json_number(struct json_writer *w, const char *key, uint64_t value)
+{
+	json_member(w, key);
+	fprintf(w->out, "%"PRIu64, value);
+}
+
+int
+json_option(const struct option *opts, const char *name)
+{
+	for (; opts->name; opts++)
+		if (strcmp(opts->name, name) == 0)
+			return opts->val;
+	return 0;
+}
+
+/* The rule fields, by the names of their options. */
+static const struct json_field
+{
+	const char *name;
+	int c;			/* as in fast_opts */
+	unsigned int option;
+	uint16_t inv;
+} json_fields[] = {
+	{ "source-ip", 's', OPT_S_IP, ARPT_INV_SRCIP },
+	{ "destination-ip", 'd', OPT_D_IP, ARPT_INV_TGTIP },
+	{ "source-mac", 2, OPT_S_MAC, ARPT_INV_SRCDEVADDR },
+	{ "destination-mac", 3, OPT_D_MAC, ARPT_INV_TGTDEVADDR },
+	{ "in-interface", 'i', OPT_VIANAMEIN, ARPT_INV_VIA_IN },
+	{ "out-interface", 'o', OPT_VIANAMEOUT, ARPT_INV_VIA_OUT },
+	{ "h-length", 'l', OPT_H_LENGTH, ARPT_INV_ARPHLN },
+	{ "opcode", 4, OPT_OPCODE, ARPT_INV_ARPOP },
+	{ "h-type", 5, OPT_H_TYPE, ARPT_INV_ARPHRD },
+	{ "proto-type", 6, OPT_P_TYPE, ARPT_INV_ARPPRO },
+	{ NULL, 0, 0, 0 }
+};
+
+static const struct json_field *
+json_field(const char *name)
+{
+	const struct json_field *f;
+
+	for (f = json_fields; f->name; f++)
+		if (strcmp(f->name, name) == 0)
+			return f;
+	return NULL;
+}
+
+static void
+json_mac(struct json_writer *w, const char *key, const char *addr,
+	 const char *mask)
+{
+	char buf[2 * 3 * ETH_ALEN];
+	int i, n, full = 1;
+
+	for (i = 0, n = 0; i < ETH_ALEN; i++) {
+		n += sprintf(buf + n, "%s%02x", i ? ":" : "",
+			     (unsigned char)addr[i]);
+		full &= (unsigned char)mask[i] == 255;
+	}
+	for (i = 0; !full && i < ETH_ALEN; i++)
+		n += sprintf(buf + n, "%s%02x", i ? ":" : "/",
+			     (unsigned char)mask[i]);
+	json_string(w, key, buf);
+}
+
+/* A value with a mask: a number if the mask is full, else a string as
+   the option takes it. */
+static void
+json_masked(struct json_writer *w, const char *key, unsigned int value,
+	    unsigned int mask, unsigned int full, const char *fmt)
+{
+	char buf[32];
+
+	if (mask == full)
+		json_number(w, key, value);
+	else {
+		snprintf(buf, sizeof(buf), fmt, value, mask);
+		json_string(w, key, buf);
+	}
+}
+
+static void
+json_counters(struct json_writer *w, const struct arpt_counters *c)
+{
+	json_begin_object(w, "counters");
+	json_number(w, "packets", c->pcnt);
+	json_number(w, "bytes", c->bcnt);
+	json_end_object(w);
+}
+
+static void
+json_rule(struct json_writer *w, const struct arpt_entry *e,
+	  const char *label)
+{
+	const struct arpt_arp *arp = &e->arp;
+	const struct arpt_entry_target *t;
+	const struct json_field *f;
+	struct arptables_target *target;
+	char buf[64];
+	int i;
+
+	json_begin_object(w, NULL);
+	if (arp->smsk.s_addr) {
+		strcpy(buf, addr_to_dotted(&arp->src));
+		strcat(buf, mask_to_dotted(&arp->smsk));
+		json_string(w, "source-ip", buf);
+	}
+	if (arp->tmsk.s_addr) {
+		strcpy(buf, addr_to_dotted(&arp->tgt));
+		strcat(buf, mask_to_dotted(&arp->tmsk));
+		json_string(w, "destination-ip", buf);
+	}
+	for (i = 0; i < ARPT_DEV_ADDR_LEN_MAX; i++)
+		if (arp->src_devaddr.mask[i]) {
+			json_mac(w, "source-mac", arp->src_devaddr.addr,
+				 arp->src_devaddr.mask);
+			break;
+		}
+	for (i = 0; i < ARPT_DEV_ADDR_LEN_MAX; i++)
+		if (arp->tgt_devaddr.mask[i]) {
+			json_mac(w, "destination-mac", arp->tgt_devaddr.addr,
+				 arp->tgt_devaddr.mask);
+			break;
+		}
+	if (arp->iniface[0])
+		json_string(w, "in-interface", arp->iniface);
+	if (arp->outiface[0])
+		json_string(w, "out-interface", arp->outiface);
+	if (arp->arhln_mask)
+		json_masked(w, "h-length", arp->arhln, arp->arhln_mask, 255,
+			    "%u/%u");
+	if (arp->arpop_mask)
+		json_masked(w, "opcode", ntohs(arp->arpop),
+			    ntohs(arp->arpop_mask), 65535, "%u/%u");
+	/* --h-type is parsed as hexadecimal. */
+	if (arp->arhrd_mask)
+		json_masked(w, "h-type", ntohs(arp->arhrd),
+			    ntohs(arp->arhrd_mask), 65535, "%x/%x");
+	if (arp->arpro_mask)
+		json_masked(w, "proto-type", ntohs(arp->arpro),
+			    ntohs(arp->arpro_mask), 65535, "0x%x/0x%x");
+	if (arp->invflags) {
+		json_begin_array(w, "invert");
+		for (f = json_fields; f->name; f++)
+			if (arp->invflags & f->inv)
+				json_string(w, NULL, f->name);
+		json_end_array(w);
+	}
+	json_counters(w, &e->counters);
+
+	if (label[0])
+		json_string(w, "target", label);
+	t = arpt_get_target((struct arpt_entry *)e);
+	if (strcmp(t->u.user.name, ARPT_STANDARD_TARGET) != 0) {
+		target = find_target(t->u.user.name, TRY_LOAD);
+		if (!target || !target->json_save)
+			exit_error(OTHER_PROBLEM, "target `%s' has no JSON "
+				   "form", t->u.user.name);
+		json_begin_object(w, "target-options");
+		target->json_save(w, arp, t);
+		json_end_object(w);
+	}
+	json_end_object(w);
+}
+
+static int
+json_export(const char *table, arptc_handle_t *handle)
+{
+	struct json_writer w = { stdout, 4 };
+	const struct arpt_entry *e;
+	struct arptc_cursor cursor;
+	struct arpt_counters pol;
+	const char *chain, *policy;
+
+	json_begin_object(&w, NULL);
+	json_string(&w, "table", table);
+	json_begin_array(&w, "chains");
+	for (chain = arptc_first_chain(handle); chain;
+	     chain = arptc_next_chain(handle)) {
+		json_begin_object(&w, NULL);
+		json_string(&w, "name", chain);
+		if ((policy = arptc_get_policy(chain, &pol, handle))) {
+			json_string(&w, "policy", policy);
+			json_counters(&w, &pol);
+		}
+		json_begin_array(&w, "rules");
+		if (!arptc_cursor_init(&cursor, chain, handle))
+			return 0;
+		while ((e = arptc_cursor_next(&cursor)))
+			json_rule(&w, e, arptc_get_target(e, handle));
+		json_end_array(&w);
+		json_end_object(&w);
+	}
+	json_end_array(&w);
+	json_end_object(&w);
+	fputc('\n', stdout);
+	return 1;
+}
+
+/* The tokens of JSON input, one at a time. */
+enum json_token {
+	JSON_END,
+	JSON_OBJECT,
+	JSON_OBJECT_END,
+	JSON_ARRAY,
+	JSON_ARRAY_END,
+	JSON_KEY,
+	JSON_STRING,
+	JSON_NUMBER,
+	JSON_TRUE,
+	JSON_FALSE,
+	JSON_NULL
+};
+
+/* What may come next. */
+enum json_want {
+	JSON_WANT_VALUE,
+	JSON_WANT_FIRST_VALUE,	/* or `]' */
+	JSON_WANT_KEY,
+	JSON_WANT_FIRST_KEY,	/* or `}' */
+	JSON_WANT_SEP		/* `,' or the end of the container */
+};
+
+struct json_reader
+{
+	FILE *in;
+	const char *name;
+	unsigned int line;
+	enum json_want want;
+	unsigned int depth;
+	char stack[JSON_MAX_DEPTH];
+	/* The text of the last key, string or number. */
+	char *text;
+	size_t len, size;
+};
+
+static void json_error(struct json_reader *r, const char *fmt, ...)
+	__attribute__((noreturn, format(printf, 2, 3)));
+
+static void
+json_error(struct json_reader *r, const char *fmt, ...)
+{
+	char msg[256];
+	va_list args;
+
+	va_start(args, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, args);
+	va_end(args);
+	exit_error(PARAMETER_PROBLEM, "%s: line %u: %s", r->name, r->line,
+		   msg);
+}
+
+static int
+json_getc(struct json_reader *r)
+{
+	int c = getc(r->in);
+
+	if (c == '\n')
+		r->line++;
+	return c;
+}
+
+static int
+json_space(struct json_reader *r)
+{
+	int c;
+
+	while ((c = json_getc(r)) == ' ' || c == '\t' || c == '\n'
+	       || c == '\r')
+		;
+	return c;
+}
+
+static void
+json_put(struct json_reader *r, int c)
+{
+	if (r->len + 1 >= r->size) {
+		r->size = r->size ? 2 * r->size : 256;
+		if (!(r->text = realloc(r->text, r->size)))
+			exit_error(OTHER_PROBLEM, "out of memory");
+	}
+	r->text[r->len++] = c;
+	r->text[r->len] = '\0';
+}
+
+static void
+json_utf8(struct json_reader *r, unsigned int u)
+{
+	if (u < 0x80)
+		json_put(r, u);
+	else if (u < 0x800) {
+		json_put(r, 0xc0 | u >> 6);
+		json_put(r, 0x80 | (u & 0x3f));
+	} else if (u < 0x10000) {
+		json_put(r, 0xe0 | u >> 12);
+		json_put(r, 0x80 | (u >> 6 & 0x3f));
+		json_put(r, 0x80 | (u & 0x3f));
+	} else {
+		json_put(r, 0xf0 | u >> 18);
+		json_put(r, 0x80 | (u >> 12 & 0x3f));
+		json_put(r, 0x80 | (u >> 6 & 0x3f));
+		json_put(r, 0x80 | (u & 0x3f));
+	}
+}
+
+static unsigned int
+json_hex4(struct json_reader *r)
+{
+	unsigned int u = 0;
+	int i, c;
+
+	for (i = 0; i < 4; i++) {
+		c = json_getc(r);
+		if (!isxdigit(c))
+			json_error(r, "bad \\u escape");
+		u = u << 4 | (isdigit(c) ? c - '0' : (c | 0x20) - 'a' + 10);
+	}
+	return u;
+}
+
+/* A string, its opening quote read. */
+static void
+json_read_string(struct json_reader *r)
+{
+	unsigned int u, lo;
+	int c;
+
+	r->len = 0;
+	json_put(r, 0);
+	r->len = 0;
+	while ((c = json_getc(r)) != '"') {
+		if (c == EOF || c < 0x20)
+			json_error(r, "unterminated string");
+		if (c != '\\') {
+			json_put(r, c);
+			continue;
+		}
+		switch (c = json_getc(r)) {
+		case '"': case '\\': case '/':
+			json_put(r, c);
+			break;
+		case 'b': json_put(r, '\b'); break;
+		case 'f': json_put(r, '\f'); break;
+		case 'n': json_put(r, '\n'); break;
+		case 'r': json_put(r, '\r'); break;
+		case 't': json_put(r, '\t'); break;
+		case 'u':
+			u = json_hex4(r);
+			if (u >= 0xd800 && u < 0xdc00) {
+				if (json_getc(r) != '\\' || json_getc(r) != 'u'
+				    || (lo = json_hex4(r)) < 0xdc00
+				    || lo >= 0xe000)
+					json_error(r, "bad surrogate pair");
+				u = 0x10000 + ((u - 0xd800) << 10)
+					+ (lo - 0xdc00);
+			}
+			if (u == 0)
+				json_error(r, "\\u0000 in a string");
+			json_utf8(r, u);
+			break;
+		default:
+			json_error(r, "bad escape in a string");
+		}
+	}
+}
+
+/* A number, its first character `c' read; the caller checks it. */
+static void
+json_read_number(struct json_reader *r, int c)
+{
+	r->len = 0;
+	do
+		json_put(r, c);
+	while (isdigit(c = json_getc(r)) || c == '.' || c == 'e'
+	       || c == 'E' || c == '+' || c == '-');
+	if (c == '\n')
+		r->line--;
+	ungetc(c, r->in);
+}
+
+static void
+json_literal(struct json_reader *r, const char *rest)
+{
+	for (; *rest; rest++)
+		if (json_getc(r) != *rest)
+			json_error(r, "unknown word");
+}
+
+static enum json_token
+json_push(struct json_reader *r, char c)
+{
+	if (r->depth == JSON_MAX_DEPTH)
+		json_error(r, "nested too deep");
+	r->stack[r->depth++] = c;
+	if (c == '{') {
+		r->want = JSON_WANT_FIRST_KEY;
+		return JSON_OBJECT;
+	}
+	r->want = JSON_WANT_FIRST_VALUE;
+	return JSON_ARRAY;
+}
+
+static enum json_token
+json_pop(struct json_reader *r)
+{
+	r->want = JSON_WANT_SEP;
+	return r->stack[--r->depth] == '{' ? JSON_OBJECT_END
+					   : JSON_ARRAY_END;
+}
+
+/* The next token.  The input must be one JSON value: anything else is
+   an error that names the line. */
+static enum json_token
+json_next(struct json_reader *r)
+{
+	char top = r->depth ? r->stack[r->depth - 1] : 0;
+	char end = top == '{' ? '}' : ']';
+	int c = json_space(r);
+
+	switch (r->want) {
+	case JSON_WANT_SEP:
+		if (!top) {
+			if (c != EOF)
+				json_error(r, "more after the document");
+			return JSON_END;
+		}
+		if (c == end)
+			return json_pop(r);
+		if (c != ',')
+			json_error(r, "expected `,' or `%c'", end);
+		r->want = top == '{' ? JSON_WANT_KEY : JSON_WANT_VALUE;
+		c = json_space(r);
+		break;
+	case JSON_WANT_FIRST_KEY:
+	case JSON_WANT_FIRST_VALUE:
+		if (c == end)
+			return json_pop(r);
+		r->want = r->want == JSON_WANT_FIRST_KEY ? JSON_WANT_KEY
+							 : JSON_WANT_VALUE;
+		break;
+	default:
+		break;
+	}
+
+	if (r->want == JSON_WANT_KEY) {
+		if (c != '"')
+			json_error(r, "expected a member name");
+		json_read_string(r);
+		if (json_space(r) != ':')
+			json_error(r, "expected `:' after \"%s\"", r->text);
+		r->want = JSON_WANT_VALUE;
+		return JSON_KEY;
+	}
+
+	r->want = JSON_WANT_SEP;
+	switch (c) {
+	case '{':
+	case '[':
+		return json_push(r, c);
+	case '"':
+		json_read_string(r);
+		return JSON_STRING;
+	case 't':
+		json_literal(r, "rue");
+		return JSON_TRUE;
+	case 'f':
+		json_literal(r, "alse");
+		return JSON_FALSE;
+	case 'n':
+		json_literal(r, "ull");
+		return JSON_NULL;
+	case EOF:
+		json_error(r, "unexpected end of input");
+	default:
+		if (c != '-' && !isdigit(c))
+			json_error(r, "unexpected `%c'", c);
+		json_read_number(r, c);
+		return JSON_NUMBER;
+	}
+}
+
+static void
+json_expect(struct json_reader *r, enum json_token want, const char *what)
+{
+	if (json_next(r) != want)
+		json_error(r, "%s", what);
+}
+
+static uint64_t
+json_uint(struct json_reader *r, const char *what)
+{
+	uint64_t n;
+	char *end;
 
-	if (verbose)
-		fprintf(stdout, "Zeroing chain `%s'\n", chain);
-	return arptc_zero_entries(chain, handle);
+	json_expect(r, JSON_NUMBER, what);
+	errno = 0;
+	n = strtoull(r->text, &end, 10);
+	if (r->text[0] == '-' || *end || errno)
+		json_error(r, "%s", what);
+	return n;
 }
 
-int
-delete_chain(const arpt_chainlabel chain, int verbose,
-	     arptc_handle_t *handle)
+static void
+json_read_counters(struct json_reader *r, struct arpt_counters *c)
 {
-	if (!chain)
-		return for_each_chain(delete_chain, verbose, 0, handle);
-
-	if (verbose)
-	        fprintf(stdout, "Deleting chain `%s'\n", chain);
-	return arptc_delete_chain(chain, handle);
+	json_expect(r, JSON_OBJECT, "\"counters\" must be an object");
+	while (json_next(r) == JSON_KEY) {
+		if (strcmp(r->text, "packets") == 0)
+			c->pcnt = json_uint(r, "bad packet counter");
+		else if (strcmp(r->text, "bytes") == 0)
+			c->bcnt = json_uint(r, "bad byte counter");
+		else
+			json_error(r, "unknown counter \"%s\"", r->text);
+	}
 }
 
-static int
-list_entries(const arpt_chainlabel chain, int verbose, int numeric,
-	     int expanded, int linenumbers, arptc_handle_t *handle)
+/* User chains named so far: declared by a chain object, or created
+   for a rule that jumps to them before that. */
+struct json_chains
 {
-	int found = 0;
-	unsigned int format;
-	const char *this;
+	struct json_chain {
+		arpt_chainlabel name;
+		int declared;
+	} *chain;
+	unsigned int num;
+};
 
-	format = FMT_OPTIONS;
-	if (!verbose)
-		format |= FMT_NOCOUNTS;
-	else
-		format |= FMT_VIA;
+/* A rule object as it is read: what it holds until it is appended. */
+struct json_rule
+{
+	struct fast_rule fr;
+	char *label;
+	/* "target-options", as key, value pairs. */
+	char **opt;
+	unsigned int num_opts;
+	struct arpt_entry_target *t;
+	unsigned int tflags;
+	struct arpt_entry *e;
+};
 
-	if (numeric)
-		format |= FMT_NUMERIC;
+/* A --json-import under way. */
+struct json_import
+{
+	struct json_reader r;
+	struct json_chains jc;
+	struct json_rule rule;
+};
 
-	if (!expanded)
-		format |= FMT_KILOMEGAGIGA;
+static void
+json_rule_free(struct json_rule *rule)
+{
+	unsigned int i;
 
-	if (linenumbers)
-		format |= FMT_LINENUMBERS;
+	for (i = 0; i < rule->num_opts; i++)
+		free(rule->opt[i]);
+	free(rule->opt);
+	free(rule->label);
+	free(rule->t);
+	free(rule->e);
+	fast_free(&rule->fr);
+	memset(rule, 0, sizeof(*rule));
+}
 
-	for (this = arptc_first_chain(handle);
-	     this;
-	     this = arptc_next_chain(handle)) {
-		const struct arpt_entry *i;
-		unsigned int num;
+static void
+json_import_free(struct json_import *ji)
+{
+	if (!ji)
+		return;
+	if (ji->r.in && ji->r.in != stdin)
+		fclose(ji->r.in);
+	free(ji->r.text);
+	free(ji->jc.chain);
+	json_rule_free(&ji->rule);
+	free(ji);
+}
 
-		if (chain && strcmp(chain, this) != 0)
-			continue;
+static struct json_chain *
+json_find_chain(struct json_chains *jc, const char *name)
+{
+	unsigned int i;
 
-		if (found) printf("\n");
+	for (i = 0; i < jc->num; i++)
+		if (strcmp(jc->chain[i].name, name) == 0)
+			return &jc->chain[i];
+	return NULL;
+}
 
-		print_header(format, this, handle);
-		i = arptc_first_rule(this, handle);
+static struct json_chain *
+json_new_chain(struct json_reader *r, struct json_chains *jc,
+	       const char *name, arptc_handle_t *handle)
+{
+	struct json_chain *c;
+
+	if (name[0] == '-' || strlen(name) > ARPT_FUNCTION_MAXNAMELEN)
+		json_error(r, "bad chain name `%s'", name);
+	if (find_target(name, TRY_LOAD))
+		json_error(r, "chain name `%s' clashes with a target", name);
+	if (!arptc_create_chain(name, handle))
+		json_error(r, "can't create chain `%s': %s", name,
+			   arptc_strerror(errno));
+	if (!(jc->num & 63)) {
+		c = realloc(jc->chain, (jc->num + 64) * sizeof(*c));
+		if (!c)
+			exit_error(OTHER_PROBLEM, "out of memory");
+		jc->chain = c;
+	}
+	c = &jc->chain[jc->num++];
+	strcpy(c->name, name);
+	c->declared = 0;
+	return c;
+}
 
-		num = 0;
-		while (i) {
-			print_firewall(i,
-				       arptc_get_target(i, handle),
-				       num++,
-				       format,
-				       *handle);
-			i = arptc_next_rule(i, handle);
+/* A rule field from `r->text', a string or a number. */
+static void
+json_read_field(struct json_reader *r, const struct json_field *f,
+		enum json_token tok, struct fast_rule *fr)
+{
+	struct arpt_arp *arp = &fr->fw.e.arp;
+	uint64_t n;
+	char *end;
+	int ok;
+
+	if (tok == JSON_NUMBER && (f->c == 'l' || f->c == 4 || f->c == 5
+				   || f->c == 6)) {
+		errno = 0;
+		n = strtoull(r->text, &end, 10);
+		if (r->text[0] == '-' || *end || errno
+		    || n > (f->c == 'l' ? 255 : 65535))
+			json_error(r, "bad \"%s\"", f->name);
+		switch (f->c) {
+		case 'l':
+			arp->arhln = n;
+			arp->arhln_mask = 255;
+			break;
+		case 4:
+			arp->arpop = htons(n);
+			arp->arpop_mask = 65535;
+			break;
+		case 5:
+			arp->arhrd = htons(n);
+			arp->arhrd_mask = 65535;
+			break;
+		case 6:
+			arp->arpro = htons(n);
+			arp->arpro_mask = 65535;
+			break;
 		}
-		found = 1;
+		return;
 	}
+	if (tok != JSON_STRING)
+		json_error(r, "\"%s\" must be a string", f->name);
 
-	errno = ENOENT;
-	return found;
+	switch (f->c) {
+	case 's':
+		ok = fast_addr(r->text, &fr->saddrs, &fr->nsaddrs, &fr->saddr,
+			       &arp->smsk);
+		break;
+	case 'd':
+		ok = fast_addr(r->text, &fr->daddrs, &fr->ndaddrs, &fr->daddr,
+			       &arp->tmsk);
+		break;
+	case 'i':
+		ok = fast_interface(r->text, arp->iniface,
+				    arp->iniface_mask);
+		break;
+	case 'o':
+		ok = fast_interface(r->text, arp->outiface,
+				    arp->outiface_mask);
+		break;
+	default:
+		ok = fast_value(f->c, r->text, arp);
+		break;
+	}
+	if (!ok)
+		json_error(r, "bad \"%s\" `%s'", f->name, r->text);
 }
 
-static char *get_modprobe(void)
+/* A rule object, its `{' read: append it to `chain'. */
+static void
+json_read_rule(struct json_import *ji, const char *chain,
+	       arptc_handle_t *handle)
 {
-	int procfile;
-	char *ret;
-
-	procfile = open(PROC_SYS_MODPROBE, O_RDONLY);
-	if (procfile < 0)
-		return NULL;
+	struct json_reader *r = &ji->r;
+	struct json_rule *rule = &ji->rule;
+	struct fast_rule *fr = &rule->fr;
+	const struct json_field *f;
+	struct arptables_target *target = NULL;
+	unsigned int seen = 0, i, j;
+	enum json_token tok;
+
+	fr->chain = chain;
+	while (json_next(r) == JSON_KEY) {
+		if ((f = json_field(r->text))) {
+			if (seen & f->option)
+				json_error(r, "\"%s\" twice", f->name);
+			seen |= f->option;
+			json_read_field(r, f, json_next(r), fr);
+		} else if (strcmp(r->text, "invert") == 0) {
+			json_expect(r, JSON_ARRAY, "\"invert\" must be an "
+				    "array");
+			while ((tok = json_next(r)) == JSON_STRING) {
+				if (!(f = json_field(r->text)))
+					json_error(r, "can't invert \"%s\"",
+						   r->text);
+				fr->fw.e.arp.invflags |= f->inv;
+			}
+			if (tok != JSON_ARRAY_END)
+				json_error(r, "\"invert\" must list names");
+		} else if (strcmp(r->text, "counters") == 0)
+			json_read_counters(r, &fr->fw.e.counters);
+		else if (strcmp(r->text, "target") == 0) {
+			json_expect(r, JSON_STRING, "\"target\" must be a "
+				    "string");
+			free(rule->label);
+			rule->label = strdup(r->text);
+		} else if (strcmp(r->text, "target-options") == 0) {
+			char **opt;
+
+			json_expect(r, JSON_OBJECT, "\"target-options\" must "
+				    "be an object");
+			/* Kept as key, value pairs until the target is
+			   known. */
+			while (json_next(r) == JSON_KEY) {
+				opt = realloc(rule->opt, (rule->num_opts + 2)
+					      * sizeof(*opt));
+				if (!opt)
+					exit_error(OTHER_PROBLEM,
+						   "out of memory");
+				rule->opt = opt;
+				opt[rule->num_opts++] = strdup(r->text);
+				tok = json_next(r);
+				if (tok != JSON_STRING && tok != JSON_NUMBER)
+					json_error(r, "target option \"%s\" "
+						   "must be a string or a "
+						   "number",
+						   opt[rule->num_opts - 1]);
+				opt[rule->num_opts++] = strdup(r->text);
+			}
+		} else
+			json_error(r, "unknown rule member \"%s\"", r->text);
+	}
 
-	ret = malloc(1024);
-	if (ret) {
-		int read_bytes = read(procfile, ret, 1024);
-		switch (read_bytes) {
-		case -1: goto fail;
-		case 1024: goto fail; /* Partial read.  Wierd */
+	for (f = json_fields; f->name; f++)
+		if ((fr->fw.e.arp.invflags & f->inv) && !(seen & f->option))
+			json_error(r, "\"%s\" is inverted but not tested",
+				   f->name);
+	if ((seen & OPT_VIANAMEOUT) && (strcmp(chain, "PREROUTING") == 0
+					|| strcmp(chain, "INPUT") == 0))
+		json_error(r, "\"out-interface\" in chain %s", chain);
+	if ((seen & OPT_VIANAMEIN) && (strcmp(chain, "POSTROUTING") == 0
+				       || strcmp(chain, "OUTPUT") == 0))
+		json_error(r, "\"in-interface\" in chain %s", chain);
+	if (!fr->saddrs)
+		fast_addr("0.0.0.0/0", &fr->saddrs, &fr->nsaddrs, &fr->saddr,
+			  &fr->fw.e.arp.smsk);
+	if (!fr->daddrs)
+		fast_addr("0.0.0.0/0", &fr->daddrs, &fr->ndaddrs, &fr->daddr,
+			  &fr->fw.e.arp.tmsk);
+	if ((fr->nsaddrs > 1 || fr->ndaddrs > 1)
+	    && (fr->fw.e.arp.invflags & (ARPT_INV_SRCIP | ARPT_INV_TGTIP)))
+		json_error(r, "can't invert an address that resolves to "
+			   "several");
+
+	/* A target that is neither a verdict, a chain nor an extension
+	   is a chain further on in the document. */
+	fr->target = rule->label ? rule->label : "";
+	if (fr->target[0] && strcmp(fr->target, ARPTC_LABEL_ACCEPT) != 0
+	    && strcmp(fr->target, ARPTC_LABEL_DROP) != 0
+	    && strcmp(fr->target, ARPTC_LABEL_QUEUE) != 0
+	    && strcmp(fr->target, ARPTC_LABEL_RETURN) != 0
+	    && !arptc_is_chain(fr->target, *handle)
+	    && !(target = find_target(fr->target, TRY_LOAD)))
+		json_new_chain(r, &ji->jc, fr->target, handle);
+
+	if (!target) {
+		if (rule->num_opts)
+			json_error(r, "target `%s' takes no options",
+				   fr->target);
+		if (!fast_append_rule(fr, handle))
+			json_error(r, "bad target `%s'", fr->target);
+	} else {
+		size_t size = ARPT_ALIGN(sizeof(struct arpt_entry_target))
+			+ target->size;
+
+		rule->t = fw_calloc(1, size);
+		rule->t->u.target_size = size;
+		strncpy(rule->t->u.user.name, fr->target,
+			sizeof(rule->t->u.user.name) - 1);
+		rule->t->u.user.revision = target->revision;
+		target->init(rule->t);
+		for (i = 0; i < rule->num_opts; i += 2)
+			if (!target->json_parse
+			    || !target->json_parse(rule->opt[i],
+						   rule->opt[i + 1],
+						   &rule->tflags,
+						   &fr->fw.e, &rule->t))
+				json_error(r, "target `%s' has no option "
+					   "\"%s\"", fr->target, rule->opt[i]);
+		target->final_check(rule->tflags);
+
+		rule->e = generate_entry(&fr->fw.e, NULL, rule->t);
+		for (i = 0; i < fr->nsaddrs; i++) {
+			rule->e->arp.src.s_addr = fr->saddrs[i].s_addr;
+			for (j = 0; j < fr->ndaddrs; j++) {
+				rule->e->arp.tgt.s_addr = fr->daddrs[j].s_addr;
+				if (!arptc_append_entry(chain, rule->e,
+							handle))
+					json_error(r, "%s",
+						   arptc_strerror(errno));
+			}
 		}
-		ret[read_bytes] = '\0';
-		if (ret[strlen(ret)-1]=='\n')
-			ret[strlen(ret)-1]=0;
-		close(procfile);
-		return ret;
 	}
- fail:
-	free(ret);
-	close(procfile);
-	return NULL;
+
+	json_rule_free(rule);
 }
 
-int arptables_insmod(const char *modname, const char *modprobe)
+/* A chain object, its `{' read.  "name" comes before "rules", which are
+   appended as they are read. */
+static void
+json_read_chain(struct json_import *ji, arptc_handle_t *handle)
 {
-	char *buf = NULL;
-	char *argv[3];
-
-	/* If they don't explicitly set it, read out of kernel */
-	if (!modprobe) {
-		buf = get_modprobe();
-		if (!buf)
-			return -1;
-		modprobe = buf;
+	struct json_reader *r = &ji->r;
+	struct json_chains *jc = &ji->jc;
+	struct json_chain *c;
+	struct arpt_counters counters;
+	arpt_chainlabel name = "", policy = ARPTC_LABEL_ACCEPT;
+	int have_policy = 0, have_counters = 0;
+	enum json_token tok;
+
+	memset(&counters, 0, sizeof(counters));
+	while (json_next(r) == JSON_KEY) {
+		if (strcmp(r->text, "name") == 0) {
+			if (name[0])
+				json_error(r, "chain with two names");
+			json_expect(r, JSON_STRING, "\"name\" must be a "
+				    "string");
+			if (!r->text[0])
+				json_error(r, "empty chain name");
+			if (!arptc_builtin(r->text, *handle)) {
+				c = json_find_chain(jc, r->text);
+				if (!c)
+					c = json_new_chain(r, jc, r->text,
+							   handle);
+				else if (c->declared)
+					json_error(r, "chain `%s' twice",
+						   r->text);
+				c->declared = 1;
+			}
+			strcpy(name, r->text);
+		} else if (strcmp(r->text, "policy") == 0) {
+			json_expect(r, JSON_STRING, "\"policy\" must be a "
+				    "string");
+			if (strlen(r->text) >= sizeof(policy))
+				json_error(r, "bad policy `%s'", r->text);
+			strcpy(policy, r->text);
+			have_policy = 1;
+		} else if (strcmp(r->text, "counters") == 0) {
+			json_read_counters(r, &counters);
+			have_counters = 1;
+		} else if (strcmp(r->text, "rules") == 0) {
+			if (!name[0])
+				json_error(r, "\"rules\" before the chain's "
+					   "\"name\"");
+			json_expect(r, JSON_ARRAY, "\"rules\" must be an "
+				    "array");
+			while ((tok = json_next(r)) == JSON_OBJECT)
+				json_read_rule(ji, name, handle);
+			if (tok != JSON_ARRAY_END)
+				json_error(r, "rules must be objects");
+		} else
+			json_error(r, "unknown chain member \"%s\"", r->text);
 	}
-
-	switch (fork()) {
-	case 0:
-		argv[0] = (char *)modprobe;
-		argv[1] = (char *)modname;
-		argv[2] = NULL;
-		execv(argv[0], argv);
-
-		/* not usually reached */
-		exit(0);
-	case -1:
-		return -1;
-
-	default: /* parent */
-		wait(NULL);
+	if (!name[0])
+		json_error(r, "chain without a name");
+
+	if (have_policy || have_counters) {
+		if (!arptc_builtin(name, *handle))
+			json_error(r, "user chain `%s' with a policy", name);
+		if (!arptc_set_policy(name, policy,
+				      have_counters ? &counters : NULL,
+				      handle))
+			json_error(r, "can't set policy of `%s': %s", name,
+				   arptc_strerror(errno));
 	}
-
-	free(buf);
-	return 0;
 }
 
-static struct arpt_entry *
-generate_entry(const struct arpt_entry *fw,
-	       struct arptables_match *matches,
-	       struct arpt_entry_target *target)
+static int
+json_reset_policy(const arpt_chainlabel chain, int verbose,
+		  arptc_handle_t *handle)
 {
-	unsigned int size;
-	/*
-	struct arptables_match *m;
-	*/
-	struct arpt_entry *e;
+	static const arpt_chainlabel accept = ARPTC_LABEL_ACCEPT;
 
-	size = sizeof(struct arpt_entry);
-	/* FIXME
-	for (m = matches; m; m = m->next) {
-		if (!m->used)
-			continue;
-
-		size += m->m->u.match_size;
-	}
-	*/
-
-	e = fw_malloc(size + target->u.target_size);
-	*e = *fw;
-	e->target_offset = size;
-	e->next_offset = size + target->u.target_size;
+	if (!arptc_builtin(chain, *handle))
+		return 1;
+	return arptc_set_policy(chain, accept, NULL, handle);
+}
 
-	size = 0;
-	/* FIXME
-	for (m = matches; m; m = m->next) {
-		if (!m->used)
-			continue;
+/* Replace the rules of the table with those in the document in `file'
+   (or standard input).  Chains and policies the document doesn't
+   mention are left as they would be after a reboot: gone, and
+   ACCEPT. */
+static int
+json_import(struct command *cmd, const char *file, const char *table,
+	    arptc_handle_t *handle)
+{
+	struct json_import *ji;
+	struct json_reader *r;
+	enum json_token tok;
+	unsigned int i;
 
-		memcpy(e->elems + size, m->m, m->m->u.match_size);
-		size += m->m->u.match_size;
+	if (!(ji = cmd->json = calloc(1, sizeof(*ji))))
+		exit_error(OTHER_PROBLEM, "out of memory");
+	r = &ji->r;
+	r->in = stdin;
+	r->name = "standard input";
+	r->line = 1;
+	if (file && strcmp(file, "-") != 0) {
+		if (!(r->in = fopen(file, "r")))
+			exit_error(OTHER_PROBLEM, "can't open `%s': %s",
+				   file, strerror(errno));
+		r->name = file;
 	}
-	*/
 
-	memcpy(e->elems + size, target, target->u.target_size);
+	if (!flush_entries(NULL, 0, handle) || !delete_chain(NULL, 0, handle)
+	    || !for_each_chain(json_reset_policy, 0, 1, handle))
+		return 0;
 
-	return e;
+	json_expect(r, JSON_OBJECT, "the document must be an object");
+	while (json_next(r) == JSON_KEY) {
+		if (strcmp(r->text, "table") == 0) {
+			json_expect(r, JSON_STRING, "\"table\" must be a "
+				    "string");
+			if (strcmp(r->text, table) != 0)
+				json_error(r, "rules for table `%s', not "
+					   "`%s'", r->text, table);
+		} else if (strcmp(r->text, "$schema") == 0)
+			json_expect(r, JSON_STRING, "\"$schema\" must be a "
+				    "string");
+		else if (strcmp(r->text, "chains") == 0) {
+			json_expect(r, JSON_ARRAY, "\"chains\" must be an "
+				    "array");
+			while ((tok = json_next(r)) == JSON_OBJECT)
+				json_read_chain(ji, handle);
+			if (tok != JSON_ARRAY_END)
+				json_error(r, "chains must be objects");
+		} else
+			json_error(r, "unknown member \"%s\"", r->text);
+	}
+	json_next(r);
+	if (ferror(r->in))
+		exit_error(OTHER_PROBLEM, "reading %s: %s", r->name,
+			   strerror(errno));
+
+	for (i = 0; i < ji->jc.num; i++)
+		if (!ji->jc.chain[i].declared)
+			json_error(r, "a rule jumps to `%s', which isn't in "
+				   "the document", ji->jc.chain[i].name);
+	return 1;
 }
 
-int do_command(int argc, char *argv[], char **table, arptc_handle_t *handle)
+static int
+run_command(struct command *cmd, int argc, char *argv[], char **table,
+	    arptc_handle_t *handle)
 {
-	struct arpt_entry fw, *e = NULL;
+	struct arpt_entry fw;
 	int invert = 0;
 	unsigned int nsaddrs = 0, ndaddrs = 0;
-	struct in_addr *saddrs = NULL, *daddrs = NULL;
 
 	int c, verbose = 0;
 	const char *chain = NULL;
@@ -1781,27 +4418,14 @@ int do_command(int argc, char *argv[], char **table, arptc_handle_t *handle)
 	const char *jumpto = "";
 	char *protocol = NULL;
 	const char *modprobe = NULL;
-
-	/* first figure out if this is a 2.6 or a 2.4 kernel */
-	*handle = arptc_init(*table);
-
-	if (!*handle) {
-		arptables_insmod("arp_tables", modprobe);
-		*handle = arptc_init(*table);
-		if (!*handle) {
-			RUNTIME_NF_ARP_NUMHOOKS = 2;
-			*handle = arptc_init(*table);
-			if (!*handle) {
-				exit_error(VERSION_PROBLEM,
-				"can't initialize arptables table `%s': %s",
-				*table, arptc_strerror(errno));
-			}
-		}
-	}
+	int wait = 0;
+	unsigned int wait_interval = 1000000;
+	const char *json_file = NULL;
+	arptc_handle_t (*init)(const char *) = arptc_init;
+	const char *cache;
 
 	memset(&fw, 0, sizeof(fw));
-	opts = original_opts;
-	global_option_offset = 0;
+	cmd->opts = original_opts;
 
 	/* re-set optind to 0 in case do_command gets called
 	 * a second time */
@@ -1814,18 +4438,16 @@ int do_command(int argc, char *argv[], char **table, arptc_handle_t *handle)
 		m->used = 0;
 	}*/
 
-	for (t = arptables_targets; t; t = t->next) {
-		t->tflags = 0;
+	for (t = arptables_targets; t; t = t->next)
 		t->used = 0;
-	}
 
 	/* Suppress error messages: we may add new options if we
            demand-load a protocol. */
 	opterr = 0;
 
 	while ((c = getopt_long(argc, argv,
-	   "-A:D:R:I:L::M:F::Z::N:X::E:P:Vh::o:p:s:d:j:l:i:vnt:m:c:",
-					   opts, NULL)) != -1) {
+	   "-A:D:R:I:L::M:F::Z::N:X::E:P:Vh::o:p:s:d:j:l:i:vnt:m:c:w::W:",
+					   cmd->opts, NULL)) != -1) {
 		switch (c) {
 			/*
 			 * Command selection
@@ -2063,16 +4685,18 @@ int do_command(int argc, char *argv[], char **table, arptc_handle_t *handle)
 				size = ARPT_ALIGN(sizeof(struct arpt_entry_target))
 					+ target->size;
 
-				target->t = fw_calloc(1, size);
-				target->t->u.target_size = size;
-				strncpy(target->t->u.user.name, jumpto, sizeof(target->t->u.user.name) - 1);
-				target->t->u.user.revision = target->revision;
+				free(cmd->t);
+				cmd->t = fw_calloc(1, size);
+				cmd->t->u.target_size = size;
+				strncpy(cmd->t->u.user.name, jumpto, sizeof(cmd->t->u.user.name) - 1);
+				cmd->t->u.user.revision = target->revision;
 /*
-				target->init(target->t, &fw.nfcache);
+				target->init(cmd->t, &fw.nfcache);
 */
-				target->init(target->t);
+				target->init(cmd->t);
+				cmd->tflags = 0;
 
-				opts = merge_options(opts, target->extra_opts, &target->option_offset);
+				merge_options(cmd, target->extra_opts, &cmd->target_offset);
 			}
 			break;
 
@@ -2140,7 +4764,7 @@ int do_command(int argc, char *argv[], char **table, arptc_handle_t *handle)
 			else
 				printf("%s v%s\n",
 				       program_name, program_version);
-			exit(0);
+			exit_ok();
 
 		case '0':
 			set_option(&options, OPT_LINENUMBERS, &fw.arp.invflags,
@@ -2178,6 +4802,72 @@ int do_command(int argc, char *argv[], char **table, arptc_handle_t *handle)
 			break;
 
 
+		case 'w': {
+			unsigned int seconds;
+
+			if (invert)
+				exit_error(PARAMETER_PROBLEM,
+					   "unexpected ! flag before --wait");
+			if (!optarg && optind < argc && argv[optind][0] != '-'
+			    && argv[optind][0] != '!')
+				optarg = argv[optind++];
+			if (!optarg)
+				wait = ARPTC_LOCK_WAIT_FOREVER;
+			else if (string_to_number(optarg, 0, INT_MAX,
+						  &seconds) == -1)
+				exit_error(PARAMETER_PROBLEM,
+					   "wait seconds not numeric");
+			else
+				wait = seconds;
+			break;
+		}
+
+		case 'W':
+			if (invert)
+				exit_error(PARAMETER_PROBLEM,
+					   "unexpected ! flag before --wait-interval");
+			if (string_to_number(optarg, 0, INT_MAX,
+					     &wait_interval) == -1)
+				exit_error(PARAMETER_PROBLEM,
+					   "wait interval not numeric");
+			break;
+
+		case 9: { /* where */
+			struct where *where;
+
+			if (invert)
+				exit_error(PARAMETER_PROBLEM,
+					   "unexpected ! flag before --where");
+			where = realloc(cmd->where, (cmd->num_where + 1)
+					* sizeof(*where));
+			if (!where)
+				exit_error(OTHER_PROBLEM, "realloc failed");
+			cmd->where = where;
+			/* Counted first, so its terms are freed if it is
+			   bad. */
+			parse_where(optarg, &where[cmd->num_where++]);
+			break;
+		}
+
+		case 10: /* json-export */
+		case 11: /* json-import */
+			if (invert)
+				exit_error(PARAMETER_PROBLEM,
+					   "unexpected ! flag");
+			if (command)
+				exit_error(PARAMETER_PROBLEM,
+					   "Can't use --json-%s with other "
+					   "commands",
+					   c == 10 ? "export" : "import");
+			command = c == 10 ? CMD_JSON_EXPORT : CMD_JSON_IMPORT;
+			if (c == 10)
+				break;
+			if (optarg) json_file = optarg;
+			else if (optind < argc && argv[optind][0] != '-'
+				 && argv[optind][0] != '!')
+				json_file = argv[optind++];
+			break;
+
 		case 1: /* non option */
 			if (optarg[0] == '!' && optarg[1] == '\0') {
 				if (invert)
@@ -2188,17 +4878,17 @@ int do_command(int argc, char *argv[], char **table, arptc_handle_t *handle)
 				optarg[0] = '\0';
 				continue;
 			}
-			printf("Bad argument `%s'\n", optarg);
-			exit_tryhelp(2);
+			exit_error(PARAMETER_PROBLEM,
+				   "Bad argument `%s'", optarg);
 
 		default:
 			/* FIXME: This scheme doesn't allow two of the same
 			   matches --RR */
 			if (!target
-			    || !(target->parse(c - target->option_offset,
+			    || !(target->parse(c - cmd->target_offset,
 					       argv, invert,
-					       &target->tflags,
-					       &fw, &target->t))) {
+					       &cmd->tflags,
+					       &fw, &cmd->t))) {
 /*
 				for (m = arptables_matches; m; m = m->next) {
 					if (!m->used)
@@ -2287,7 +4977,7 @@ int do_command(int argc, char *argv[], char **table, arptc_handle_t *handle)
 */
 
 	if (target)
-		target->final_check(target->tflags);
+		target->final_check(cmd->tflags);
 
 	/* Fix me: must put inverse options checking here --MN */
 
@@ -2308,11 +4998,11 @@ int do_command(int argc, char *argv[], char **table, arptc_handle_t *handle)
 	}
 
 	if (shostnetworkmask)
-		parse_hostnetworkmask(shostnetworkmask, &saddrs,
+		parse_hostnetworkmask(shostnetworkmask, &cmd->saddrs,
 				      &(fw.arp.smsk), &nsaddrs);
 
 	if (dhostnetworkmask)
-		parse_hostnetworkmask(dhostnetworkmask, &daddrs,
+		parse_hostnetworkmask(dhostnetworkmask, &cmd->daddrs,
 				      &(fw.arp.tmsk), &ndaddrs);
 
 	if ((nsaddrs > 1 || ndaddrs > 1) &&
@@ -2326,19 +5016,46 @@ int do_command(int argc, char *argv[], char **table, arptc_handle_t *handle)
 
 	generic_opt_check(command, options);
 
+	if (cmd->num_where && command != CMD_LIST)
+		exit_error(PARAMETER_PROBLEM,
+			   "--where can only be used with -%c",
+			   cmd2char(CMD_LIST));
+
 	if (chain && strlen(chain) > ARPT_FUNCTION_MAXNAMELEN)
 		exit_error(PARAMETER_PROBLEM,
 			   "chain name `%s' too long (must be under %i chars)",
 			   chain, ARPT_FUNCTION_MAXNAMELEN);
 
-	/* only allocate handle if we weren't called with a handle */
-	if (!*handle)
-		*handle = arptc_init(*table);
+	/* Writers hold the lock from the snapshot until the commit, so
+	 * concurrent arptables processes can't overwrite each other.  A
+	 * batch may write later on, so it locks from its first line. */
+	if ((command != CMD_LIST && command != CMD_JSON_EXPORT)
+	    || batch_line) {
+		if (!arptc_lock(wait, wait_interval)) {
+			if (errno == EWOULDBLOCK)
+				exit_error(RESOURCE_PROBLEM,
+					   "%s. Perhaps you want to use the "
+					   "-w option?", arptc_strerror(errno));
+			exit_error(RESOURCE_PROBLEM, "%s",
+				   arptc_strerror(errno));
+		}
+		lock_verbose = verbose;
+	}
+
+	/* A listing without counters can come from the table cache,
+	 * when asked for. */
+	if (command == CMD_LIST && !(options & OPT_VERBOSE) && !batch_line
+	    && (cache = getenv("ARPTABLES_CACHE")) && *cache)
+		init = arptc_init_cached;
 
+	/* only allocate handle if we weren't called with a handle.
+	 * libarptc works out the kernel's hook count by itself; the
+	 * module loader is only worth a fork when the module is missing. */
 	if (!*handle) {
-		/* try to insmod the module if arptc_init failed */
-		arptables_insmod("arp_tables", modprobe);
-		*handle = arptc_init(*table);
+		*handle = init(*table);
+		if (!*handle && (errno == ENOPROTOOPT || errno == ENOENT)
+		    && arptables_insmod("arp_tables", modprobe) == 0)
+			*handle = init(*table);
 	}
 
 	if (!*handle)
@@ -2389,11 +5106,12 @@ int do_command(int argc, char *argv[], char **table, arptc_handle_t *handle)
 
 			size = sizeof(struct arpt_entry_target)
 				+ target->size;
-			target->t = fw_calloc(1, size);
-			target->t->u.target_size = size;
-			strcpy(target->t->u.user.name, jumpto);
-			target->t->u.user.revision = target->revision;
-			target->init(target->t);
+			free(cmd->t);
+			cmd->t = fw_calloc(1, size);
+			cmd->t->u.target_size = size;
+			strcpy(cmd->t->u.user.name, jumpto);
+			cmd->t->u.user.revision = target->revision;
+			target->init(cmd->t);
 		}
 
 		if (!target) {
@@ -2403,20 +5121,32 @@ int do_command(int argc, char *argv[], char **table, arptc_handle_t *handle)
 			 * chain. */
 			find_target(jumpto, LOAD_MUST_SUCCEED);
 		} else {
-			e = generate_entry(&fw, arptables_matches, target->t);
+			cmd->e = generate_entry(&fw, arptables_matches,
+					       cmd->t);
 		}
 	}
 
+	/* A change in several steps that fails part way is undone as a
+	 * whole, if the caller asked for that. */
+	if (cmd->rollback
+	    && (((command & (CMD_APPEND | CMD_DELETE | CMD_INSERT))
+		 && nsaddrs * ndaddrs > 1)
+		|| (!chain && (command & (CMD_FLUSH | CMD_ZERO
+					  | CMD_DELETE_CHAIN)))
+		|| command == CMD_JSON_IMPORT)
+	    && !(cmd->undo = arptc_dup(handle)))
+		exit_error(OTHER_PROBLEM, "%s", arptc_strerror(errno));
+
 	switch (command) {
 	case CMD_APPEND:
-		ret = append_entry(chain, e,
-				   nsaddrs, saddrs, ndaddrs, daddrs,
+		ret = append_entry(chain, cmd->e,
+				   nsaddrs, cmd->saddrs, ndaddrs, cmd->daddrs,
 				   options&OPT_VERBOSE,
 				   handle);
 		break;
 	case CMD_DELETE:
-		ret = delete_entry(chain, e,
-				   nsaddrs, saddrs, ndaddrs, daddrs,
+		ret = delete_entry(chain, cmd->e,
+				   nsaddrs, cmd->saddrs, ndaddrs, cmd->daddrs,
 				   options&OPT_VERBOSE,
 				   handle);
 		break;
@@ -2424,17 +5154,27 @@ int do_command(int argc, char *argv[], char **table, arptc_handle_t *handle)
 		ret = arptc_delete_num_entry(chain, rulenum - 1, handle);
 		break;
 	case CMD_REPLACE:
-		ret = replace_entry(chain, e, rulenum - 1,
-				    saddrs, daddrs, options&OPT_VERBOSE,
+		ret = replace_entry(chain, cmd->e, rulenum - 1,
+				    cmd->saddrs, cmd->daddrs,
+				    options&OPT_VERBOSE,
 				    handle);
 		break;
 	case CMD_INSERT:
-		ret = insert_entry(chain, e, rulenum - 1,
-				   nsaddrs, saddrs, ndaddrs, daddrs,
+		ret = insert_entry(chain, cmd->e, rulenum - 1,
+				   nsaddrs, cmd->saddrs, ndaddrs, cmd->daddrs,
 				   options&OPT_VERBOSE,
 				   handle);
 		break;
 	case CMD_LIST:
+		if (cmd->num_where) {
+			ret = list_where(chain, cmd->where, cmd->num_where,
+					 options&OPT_VERBOSE,
+					 options&OPT_NUMERIC,
+					 /*options&OPT_EXPANDED*/0,
+					 options&OPT_LINENUMBERS,
+					 handle);
+			break;
+		}
 		ret = list_entries(chain,
 				   options&OPT_VERBOSE,
 				   options&OPT_NUMERIC,
@@ -2469,7 +5209,15 @@ int do_command(int argc, char *argv[], char **table, arptc_handle_t *handle)
 		ret = arptc_rename_chain(chain, newname,	handle);
 		break;
 	case CMD_SET_POLICY:
-		ret = arptc_set_policy(chain, policy, NULL, handle);
+		ret = arptc_set_policy(chain, policy,
+				       options&OPT_COUNTERS ? &fw.counters
+							    : NULL, handle);
+		break;
+	case CMD_JSON_EXPORT:
+		ret = json_export(*table, handle);
+		break;
+	case CMD_JSON_IMPORT:
+		ret = json_import(cmd, json_file, *table, handle);
 		break;
 	default:
 		/* We should never reach this... */
@@ -2482,3 +5230,51 @@ int do_command(int argc, char *argv[], char **table, arptc_handle_t *handle)
 	return ret;
 }
 
+int do_command(int argc, char *argv[], char **table, arptc_handle_t *handle)
+{
+	struct command cmd;
+	int ret;
+
+	memset(&cmd, 0, sizeof(cmd));
+	ret = run_command(&cmd, argc, argv, table, handle);
+	command_free(&cmd);
+	return ret;
+}
+
+/* getopt_long()'s state and the extensions' are the process's. */
+static pthread_mutex_t command_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int
+do_command_ctx(struct arptables_ctx *ctx, int argc, char *argv[],
+	       char **table, arptc_handle_t *handle)
+{
+	/* Static, as what run_command() leaves in it has to survive the
+	 * longjmp(); command_lock keeps it to one call at a time. */
+	static struct command cmd;
+	int ret;
+
+	pthread_mutex_lock(&command_lock);
+	memset(&ctx->error, 0, sizeof(ctx->error));
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.rollback = 1;
+	error_ctx = ctx;
+	if (setjmp(ctx->jmp))
+		ret = ctx->error.status == 0;
+	else if (!(ret = run_command(&cmd, argc, argv, table, handle))) {
+		ctx->error.status = OTHER_PROBLEM;
+		ctx->error.errnum = errno;
+		snprintf(ctx->error.message, sizeof(ctx->error.message),
+			 "%s", arptc_strerror(errno));
+	}
+	error_ctx = NULL;
+
+	if (!ret && cmd.undo) {
+		arptc_free(handle);
+		*handle = cmd.undo;
+		cmd.undo = NULL;
+	}
+	command_free(&cmd);
+	pthread_mutex_unlock(&command_lock);
+	return ret;
+}
+
@@ -0,0 +1,80 @@
+#!/bin/sh
+#
+# Throughput of arptables-legacy-restore and cold start of
+# arptables-legacy, against the running kernel's filter table, which
+# is only read: restore runs with --test.  Needs root and arp_tables.
+#
+#   RULES=n  rule lines per restore run (default 1000000)
+#   RUNS=n   arptables-legacy -L runs to average (default 300)
+#   BEST=n   rounds of each, of which the fastest counts (default 5)
+
+RULES=${RULES:-1000000}
+RUNS=${RUNS:-300}
+BEST=${BEST:-5}
+DIR=$(dirname "$0")
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+
+now() { date +%s%N; }
+
+# Nanoseconds of the fastest of $BEST rounds of "$@".
+best() {
+	min=
+	i=0
+	while [ $i -lt "$BEST" ]; do
+		start=$(now)
+		"$@" || exit 1
+		t=$(($(now) - start))
+		[ -z "$min" ] || [ $t -lt $min ] && min=$t
+		i=$((i + 1))
+	done
+	echo $min
+}
+
+# Generated rules, the same every time.  Short ones take restore's
+# fast path; mixed ones add masks, interfaces, ARP fields, inversions
+# and, every tenth line, a target extension parsed by do_command().
+rules() {
+	awk -v n="$RULES" -v mixed="$1" 'BEGIN {
+	print "*filter"
+	print ":INPUT ACCEPT"
+	print ":OUTPUT ACCEPT"
+	print ":FORWARD ACCEPT"
+	for (i = 0; i < n; i++) {
+		a = int(i / 65536) % 256 "." int(i / 256) % 256 "." i % 256
+		if (!mixed)
+			print "-A INPUT -s 10." a " -j ACCEPT"
+		else if (i % 10 == 9)
+			print "-A OUTPUT -d 10." a " -j MARK --set-mark " i
+		else
+			printf "-A INPUT %s-s 10.%s/%d -d 192.168.%d.0/24" \
+			       " -i eth%d --opcode %d --h-length 6 -j %s\n",
+			       i % 3 ? "" : "! ", a, 16 + i % 17, i % 256,
+			       i % 4, 1 + i % 2, i % 2 ? "DROP" : "ACCEPT"
+	}
+	print "COMMIT"
+	}'
+}
+
+restore() {
+	"$DIR"/arptables-legacy-restore --test "$1" >/dev/null
+}
+
+list() {
+	run=0
+	while [ $run -lt "$RUNS" ]; do
+		"$DIR"/arptables-legacy -L -n >/dev/null || return 1
+		run=$((run + 1))
+	done
+}
+
+rules 0 >"$TMP"/short
+rules 1 >"$TMP"/mixed
+for f in short mixed; do
+	ns=$(best restore "$TMP"/$f)
+	echo "restore --test, $RULES $f rules: $((ns / 1000000))ms," \
+	     "$((RULES * 1000000 / (ns / 1000 + 1))) lines/s"
+done
+us=$(($(best list) / RUNS / 1000))
+echo "arptables -L -n, mean of $RUNS runs:" \
+     "$((us / 1000)).$(printf %03d $((us % 1000)))ms"
@@ -53,18 +53,18 @@ init(struct arpt_entry_target *t)
 }
 
 static int
-parse(int c, char **argv, int invert, unsigned int *flags,
-	const struct arpt_entry *e,
-	struct arpt_entry_target **t)
+set_option(int c, const char *arg, unsigned int *flags,
+	   const struct arpt_entry *e,
+	   struct arpt_entry_target **t)
 {
 	struct xt_classify_target_info *classify = (struct xt_classify_target_info *)(*t)->data;
 	int i,j;
 
 	switch (c) {
 		case CLASSIFY_OPT:
-			if (sscanf(argv[optind-1], "%x:%x", &i, &j) != 2) {
+			if (sscanf(arg, "%x:%x", &i, &j) != 2) {
 				exit_error(PARAMETER_PROBLEM,
-						"Bad class value `%s'", optarg);
+						"Bad class value `%s'", arg);
 				return 0;
 			}
 			classify->priority = TC_H_MAKE(i<<16, j);
@@ -79,6 +79,14 @@ parse(int c, char **argv, int invert, unsigned int *flags,
 	return 1;
 }
 
+static int
+parse(int c, char **argv, int invert, unsigned int *flags,
+	const struct arpt_entry *e,
+	struct arpt_entry_target **t)
+{
+	return set_option(c, argv[optind-1], flags, e, t);
+}
+
 static void final_check(unsigned int flags)
 {
 	if (!flags)
@@ -96,6 +104,51 @@ static void print(const struct arpt_arp *ip,
 static void
 save(const struct arpt_arp *ip, const struct arpt_entry_target *target)
 {
+	struct xt_classify_target_info *t = (struct xt_classify_target_info *)(target->data);
+
+	printf("--set-class %x:%x ", TC_H_MAJ(t->priority)>>16, TC_H_MIN(t->priority));
+}
+
+static void
+json_save(struct json_writer *w, const struct arpt_arp *ip,
+	  const struct arpt_entry_target *target)
+{
+	struct xt_classify_target_info *t = (struct xt_classify_target_info *)(target->data);
+	char buf[16];
+
+	sprintf(buf, "%x:%x", TC_H_MAJ(t->priority)>>16, TC_H_MIN(t->priority));
+	json_string(w, "set-class", buf);
+}
+
+static int
+json_parse(const char *key, const char *value, unsigned int *flags,
+	   const struct arpt_entry *e, struct arpt_entry_target **t)
+{
+	return set_option(json_option(opts, key), value, flags, e, t);
+}
+
+static int
+portable_save(const struct arpt_entry_target *target, unsigned char *out,
+	      unsigned int size)
+{
+	struct xt_classify_target_info *t = (struct xt_classify_target_info *)(target->data);
+
+	if (size < 4)
+		return -1;
+	put_be32(out, t->priority);
+	return 4;
+}
+
+static int
+portable_parse(const unsigned char *in, unsigned int len,
+	       struct arpt_entry_target *target)
+{
+	struct xt_classify_target_info *t = (struct xt_classify_target_info *)(target->data);
+
+	if (len != 4)
+		return 0;
+	t->priority = get_be32(in);
+	return 1;
 }
 
 static
@@ -112,7 +165,11 @@ struct arptables_target classify
 	&final_check,
 	&print,
 	&save,
-	opts
+	opts,
+	&json_save,
+	&json_parse,
+	&portable_save,
+	&portable_parse
 };
 
 static void _init(void) __attribute__ ((constructor));
@@ -53,17 +53,17 @@ static void init(struct arpt_entry_target *t)
 	info->mark = 0;
 }
 
-static int parse(int c, char **argv, int invert, unsigned int *flags,
-		 const struct arpt_entry *e, struct arpt_entry_target **t)
+static int set_option(int c, const char *arg, unsigned int *flags,
+		      const struct arpt_entry *e, struct arpt_entry_target **t)
 {
 	struct xt_mark_tginfo2 *info = (struct xt_mark_tginfo2 *)(*t)->data;
 	int i;
 
 	switch (c) {
 	case MARK_OPT:
-		if (sscanf(argv[optind-1], "%x", &i) != 1) {
+		if (sscanf(arg, "%x", &i) != 1) {
 			exit_error(PARAMETER_PROBLEM,
-				"Bad mark value `%s'", optarg);
+				"Bad mark value `%s'", arg);
 			return 0;
 		}
 		info->mark = i;
@@ -73,9 +73,9 @@ static int parse(int c, char **argv, int invert, unsigned int *flags,
 		*flags = 1;
 		break;
 	case AND_MARK_OPT:
-		if (sscanf(argv[optind-1], "%x", &i) != 1) {
+		if (sscanf(arg, "%x", &i) != 1) {
 			exit_error(PARAMETER_PROBLEM,
-				"Bad mark value `%s'", optarg);
+				"Bad mark value `%s'", arg);
 			return 0;
 		}
 		info->mark = 0;
@@ -86,9 +86,9 @@ static int parse(int c, char **argv, int invert, unsigned int *flags,
 		*flags = 1;
 		break;
 	case OR_MARK_OPT:
-		if (sscanf(argv[optind-1], "%x", &i) != 1) {
+		if (sscanf(arg, "%x", &i) != 1) {
 			exit_error(PARAMETER_PROBLEM,
-				"Bad mark value `%s'", optarg);
+				"Bad mark value `%s'", arg);
 			return 0;
 		}
 		info->mark = info->mask = i;
@@ -103,6 +103,12 @@ static int parse(int c, char **argv, int invert, unsigned int *flags,
 	return 1;
 }
 
+static int parse(int c, char **argv, int invert, unsigned int *flags,
+		 const struct arpt_entry *e, struct arpt_entry_target **t)
+{
+	return set_option(c, argv[optind-1], flags, e, t);
+}
+
 static void final_check(unsigned int flags)
 {
 	if (!flags)
@@ -125,6 +131,63 @@ static void print(const struct arpt_arp *ip,
 static void save(const struct arpt_arp *ip,
 		 const struct arpt_entry_target *target)
 {
+	struct xt_mark_tginfo2 *info = (struct xt_mark_tginfo2 *)(target->data);
+
+	if (info->mark == 0)
+		printf("--and-mark %x ", (unsigned int)(uint32_t)~info->mask);
+	else if (info->mark == info->mask)
+		printf("--or-mark %x ", info->mark);
+	else
+		printf("--set-mark %x ", info->mark);
+}
+
+static void json_save(struct json_writer *w, const struct arpt_arp *ip,
+		      const struct arpt_entry_target *target)
+{
+	struct xt_mark_tginfo2 *info = (struct xt_mark_tginfo2 *)(target->data);
+	char buf[16];
+
+	if (info->mark == 0) {
+		sprintf(buf, "%x", (unsigned int)(uint32_t)~info->mask);
+		json_string(w, "and-mark", buf);
+	} else if (info->mark == info->mask) {
+		sprintf(buf, "%x", info->mark);
+		json_string(w, "or-mark", buf);
+	} else {
+		sprintf(buf, "%x", info->mark);
+		json_string(w, "set-mark", buf);
+	}
+}
+
+static int json_parse(const char *key, const char *value,
+		      unsigned int *flags, const struct arpt_entry *e,
+		      struct arpt_entry_target **t)
+{
+	return set_option(json_option(opts, key), value, flags, e, t);
+}
+
+static int portable_save(const struct arpt_entry_target *target,
+			 unsigned char *out, unsigned int size)
+{
+	struct xt_mark_tginfo2 *info = (struct xt_mark_tginfo2 *)(target->data);
+
+	if (size < 8)
+		return -1;
+	put_be32(out, info->mark);
+	put_be32(out + 4, info->mask);
+	return 8;
+}
+
+static int portable_parse(const unsigned char *in, unsigned int len,
+			  struct arpt_entry_target *target)
+{
+	struct xt_mark_tginfo2 *info = (struct xt_mark_tginfo2 *)(target->data);
+
+	if (len != 8)
+		return 0;
+	info->mark = get_be32(in);
+	info->mask = get_be32(in + 4);
+	return 1;
 }
 
 static struct arptables_target mark = {
@@ -140,7 +203,11 @@ static struct arptables_target mark = {
 	.final_check   = final_check,
 	.print         = print,
 	.save          = save,
-	.extra_opts    = opts
+	.extra_opts    = opts,
+	.json_save     = json_save,
+	.json_parse    = json_parse,
+	.portable_save = portable_save,
+	.portable_parse = portable_parse
 };
 
 static void _init(void) __attribute__ ((constructor));
@@ -43,9 +43,9 @@ init(struct arpt_entry_target *t)
 }
 
 static int
-parse(int c, char **argv, int invert, unsigned int *flags,
-      const struct arpt_entry *e,
-      struct arpt_entry_target **t)
+set_option(int c, const char *arg, unsigned int *flags,
+	   const struct arpt_entry *e,
+	   struct arpt_entry_target **t)
 {
 	struct arpt_mangle *mangle = (struct arpt_mangle *)(*t)->data;
 	struct in_addr *ipaddr;
@@ -68,7 +68,7 @@ parse(int c, char **argv, int invert, unsigned int *flags,
 */
 		{
 			unsigned int nr;
-			ipaddr = parse_hostnetwork(argv[optind-1], &nr);
+			ipaddr = parse_hostnetwork(arg, &nr);
 		}
 		mangle->u_s.src_ip.s_addr = ipaddr->s_addr;
 		free(ipaddr);
@@ -89,7 +89,7 @@ parse(int c, char **argv, int invert, unsigned int *flags,
 */
 		{
 			unsigned int nr;
-			ipaddr = parse_hostnetwork(argv[optind-1], &nr);
+			ipaddr = parse_hostnetwork(arg, &nr);
 		}
 		mangle->u_t.tgt_ip.s_addr = ipaddr->s_addr;
 		free(ipaddr);
@@ -105,7 +105,7 @@ parse(int c, char **argv, int invert, unsigned int *flags,
 		if (e->arp.arhln != 6)
 			exit_error(PARAMETER_PROBLEM, "only --h-length 6 "
 						      "supported");
-		macaddr = ether_aton(argv[optind-1]);
+		macaddr = ether_aton(arg);
 		if (macaddr == NULL)
 			exit_error(PARAMETER_PROBLEM, "invalid source MAC");
 		memcpy(mangle->src_devaddr, macaddr, e->arp.arhln);
@@ -120,18 +120,18 @@ parse(int c, char **argv, int invert, unsigned int *flags,
 		if (e->arp.arhln != 6)
 			exit_error(PARAMETER_PROBLEM, "only --h-length 6 "
 						      "supported");
-		macaddr = ether_aton(argv[optind-1]);
+		macaddr = ether_aton(arg);
 		if (macaddr == NULL)
 			exit_error(PARAMETER_PROBLEM, "invalid target MAC");
 		memcpy(mangle->tgt_devaddr, macaddr, e->arp.arhln);
 		mangle->flags |= ARPT_MANGLE_TDEV;
 		break;
 	case MANGLE_TARGET:
-		if (!strcmp(argv[optind-1], "DROP"))
+		if (!strcmp(arg, "DROP"))
 			mangle->target = NF_DROP;
-		else if (!strcmp(argv[optind-1], "ACCEPT"))
+		else if (!strcmp(arg, "ACCEPT"))
 			mangle->target = NF_ACCEPT;
-		else if (!strcmp(argv[optind-1], "CONTINUE"))
+		else if (!strcmp(arg, "CONTINUE"))
 			mangle->target = ARPT_CONTINUE;
 		else
 			exit_error(PARAMETER_PROBLEM, "bad target for "
@@ -144,6 +144,14 @@ parse(int c, char **argv, int invert, unsigned int *flags,
 	return ret;
 }
 
+static int
+parse(int c, char **argv, int invert, unsigned int *flags,
+      const struct arpt_entry *e,
+      struct arpt_entry_target **t)
+{
+	return set_option(c, argv[optind-1], flags, e, t);
+}
+
 static void final_check(unsigned int flags)
 {
 }
@@ -190,6 +198,105 @@ static void print(const struct arpt_arp *ip,
 static void
 save(const struct arpt_arp *ip, const struct arpt_entry_target *target)
 {
+	struct arpt_mangle *m = (struct arpt_mangle *)(target->data);
+
+	if (m->flags & ARPT_MANGLE_SIP)
+		printf("--mangle-ip-s %s ", addr_to_dotted(&(m->u_s.src_ip)));
+	if (m->flags & ARPT_MANGLE_SDEV) {
+		printf("--mangle-mac-s ");
+		print_mac((unsigned char *)m->src_devaddr, 6);
+		printf(" ");
+	}
+	if (m->flags & ARPT_MANGLE_TIP)
+		printf("--mangle-ip-d %s ", addr_to_dotted(&(m->u_t.tgt_ip)));
+	if (m->flags & ARPT_MANGLE_TDEV) {
+		printf("--mangle-mac-d ");
+		print_mac((unsigned char *)m->tgt_devaddr, 6);
+		printf(" ");
+	}
+	if (m->target != NF_ACCEPT) {
+		printf("--mangle-target ");
+		if (m->target == NF_DROP)
+			printf("DROP ");
+		else
+			printf("CONTINUE ");
+	}
+}
+
+static void
+json_mac(struct json_writer *w, const char *key, const unsigned char *mac)
+{
+	char buf[18];
+
+	sprintf(buf, "%02x:%02x:%02x:%02x:%02x:%02x",
+		mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+	json_string(w, key, buf);
+}
+
+static void
+json_save(struct json_writer *w, const struct arpt_arp *ip,
+	  const struct arpt_entry_target *target)
+{
+	struct arpt_mangle *m = (struct arpt_mangle *)(target->data);
+
+	if (m->flags & ARPT_MANGLE_SIP)
+		json_string(w, "mangle-ip-s", addr_to_dotted(&(m->u_s.src_ip)));
+	if (m->flags & ARPT_MANGLE_SDEV)
+		json_mac(w, "mangle-mac-s", (unsigned char *)m->src_devaddr);
+	if (m->flags & ARPT_MANGLE_TIP)
+		json_string(w, "mangle-ip-d", addr_to_dotted(&(m->u_t.tgt_ip)));
+	if (m->flags & ARPT_MANGLE_TDEV)
+		json_mac(w, "mangle-mac-d", (unsigned char *)m->tgt_devaddr);
+	if (m->target != NF_ACCEPT)
+		json_string(w, "mangle-target",
+			    m->target == NF_DROP ? "DROP" : "CONTINUE");
+}
+
+static int
+json_parse(const char *key, const char *value, unsigned int *flags,
+	   const struct arpt_entry *e, struct arpt_entry_target **t)
+{
+	return set_option(json_option(opts, key), value, flags, e, t);
+}
+
+/* flags, the two MAC addresses, the two IP addresses, target */
+#define PORTABLE_LEN (1 + 2 * ARPT_DEV_ADDR_LEN_MAX + 2 * 4 + 4)
+
+static int
+portable_save(const struct arpt_entry_target *target, unsigned char *out,
+	      unsigned int size)
+{
+	struct arpt_mangle *m = (struct arpt_mangle *)(target->data);
+
+	if (size < PORTABLE_LEN)
+		return -1;
+	out[0] = m->flags;
+	memcpy(out + 1, m->src_devaddr, ARPT_DEV_ADDR_LEN_MAX);
+	memcpy(out + 1 + ARPT_DEV_ADDR_LEN_MAX, m->tgt_devaddr,
+	       ARPT_DEV_ADDR_LEN_MAX);
+	/* Addresses are in network order already. */
+	memcpy(out + 1 + 2 * ARPT_DEV_ADDR_LEN_MAX, &m->u_s.src_ip, 4);
+	memcpy(out + 5 + 2 * ARPT_DEV_ADDR_LEN_MAX, &m->u_t.tgt_ip, 4);
+	put_be32(out + 9 + 2 * ARPT_DEV_ADDR_LEN_MAX, m->target);
+	return PORTABLE_LEN;
+}
+
+static int
+portable_parse(const unsigned char *in, unsigned int len,
+	       struct arpt_entry_target *target)
+{
+	struct arpt_mangle *m = (struct arpt_mangle *)(target->data);
+
+	if (len != PORTABLE_LEN || (in[0] & ~ARPT_MANGLE_MASK))
+		return 0;
+	m->flags = in[0];
+	memcpy(m->src_devaddr, in + 1, ARPT_DEV_ADDR_LEN_MAX);
+	memcpy(m->tgt_devaddr, in + 1 + ARPT_DEV_ADDR_LEN_MAX,
+	       ARPT_DEV_ADDR_LEN_MAX);
+	memcpy(&m->u_s.src_ip, in + 1 + 2 * ARPT_DEV_ADDR_LEN_MAX, 4);
+	memcpy(&m->u_t.tgt_ip, in + 5 + 2 * ARPT_DEV_ADDR_LEN_MAX, 4);
+	m->target = get_be32(in + 9 + 2 * ARPT_DEV_ADDR_LEN_MAX);
+	return 1;
 }
 
 static
@@ -206,7 +313,11 @@ struct arptables_target change
     &final_check,
     &print,
     &save,
-    opts
+    opts,
+    &json_save,
+    &json_parse,
+    &portable_save,
+    &portable_parse
 };
 
 static void _init(void) __attribute__ ((constructor));
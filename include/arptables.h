@@ -2,6 +2,8 @@
 #define _ARPTABLES_USER_H
 
 #include <stdint.h>
+#include <stdio.h>
+#include <setjmp.h>
 #include "arptables_common.h"
 #include "libarptc/libarptc.h"
 
@@ -18,6 +20,28 @@ struct arpt_entry_match
 /* END OF KERNEL REPLACEMENTS  */
 /*******************************/
 
+/* Streaming JSON output for --json-export, a member at a time, so no
+   document is built in memory.  `key' is the name of the member in an
+   object, and NULL in an array. */
+#define JSON_MAX_DEPTH	16
+struct json_writer
+{
+	FILE *out;
+	/* Members this deep or less go on lines of their own. */
+	unsigned int pretty;
+	unsigned int depth;
+	unsigned char first[JSON_MAX_DEPTH];
+};
+
+extern void json_begin_object(struct json_writer *w, const char *key);
+extern void json_end_object(struct json_writer *w);
+extern void json_begin_array(struct json_writer *w, const char *key);
+extern void json_end_array(struct json_writer *w);
+extern void json_string(struct json_writer *w, const char *key,
+			const char *value);
+extern void json_number(struct json_writer *w, const char *key,
+			uint64_t value);
+
 /* Include file for additions: new matches and targets. */
 struct arptables_match
 {
@@ -114,10 +138,30 @@ struct arptables_target
 	/* Pointer to list of extra command-line options */
 	struct option *extra_opts;
 
+	/* Writes the targinfo as the members of a rule's JSON
+	   "target-options", named after the command-line options. */
+	void (*json_save)(struct json_writer *w, const struct arpt_arp *ip,
+			  const struct arpt_entry_target *target);
+
+	/* Sets the targinfo from one member of "target-options", with
+	   `value' as it would be given on the command line; returns
+	   true if it knew `key'. */
+	int (*json_parse)(const char *key, const char *value,
+			  unsigned int *flags, const struct arpt_entry *entry,
+			  struct arpt_entry_target **target);
+
+	/* Writes the targinfo for a portable rule set, field by field in
+	   network byte order, to `out' (room for `size' bytes); returns
+	   its length, or -1. */
+	int (*portable_save)(const struct arpt_entry_target *target,
+			     unsigned char *out, unsigned int size);
+
+	/* Sets the zeroed targinfo from what portable_save() wrote;
+	   returns false if the `len' bytes at `in' are bad. */
+	int (*portable_parse)(const unsigned char *in, unsigned int len,
+			      struct arpt_entry_target *target);
+
 	/* Ignore these men behind the curtain: */
-	unsigned int option_offset;
-	struct arpt_entry_target *t;
-	unsigned int tflags;
 	unsigned int used;
 	unsigned int loaded; /* simulate loading so options are merged properly */
 };
@@ -137,6 +181,74 @@ extern uint16_t parse_protocol(const char *s);
 
 extern int do_command(int argc, char *argv[], char **table,
 		      arptc_handle_t *handle);
+
+/* A rule read by fast_parse(): the entry with a standard target, and
+   the addresses it is appended for.  The names point into argv. */
+struct fast_rule
+{
+	struct {
+		struct arpt_entry e;
+		union {
+			struct arpt_standard_target t;
+			unsigned char size[ARPT_ALIGN(
+				sizeof(struct arpt_entry_target))
+				+ ARPT_ALIGN(sizeof(int))];
+		} u;
+	} fw;
+	const char *chain, *target;
+	struct in_addr *saddrs, *daddrs, saddr, daddr;
+	unsigned int nsaddrs, ndaddrs;
+};
+
+extern int fast_parse(int argc, char *argv[], struct fast_rule *r);
+extern int fast_append_rule(struct fast_rule *r, arptc_handle_t *handle);
+extern void fast_free(struct fast_rule *r);
+extern int fast_append(int argc, char *argv[], arptc_handle_t *handle);
+extern void print_rule(const char *command, const char *chain,
+		       unsigned int rulenum, const struct arpt_entry *e,
+		       const char *target, int counters,
+		       arptc_handle_t *handle);
+extern void save_rule(const char *chain, const struct arpt_entry *e,
+		      int counters, arptc_handle_t *handle);
+extern int split_line(char *line, char *argv[], int max, const char **err);
+/* Note the host and network names of the -s and -d options in a
+   command line, then look up all those noted at once, several at a
+   time; parsing then takes them from there. */
+extern void resolve_want(const char *line, size_t len);
+extern void resolve_run(void);
+/* The `val' of the option named `name' in `opts', or 0. */
+extern int json_option(const struct option *opts, const char *name);
+/* Big-endian fields for portable_save() and portable_parse(). */
+extern void put_be32(unsigned char *p, uint32_t v);
+extern uint32_t get_be32(const unsigned char *p);
+/* arptc_encode() and arptc_decode() through the targets' portable_save()
+   and portable_parse(). */
+extern const struct arptc_target_codec portable_targets;
+
+/* What went wrong in a do_command_ctx() call. */
+struct arptables_error
+{
+	/* enum exittype; 0 when the command ended early but fine (-h). */
+	int status;
+	/* errno from libarptc, 0 for errors in the command line. */
+	int errnum;
+	char message[256];
+};
+
+struct arptables_ctx
+{
+	struct arptables_error error;
+	jmp_buf jmp;
+};
+
+/* do_command() that returns instead of exiting: on errors, from the
+   command line or any extension's parse(), it returns 0, describes
+   the error in ctx->error and leaves the handle as it was before the
+   call.  Calls from several threads take turns, as getopt_long() and
+   the extensions keep their state in the process; an extension must
+   not call it. */
+extern int do_command_ctx(struct arptables_ctx *ctx, int argc, char *argv[],
+			  char **table, arptc_handle_t *handle);
 /* Keeping track of external matches and targets: linked lists.  */
 extern struct arptables_match *arptables_matches;
 extern struct arptables_target *arptables_targets;
@@ -4,7 +4,8 @@
 enum exittype {
 	OTHER_PROBLEM = 1,
 	PARAMETER_PROBLEM,
-	VERSION_PROBLEM
+	VERSION_PROBLEM,
+	RESOURCE_PROBLEM
 };
 extern void exit_printhelp() __attribute__((noreturn));
 extern void exit_tryhelp(int) __attribute__((noreturn));
@@ -14,9 +15,13 @@ extern int string_to_number(const char *,
 			    unsigned int,
 			    unsigned int *);
 extern int iptables_insmod(const char *modname, const char *modprobe);
+extern int arptables_insmod(const char *modname, const char *modprobe);
+extern void arptables_unlock(void);
 void exit_error(enum exittype, char *, ...)__attribute__((noreturn,
 							  format(printf,2,3)));
 extern const char *program_name, *program_version;
+/* Line of the --batch input being run (0 = not in a batch). */
+extern unsigned int batch_line;
 
   extern void init_extensions(void);
 
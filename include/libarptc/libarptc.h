@@ -2,6 +2,7 @@
 #define _LIBARPTC_H
 /* Library which manipulates filtering rules. */
 
+#include <stdint.h>
 #include <libarptc/arpt_kernel_headers.h>
 #include <linux/netfilter/x_tables.h>
 #include <linux/netfilter_arp/arp_tables.h>
@@ -16,6 +17,10 @@
 
 #define ARPT_ALIGN(s) (((s) + ((ARPT_MIN_ALIGN)-1)) & ~((ARPT_MIN_ALIGN)-1))
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef char arpt_chainlabel[32];
 
 #define ARPTC_LABEL_ACCEPT  "ACCEPT"
@@ -37,6 +42,19 @@ int arptc_is_chain(const char *chain, const arptc_handle_t handle);
 /* Take a snapshot of the rules.  Returns NULL on error. */
 arptc_handle_t arptc_init(const char *tablename);
 
+/* Like arptc_init(), but takes the rules from the table cache when the
+   kernel's SO_GET_INFO reply (size, entry count, hooks) still matches
+   it.  Only commits made holding arptc_lock() write the cache, so a
+   same-sized change made without libarptc is not noticed: don't use
+   this for anything that must see the kernel's rules.  The counters of a
+   cached snapshot are old: arptc_refresh_counters() fetches the
+   kernel's, and reading or zeroing counters does so by itself. */
+arptc_handle_t arptc_init_cached(const char *tablename);
+
+/* Replace the counters in the snapshot with the kernel's.  Fails with
+   EAGAIN if the kernel table no longer matches the snapshot. */
+int arptc_refresh_counters(arptc_handle_t *handle);
+
 /* Iterator functions to run through the chains.  Returns NULL at end. */
 const char *arptc_first_chain(arptc_handle_t *handle);
 const char *arptc_next_chain(arptc_handle_t *handle);
@@ -49,6 +67,32 @@ const struct arpt_entry *arptc_first_rule(const char *chain,
 const struct arpt_entry *arptc_next_rule(const struct arpt_entry *prev,
 				       arptc_handle_t *handle);
 
+/* Get the rules of a chain as one contiguous range of the table:
+   [*begin, *end) holds *count (if not NULL) entries, each next_offset
+   bytes long; *begin == *end for an empty chain.  The range stays
+   valid until the handle is changed. */
+int arptc_chain_span(const char *chain,
+		     const struct arpt_entry **begin,
+		     const struct arpt_entry **end,
+		     unsigned int *count,
+		     arptc_handle_t *handle);
+
+/* Reentrant rule iterator: unlike arptc_first_rule()/arptc_next_rule()
+   it keeps its state to itself, so any number of chains (or pieces of
+   a span handed to other threads) can be walked at once. */
+struct arptc_cursor
+{
+	const struct arpt_entry *next;
+	const struct arpt_entry *end;
+};
+
+/* Point `cursor' at the rules of `chain'. */
+int arptc_cursor_init(struct arptc_cursor *cursor, const char *chain,
+		      arptc_handle_t *handle);
+
+/* Returns NULL when the rules run out. */
+const struct arpt_entry *arptc_cursor_next(struct arptc_cursor *cursor);
+
 /* Returns a pointer to the target name of this entry. */
 const char *arptc_get_target(const struct arpt_entry *e,
 			    arptc_handle_t *handle);
@@ -105,6 +149,12 @@ const char *arptc_check_packet(const arpt_chainlabel chain,
 int arptc_flush_entries(const arpt_chainlabel chain,
 		       arptc_handle_t *handle);
 
+/* Flushes a chain that is about to be filled again: a rule appended
+   to it later that is identical to one of the flushed rules keeps that
+   rule's counters instead of starting from zero. */
+int arptc_reload_chain(const arpt_chainlabel chain,
+		      arptc_handle_t *handle);
+
 /* Zeroes the counters in a chain. */
 int arptc_zero_entries(const arpt_chainlabel chain,
 		      arptc_handle_t *handle);
@@ -152,12 +202,211 @@ int arptc_set_counter(const arpt_chainlabel chain,
 /* Makes the actual changes. */
 int arptc_commit(arptc_handle_t *handle);
 
+/* Frees a handle without committing it. */
+void arptc_free(arptc_handle_t *handle);
+
+/* Copies a handle with the changes made to it so far: keeping the copy
+   and freeing the original undoes those made after.  Returns NULL on
+   error. */
+arptc_handle_t arptc_dup(arptc_handle_t *handle);
+
+/* Declares `chain' as owned by this handle.  Once a handle owns any
+   chain, arptc_commit() only commits the owned chains: holding the
+   table lock (it waits for arptc_lock() if the caller hasn't taken
+   it), it re-reads the kernel table and splices the owned chains
+   (rules, policy, creation and deletion) into it instead of
+   overwriting it, retrying if the kernel refuses the replace because
+   a writer outside the lock got in first.  Chains the handle doesn't
+   own are left as the kernel has them. */
+int arptc_own_chain(const arpt_chainlabel chain, arptc_handle_t *handle);
+
+/* Packs the handle's rules into a compact encoding, for handles that
+   are kept around idle.  Listing or changing the rules unpacks the
+   handle again; arptc_commit() unpacks straight into the kernel
+   buffer. */
+int arptc_compact(arptc_handle_t *handle);
+
+/* Writes the table in `handle' to `fd' as a binary snapshot: the
+   image arptc_commit() would hand the kernel, with the counters of each
+   rule if `counters'.  The handle is left alone. */
+int arptc_save_snapshot(int fd, int counters, arptc_handle_t *handle);
+
+/* Replaces the kernel table with a snapshot from arptc_save_snapshot()
+   in one call, after checking that it is intact and that this kernel
+   has its hook layout and targets.  The image, `len' bytes, is
+   modified; the counters in it are restored if `counters'. */
+int arptc_restore_snapshot(void *image, size_t len, int counters);
+
+/* The checks of arptc_restore_snapshot() alone. */
+int arptc_check_snapshot(void *image, size_t len);
+
+/* The data of targets other than the standard ones in a portable rule
+   set, which only the targets themselves know how to lay out. */
+struct arptc_target_codec
+{
+	/* Writes the data of `t' to `out', which has room for `size'
+	   bytes, in an order that doesn't depend on the host; returns
+	   its length, or -1 if `t' has no portable form. */
+	int (*encode)(const struct arpt_entry_target *t, unsigned char *out,
+		      unsigned int size);
+	/* Fills in the data and target_size of `t', whose name and
+	   revision are set and which has room for `size' bytes of data,
+	   from the `len' bytes at `in'.  Returns 1, 0 if the target is
+	   unknown, or -1 if the bytes are bad. */
+	int (*decode)(const unsigned char *in, unsigned int len,
+		      struct arpt_entry_target *t, unsigned int size);
+};
+
+/* Writes the rules in `handle' to `fd' as a portable rule set: chains,
+   policies and rules with their fields dictionary-coded, independent
+   of the kernel's layout and the host's byte order, and a fraction of
+   the size of arptables-save text.  Targets other than the standard
+   ones go through `codec'; without one, or with matches, this fails
+   with EOPNOTSUPP.  Counters are included if `counters'. */
+int arptc_encode(int fd, int counters,
+		 const struct arptc_target_codec *codec,
+		 arptc_handle_t *handle);
+
+/* Reads a portable rule set from `fd' into `*handle', replacing all its
+   chains and rules; if `*handle' is NULL, the table named in the
+   stream is opened first.  Targets other than the standard ones go
+   through `codec'.  Rule counters are kept if `counters'.  Nothing
+   reaches the kernel until arptc_commit(). */
+int arptc_decode(int fd, int counters,
+		 const struct arptc_target_codec *codec,
+		 arptc_handle_t *handle);
+
+/* Sets `*hash' to a hash of the rules and policy of `chain', without
+   counters.  Chains with the same hash have the same rules, in any
+   table or on any host: jumps count by the name of the chain they go
+   to, not by where it is. */
+int arptc_chain_hash(const arpt_chainlabel chain, uint64_t *hash,
+		     arptc_handle_t *handle);
+
+/* Edit scripts: the steps that turn the rules of one handle into those
+   of another, of the same table. */
+enum arptc_edit_op
+{
+	ARPTC_EDIT_NEW_CHAIN,	/* create `chain' */
+	ARPTC_EDIT_POLICY,	/* set the policy of `chain' to `target' */
+	ARPTC_EDIT_DELETE,	/* delete rule `rulenum', `rule' */
+	ARPTC_EDIT_INSERT,	/* insert `rule' jumping to `target' */
+	ARPTC_EDIT_MOVE,	/* take rule `from', `rule', out and put it
+				   back as `rulenum' */
+	ARPTC_EDIT_FLUSH,	/* delete the rules of `chain' */
+	ARPTC_EDIT_DELETE_CHAIN	/* delete `chain' */
+};
+
+struct arptc_edit
+{
+	enum arptc_edit_op op;
+	arpt_chainlabel chain;
+	/* Rule numbers count from 0 in the chain as edited so far. */
+	unsigned int rulenum, from;
+	/* INSERT: the rule in `to'; DELETE, MOVE: the rule in `from'. */
+	const struct arpt_entry *rule;
+	/* The rule's target or the policy, as arptc_get_target() has it. */
+	const char *target;
+};
+
+/* Calls `fn' for each step of a short edit script from `from' to `to',
+   stopping if it returns 0.  Rules are equal if they match the same
+   packets and have the same target; `userspacesize', if not NULL,
+   gives how much of a target's data to compare.  Chains with the same
+   arptc_chain_hash() are not compared rule by rule.  Neither handle may
+   change until this returns. */
+int arptc_diff(arptc_handle_t *from, arptc_handle_t *to,
+	       unsigned int (*userspacesize)(const char *target),
+	       int (*fn)(const struct arptc_edit *edit, void *data),
+	       void *data);
+
+/* Applies one step of an edit script to `handle', which holds the rules
+   of `from' with the steps before it applied.  Moved rules keep their
+   counters. */
+int arptc_apply_edit(const struct arptc_edit *edit, arptc_handle_t *handle);
+
+/* Rule queries: find the rules which test a field for a given value
+   without walking and formatting the whole table.  Fields are indexed
+   on first use and the indexes are dropped when the handle changes. */
+enum arptc_query_field
+{
+	ARPTC_QUERY_SRC_IP,
+	ARPTC_QUERY_TGT_IP,
+	ARPTC_QUERY_SRC_MAC,
+	ARPTC_QUERY_TGT_MAC,
+	ARPTC_QUERY_IN_IFACE,
+	ARPTC_QUERY_OUT_IFACE,
+	ARPTC_QUERY_OPCODE,
+	ARPTC_QUERY_TARGET,
+	/* Either the input or the output interface. */
+	ARPTC_QUERY_IFACE
+};
+
+struct arptc_query_term
+{
+	enum arptc_query_field field;
+	/* Leading bits of ip or mac that must match, the rest is a
+	   wildcard (ignored for the other fields). */
+	unsigned int prefix;
+	union {
+		struct in_addr ip;
+		unsigned char mac[6];
+		char iface[IFNAMSIZ];
+		uint16_t opcode;	/* host byte order */
+		arpt_chainlabel target;	/* chain name for jumps */
+	} u;
+};
+
+struct arptc_query_result
+{
+	const char *chain;
+	unsigned int rulenum;
+	const char *target;
+	const struct arpt_entry *entry;
+};
+
+/* Finds the rules matching all `num_terms' terms (every rule for none):
+   a rule matches a term if it tests the field and some value the term
+   describes passes that test, so rules that don't test the field at
+   all never match.  Results are in table order in a malloc()ed array
+   the caller frees; they stay valid until the handle is changed. */
+int arptc_query(const struct arptc_query_term *terms,
+		unsigned int num_terms,
+		struct arptc_query_result **result,
+		unsigned int *num_results,
+		arptc_handle_t *handle);
+
 /* Get raw socket. */
 int arptc_get_raw_socket();
 
 /* Translates errno numbers into more human-readable form than strerror. */
 const char *arptc_strerror(int err);
 
+/* Wait forever for the table lock. */
+#define ARPTC_LOCK_WAIT_FOREVER	-1
+
+/* Serialize writers across processes: take the table lock before
+   arptc_init() and hold it until after arptc_commit().  Waits up to
+   `wait' seconds (0 = don't wait), polling every `interval'
+   microseconds; waiters get the lock in the order they asked for it.
+   Returns TRUE if the lock is ours, or 0 and sets errno. */
+int arptc_lock(int wait, unsigned int interval);
 
+/* Releases the table lock taken by arptc_lock(). */
+void arptc_unlock(void);
+
+/* Time spent waiting for and holding the most recently taken lock. */
+struct arptc_lock_stats
+{
+	unsigned long long wait_usec;
+	unsigned long long hold_usec;
+};
+
+const struct arptc_lock_stats *arptc_get_lock_stats(void);
+
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* _LIBARPTC_H */
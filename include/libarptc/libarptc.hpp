@@ -0,0 +1,580 @@
+#ifndef _LIBARPTC_HPP
+#define _LIBARPTC_HPP
+/* C++ interface to libarptc: an owning handle, rules laid out in place
+ * in memory the caller provides, and ranges over chains and rules.
+ *
+ * Nothing here allocates per rule: a rule<> is built directly in a
+ * rule_buffer<> or an arena, with all sizes known at compile time.
+ * As with the C library, the program defines RUNTIME_NF_ARP_NUMHOOKS.
+ */
+
+#include <cstddef>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include <libarptc/libarptc.h>
+#include <linux/netfilter_arp/arpt_mangle.h>
+#include <linux/netfilter/xt_mark.h>
+#include <linux/netfilter/xt_CLASSIFY.h>
+
+namespace arptc {
+
+/* A libarptc failure; what() is arptc_strerror() of the errno. */
+class error : public std::runtime_error
+{
+public:
+	explicit error(int err)
+		: std::runtime_error(arptc_strerror(err)), err_(err) {}
+
+	int code() const noexcept { return err_; }
+
+private:
+	int err_;
+};
+
+namespace detail {
+
+constexpr std::size_t align(std::size_t size)
+{
+	return ARPT_ALIGN(size);
+}
+
+inline void check(int ok)
+{
+	if (!ok)
+		throw error(errno);
+}
+
+}
+
+/* Targets: the payload following struct arpt_entry_target, the name
+ * and revision the kernel knows it by, and its default contents (the
+ * same as the extension's init()). */
+struct standard_target
+{
+	typedef int data_type;
+	static const char *name() { return ""; }
+	static const std::uint8_t revision = 0;
+	static void init(data_type &) {}
+};
+
+struct mangle_target
+{
+	typedef struct arpt_mangle data_type;
+	static const char *name() { return "mangle"; }
+	static const std::uint8_t revision = 0;
+	static void init(data_type &d) { d.target = NF_ACCEPT; }
+};
+
+struct mark_target
+{
+	typedef struct xt_mark_tginfo2 data_type;
+	static const char *name() { return "MARK"; }
+	static const std::uint8_t revision = 2;
+	static void init(data_type &) {}
+};
+
+struct classify_target
+{
+	typedef struct xt_classify_target_info data_type;
+	static const char *name() { return "CLASSIFY"; }
+	static const std::uint8_t revision = 0;
+	static void init(data_type &) {}
+};
+
+/* A rule with target `Target', written into caller memory of rule<>::size
+ * bytes, aligned like struct arpt_entry. */
+template <typename Target>
+class rule
+{
+public:
+	typedef typename Target::data_type data_type;
+
+	static constexpr std::size_t target_size =
+		detail::align(sizeof(struct arpt_entry_target))
+		+ detail::align(sizeof(data_type));
+	static constexpr std::size_t size =
+		sizeof(struct arpt_entry) + target_size;
+
+	explicit rule(void *buf)
+		: e_(static_cast<struct arpt_entry *>(buf))
+	{
+		struct arpt_entry_target *t;
+
+		std::memset(buf, 0, size);
+		e_->target_offset = sizeof(struct arpt_entry);
+		e_->next_offset = size;
+
+		t = target();
+		t->u.target_size = target_size;
+		std::strncpy(t->u.user.name, Target::name(),
+			     sizeof(t->u.user.name) - 1);
+		t->u.user.revision = Target::revision;
+		Target::init(data());
+	}
+
+	/* Standard targets: ACCEPT, DROP, RETURN or a chain name. */
+	rule &jump(const char *chain)
+	{
+		static_assert(std::is_same<Target, standard_target>::value,
+			      "only the standard target jumps");
+		std::memset(target()->u.user.name, 0,
+			    sizeof(target()->u.user.name));
+		std::strncpy(target()->u.user.name, chain,
+			     sizeof(target()->u.user.name) - 1);
+		return *this;
+	}
+
+	rule &src_ip(struct in_addr addr, struct in_addr mask = all_ones(),
+		     bool invert = false)
+	{
+		e_->arp.src.s_addr = addr.s_addr & mask.s_addr;
+		e_->arp.smsk = mask;
+		flag(ARPT_INV_SRCIP, invert);
+		return *this;
+	}
+
+	rule &dst_ip(struct in_addr addr, struct in_addr mask = all_ones(),
+		     bool invert = false)
+	{
+		e_->arp.tgt.s_addr = addr.s_addr & mask.s_addr;
+		e_->arp.tmsk = mask;
+		flag(ARPT_INV_TGTIP, invert);
+		return *this;
+	}
+
+	rule &src_mac(const unsigned char *mac,
+		      const unsigned char *mask = nullptr,
+		      bool invert = false)
+	{
+		set_mac(e_->arp.src_devaddr, mac, mask);
+		flag(ARPT_INV_SRCDEVADDR, invert);
+		return *this;
+	}
+
+	rule &dst_mac(const unsigned char *mac,
+		      const unsigned char *mask = nullptr,
+		      bool invert = false)
+	{
+		set_mac(e_->arp.tgt_devaddr, mac, mask);
+		flag(ARPT_INV_TGTDEVADDR, invert);
+		return *this;
+	}
+
+	/* Interface names ending in `+' match every name with that
+	 * prefix, as with -i and -o. */
+	rule &in_interface(const char *name, bool invert = false)
+	{
+		set_iface(e_->arp.iniface, e_->arp.iniface_mask, name);
+		flag(ARPT_INV_VIA_IN, invert);
+		return *this;
+	}
+
+	rule &out_interface(const char *name, bool invert = false)
+	{
+		set_iface(e_->arp.outiface, e_->arp.outiface_mask, name);
+		flag(ARPT_INV_VIA_OUT, invert);
+		return *this;
+	}
+
+	/* 16 bit fields take host byte order. */
+	rule &opcode(std::uint16_t op, std::uint16_t mask = 0xFFFF,
+		     bool invert = false)
+	{
+		e_->arp.arpop = htons(op & mask);
+		e_->arp.arpop_mask = htons(mask);
+		flag(ARPT_INV_ARPOP, invert);
+		return *this;
+	}
+
+	rule &h_type(std::uint16_t type, std::uint16_t mask = 0xFFFF,
+		     bool invert = false)
+	{
+		e_->arp.arhrd = htons(type & mask);
+		e_->arp.arhrd_mask = htons(mask);
+		flag(ARPT_INV_ARPHRD, invert);
+		return *this;
+	}
+
+	rule &proto_type(std::uint16_t type, std::uint16_t mask = 0xFFFF,
+			 bool invert = false)
+	{
+		e_->arp.arpro = htons(type & mask);
+		e_->arp.arpro_mask = htons(mask);
+		flag(ARPT_INV_ARPPRO, invert);
+		return *this;
+	}
+
+	rule &h_length(std::uint8_t len, std::uint8_t mask = 0xFF,
+		       bool invert = false)
+	{
+		e_->arp.arhln = len & mask;
+		e_->arp.arhln_mask = mask;
+		flag(ARPT_INV_ARPHLN, invert);
+		return *this;
+	}
+
+	rule &counters(std::uint64_t pcnt, std::uint64_t bcnt)
+	{
+		e_->counters.pcnt = pcnt;
+		e_->counters.bcnt = bcnt;
+		return *this;
+	}
+
+	/* The target's payload, to fill in directly. */
+	data_type &data()
+	{
+		return *reinterpret_cast<data_type *>(target()->data);
+	}
+
+	const struct arpt_entry *entry() const { return e_; }
+
+private:
+	static struct in_addr all_ones()
+	{
+		struct in_addr a;
+
+		a.s_addr = 0xFFFFFFFF;
+		return a;
+	}
+
+	struct arpt_entry_target *target()
+	{
+		return arpt_get_target(e_);
+	}
+
+	void flag(std::uint16_t inv, bool invert)
+	{
+		if (invert)
+			e_->arp.invflags |= inv;
+		else
+			e_->arp.invflags &= ~inv;
+	}
+
+	static void set_mac(struct arpt_devaddr_info &dev,
+			    const unsigned char *mac,
+			    const unsigned char *mask)
+	{
+		unsigned int i;
+
+		std::memset(&dev, 0, sizeof(dev));
+		for (i = 0; i < ETH_ALEN; i++) {
+			dev.mask[i] = mask ? mask[i] : 0xFF;
+			dev.addr[i] = mac[i] & dev.mask[i];
+		}
+	}
+
+	static void set_iface(char *via, unsigned char *mask,
+			      const char *name)
+	{
+		std::size_t len = std::strlen(name);
+
+		if (len + 1 > IFNAMSIZ)
+			throw std::length_error("interface name too long");
+
+		std::memset(via, 0, IFNAMSIZ);
+		std::memset(mask, 0, IFNAMSIZ);
+		std::memcpy(via, name, len);
+		if (len && name[len - 1] == '+')
+			std::memset(mask, 0xFF, len - 1);
+		else if (len)
+			/* Include nul-terminator in match */
+			std::memset(mask, 0xFF, len + 1);
+	}
+
+	struct arpt_entry *e_;
+};
+
+template <typename Target>
+constexpr std::size_t rule<Target>::target_size;
+template <typename Target>
+constexpr std::size_t rule<Target>::size;
+
+/* Storage for one rule, e.g. on the stack. */
+template <typename Target>
+struct rule_buffer
+{
+	alignas(struct arpt_entry) unsigned char bytes[rule<Target>::size];
+
+	rule<Target> make() { return rule<Target>(bytes); }
+};
+
+/* Bump allocator over a caller-provided buffer, for building many
+ * rules back to back.  Throws std::bad_alloc when the buffer is full;
+ * reset() recycles it. */
+class arena
+{
+public:
+	arena(void *buf, std::size_t len)
+		: base_(static_cast<unsigned char *>(buf)), len_(len), used_(0)
+	{
+		std::size_t skew = reinterpret_cast<std::uintptr_t>(base_)
+			% ARPT_MIN_ALIGN;
+
+		if (skew) {
+			skew = ARPT_MIN_ALIGN - skew;
+			base_ += skew < len_ ? skew : len_;
+			len_ -= skew < len_ ? skew : len_;
+		}
+	}
+
+	template <typename Target>
+	rule<Target> make()
+	{
+		void *p;
+
+		if (len_ - used_ < rule<Target>::size)
+			throw std::bad_alloc();
+		p = base_ + used_;
+		used_ += detail::align(rule<Target>::size);
+		return rule<Target>(p);
+	}
+
+	std::size_t used() const { return used_; }
+	void reset() { used_ = 0; }
+
+private:
+	unsigned char *base_;
+	std::size_t len_, used_;
+};
+
+/* The rules of one chain, straight from the table (see
+ * arptc_chain_span()); valid until the handle changes. */
+class rule_range
+{
+public:
+	class iterator
+	{
+	public:
+		explicit iterator(const struct arpt_entry *e) : e_(e) {}
+
+		const struct arpt_entry &operator*() const { return *e_; }
+		const struct arpt_entry *operator->() const { return e_; }
+
+		iterator &operator++()
+		{
+			e_ = reinterpret_cast<const struct arpt_entry *>(
+				reinterpret_cast<const char *>(e_)
+				+ e_->next_offset);
+			return *this;
+		}
+
+		bool operator==(const iterator &o) const { return e_ == o.e_; }
+		bool operator!=(const iterator &o) const { return e_ != o.e_; }
+
+	private:
+		const struct arpt_entry *e_;
+	};
+
+	rule_range(const struct arpt_entry *begin,
+		   const struct arpt_entry *end, unsigned int count)
+		: begin_(begin), end_(end), count_(count) {}
+
+	iterator begin() const { return iterator(begin_); }
+	iterator end() const { return iterator(end_); }
+	unsigned int size() const { return count_; }
+	bool empty() const { return begin_ == end_; }
+
+private:
+	const struct arpt_entry *begin_, *end_;
+	unsigned int count_;
+};
+
+/* The chain names of a table, built-ins first.  This walks with
+ * arptc_first_chain()/arptc_next_chain(), so only one chain_range per
+ * handle can be iterated at a time. */
+class chain_range
+{
+public:
+	class iterator
+	{
+	public:
+		iterator(arptc_handle_t *h, const char *name)
+			: h_(h), name_(name) {}
+
+		const char *operator*() const { return name_; }
+
+		iterator &operator++()
+		{
+			name_ = arptc_next_chain(h_);
+			return *this;
+		}
+
+		bool operator==(const iterator &o) const
+		{
+			return name_ == o.name_;
+		}
+		bool operator!=(const iterator &o) const
+		{
+			return name_ != o.name_;
+		}
+
+	private:
+		arptc_handle_t *h_;
+		const char *name_;
+	};
+
+	explicit chain_range(arptc_handle_t *h) : h_(h) {}
+
+	iterator begin() const
+	{
+		return iterator(h_, arptc_first_chain(h_));
+	}
+	iterator end() const { return iterator(h_, nullptr); }
+
+private:
+	arptc_handle_t *h_;
+};
+
+/* Owns an arptc_handle_t: a snapshot of one table, freed unless it is
+ * committed. */
+class handle
+{
+public:
+	explicit handle(const char *table = "filter")
+		: h_(arptc_init(table))
+	{
+		if (!h_)
+			throw error(errno);
+	}
+
+	~handle()
+	{
+		if (h_)
+			arptc_free(&h_);
+	}
+
+	handle(handle &&o) noexcept : h_(o.h_) { o.h_ = nullptr; }
+
+	handle &operator=(handle &&o) noexcept
+	{
+		if (this != &o) {
+			if (h_)
+				arptc_free(&h_);
+			h_ = o.h_;
+			o.h_ = nullptr;
+		}
+		return *this;
+	}
+
+	handle(const handle &) = delete;
+	handle &operator=(const handle &) = delete;
+
+	/* For calling the C API directly. */
+	arptc_handle_t *get() { return &h_; }
+
+	chain_range chains() { return chain_range(&h_); }
+
+	rule_range rules(const char *chain)
+	{
+		const struct arpt_entry *begin, *end;
+		unsigned int count;
+
+		detail::check(arptc_chain_span(chain, &begin, &end, &count,
+					       &h_));
+		return rule_range(begin, end, count);
+	}
+
+	const char *target(const struct arpt_entry &e)
+	{
+		return arptc_get_target(&e, &h_);
+	}
+
+	bool is_chain(const char *chain) const
+	{
+		return arptc_is_chain(chain, h_);
+	}
+
+	bool builtin(const char *chain) const
+	{
+		return arptc_builtin(chain, h_);
+	}
+
+	/* Rule numbers start at 0, as in the C API. */
+	template <typename Target>
+	void append(const char *chain, const rule<Target> &r)
+	{
+		detail::check(arptc_append_entry(chain, r.entry(), &h_));
+	}
+
+	template <typename Target>
+	void insert(const char *chain, const rule<Target> &r,
+		    unsigned int rulenum)
+	{
+		detail::check(arptc_insert_entry(chain, r.entry(), rulenum,
+						 &h_));
+	}
+
+	template <typename Target>
+	void replace(const char *chain, const rule<Target> &r,
+		     unsigned int rulenum)
+	{
+		detail::check(arptc_replace_entry(chain, r.entry(), rulenum,
+						  &h_));
+	}
+
+	void erase(const char *chain, unsigned int rulenum)
+	{
+		detail::check(arptc_delete_num_entry(chain, rulenum, &h_));
+	}
+
+	void flush(const char *chain)
+	{
+		detail::check(arptc_flush_entries(chain, &h_));
+	}
+
+	void zero(const char *chain)
+	{
+		detail::check(arptc_zero_entries(chain, &h_));
+	}
+
+	void create_chain(const char *chain)
+	{
+		detail::check(arptc_create_chain(chain, &h_));
+	}
+
+	void delete_chain(const char *chain)
+	{
+		detail::check(arptc_delete_chain(chain, &h_));
+	}
+
+	void rename_chain(const char *from, const char *to)
+	{
+		detail::check(arptc_rename_chain(from, to, &h_));
+	}
+
+	void set_policy(const char *chain, const char *policy)
+	{
+		detail::check(arptc_set_policy(chain, policy, nullptr, &h_));
+	}
+
+	void own_chain(const char *chain)
+	{
+		detail::check(arptc_own_chain(chain, &h_));
+	}
+
+	/* Packs the rules while the handle sits idle. */
+	void compact()
+	{
+		detail::check(arptc_compact(&h_));
+	}
+
+	/* Hands the table to the kernel; the handle is empty afterwards. */
+	void commit()
+	{
+		detail::check(arptc_commit(&h_));
+		h_ = nullptr;
+	}
+
+private:
+	arptc_handle_t h_;
+};
+
+}
+
+#endif /* _LIBARPTC_HPP */
@@ -14,10 +14,18 @@
 #include <assert.h>
 #include <string.h>
 #include <errno.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <net/ethernet.h>
+#include <net/if.h>
 
 #ifdef DEBUG_CONNTRACK
 #define inline
@@ -37,6 +45,9 @@
 #define STRUCT_COUNTERS_INFO	struct arpt_counters_info
 #define STRUCT_STANDARD_TARGET	struct arpt_standard_target
 #define STRUCT_REPLACE		struct arpt_replace
+#define STRUCT_LOCK_STATS	struct arptc_lock_stats
+#define STRUCT_QUERY_RESULT	struct arptc_query_result
+#define STRUCT_CURSOR		struct arptc_cursor
 
 #define STRUCT_TC_HANDLE	struct arptc_handle
 #define TC_HANDLE_T		arptc_handle_t
@@ -57,6 +68,9 @@
 #define TC_NEXT_CHAIN		arptc_next_chain
 #define TC_FIRST_RULE		arptc_first_rule
 #define TC_NEXT_RULE		arptc_next_rule
+#define TC_CHAIN_SPAN		arptc_chain_span
+#define TC_CURSOR_INIT		arptc_cursor_init
+#define TC_CURSOR_NEXT		arptc_cursor_next
 #define TC_GET_TARGET		arptc_get_target
 #define TC_BUILTIN		arptc_builtin
 #define TC_GET_POLICY		arptc_get_policy
@@ -67,6 +81,7 @@
 #define TC_DELETE_NUM_ENTRY	arptc_delete_num_entry
 #define TC_CHECK_PACKET		arptc_check_packet
 #define TC_FLUSH_ENTRIES	arptc_flush_entries
+#define TC_RELOAD_CHAIN		arptc_reload_chain
 #define TC_ZERO_ENTRIES		arptc_zero_entries
 #define TC_READ_COUNTER		arptc_read_counter
 #define TC_ZERO_COUNTER		arptc_zero_counter
@@ -78,8 +93,26 @@
 #define TC_SET_POLICY		arptc_set_policy
 #define TC_GET_RAW_SOCKET	arptc_get_raw_socket
 #define TC_INIT			arptc_init
+#define TC_INIT_CACHED		arptc_init_cached
+#define TC_REFRESH_COUNTERS	arptc_refresh_counters
 #define TC_COMMIT		arptc_commit
+#define TC_FREE			arptc_free
+#define TC_OWN_CHAIN		arptc_own_chain
+#define TC_DUP			arptc_dup
+#define TC_COMPACT		arptc_compact
+#define TC_SAVE_SNAPSHOT	arptc_save_snapshot
+#define TC_CHECK_SNAPSHOT	arptc_check_snapshot
+#define TC_RESTORE_SNAPSHOT	arptc_restore_snapshot
+#define TC_ENCODE		arptc_encode
+#define TC_DECODE		arptc_decode
+#define TC_CHAIN_HASH		arptc_chain_hash
+#define TC_DIFF			arptc_diff
+#define TC_APPLY_EDIT		arptc_apply_edit
+#define TC_QUERY		arptc_query
 #define TC_STRERROR		arptc_strerror
+#define TC_LOCK			arptc_lock
+#define TC_UNLOCK		arptc_unlock
+#define TC_GET_LOCK_STATS	arptc_get_lock_stats
 
 #define TC_AF			AF_INET
 #define TC_IPPROTO		IPPROTO_IP
@@ -96,6 +129,25 @@
 #define LABEL_DROP		ARPTC_LABEL_DROP
 #define LABEL_QUEUE		ARPTC_LABEL_QUEUE
 
+#ifndef ARPT_LOCK_NAME
+#define ARPT_LOCK_NAME		"/run/arptables.lock"
+#endif
+#define LOCK_NAME		ARPT_LOCK_NAME
+#define LOCK_NAME_ENV		"ARPTABLES_LOCKFILE"
+
+#ifndef ARPT_CACHE_DIR
+#define ARPT_CACHE_DIR		"/run/arptables"
+#endif
+#define CACHE_DIR		ARPT_CACHE_DIR
+#define CACHE_DIR_ENV		"ARPTABLES_CACHEDIR"
+#define CACHE_ENV		"ARPTABLES_CACHE"
+
+/* How often a rebasing commit re-applies owned chains before giving up. */
+#define REBASE_RETRIES		8
+/* How often a rebasing commit made without arptc_lock() checks the lock
+   it then waits for, in microseconds. */
+#define REBASE_LOCK_INTERVAL	10000
+
 #define ALIGN			ARPT_ALIGN
 #define RETURN			ARPT_RETURN
 
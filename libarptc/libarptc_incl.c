@@ -20,6 +20,8 @@ GET_TARGET(STRUCT_ENTRY *e)
 #endif
 
 static int sockfd = -1;
+/* The table lock we hold (-1 = none), from TC_LOCK(). */
+static int lockfd = -1;
 static void *arptc_fn = NULL;
 
 static const char *hooknames[] =
@@ -47,6 +49,101 @@ struct chain_cache
 	STRUCT_ENTRY *start;
 	/* Last rule in chain */
 	STRUCT_ENTRY *end;
+	/* Hash of its rules and policy (0 = not worked out yet). */
+	uint64_t hash;
+};
+
+/* Rule queries.  Each indexed field keeps its rules in buckets by how
+ * many leading bits (or characters) of the field the rule tests; every
+ * bucket is sorted by key, so a lookup is one binary search per
+ * non-empty bucket.  Rules the buckets can't describe (inverted tests,
+ * odd masks) go on a short list that is checked one by one. */
+#define QUERY_BUCKETS		49	/* prefix lengths 0..48 */
+#define QUERY_NUM_INDEXES	(ARPTC_QUERY_TARGET + 1)
+
+struct query_key
+{
+	union {
+		uint64_t num;
+		const char *str;
+	} k;
+	unsigned int rule;
+};
+
+struct query_bucket
+{
+	unsigned int num;
+	struct query_key *keys;
+};
+
+struct query_index
+{
+	int built;
+	struct query_bucket bucket[QUERY_BUCKETS];
+	unsigned int num_rest;
+	unsigned int *rest;
+};
+
+/* Appends waiting to be merged into the entry table.  Every append
+ * goes at the end of a chain, so a run of them can be written out in
+ * one pass over the table instead of one reallocation each. */
+struct pending_rule
+{
+	/* Where it goes: the chain's policy or RETURN, in the old table. */
+	unsigned int offset;
+	/* Where its copy starts in `rules'. */
+	unsigned int pos;
+	/* Fall-through verdicts point at the next rule, wherever it is. */
+	int fallthrough;
+	struct counter_map map;
+};
+
+struct pending
+{
+	unsigned int num, num_alloc;
+	struct pending_rule *rule;
+	/* The rules themselves, targets mapped against the old table. */
+	unsigned int size, size_alloc;
+	unsigned char *rules;
+};
+
+/* Rules flushed by TC_RELOAD_CHAIN(), written the way a caller would
+ * append them again.  Appending an identical rule to the same chain
+ * takes over the flushed rule's counters. */
+struct reload_rule
+{
+	uint64_t hash;
+	ARPT_CHAINLABEL chain;
+	/* Where its copy starts in `rules'. */
+	unsigned int pos, size;
+	int taken;
+	struct counter_map map;
+	STRUCT_COUNTERS counters;
+};
+
+struct reload
+{
+	/* Sorted by hash. */
+	unsigned int num;
+	struct reload_rule *rule;
+	unsigned int size;
+	unsigned char *rules;
+};
+
+struct query_rule
+{
+	const STRUCT_ENTRY *e;
+	const char *chain;
+	const char *target;
+	unsigned int rulenum;
+};
+
+struct query_cache
+{
+	/* All rules (no policies or chain heads) in table order. */
+	unsigned int num_rules;
+	struct query_rule *rules;
+	struct query_index index[QUERY_NUM_INDEXES];
 };
 
 STRUCT_TC_HANDLE
@@ -71,14 +168,55 @@ STRUCT_TC_HANDLE
 	/* Rule iterator: terminal rule */
 	STRUCT_ENTRY *cache_rule_end;
 
+	/* Chains this handle owns (NULL = commit the whole table). */
+	unsigned int num_owned;
+	ARPT_CHAINLABEL *owned;
+
+	/* Fingerprint of the table as we read it from the kernel. */
+	uint64_t init_hash;
+
+	/* Rule query indexes (NULL = not built yet). */
+	struct query_cache *query;
+
+	/* Packed rules (NULL = the entries below are live). */
+	struct compact *compact;
+
+	/* Entries came from the table cache: counters are old. */
+	int stale_counters;
+
+	/* Appends not merged yet (NULL = none). */
+	struct pending *pending;
+
+	/* Flushed rules whose counters can be taken over (NULL = none). */
+	struct reload *reload;
+
 	/* Number in here reflects current state. */
 	unsigned int new_number;
 	STRUCT_GET_ENTRIES entries;
 };
 
+static void
+free_query(TC_HANDLE_T h)
+{
+	unsigned int i, j;
+
+	if (!h->query)
+		return;
+
+	for (i = 0; i < QUERY_NUM_INDEXES; i++) {
+		for (j = 0; j < QUERY_BUCKETS; j++)
+			free(h->query->index[i].bucket[j].keys);
+		free(h->query->index[i].rest);
+	}
+	free(h->query->rules);
+	free(h->query);
+	h->query = NULL;
+}
+
 static void
 set_changed(TC_HANDLE_T h)
 {
+	free_query(h);
 	if (h->cache_chain_heads) {
 		free(h->cache_chain_heads);
 		h->cache_chain_heads = NULL;
@@ -96,6 +234,21 @@ static void do_check(TC_HANDLE_T h, unsigned int line);
 #define CHECK(h)
 #endif
 
+/* Expand a compacted handle, and merge queued appends, before
+   touching its entries. */
+static int unpack(TC_HANDLE_T *handle);
+static int compact_is_chain(const char *chain, const struct compact *c);
+static int merge_pending(TC_HANDLE_T *handle);
+#define UNPACK(h) do { if (((*h)->compact && !unpack(h))		\
+			   || ((*h)->pending && !merge_pending(h)))	\
+			return 0; } while(0)
+
+/* Fetch the kernel's counters before relying on ours. */
+static int refresh_counters(TC_HANDLE_T h);
+#define FRESH(h) do { if ((*h)->stale_counters		\
+			  && !refresh_counters(*h))		\
+			return 0; } while(0)
+
 static inline int
 get_number(const STRUCT_ENTRY *i,
 	   const STRUCT_ENTRY *seek,
@@ -180,6 +333,49 @@ get_errorlabel(TC_HANDLE_T h, unsigned int offset)
 	return (const char *)GET_TARGET(e)->data;
 }
 
+/* Cheap 64-bit hash, eight bytes at a time. */
+static uint64_t
+hash_bytes(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	uint64_t w;
+
+	for (; len >= sizeof(w); p += sizeof(w), len -= sizeof(w)) {
+		memcpy(&w, p, sizeof(w));
+		hash = (hash ^ w) * 0x100000001b3ULL;
+		hash ^= hash >> 29;
+	}
+	for (; len; p++, len--)
+		hash = (hash ^ *p) * 0x100000001b3ULL;
+
+	return hash;
+}
+
+/* Hash an entry, leaving out what the kernel changes under us. */
+static inline int
+hash_entry(const STRUCT_ENTRY *e, uint64_t *hash)
+{
+	*hash = hash_bytes(*hash, e, offsetof(STRUCT_ENTRY, comefrom));
+	*hash = hash_bytes(*hash, e->elems,
+			   e->next_offset - sizeof(STRUCT_ENTRY));
+	return 0;
+}
+
+static uint64_t
+entries_hash(STRUCT_ENTRY *entries, unsigned int size)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	ENTRY_ITERATE(entries, size, hash_entry, &hash);
+	return hash;
+}
+
+static uint64_t
+table_hash(const TC_HANDLE_T h)
+{
+	return entries_hash(h->entries.entrytable, h->entries.size);
+}
+
 /* Allocate handle of given size */
 static TC_HANDLE_T
 alloc_handle(const char *tablename, unsigned int size, unsigned int num_rules)
@@ -205,56 +401,92 @@ alloc_handle(const char *tablename, unsigned int size, unsigned int num_rules)
 	return h;
 }
 
-TC_HANDLE_T
-TC_INIT(const char *tablename)
+/* Ask the kernel for the table's layout.  A kernel with two ARP hooks
+ * rejects the three-hook size with EINVAL; the first such reply
+ * switches RUNTIME_NF_ARP_NUMHOOKS for the rest of the process. */
+static int
+get_info(const char *tablename, STRUCT_GETINFO *info)
 {
-	TC_HANDLE_T h;
-	STRUCT_GETINFO info;
-	unsigned int i;
-	socklen_t s, tmp;
-
-	arptc_fn = TC_INIT;
-
-	if (sockfd != -1)
-		close(sockfd);
-
-	sockfd = socket(TC_AF, SOCK_RAW, IPPROTO_RAW);
-	if (sockfd < 0)
-		return NULL;
-
-	s = sizeof(info);
-	if (RUNTIME_NF_ARP_NUMHOOKS == 2)
-		s -= 2 * sizeof(unsigned int);
+	socklen_t s;
 
 	if (strlen(tablename) >= TABLE_MAXNAMELEN) {
 		errno = EINVAL;
-		return NULL;
+		return 0;
+	}
+
+	for (;;) {
+		s = sizeof(*info);
+		if (RUNTIME_NF_ARP_NUMHOOKS == 2)
+			s -= 2 * sizeof(unsigned int);
+
+		memset(info, 0, sizeof(*info));
+		strcpy(info->name, tablename);
+		if (getsockopt(sockfd, TC_IPPROTO, SO_GET_INFO, info, &s) == 0)
+			break;
+		if (errno != EINVAL || RUNTIME_NF_ARP_NUMHOOKS != 3)
+			return 0;
+		RUNTIME_NF_ARP_NUMHOOKS = 2;
 	}
-	strcpy(info.name, tablename);
-	if (getsockopt(sockfd, TC_IPPROTO, SO_GET_INFO, &info, &s) < 0)
-		return NULL;
 
 	if (RUNTIME_NF_ARP_NUMHOOKS == 2) {
-		memmove(&(info.hook_entry[3]), &(info.hook_entry[2]),
+		memmove(&(info->hook_entry[3]), &(info->hook_entry[2]),
 		5 * sizeof(unsigned int));
-		memmove(&(info.underflow[3]), &(info.underflow[2]),
+		memmove(&(info->underflow[3]), &(info->underflow[2]),
 		2 * sizeof(unsigned int));
 	}
+	return 1;
+}
+
+/* A handle for the table `info' describes, entries still to be read. */
+static TC_HANDLE_T
+new_handle(const STRUCT_GETINFO *info)
+{
+	TC_HANDLE_T h;
+	unsigned int i;
 
-	if ((h = alloc_handle(info.name, info.size, info.num_entries))
+	if ((h = alloc_handle(info->name, info->size, info->num_entries))
 	    == NULL)
 		return NULL;
 
 	h->hooknames = hooknames;
 
 	/* Initialize current state */
-	h->info = info;
+	h->info = *info;
 	h->new_number = h->info.num_entries;
 	for (i = 0; i < h->info.num_entries; i++)
 		h->counter_map[i]
 			= ((struct counter_map){COUNTER_MAP_NORMAL_MAP, i});
 
 	h->entries.size = h->info.size;
+	return h;
+}
+
+/* One raw socket serves every handle. */
+static int
+open_socket(void)
+{
+	if (sockfd == -1)
+		sockfd = socket(TC_AF, SOCK_RAW, IPPROTO_RAW);
+	return sockfd >= 0;
+}
+
+TC_HANDLE_T
+TC_INIT(const char *tablename)
+{
+	TC_HANDLE_T h;
+	STRUCT_GETINFO info;
+	socklen_t tmp;
+
+	arptc_fn = TC_INIT;
+
+	if (!open_socket())
+		return NULL;
+
+	if (!get_info(tablename, &info))
+		return NULL;
+
+	if ((h = new_handle(&info)) == NULL)
+		return NULL;
 
 	tmp = sizeof(STRUCT_GET_ENTRIES) + h->info.size;
 
@@ -264,10 +496,240 @@ TC_INIT(const char *tablename)
 		return NULL;
 	}
 
+	h->init_hash = table_hash(h);
+
 	CHECK(h);
 	return h;
 }
 
+/* The table cache: one file per table holding the SO_GET_INFO reply
+ * and the entries that went with it.  A reader whose SO_GET_INFO
+ * still matches takes the entries from the file; readers never write
+ * it.  Commits through libarptc remove the file before replacing the
+ * table, and write it again afterwards if they hold the table lock,
+ * so no other commit can come in between, and if the cache is in use
+ * (there was a file, or ARPTABLES_CACHE is set).  A change of the same
+ * size and layout made behind libarptc's back goes unnoticed until the
+ * next commit, which is why the cache is only used when asked for. */
+#define CACHE_MAGIC	"arptc01"
+
+struct cache_header
+{
+	char magic[8];
+	STRUCT_GETINFO info;
+};
+
+static int
+cache_path(const char *tablename, char *path, size_t len)
+{
+	const char *dir = getenv(CACHE_DIR_ENV);
+
+	if (!dir || !*dir)
+		dir = CACHE_DIR;
+	return snprintf(path, len, "%s/%s.cache", dir, tablename) < (int)len;
+}
+
+/* Save a handle fresh from the kernel.  Best effort: errno is kept. */
+static void
+write_cache(const TC_HANDLE_T h)
+{
+	struct cache_header hdr;
+	char path[PATH_MAX], tmp[PATH_MAX + 16];
+	int fd, err = errno;
+	char *slash;
+
+	if (!cache_path(h->info.name, path, sizeof(path)))
+		return;
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	slash = strrchr(path, '/');
+	if (slash) {
+		*slash = '\0';
+		mkdir(path, 0700);
+		*slash = '/';
+	}
+
+	fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0600);
+	if (fd < 0)
+		goto out;
+
+	memset(&hdr, 0, sizeof(hdr));
+	strcpy(hdr.magic, CACHE_MAGIC);
+	hdr.info = h->info;
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)
+	    || write(fd, h->entries.entrytable, h->info.size)
+	       != (ssize_t)h->info.size) {
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+	close(fd);
+	if (rename(tmp, path) < 0)
+		unlink(tmp);
+ out:
+	errno = err;
+}
+
+/* Drop the cache for `tablename'; returns whether there was one. */
+static int
+drop_cache(const char *tablename)
+{
+	char path[PATH_MAX];
+	int err = errno, ret;
+
+	ret = cache_path(tablename, path, sizeof(path)) && unlink(path) == 0;
+	errno = err;
+	return ret;
+}
+
+/* Re-read a table we just replaced into its cache, if `cached' (it
+   had one) or the cache is turned on, and the commit lock is ours. */
+static void
+refresh_cache(const char *tablename, int cached)
+{
+	const char *on = getenv(CACHE_ENV);
+	void *fn = arptc_fn;
+	TC_HANDLE_T h;
+
+	if (lockfd == -1 || (!cached && (!on || !*on)))
+		return;
+	if ((h = TC_INIT(tablename)) != NULL) {
+		write_cache(h);
+		TC_FREE(&h);
+	}
+	arptc_fn = fn;
+}
+
+static TC_HANDLE_T
+read_cache(const STRUCT_GETINFO *info)
+{
+	struct cache_header hdr;
+	char path[PATH_MAX];
+	struct stat st;
+	TC_HANDLE_T h = NULL;
+	int fd;
+
+	if (!cache_path(info->name, path, sizeof(path)))
+		return NULL;
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0
+	    || st.st_size != (off_t)(sizeof(hdr) + info->size)
+	    || read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)
+	    || memcmp(hdr.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0
+	    || memcmp(&hdr.info, info, sizeof(*info)) != 0)
+		goto out;
+
+	if ((h = new_handle(info)) == NULL)
+		goto out;
+	if (read(fd, h->entries.entrytable, info->size)
+	    != (ssize_t)info->size) {
+		free(h);
+		h = NULL;
+		goto out;
+	}
+	h->stale_counters = 1;
+	h->init_hash = table_hash(h);
+ out:
+	close(fd);
+	return h;
+}
+
+TC_HANDLE_T
+TC_INIT_CACHED(const char *tablename)
+{
+	TC_HANDLE_T h;
+	STRUCT_GETINFO info;
+
+	arptc_fn = TC_INIT_CACHED;
+
+	if (!open_socket())
+		return NULL;
+
+	if (!get_info(tablename, &info))
+		return NULL;
+
+	if ((h = read_cache(&info)) != NULL) {
+		CHECK(h);
+		return h;
+	}
+
+	return TC_INIT(tablename);
+}
+
+static int
+refresh_counters(TC_HANDLE_T h)
+{
+	STRUCT_GETINFO info;
+	STRUCT_GET_ENTRIES *fresh;
+	STRUCT_ENTRY **kernel, *e, *k;
+	socklen_t tmp;
+	unsigned int i;
+
+	arptc_fn = TC_REFRESH_COUNTERS;
+
+	if (!get_info(h->info.name, &info))
+		return 0;
+
+	tmp = sizeof(*fresh) + info.size;
+	fresh = malloc(tmp);
+	kernel = malloc(info.num_entries * sizeof(*kernel) + 1);
+	if (!fresh || !kernel) {
+		free(fresh);
+		free(kernel);
+		errno = ENOMEM;
+		return 0;
+	}
+	strcpy(fresh->name, info.name);
+	fresh->size = info.size;
+	if (getsockopt(sockfd, TC_IPPROTO, SO_GET_ENTRIES, fresh, &tmp) < 0) {
+		free(fresh);
+		free(kernel);
+		return 0;
+	}
+
+	/* Only the counters may differ from what the cache gave us. */
+	if (entries_hash(fresh->entrytable, info.size) != h->init_hash) {
+		free(fresh);
+		free(kernel);
+		errno = EAGAIN;
+		return 0;
+	}
+
+	k = fresh->entrytable;
+	for (i = 0; i < info.num_entries; i++) {
+		kernel[i] = k;
+		k = (void *)k + k->next_offset;
+	}
+
+	e = h->entries.entrytable;
+	for (i = 0; i < h->new_number; i++, e = (void *)e + e->next_offset) {
+		switch (h->counter_map[i].maptype) {
+		case COUNTER_MAP_NORMAL_MAP:
+		case COUNTER_MAP_ZEROED:
+			e->counters
+				= kernel[h->counter_map[i].mappos]->counters;
+			break;
+		default:
+			break;
+		}
+	}
+	free(fresh);
+	free(kernel);
+
+	h->stale_counters = 0;
+	return 1;
+}
+
+/* Replace the counters of a handle from the table cache with the
+   kernel's. */
+int
+TC_REFRESH_COUNTERS(TC_HANDLE_T *handle)
+{
+	UNPACK(handle);
+	return refresh_counters(*handle);
+}
+
 /*
 static inline int
 print_match(const STRUCT_ENTRY_MATCH *m)
@@ -282,11 +744,21 @@ static int dump_entry(STRUCT_ENTRY *e, const TC_HANDLE_T handle);
 void
 TC_DUMP_ENTRIES(const TC_HANDLE_T handle)
 {
+	if (handle->compact) {
+		printf("libarptc v%s.  %u entries, %u bytes (compacted).\n",
+		       ARPTABLES_VERSION,
+		       handle->new_number, handle->entries.size);
+		return;
+	}
+
 	CHECK(handle);
 
 	printf("libarptc v%s.  %u entries, %u bytes.\n",
 	       ARPTABLES_VERSION,
 	       handle->new_number, handle->entries.size);
+	if (handle->pending)
+		printf("%u appends (%u bytes) not merged yet.\n",
+		       handle->pending->num, handle->pending->size);
 	printf("Table `%s'\n", handle->info.name);
 	printf("Hooks: in/out = %u/%u\n",
 	       handle->info.hook_entry[NF_ARP_IN],
@@ -337,6 +809,7 @@ add_chain(STRUCT_ENTRY *e, TC_HANDLE_T h, STRUCT_ENTRY **prev)
 		h->cache_chain_heads[h->cache_num_chains].name[TABLE_MAXNAMELEN-1] = '\0';
 		h->cache_chain_heads[h->cache_num_chains].start
 			= (void *)e + e->next_offset;
+		h->cache_chain_heads[h->cache_num_chains].hash = 0;
 		h->cache_num_chains++;
 	} else if ((builtin = is_hook_entry(e, h)) != 0) {
 		if (h->cache_num_chains > 0)
@@ -349,6 +822,7 @@ add_chain(STRUCT_ENTRY *e, TC_HANDLE_T h, STRUCT_ENTRY **prev)
 		h->cache_chain_heads[h->cache_num_chains].name[TABLE_MAXNAMELEN-1] = '\0';
 		h->cache_chain_heads[h->cache_num_chains].start
 			= (void *)e;
+		h->cache_chain_heads[h->cache_num_chains].hash = 0;
 		h->cache_num_chains++;
 	}
 
@@ -417,6 +891,8 @@ find_label(const char *name, TC_HANDLE_T handle)
 /* Does this chain exist? */
 int TC_IS_CHAIN(const char *chain, const TC_HANDLE_T handle)
 {
+	if (handle->compact)
+		return compact_is_chain(chain, handle->compact);
 	return find_label(chain, handle) != NULL;
 }
 
@@ -461,6 +937,8 @@ get_chain_end(const TC_HANDLE_T handle, unsigned int start)
 const char *
 TC_FIRST_CHAIN(TC_HANDLE_T *handle)
 {
+	UNPACK(handle);
+
 	if ((*handle)->cache_chain_heads == NULL
 	    && !populate_cache(*handle))
 		return NULL;
@@ -475,6 +953,10 @@ TC_FIRST_CHAIN(TC_HANDLE_T *handle)
 const char *
 TC_NEXT_CHAIN(TC_HANDLE_T *handle)
 {
+	/* Compacting ended the iteration. */
+	if (!(*handle)->cache_chain_iteration)
+		return NULL;
+
 	(*handle)->cache_chain_iteration++;
 
 	if ((*handle)->cache_chain_iteration - (*handle)->cache_chain_heads
@@ -490,6 +972,8 @@ TC_FIRST_RULE(const char *chain, TC_HANDLE_T *handle)
 {
 	struct chain_cache *c;
 
+	UNPACK(handle);
+
 	c = find_label(chain, *handle);
 	if (!c) {
 		errno = ENOENT;
@@ -515,6 +999,59 @@ TC_NEXT_RULE(const STRUCT_ENTRY *prev, TC_HANDLE_T *handle)
 	return (void *)prev + prev->next_offset;
 }
 
+/* Byte range of the rules in a chain, excluding its policy or RETURN. */
+int
+TC_CHAIN_SPAN(const char *chain, const STRUCT_ENTRY **begin,
+	      const STRUCT_ENTRY **end, unsigned int *count,
+	      TC_HANDLE_T *handle)
+{
+	struct chain_cache *c;
+	const STRUCT_ENTRY *e;
+	unsigned int num = 0;
+
+	UNPACK(handle);
+
+	arptc_fn = TC_CHAIN_SPAN;
+
+	c = find_label(chain, *handle);
+	if (!c) {
+		errno = ENOENT;
+		return 0;
+	}
+
+	for (e = c->start; e != c->end; e = (void *)e + e->next_offset)
+		num++;
+
+	*begin = c->start;
+	*end = c->end;
+	if (count)
+		*count = num;
+	return 1;
+}
+
+/* Point a cursor at the rules of a chain. */
+int
+TC_CURSOR_INIT(STRUCT_CURSOR *cursor, const char *chain,
+	       TC_HANDLE_T *handle)
+{
+	if (!TC_CHAIN_SPAN(chain, &cursor->next, &cursor->end, NULL, handle))
+		return 0;
+	return 1;
+}
+
+/* Returns NULL when the cursor's rules run out. */
+const STRUCT_ENTRY *
+TC_CURSOR_NEXT(STRUCT_CURSOR *cursor)
+{
+	const STRUCT_ENTRY *e = cursor->next;
+
+	if (e == cursor->end)
+		return NULL;
+
+	cursor->next = (void *)e + e->next_offset;
+	return e;
+}
+
 #if 0
 /* How many rules in this chain? */
 unsigned int
@@ -554,6 +1091,10 @@ const STRUCT_ENTRY *TC_GET_RULE(const char *chain,
 }
 #endif
 
+/* Size of the error rule that heads a user chain. */
+#define ERROR_NODE_SIZE \
+	(sizeof(STRUCT_ENTRY) + ALIGN(sizeof(struct arpt_error_target)))
+
 static const char *
 target_name(TC_HANDLE_T handle, const STRUCT_ENTRY *ce)
 {
@@ -593,7 +1134,18 @@ target_name(TC_HANDLE_T handle, const STRUCT_ENTRY *ce)
 	if (jumpto == (void *)e + e->next_offset)
 		return "";
 
-	/* Must point to head of a chain: ie. after error rule */
+	/* Must point to head of a chain: ie. after error rule.  That
+	   has the size TC_CREATE_CHAIN gives it, so it can be found
+	   without counting rules from the start of the table. */
+	if ((unsigned int)spos >= ERROR_NODE_SIZE) {
+		STRUCT_ENTRY *head = get_entry(handle, spos - ERROR_NODE_SIZE);
+
+		if (head->next_offset == ERROR_NODE_SIZE
+		    && head->target_offset == sizeof(STRUCT_ENTRY)
+		    && strcmp(GET_TARGET(head)->u.user.name,
+			      ERROR_TARGET) == 0)
+			return (const char *)GET_TARGET(head)->data;
+	}
 	labelidx = entry2index(handle, jumpto) - 1;
 	return get_errorlabel(handle, index2offset(handle, labelidx));
 }
@@ -630,6 +1182,8 @@ TC_GET_POLICY(const char *chain,
 	STRUCT_ENTRY *e;
 	int hook;
 
+	UNPACK(handle);
+
 	hook = TC_BUILTIN(chain, *handle);
 	if (hook != 0)
 		start = (*handle)->info.hook_entry[hook-1];
@@ -742,9 +1296,15 @@ insert_rules(unsigned int num_rules, unsigned int rules_size,
 	newh->new_number = (*handle)->new_number + num_rules;
 	newh->entries.size = (*handle)->entries.size + rules_size;
 	newh->hooknames = (*handle)->hooknames;
+	newh->num_owned = (*handle)->num_owned;
+	newh->owned = (*handle)->owned;
+	newh->init_hash = (*handle)->init_hash;
+	newh->stale_counters = (*handle)->stale_counters;
+	newh->reload = (*handle)->reload;
 
 	if ((*handle)->cache_chain_heads)
 		free((*handle)->cache_chain_heads);
+	free_query(*handle);
 	free(*handle);
 	*handle = newh;
 
@@ -894,6 +1454,8 @@ TC_INSERT_ENTRY(const ARPT_CHAINLABEL chain,
 	STRUCT_ENTRY *tmp;
 	int ret;
 
+	UNPACK(handle);
+
 	arptc_fn = TC_INSERT_ENTRY;
 	if (!(c = find_label(chain, *handle))) {
 		errno = ENOENT;
@@ -933,6 +1495,8 @@ TC_REPLACE_ENTRY(const ARPT_CHAINLABEL chain,
 	STRUCT_ENTRY *tmp;
 	int ret;
 
+	UNPACK(handle);
+
 	arptc_fn = TC_REPLACE_ENTRY;
 
 	if (!(c = find_label(chain, *handle))) {
@@ -963,31 +1527,308 @@ TC_REPLACE_ENTRY(const ARPT_CHAINLABEL chain,
 	return ret;
 }
 
-/* Append entry `fw' to chain `chain'.  Equivalent to insert with
-   rulenum = length of chain. */
-int
-TC_APPEND_ENTRY(const ARPT_CHAINLABEL chain,
-		const STRUCT_ENTRY *e,
-		TC_HANDLE_T *handle)
+static void
+free_pending(struct pending *p)
 {
-	struct chain_cache *c;
-	STRUCT_ENTRY_TARGET old;
-	int ret;
-
-	arptc_fn = TC_APPEND_ENTRY;
-	if (!(c = find_label(chain, *handle))) {
-		errno = ENOENT;
-		return 0;
-	}
+	if (!p)
+		return;
+	free(p->rule);
+	free(p->rules);
+	free(p);
+}
 
-	if (!map_target(*handle, (STRUCT_ENTRY *)e,
-			entry2offset(*handle, c->end), &old))
-		return 0;
+static void
+free_reload(struct reload *r)
+{
+	if (!r)
+		return;
+	free(r->rule);
+	free(r->rules);
+	free(r);
+}
 
-	ret = insert_rules(1, e->next_offset, e,
-			   entry2offset(*handle, c->end),
-			   entry2index(*handle, c->end),
-			   0, handle);
+/* Write a rule the way a caller passes it in: no counters, and a
+   standard target by name rather than by verdict. */
+static void
+normalize_rule(STRUCT_ENTRY *e, const char *target)
+{
+	STRUCT_STANDARD_TARGET *t = (void *)GET_TARGET(e);
+
+	e->comefrom = 0;
+	memset(&e->counters, 0, sizeof(e->counters));
+	if (target) {
+		memset(t->target.u.user.name, 0,
+		       sizeof(t->target.u.user.name));
+		memcpy(t->target.u.user.name, target,
+		       strnlen(target, sizeof(t->target.u.user.name) - 1));
+		t->verdict = 0;
+	}
+}
+
+static uint64_t
+reload_hash(const char *chain, const STRUCT_ENTRY *e)
+{
+	return hash_bytes(hash_bytes(0xcbf29ce484222325ULL, chain,
+				     strlen(chain)),
+			  e, e->next_offset);
+}
+
+/* Claim the flushed rule of `chain' identical to `e', whose standard
+   target (if any) is called `target'.  NULL if there is none. */
+static struct reload_rule *
+reload_take(TC_HANDLE_T h, const char *chain, const STRUCT_ENTRY *e,
+	    const char *target)
+{
+	struct reload *r = h->reload;
+	STRUCT_ENTRY *copy;
+	unsigned int lo = 0, hi;
+	uint64_t hash;
+
+	/* Only counters are at stake: give up quietly without memory. */
+	if (!r || !(copy = malloc(e->next_offset)))
+		return NULL;
+	memcpy(copy, e, e->next_offset);
+	normalize_rule(copy, target);
+	hash = reload_hash(chain, copy);
+
+	for (hi = r->num; lo < hi; ) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (r->rule[mid].hash < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < r->num && r->rule[lo].hash == hash; lo++) {
+		struct reload_rule *rr = &r->rule[lo];
+
+		if (!rr->taken && rr->size == copy->next_offset
+		    && strcmp(rr->chain, chain) == 0
+		    && memcmp(r->rules + rr->pos, copy, rr->size) == 0) {
+			rr->taken = 1;
+			free(copy);
+			return rr;
+		}
+	}
+	free(copy);
+	return NULL;
+}
+
+/* Queue a mapped copy of `e' for the chain end at `offset'.  It gets
+   the counters of `old', a flushed rule, or else its own. */
+static int
+queue_append(TC_HANDLE_T h, const STRUCT_ENTRY *e, unsigned int offset,
+	     int fallthrough, const struct reload_rule *old)
+{
+	STRUCT_ENTRY *copy;
+	struct pending *p = h->pending;
+	void *new;
+
+	if (!p && !(p = h->pending = calloc(1, sizeof(*p))))
+		goto nomem;
+
+	if (p->num == p->num_alloc) {
+		unsigned int n = p->num_alloc ? p->num_alloc * 2 : 64;
+
+		if (!(new = realloc(p->rule, n * sizeof(*p->rule))))
+			goto nomem;
+		p->rule = new;
+		p->num_alloc = n;
+	}
+	if (p->size + e->next_offset > p->size_alloc) {
+		unsigned int n = p->size_alloc ? p->size_alloc : 8192;
+
+		while (n < p->size + e->next_offset)
+			n *= 2;
+		if (!(new = realloc(p->rules, n)))
+			goto nomem;
+		p->rules = new;
+		p->size_alloc = n;
+	}
+
+	p->rule[p->num] = (struct pending_rule){ offset, p->size,
+						 fallthrough,
+						 { COUNTER_MAP_SET, 0 } };
+	copy = memcpy(p->rules + p->size, e, e->next_offset);
+	if (old) {
+		p->rule[p->num].map = old->map;
+		copy->counters = old->counters;
+	}
+	p->num++;
+	p->size += e->next_offset;
+	h->changed = 1;
+	return 1;
+
+ nomem:
+	errno = ENOMEM;
+	return 0;
+}
+
+static int
+pending_cmp(const void *a, const void *b)
+{
+	const struct pending_rule *x = a, *y = b;
+
+	if (x->offset != y->offset)
+		return (x->offset > y->offset) - (x->offset < y->offset);
+	return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+/* How many queued rules go before old offset `off' (or at it, too,
+   if `at').  The queue is sorted by offset. */
+static unsigned int
+pending_before(const struct pending *p, unsigned int off, int at)
+{
+	unsigned int lo = 0, hi = p->num;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (p->rule[mid].offset < off
+		    || (at && p->rule[mid].offset == off))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Move a jump by the bytes merged in before its destination.  As in
+   correct_verdict(), rules merged in at the destination itself come
+   after the jump lands. */
+static void
+shift_verdict(STRUCT_ENTRY *e, const struct pending *p,
+	      const unsigned int *bytes)
+{
+	STRUCT_STANDARD_TARGET *t = (void *)GET_TARGET(e);
+
+	if (strcmp(t->target.u.user.name, STANDARD_TARGET) == 0
+	    && t->verdict >= 0)
+		t->verdict += bytes[pending_before(p, t->verdict, 0)];
+}
+
+/* Write the queued appends into the table: one pass, one new handle. */
+static int
+merge_pending(TC_HANDLE_T *handle)
+{
+	TC_HANDLE_T h = *handle, newh;
+	struct pending *p = h->pending;
+	unsigned int *bytes, i, j, off, newoff, old_rule, new_rule;
+	STRUCT_ENTRY *e;
+
+	qsort(p->rule, p->num, sizeof(*p->rule), pending_cmp);
+
+	/* bytes[i]: size of the first i queued rules. */
+	bytes = malloc((p->num + 1) * sizeof(*bytes));
+	if (!bytes) {
+		errno = ENOMEM;
+		return 0;
+	}
+	bytes[0] = 0;
+	for (i = 0; i < p->num; i++)
+		bytes[i + 1] = bytes[i]
+			+ ((STRUCT_ENTRY *)(p->rules + p->rule[i].pos))
+				->next_offset;
+
+	newh = alloc_handle(h->info.name, h->entries.size + p->size,
+			    h->new_number + p->num);
+	if (!newh) {
+		free(bytes);
+		return 0;
+	}
+	newh->info = h->info;
+
+	/* Entry points stay at the start of their chain, underflows
+	   follow the policy to the end. */
+	for (i = 0; i < RUNTIME_NF_ARP_NUMHOOKS; i++) {
+		newh->info.hook_entry[i]
+			+= bytes[pending_before(p, h->info.hook_entry[i], 0)];
+		newh->info.underflow[i]
+			+= bytes[pending_before(p, h->info.underflow[i], 1)];
+	}
+
+	off = newoff = old_rule = new_rule = j = 0;
+	while (off < h->entries.size) {
+		for (; j < p->num && p->rule[j].offset == off; j++) {
+			e = (void *)newh->entries.entrytable + newoff;
+			memcpy(e, p->rules + p->rule[j].pos,
+			       ((STRUCT_ENTRY *)(p->rules + p->rule[j].pos))
+					->next_offset);
+			if (p->rule[j].fallthrough)
+				((STRUCT_STANDARD_TARGET *)GET_TARGET(e))
+					->verdict = newoff + e->next_offset;
+			else
+				shift_verdict(e, p, bytes);
+			newh->counter_map[new_rule++] = p->rule[j].map;
+			newoff += e->next_offset;
+		}
+
+		e = (void *)newh->entries.entrytable + newoff;
+		memcpy(e, get_entry(h, off), get_entry(h, off)->next_offset);
+		shift_verdict(e, p, bytes);
+		newh->counter_map[new_rule++] = h->counter_map[old_rule++];
+		off += e->next_offset;
+		newoff += e->next_offset;
+	}
+	free(bytes);
+
+	newh->new_number = new_rule;
+	newh->entries.size = newoff;
+	newh->hooknames = h->hooknames;
+	newh->num_owned = h->num_owned;
+	newh->owned = h->owned;
+	newh->init_hash = h->init_hash;
+	newh->stale_counters = h->stale_counters;
+	newh->reload = h->reload;
+
+	if (h->cache_chain_heads)
+		free(h->cache_chain_heads);
+	free_query(h);
+	free_pending(p);
+	free(h);
+	*handle = newh;
+
+	set_changed(newh);
+	return 1;
+}
+
+/* Append entry `fw' to chain `chain'.  Equivalent to insert with
+   rulenum = length of chain, but only queued: the next call that
+   needs the entries merges every queued append at once. */
+int
+TC_APPEND_ENTRY(const ARPT_CHAINLABEL chain,
+		const STRUCT_ENTRY *e,
+		TC_HANDLE_T *handle)
+{
+	struct chain_cache *c;
+	STRUCT_ENTRY_TARGET old;
+	struct reload_rule *taken = NULL;
+	unsigned int offset;
+	int ret;
+
+	/* Queued appends keep the chain cache valid; unpacking is all
+	   that is needed here. */
+	if ((*handle)->compact && !unpack(handle))
+		return 0;
+
+	arptc_fn = TC_APPEND_ENTRY;
+	if (!(c = find_label(chain, *handle))) {
+		errno = ENOENT;
+		return 0;
+	}
+
+	offset = entry2offset(*handle, c->end);
+	if (!map_target(*handle, (STRUCT_ENTRY *)e, offset, &old))
+		return 0;
+
+	if ((*handle)->reload)
+		taken = reload_take(*handle, chain, e,
+				    strcmp(GET_TARGET((STRUCT_ENTRY *)e)
+					   ->u.user.name, STANDARD_TARGET)
+				    == 0 ? old.u.user.name : NULL);
+
+	ret = queue_append(*handle, e, offset,
+			   strcmp(old.u.user.name, "") == 0, taken);
 	unmap_target((STRUCT_ENTRY *)e, &old);
 	return ret;
 }
@@ -1052,6 +1893,8 @@ TC_DELETE_ENTRY(const ARPT_CHAINLABEL chain,
 	struct chain_cache *c;
 	STRUCT_ENTRY *e, *fw;
 
+	UNPACK(handle);
+
 	arptc_fn = TC_DELETE_ENTRY;
 	if (!(c = find_label(chain, *handle))) {
 		errno = ENOENT;
@@ -1108,6 +1951,8 @@ TC_DELETE_NUM_ENTRY(const ARPT_CHAINLABEL chain,
 	STRUCT_ENTRY *e;
 	struct chain_cache *c;
 
+	UNPACK(handle);
+
 	arptc_fn = TC_DELETE_NUM_ENTRY;
 	if (!(c = find_label(chain, *handle))) {
 		errno = ENOENT;
@@ -1151,6 +1996,8 @@ TC_FLUSH_ENTRIES(const ARPT_CHAINLABEL chain, TC_HANDLE_T *handle)
 	struct chain_cache *c;
 	int ret;
 
+	UNPACK(handle);
+
 	arptc_fn = TC_FLUSH_ENTRIES;
 	if (!(c = find_label(chain, *handle))) {
 		errno = ENOENT;
@@ -1173,6 +2020,9 @@ TC_ZERO_ENTRIES(const ARPT_CHAINLABEL chain, TC_HANDLE_T *handle)
 	unsigned int i, end;
 	struct chain_cache *c;
 
+	UNPACK(handle);
+	FRESH(handle);
+
 	if (!(c = find_label(chain, *handle))) {
 		errno = ENOENT;
 		return 0;
@@ -1199,6 +2049,9 @@ TC_READ_COUNTER(const ARPT_CHAINLABEL chain,
 	struct chain_cache *c;
 	unsigned int chainindex, end;
 
+	UNPACK(handle);
+	FRESH(handle);
+
 	arptc_fn = TC_READ_COUNTER;
 	CHECK(*handle);
 
@@ -1228,6 +2081,9 @@ TC_ZERO_COUNTER(const ARPT_CHAINLABEL chain,
 	struct chain_cache *c;
 	unsigned int chainindex, end;
 	
+	UNPACK(handle);
+	FRESH(handle);
+
 	arptc_fn = TC_ZERO_COUNTER;
 	CHECK(*handle);
 
@@ -1265,6 +2121,8 @@ TC_SET_COUNTER(const ARPT_CHAINLABEL chain,
 	struct chain_cache *c;
 	unsigned int chainindex, end;
 
+	UNPACK(handle);
+
 	arptc_fn = TC_SET_COUNTER;
 	CHECK(*handle);
 
@@ -1307,6 +2165,8 @@ TC_CREATE_CHAIN(const ARPT_CHAINLABEL chain, TC_HANDLE_T *handle)
 		STRUCT_STANDARD_TARGET target;
 	} newc;
 
+	UNPACK(handle);
+
 	arptc_fn = TC_CREATE_CHAIN;
 
 	/* find_label doesn't cover built-in targets: DROP, ACCEPT,
@@ -1373,6 +2233,8 @@ TC_GET_REFERENCES(unsigned int *ref, const ARPT_CHAINLABEL chain,
 {
 	struct chain_cache *c;
 
+	UNPACK(handle);
+
 	if (!(c = find_label(chain, *handle))) {
 		errno = ENOENT;
 		return 0;
@@ -1439,6 +2301,8 @@ int TC_RENAME_CHAIN(const ARPT_CHAINLABEL oldname,
 	struct chain_cache *c;
 	struct arpt_error_target *t;
 
+	UNPACK(handle);
+
 	arptc_fn = TC_RENAME_CHAIN;
 
 	/* find_label doesn't cover built-in targets: DROP, ACCEPT,
@@ -1489,6 +2353,8 @@ TC_SET_POLICY(const ARPT_CHAINLABEL chain,
 	STRUCT_ENTRY *e;
 	STRUCT_STANDARD_TARGET *t;
 
+	UNPACK(handle);
+
 	arptc_fn = TC_SET_POLICY;
 	/* Figure out which chain. */
 	hook = TC_BUILTIN(chain, *handle);
@@ -1551,168 +2417,3705 @@ subtract_counters(STRUCT_COUNTERS *answer,
 	answer->bcnt = a->bcnt - b->bcnt;
 }
 
-int
-TC_COMMIT(TC_HANDLE_T *handle)
+/* Compact handles.  An idle handle can trade its entries for a packed
+ * copy: per rule a varint bitmap of the fields that aren't zero, then
+ * just those fields, then the index of its target in a table of
+ * distinct targets.  Interface name/mask pairs are interned the same
+ * way.  Packing is lossless: a rule that doesn't unpack to the same
+ * bytes is stored raw.  Fallthrough verdicts are stored relative to
+ * the rule, so they intern like any other target.  Any call that
+ * needs the entries unpacks the handle again; a commit unpacks
+ * straight into the replace buffer. */
+#define CF_SRC		(1 << 0)
+#define CF_SMSK		(1 << 1)
+#define CF_SRC_DEV	(1 << 2)
+#define CF_COUNTERS	(1 << 3)
+#define CF_TGT		(1 << 4)
+#define CF_TMSK		(1 << 5)
+#define CF_TGT_DEV	(1 << 6)
+#define CF_IFACES	(1 << 7)
+#define CF_ARPOP	(1 << 8)
+#define CF_ARHRD	(1 << 9)
+#define CF_ARPRO	(1 << 10)
+#define CF_ARHLN	(1 << 11)
+#define CF_FLAGS	(1 << 12)
+#define CF_COMEFROM	(1 << 13)
+#define CF_ELEMS	(1 << 14)
+#define CF_NEXT		(1 << 15)
+#define CF_RAW		(1 << 16)
+#define CF_FALLTHROUGH	(1 << 17)
+
+struct compact_iface
 {
-	/* Replace, then map back the counters. */
-	STRUCT_REPLACE *repl;
-	STRUCT_COUNTERS_INFO *newcounters;
-	unsigned int i;
-	size_t counterlen
-		= sizeof(STRUCT_COUNTERS_INFO)
-		+ sizeof(STRUCT_COUNTERS) * (*handle)->new_number;
-	int sizeof_repl = sizeof(*repl);
+	char name[IFNAMSIZ];
+	unsigned char mask[IFNAMSIZ];
+};
 
-	CHECK(*handle);
-#if 0
-	TC_DUMP_ENTRIES(*handle);
-#endif
+struct compact_chain
+{
+	char name[TABLE_MAXNAMELEN];
+};
 
-	/* Don't commit if nothing changed. */
-	if (!(*handle)->changed)
-		goto finished;
+struct compact
+{
+	unsigned int len;
+	unsigned char *rules;
 
-	/* allocate a bit more than needed for ease */
-	repl = malloc(2 * sizeof(*repl) + (*handle)->entries.size);
-	if (!repl) {
-		errno = ENOMEM;
-		return 0;
-	}
+	/* Distinct targets, back to back. */
+	unsigned int num_targets;
+	unsigned int *target_off;
+	unsigned char *targets;
 
-	/* These are the old counters we will get from kernel */
-	repl->counters = malloc(sizeof(STRUCT_COUNTERS)
-				* (*handle)->info.num_entries);
-	if (!repl->counters) {
-		free(repl);
-		errno = ENOMEM;
-		return 0;
-	}
+	unsigned int num_ifaces;
+	struct compact_iface *ifaces;
 
-	/* These are the counters we're going to put back, later. */
-	newcounters = malloc(counterlen);
-	if (!newcounters) {
-		free(repl->counters);
-		free(repl);
-		errno = ENOMEM;
-		return 0;
-	}
+	/* Enough to answer TC_IS_CHAIN without unpacking. */
+	unsigned int num_chains;
+	struct compact_chain *chains;
+};
 
-	strcpy(repl->name, (*handle)->info.name);
-	repl->num_entries = (*handle)->new_number;
-	repl->size = (*handle)->entries.size;
-	memcpy(repl->hook_entry, (*handle)->info.hook_entry,
-	       sizeof(repl->hook_entry));
-	memcpy(repl->underflow, (*handle)->info.underflow,
-	       sizeof(repl->underflow));
-	repl->num_counters = (*handle)->info.num_entries;
-	repl->valid_hooks = (*handle)->info.valid_hooks;
-	memcpy(repl->entries, (*handle)->entries.entrytable,
-	       (*handle)->entries.size);
+/* Growable byte buffer. */
+struct cbuf
+{
+	unsigned int len, size;
+	unsigned char *data;
+};
 
-	if (RUNTIME_NF_ARP_NUMHOOKS == 2) {
-		memmove(&(repl->underflow[2]), &(repl->underflow[3]),
-		((*handle)->entries.size) + sizeof(struct arpt_replace));
-		memmove(&(repl->hook_entry[2]), &(repl->hook_entry[3]),
-		((*handle)->entries.size) + sizeof(struct arpt_replace));
-		sizeof_repl -= 2 * sizeof(unsigned int);
+/* Make room for `len' more bytes. */
+static int
+cbuf_room(struct cbuf *b, unsigned int len)
+{
+	if (b->len + len > b->size) {
+		unsigned int size = b->size ? b->size : 256;
+		unsigned char *d;
+
+		while (size < b->len + len)
+			size *= 2;
+		d = realloc(b->data, size);
+		if (!d) {
+			errno = ENOMEM;
+			return 0;
+		}
+		b->data = d;
+		b->size = size;
 	}
+	return 1;
+}
 
-	if (setsockopt(sockfd, TC_IPPROTO, SO_SET_REPLACE, repl,
-		       sizeof_repl + (*handle)->entries.size) < 0) {
-		free(repl->counters);
-		free(repl);
-		free(newcounters);
+static int
+cbuf_put(struct cbuf *b, const void *data, unsigned int len)
+{
+	if (!cbuf_room(b, len))
 		return 0;
-	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+	return 1;
+}
 
-	if (RUNTIME_NF_ARP_NUMHOOKS == 2) {
-		memmove(&(repl->hook_entry[3]), &(repl->hook_entry[2]),
-		((*handle)->entries.size) + sizeof(struct arpt_replace));
-		memmove(&(repl->underflow[3]), &(repl->underflow[2]),
-		((*handle)->entries.size) + sizeof(struct arpt_replace));
+static int
+put_varint(struct cbuf *b, uint64_t v)
+{
+	unsigned char buf[10];
+	unsigned int n = 0;
+
+	while (v >= 0x80) {
+		buf[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
 	}
+	buf[n++] = v;
+	return cbuf_put(b, buf, n);
+}
 
-	/* Put counters back. */
-	strcpy(newcounters->name, (*handle)->info.name);
-	newcounters->num_counters = (*handle)->new_number;
-	for (i = 0; i < (*handle)->new_number; i++) {
-		unsigned int mappos = (*handle)->counter_map[i].mappos;
-		switch ((*handle)->counter_map[i].maptype) {
-		case COUNTER_MAP_NOMAP:
-			newcounters->counters[i]
-				= ((STRUCT_COUNTERS){ 0, 0 });
-			break;
+static uint64_t
+get_varint(const unsigned char **p)
+{
+	uint64_t v = 0;
+	unsigned int shift = 0;
 
-		case COUNTER_MAP_NORMAL_MAP:
-			/* Original read: X.
-			 * Atomic read on replacement: X + Y.
-			 * Currently in kernel: Z.
-			 * Want in kernel: X + Y + Z.
-			 * => Add in X + Y
-			 * => Add in replacement read.
-			 */
-			newcounters->counters[i] = repl->counters[mappos];
-			break;
+	while (**p & 0x80) {
+		v |= (uint64_t)(*(*p)++ & 0x7f) << shift;
+		shift += 7;
+	}
+	return v | (uint64_t)*(*p)++ << shift;
+}
 
-		case COUNTER_MAP_ZEROED:
-			/* Original read: X.
-			 * Atomic read on replacement: X + Y.
-			 * Currently in kernel: Z.
-			 * Want in kernel: Y + Z.
-			 * => Add in Y.
-			 * => Add in (replacement read - original read).
-			 */
-			subtract_counters(&newcounters->counters[i],
-					  &repl->counters[mappos],
-					  &index2entry(*handle, i)->counters);
-			break;
+/* Open-addressed set of blob indices, for interning. */
+struct intern
+{
+	unsigned int size;
+	unsigned int *slot;	/* index + 1, 0 = empty */
+};
 
-		case COUNTER_MAP_SET:
-			/* Want to set counter (iptables-restore) */
+static int
+intern_blob(struct intern *in, struct cbuf *blobs, unsigned int **off,
+	    unsigned int *num, const void *blob, unsigned int len)
+{
+	unsigned int i, h;
 
-			memcpy(&newcounters->counters[i],
-			       &index2entry(*handle, i)->counters,
-			       sizeof(STRUCT_COUNTERS));
+	if (*num * 2 >= in->size) {
+		unsigned int size = in->size ? in->size * 2 : 64;
+		unsigned int *slot = calloc(size, sizeof(*slot));
 
-			break;
+		if (!slot) {
+			errno = ENOMEM;
+			return -1;
 		}
+		for (i = 0; i < in->size; i++) {
+			unsigned int idx = in->slot[i];
+			unsigned int olen;
+
+			if (!idx)
+				continue;
+			olen = (idx < *num ? (*off)[idx] : blobs->len)
+				- (*off)[idx - 1];
+			h = hash_bytes(0, blobs->data + (*off)[idx - 1], olen)
+				& (size - 1);
+			while (slot[h])
+				h = (h + 1) & (size - 1);
+			slot[h] = idx;
+		}
+		free(in->slot);
+		in->slot = slot;
+		in->size = size;
 	}
 
-#ifdef KERNEL_64_USERSPACE_32
-	{
-		/* Kernel will think that pointer should be 64-bits, and get
-		   padding.  So we accomodate here (assumption: alignment of
-		   `counters' is on 64-bit boundary). */
-		uint64_t *kernptr = (uint64_t *)&newcounters->counters;
-		if ((unsigned long)&newcounters->counters % 8 != 0) {
-			fprintf(stderr,
-				"counters alignment incorrect! Mail rusty!\n");
-			abort();
-		}
-		*kernptr = newcounters->counters;
+	for (h = hash_bytes(0, blob, len) & (in->size - 1); in->slot[h];
+	     h = (h + 1) & (in->size - 1)) {
+		unsigned int idx = in->slot[h];
+		unsigned int olen = (idx < *num ? (*off)[idx] : blobs->len)
+			- (*off)[idx - 1];
+
+		if (olen == len
+		    && memcmp(blobs->data + (*off)[idx - 1], blob, len) == 0)
+			return idx - 1;
 	}
-#endif /* KERNEL_64_USERSPACE_32 */
 
-	if (setsockopt(sockfd, TC_IPPROTO, SO_SET_ADD_COUNTERS,
-		       newcounters, counterlen) < 0) {
-		free(repl->counters);
-		free(repl);
-		free(newcounters);
-		return 0;
+	if ((*num & (*num - 1)) == 0) {
+		unsigned int *o = realloc(*off, (*num ? *num * 2 : 1)
+					  * sizeof(*o));
+		if (!o) {
+			errno = ENOMEM;
+			return -1;
+		}
+		*off = o;
 	}
+	(*off)[*num] = blobs->len;
+	if (!cbuf_put(blobs, blob, len))
+		return -1;
+	in->slot[h] = ++*num;
+	return *num - 1;
+}
 
-	free(repl->counters);
-	free(repl);
-	free(newcounters);
+static inline const STRUCT_ENTRY_TARGET *
+compact_target(const struct compact *c, unsigned int idx)
+{
+	return (const STRUCT_ENTRY_TARGET *)(c->targets + c->target_off[idx]);
+}
 
- finished:
-	if ((*handle)->cache_chain_heads)
+static int
+compact_is_chain(const char *chain, const struct compact *c)
+{
+	unsigned int i;
+
+	for (i = 0; i < c->num_chains; i++)
+		if (strcmp(c->chains[i].name, chain) == 0)
+			return 1;
+	return 0;
+}
+
+static int
+mask_prefix(uint32_t mask)
+{
+	unsigned int bits;
+
+	for (bits = 0; bits < 32 && (mask & (0x80000000U >> bits)); bits++);
+	return bits < 32 && (mask << bits) ? -1 : (int)bits;
+}
+
+static unsigned int
+devaddr_len(const struct arpt_devaddr_info *d)
+{
+	unsigned int n;
+
+	for (n = ARPT_DEV_ADDR_LEN_MAX; n > 0; n--)
+		if (d->addr[n - 1] || d->mask[n - 1])
+			break;
+	return n;
+}
+
+/* Unpack one rule at *p into `e', `off' bytes into the table; returns
+   its size. */
+static unsigned int
+decode_entry(const struct compact *c, const unsigned char **p,
+	     STRUCT_ENTRY *e, unsigned int off)
+{
+	const STRUCT_ENTRY_TARGET *t;
+	uint64_t bits = get_varint(p);
+	unsigned int n, toff, next;
+
+	if (bits & CF_RAW) {
+		n = get_varint(p);
+		memcpy(e, *p, n);
+		*p += n;
+		return n;
+	}
+
+	memset(e, 0, sizeof(*e));
+	if (bits & CF_SRC) {
+		memcpy(&e->arp.src, *p, 4);
+		*p += 4;
+	}
+	if (bits & CF_SMSK) {
+		if (**p == 0xff) {
+			memcpy(&e->arp.smsk, *p + 1, 4);
+			*p += 5;
+		} else
+			e->arp.smsk.s_addr = htonl(~0U << (32 - *(*p)++));
+	}
+	if (bits & CF_SRC_DEV) {
+		n = *(*p)++;
+		memcpy(e->arp.src_devaddr.addr, *p, n);
+		memcpy(e->arp.src_devaddr.mask, *p + n, n);
+		*p += 2 * n;
+	}
+	if (bits & CF_COUNTERS) {
+		e->counters.pcnt = get_varint(p);
+		e->counters.bcnt = get_varint(p);
+	}
+	if (bits & CF_TGT) {
+		memcpy(&e->arp.tgt, *p, 4);
+		*p += 4;
+	}
+	if (bits & CF_TMSK) {
+		if (**p == 0xff) {
+			memcpy(&e->arp.tmsk, *p + 1, 4);
+			*p += 5;
+		} else
+			e->arp.tmsk.s_addr = htonl(~0U << (32 - *(*p)++));
+	}
+	if (bits & CF_TGT_DEV) {
+		n = *(*p)++;
+		memcpy(e->arp.tgt_devaddr.addr, *p, n);
+		memcpy(e->arp.tgt_devaddr.mask, *p + n, n);
+		*p += 2 * n;
+	}
+	if (bits & CF_IFACES) {
+		const struct compact_iface *in, *out;
+
+		in = &c->ifaces[get_varint(p)];
+		out = &c->ifaces[get_varint(p)];
+		memcpy(e->arp.iniface, in->name, IFNAMSIZ);
+		memcpy(e->arp.iniface_mask, in->mask, IFNAMSIZ);
+		memcpy(e->arp.outiface, out->name, IFNAMSIZ);
+		memcpy(e->arp.outiface_mask, out->mask, IFNAMSIZ);
+	}
+	if (bits & CF_ARPOP) {
+		memcpy(&e->arp.arpop, *p, 2);
+		memcpy(&e->arp.arpop_mask, *p + 2, 2);
+		*p += 4;
+	}
+	if (bits & CF_ARHRD) {
+		memcpy(&e->arp.arhrd, *p, 2);
+		memcpy(&e->arp.arhrd_mask, *p + 2, 2);
+		*p += 4;
+	}
+	if (bits & CF_ARPRO) {
+		memcpy(&e->arp.arpro, *p, 2);
+		memcpy(&e->arp.arpro_mask, *p + 2, 2);
+		*p += 4;
+	}
+	if (bits & CF_ARHLN) {
+		e->arp.arhln = (*p)[0];
+		e->arp.arhln_mask = (*p)[1];
+		*p += 2;
+	}
+	if (bits & CF_FLAGS) {
+		e->arp.flags = (*p)[0];
+		memcpy(&e->arp.invflags, *p + 1, 2);
+		*p += 3;
+	}
+	if (bits & CF_COMEFROM) {
+		memcpy(&e->comefrom, *p, 4);
+		*p += 4;
+	}
+
+	toff = sizeof(STRUCT_ENTRY);
+	if (bits & CF_ELEMS) {
+		toff = get_varint(p);
+		memcpy(e->elems, *p, toff - sizeof(STRUCT_ENTRY));
+		*p += toff - sizeof(STRUCT_ENTRY);
+	}
+	t = compact_target(c, get_varint(p));
+	next = toff + t->u.target_size;
+	if (bits & CF_NEXT)
+		next = get_varint(p);
+
+	e->target_offset = toff;
+	e->next_offset = next;
+	memcpy((char *)e + toff, t, t->u.target_size);
+	if (bits & CF_FALLTHROUGH)
+		((STRUCT_STANDARD_TARGET *)((char *)e + toff))->verdict
+			= off + next;
+	if (next > toff + t->u.target_size)
+		memset((char *)e + toff + t->u.target_size, 0,
+		       next - toff - t->u.target_size);
+	return next;
+}
+
+struct compact_build
+{
+	struct compact *c;
+	struct cbuf rules, targets, ifaces;
+	struct intern target_set, iface_set;
+	unsigned int *iface_off;
+	STRUCT_ENTRY *scratch;
+	const void *base;
+};
+
+static int
+intern_iface(struct compact_build *b, const char *name,
+	     const unsigned char *mask)
+{
+	struct compact_iface i;
+
+	memcpy(i.name, name, IFNAMSIZ);
+	memcpy(i.mask, mask, IFNAMSIZ);
+	return intern_blob(&b->iface_set, &b->ifaces, &b->iface_off,
+			   &b->c->num_ifaces, &i, sizeof(i));
+}
+
+static int
+encode_fields(struct compact_build *b, const STRUCT_ENTRY *e)
+{
+	const STRUCT_ENTRY_TARGET *t;
+	STRUCT_STANDARD_TARGET fall;
+	struct cbuf *r = &b->rules;
+	uint64_t bits = 0;
+	unsigned int n, sdev, tdev;
+	int smsk, tmsk, in = 0, out = 0, target;
+
+	t = (const STRUCT_ENTRY_TARGET *)((const char *)e + e->target_offset);
+	if (e->target_offset < sizeof(STRUCT_ENTRY)
+	    || e->target_offset + t->u.target_size > e->next_offset)
+		return 0;
+
+	smsk = mask_prefix(ntohl(e->arp.smsk.s_addr));
+	tmsk = mask_prefix(ntohl(e->arp.tmsk.s_addr));
+	sdev = devaddr_len(&e->arp.src_devaddr);
+	tdev = devaddr_len(&e->arp.tgt_devaddr);
+
+	if (e->arp.src.s_addr)
+		bits |= CF_SRC;
+	if (e->arp.smsk.s_addr)
+		bits |= CF_SMSK;
+	if (sdev)
+		bits |= CF_SRC_DEV;
+	if (e->counters.pcnt || e->counters.bcnt)
+		bits |= CF_COUNTERS;
+	if (e->arp.tgt.s_addr)
+		bits |= CF_TGT;
+	if (e->arp.tmsk.s_addr)
+		bits |= CF_TMSK;
+	if (tdev)
+		bits |= CF_TGT_DEV;
+	if (e->arp.iniface[0] || e->arp.iniface_mask[0]
+	    || e->arp.outiface[0] || e->arp.outiface_mask[0]) {
+		bits |= CF_IFACES;
+		in = intern_iface(b, e->arp.iniface, e->arp.iniface_mask);
+		out = intern_iface(b, e->arp.outiface, e->arp.outiface_mask);
+		if (in < 0 || out < 0)
+			return -1;
+	}
+	if (e->arp.arpop || e->arp.arpop_mask)
+		bits |= CF_ARPOP;
+	if (e->arp.arhrd || e->arp.arhrd_mask)
+		bits |= CF_ARHRD;
+	if (e->arp.arpro || e->arp.arpro_mask)
+		bits |= CF_ARPRO;
+	if (e->arp.arhln || e->arp.arhln_mask)
+		bits |= CF_ARHLN;
+	if (e->arp.flags || e->arp.invflags)
+		bits |= CF_FLAGS;
+	if (e->comefrom)
+		bits |= CF_COMEFROM;
+	if (e->target_offset != sizeof(STRUCT_ENTRY))
+		bits |= CF_ELEMS;
+	if (e->next_offset != e->target_offset + t->u.target_size)
+		bits |= CF_NEXT;
+	if (strcmp(t->u.user.name, STANDARD_TARGET) == 0
+	    && t->u.target_size == sizeof(fall)
+	    && ((const STRUCT_STANDARD_TARGET *)t)->verdict
+	       == (const void *)e - b->base + e->next_offset) {
+		bits |= CF_FALLTHROUGH;
+		memcpy(&fall, t, sizeof(fall));
+		fall.verdict = 0;
+		t = &fall.target;
+	}
+
+	target = intern_blob(&b->target_set, &b->targets, &b->c->target_off,
+			     &b->c->num_targets, t, t->u.target_size);
+	if (target < 0)
+		return -1;
+
+#define PUT(data, len) do { if (!cbuf_put(r, data, len)) return -1; } while(0)
+#define PUT_VARINT(v) do { if (!put_varint(r, v)) return -1; } while(0)
+	PUT_VARINT(bits);
+	if (bits & CF_SRC)
+		PUT(&e->arp.src, 4);
+	if (bits & CF_SMSK) {
+		unsigned char len = smsk < 0 ? 0xff : smsk;
+
+		PUT(&len, 1);
+		if (smsk < 0)
+			PUT(&e->arp.smsk, 4);
+	}
+	if (bits & CF_SRC_DEV) {
+		unsigned char len = sdev;
+
+		PUT(&len, 1);
+		PUT(e->arp.src_devaddr.addr, sdev);
+		PUT(e->arp.src_devaddr.mask, sdev);
+	}
+	if (bits & CF_COUNTERS) {
+		PUT_VARINT(e->counters.pcnt);
+		PUT_VARINT(e->counters.bcnt);
+	}
+	if (bits & CF_TGT)
+		PUT(&e->arp.tgt, 4);
+	if (bits & CF_TMSK) {
+		unsigned char len = tmsk < 0 ? 0xff : tmsk;
+
+		PUT(&len, 1);
+		if (tmsk < 0)
+			PUT(&e->arp.tmsk, 4);
+	}
+	if (bits & CF_TGT_DEV) {
+		unsigned char len = tdev;
+
+		PUT(&len, 1);
+		PUT(e->arp.tgt_devaddr.addr, tdev);
+		PUT(e->arp.tgt_devaddr.mask, tdev);
+	}
+	if (bits & CF_IFACES) {
+		PUT_VARINT(in);
+		PUT_VARINT(out);
+	}
+	if (bits & CF_ARPOP) {
+		PUT(&e->arp.arpop, 2);
+		PUT(&e->arp.arpop_mask, 2);
+	}
+	if (bits & CF_ARHRD) {
+		PUT(&e->arp.arhrd, 2);
+		PUT(&e->arp.arhrd_mask, 2);
+	}
+	if (bits & CF_ARPRO) {
+		PUT(&e->arp.arpro, 2);
+		PUT(&e->arp.arpro_mask, 2);
+	}
+	if (bits & CF_ARHLN) {
+		PUT(&e->arp.arhln, 1);
+		PUT(&e->arp.arhln_mask, 1);
+	}
+	if (bits & CF_FLAGS) {
+		PUT(&e->arp.flags, 1);
+		PUT(&e->arp.invflags, 2);
+	}
+	if (bits & CF_COMEFROM)
+		PUT(&e->comefrom, 4);
+	if (bits & CF_ELEMS) {
+		n = e->target_offset - sizeof(STRUCT_ENTRY);
+		PUT_VARINT(e->target_offset);
+		PUT(e->elems, n);
+	}
+	PUT_VARINT(target);
+	if (bits & CF_NEXT)
+		PUT_VARINT(e->next_offset);
+#undef PUT
+#undef PUT_VARINT
+
+	return 1;
+}
+
+static int
+encode_entry(const STRUCT_ENTRY *e, struct compact_build *b)
+{
+	const unsigned char *p;
+	unsigned int start = b->rules.len;
+	int ret;
+
+	ret = encode_fields(b, e);
+	if (ret < 0)
+		return 1;
+
+	/* The target table may have moved: point the decoder at it. */
+	b->c->targets = b->targets.data;
+	b->c->ifaces = (struct compact_iface *)b->ifaces.data;
+
+	if (ret) {
+		p = b->rules.data + start;
+		if (decode_entry(b->c, &p, b->scratch,
+				 (const void *)e - b->base) == e->next_offset
+		    && memcmp(b->scratch, e, e->next_offset) == 0)
+			return 0;
+	}
+
+	/* Odd one: keep it as it is. */
+	b->rules.len = start;
+	if (!put_varint(&b->rules, CF_RAW)
+	    || !put_varint(&b->rules, e->next_offset)
+	    || !cbuf_put(&b->rules, e, e->next_offset))
+		return 1;
+	return 0;
+}
+
+static void
+free_compact(struct compact *c)
+{
+	if (!c)
+		return;
+	free(c->rules);
+	free(c->target_off);
+	free(c->targets);
+	free(c->ifaces);
+	free(c->chains);
+	free(c);
+}
+
+/* Pack the handle's rules. */
+int
+TC_COMPACT(TC_HANDLE_T *handle)
+{
+	struct compact_build b;
+	TC_HANDLE_T h = *handle, newh;
+	unsigned int i;
+
+	arptc_fn = TC_COMPACT;
+
+	if (h->compact)
+		return 1;
+
+	if (h->pending) {
+		if (!merge_pending(handle))
+			return 0;
+		h = *handle;
+	}
+
+	if (h->cache_chain_heads == NULL && !populate_cache(h))
+		return 0;
+
+	memset(&b, 0, sizeof(b));
+	b.c = calloc(1, sizeof(*b.c));
+	b.scratch = malloc(0xffff);
+	if (!b.c || !b.scratch) {
+		errno = ENOMEM;
+		goto fail;
+	}
+
+	b.c->num_chains = h->cache_num_chains;
+	b.c->chains = malloc(h->cache_num_chains * sizeof(*b.c->chains));
+	if (!b.c->chains) {
+		errno = ENOMEM;
+		goto fail;
+	}
+	for (i = 0; i < h->cache_num_chains; i++)
+		memcpy(b.c->chains[i].name, h->cache_chain_heads[i].name,
+		       TABLE_MAXNAMELEN);
+
+	b.base = h->entries.entrytable;
+	if (ENTRY_ITERATE(h->entries.entrytable, h->entries.size,
+			  encode_entry, &b) != 0)
+		goto fail;
+
+	newh = malloc(sizeof(STRUCT_TC_HANDLE)
+		      + h->new_number * sizeof(struct counter_map));
+	if (!newh) {
+		errno = ENOMEM;
+		goto fail;
+	}
+
+	/* Trim the buffers to size. */
+	b.c->len = b.rules.len;
+	b.c->rules = realloc(b.rules.data, b.rules.len ? b.rules.len : 1);
+	b.c->targets = realloc(b.targets.data,
+			       b.targets.len ? b.targets.len : 1);
+	b.c->ifaces = realloc(b.ifaces.data, b.ifaces.len ? b.ifaces.len : 1);
+	free(b.target_set.slot);
+	free(b.iface_set.slot);
+	free(b.iface_off);
+	free(b.scratch);
+
+	*newh = *h;
+	newh->counter_map = (void *)newh + sizeof(STRUCT_TC_HANDLE);
+	memcpy(newh->counter_map, h->counter_map,
+	       h->new_number * sizeof(struct counter_map));
+	newh->cache_chain_heads = NULL;
+	newh->cache_num_chains = 0;
+	newh->cache_chain_iteration = NULL;
+	newh->cache_rule_end = NULL;
+	newh->query = NULL;
+	newh->compact = b.c;
+
+	if (h->cache_chain_heads)
+		free(h->cache_chain_heads);
+	free_query(h);
+	free(h);
+	*handle = newh;
+	return 1;
+
+ fail:
+	free(b.rules.data);
+	free(b.targets.data);
+	free(b.ifaces.data);
+	free(b.target_set.slot);
+	free(b.iface_set.slot);
+	free(b.iface_off);
+	free(b.scratch);
+	if (b.c) {
+		b.c->targets = NULL;
+		b.c->ifaces = NULL;
+		free_compact(b.c);
+	}
+	return 0;
+}
+
+/* Write out every rule of a compacted handle. */
+static void
+decode_rules(const struct compact *c, void *out)
+{
+	const unsigned char *p = c->rules, *end = c->rules + c->len;
+	unsigned int off = 0;
+
+	while (p < end)
+		off += decode_entry(c, &p, out + off, off);
+}
+
+static int
+unpack(TC_HANDLE_T *handle)
+{
+	TC_HANDLE_T newh;
+
+	newh = alloc_handle((*handle)->info.name, (*handle)->entries.size,
+			    (*handle)->new_number);
+	if (!newh)
+		return 0;
+
+	decode_rules((*handle)->compact, newh->entries.entrytable);
+	newh->entries.size = (*handle)->entries.size;
+	memcpy(newh->counter_map, (*handle)->counter_map,
+	       (*handle)->new_number * sizeof(struct counter_map));
+
+	newh->changed = (*handle)->changed;
+	newh->info = (*handle)->info;
+	newh->hooknames = (*handle)->hooknames;
+	newh->num_owned = (*handle)->num_owned;
+	newh->owned = (*handle)->owned;
+	newh->init_hash = (*handle)->init_hash;
+	newh->stale_counters = (*handle)->stale_counters;
+	newh->reload = (*handle)->reload;
+	newh->new_number = (*handle)->new_number;
+
+	free_compact((*handle)->compact);
+	free(*handle);
+	*handle = newh;
+	return 1;
+}
+
+/* The SO_SET_REPLACE argument for this handle's table, laid out for
+ * RUNTIME_NF_ARP_NUMHOOKS, with `counters' to take the old counters.
+ * *len is set to its length.  When the kernel has two hooks, the
+ * fields after them are moved down over the third: they are back in
+ * place, for reading the entries, after unshift_replace(). */
+static STRUCT_REPLACE *
+make_replace(const TC_HANDLE_T h, STRUCT_COUNTERS *counters, size_t *len)
+{
+	STRUCT_REPLACE *repl;
+
+	/* allocate a bit more than needed for ease */
+	repl = malloc(2 * sizeof(*repl) + h->entries.size);
+	if (!repl) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	strcpy(repl->name, h->info.name);
+	repl->num_entries = h->new_number;
+	repl->size = h->entries.size;
+	memcpy(repl->hook_entry, h->info.hook_entry,
+	       sizeof(repl->hook_entry));
+	memcpy(repl->underflow, h->info.underflow,
+	       sizeof(repl->underflow));
+	repl->num_counters = h->info.num_entries;
+	repl->counters = counters;
+	repl->valid_hooks = h->info.valid_hooks;
+	if (h->compact)
+		decode_rules(h->compact, repl->entries);
+	else
+		memcpy(repl->entries, h->entries.entrytable,
+		       h->entries.size);
+
+	*len = sizeof(*repl) + h->entries.size;
+	if (RUNTIME_NF_ARP_NUMHOOKS == 2) {
+		memmove(&(repl->underflow[2]), &(repl->underflow[3]),
+		(h->entries.size) + sizeof(struct arpt_replace));
+		memmove(&(repl->hook_entry[2]), &(repl->hook_entry[3]),
+		(h->entries.size) + sizeof(struct arpt_replace));
+		*len -= 2 * sizeof(unsigned int);
+	}
+	return repl;
+}
+
+static void
+unshift_replace(STRUCT_REPLACE *repl, unsigned int size)
+{
+	if (RUNTIME_NF_ARP_NUMHOOKS == 2) {
+		memmove(&(repl->hook_entry[3]), &(repl->hook_entry[2]),
+		size + sizeof(struct arpt_replace));
+		memmove(&(repl->underflow[3]), &(repl->underflow[2]),
+		size + sizeof(struct arpt_replace));
+	}
+}
+
+/* Replace the kernel table with this handle's, then map back the
+   counters.  The handle itself is left alone. */
+static int
+replace_table(TC_HANDLE_T *handle)
+{
+	/* Replace, then map back the counters. */
+	STRUCT_REPLACE *repl;
+	STRUCT_COUNTERS_INFO *newcounters;
+	STRUCT_COUNTERS *oldcounters;
+	STRUCT_ENTRY *e;
+	unsigned int i;
+	int cached;
+	size_t counterlen
+		= sizeof(STRUCT_COUNTERS_INFO)
+		+ sizeof(STRUCT_COUNTERS) * (*handle)->new_number;
+	size_t sizeof_repl;
+
+	/* These are the old counters we will get from kernel */
+	oldcounters = malloc(sizeof(STRUCT_COUNTERS)
+			     * (*handle)->info.num_entries);
+	if (!oldcounters) {
+		errno = ENOMEM;
+		return 0;
+	}
+
+	/* These are the counters we're going to put back, later. */
+	newcounters = malloc(counterlen);
+	if (!newcounters) {
+		free(oldcounters);
+		errno = ENOMEM;
+		return 0;
+	}
+
+	if (!(repl = make_replace(*handle, oldcounters, &sizeof_repl))) {
+		free(oldcounters);
+		free(newcounters);
+		return 0;
+	}
+
+	cached = drop_cache((*handle)->info.name);
+
+	if (setsockopt(sockfd, TC_IPPROTO, SO_SET_REPLACE, repl,
+		       sizeof_repl) < 0) {
+		free(oldcounters);
+		free(repl);
+		free(newcounters);
+		return 0;
+	}
+	unshift_replace(repl, (*handle)->entries.size);
+
+	/* Put counters back. */
+	strcpy(newcounters->name, (*handle)->info.name);
+	newcounters->num_counters = (*handle)->new_number;
+	e = (STRUCT_ENTRY *)repl->entries;
+	for (i = 0; i < (*handle)->new_number;
+	     i++, e = (void *)e + e->next_offset) {
+		unsigned int mappos = (*handle)->counter_map[i].mappos;
+		switch ((*handle)->counter_map[i].maptype) {
+		case COUNTER_MAP_NOMAP:
+			newcounters->counters[i]
+				= ((STRUCT_COUNTERS){ 0, 0 });
+			break;
+
+		case COUNTER_MAP_NORMAL_MAP:
+			/* Original read: X.
+			 * Atomic read on replacement: X + Y.
+			 * Currently in kernel: Z.
+			 * Want in kernel: X + Y + Z.
+			 * => Add in X + Y
+			 * => Add in replacement read.
+			 */
+			newcounters->counters[i] = repl->counters[mappos];
+			break;
+
+		case COUNTER_MAP_ZEROED:
+			/* Original read: X.
+			 * Atomic read on replacement: X + Y.
+			 * Currently in kernel: Z.
+			 * Want in kernel: Y + Z.
+			 * => Add in Y.
+			 * => Add in (replacement read - original read).
+			 */
+			subtract_counters(&newcounters->counters[i],
+					  &repl->counters[mappos],
+					  &e->counters);
+			break;
+
+		case COUNTER_MAP_SET:
+			/* Want to set counter (iptables-restore) */
+
+			memcpy(&newcounters->counters[i], &e->counters,
+			       sizeof(STRUCT_COUNTERS));
+
+			break;
+		}
+	}
+
+#ifdef KERNEL_64_USERSPACE_32
+	{
+		/* Kernel will think that pointer should be 64-bits, and get
+		   padding.  So we accomodate here (assumption: alignment of
+		   `counters' is on 64-bit boundary). */
+		uint64_t *kernptr = (uint64_t *)&newcounters->counters;
+		if ((unsigned long)&newcounters->counters % 8 != 0) {
+			fprintf(stderr,
+				"counters alignment incorrect! Mail rusty!\n");
+			abort();
+		}
+		*kernptr = newcounters->counters;
+	}
+#endif /* KERNEL_64_USERSPACE_32 */
+
+	if (setsockopt(sockfd, TC_IPPROTO, SO_SET_ADD_COUNTERS,
+		       newcounters, counterlen) < 0) {
+		free(repl->counters);
+		free(repl);
+		free(newcounters);
+		return 0;
+	}
+
+	free(repl->counters);
+	free(repl);
+	free(newcounters);
+
+	refresh_cache((*handle)->info.name, cached);
+	return 1;
+}
+
+/* Copy the rules (and policy) of `chain' in `h' over the same chain in
+   `newh'.  Jumps are carried over by name. */
+static int
+splice_chain(const char *chain, TC_HANDLE_T h, TC_HANDLE_T *newh)
+{
+	struct chain_cache *c;
+	STRUCT_ENTRY *e, *copy;
+	STRUCT_COUNTERS counters;
+	const char *policy;
+	int ret = 1;
+
+	if (!(c = find_label(chain, h))) {
+		errno = ENOENT;
+		return 0;
+	}
+
+	if (!TC_FLUSH_ENTRIES(chain, newh))
+		return 0;
+
+	for (e = c->start; ret && e != c->end; e = (void *)e + e->next_offset) {
+		STRUCT_ENTRY_TARGET *t;
+		unsigned int index;
+		const char *name;
+
+		if (!(copy = malloc(e->next_offset))) {
+			errno = ENOMEM;
+			return 0;
+		}
+		memcpy(copy, e, e->next_offset);
+
+		t = GET_TARGET(copy);
+		if (strcmp(t->u.user.name, STANDARD_TARGET) == 0) {
+			name = target_name(h, e);
+			/* The other writer may have removed it. */
+			if (find_label(name, h) && !find_label(name, *newh)) {
+				free(copy);
+				arptc_fn = TC_COMMIT;
+				errno = ENOENT;
+				return 0;
+			}
+			memset(t->u.user.name, 0, sizeof(t->u.user.name));
+			strncpy(t->u.user.name, name,
+				sizeof(t->u.user.name) - 1);
+		}
+
+		/* Counters can't be mapped across kernel tables: keep
+		   the values we read. */
+		index = entry2index(h, e);
+		if (h->counter_map[index].maptype == COUNTER_MAP_NOMAP
+		    || h->counter_map[index].maptype == COUNTER_MAP_ZEROED)
+			memset(&copy->counters, 0, sizeof(copy->counters));
+
+		ret = TC_APPEND_ENTRY(chain, copy, newh);
+		free(copy);
+	}
+
+	if (ret && TC_BUILTIN(chain, h)) {
+		const char *cur;
+
+		/* find_label may have been invalidated above. */
+		policy = TC_GET_POLICY(chain, &counters, &h);
+		cur = TC_GET_POLICY(chain, &counters, newh);
+		if (strcmp(policy, cur) != 0)
+			ret = TC_SET_POLICY(chain, policy, NULL, newh);
+	}
+	return ret;
+}
+
+static int hash_chains(TC_HANDLE_T h);
+
+/* Whether `chain' has the same rules and policy in `h' and `newh',
+   and `h' hasn't zeroed or set any of their counters.  Splicing such
+   a chain would only throw away what the kernel has counted since `h'
+   was read. */
+static int
+chain_unchanged(const char *chain, TC_HANDLE_T h, TC_HANDLE_T *newh)
+{
+	struct chain_cache *c, *nc;
+	STRUCT_ENTRY *e;
+	unsigned int index;
+
+	if (!hash_chains(h) || !hash_chains(*newh)
+	    || !(c = find_label(chain, h))
+	    || !(nc = find_label(chain, *newh)) || c->hash != nc->hash)
+		return 0;
+
+	index = entry2index(h, c->start);
+	for (e = c->start; ; e = (void *)e + e->next_offset, index++) {
+		if (h->counter_map[index].maptype != COUNTER_MAP_NORMAL_MAP)
+			return 0;
+		if (e == c->end)
+			return 1;
+	}
+}
+
+/* Rebuild `newh' (a fresh kernel snapshot) so that all chains owned
+   by `h' look the way they do in `h'. */
+static int
+splice_owned(TC_HANDLE_T h, TC_HANDLE_T *newh)
+{
+	unsigned int i;
+
+	/* Create owned chains first: the rules may jump between them. */
+	for (i = 0; i < h->num_owned; i++) {
+		if (find_label(h->owned[i], h)
+		    && !find_label(h->owned[i], *newh)
+		    && !TC_CREATE_CHAIN(h->owned[i], newh))
+			return 0;
+	}
+
+	for (i = 0; i < h->num_owned; i++) {
+		if (find_label(h->owned[i], h)) {
+			if (!chain_unchanged(h->owned[i], h, newh)
+			    && !splice_chain(h->owned[i], h, newh))
+				return 0;
+		} else if (find_label(h->owned[i], *newh)) {
+			/* We deleted it. */
+			if (!TC_FLUSH_ENTRIES(h->owned[i], newh)
+			    || !TC_DELETE_CHAIN(h->owned[i], newh))
+				return 0;
+		}
+	}
+	return 1;
+}
+
+/* Commit only the owned chains on top of whatever is in the kernel
+ * now: read the table again, splice our chains into it and replace
+ * it, all under the table lock (taken here if the caller didn't), so
+ * that no other writer using the lock can commit in between.  Chains
+ * we don't own go back as the kernel has them.  A writer that doesn't
+ * take the lock is caught by the kernel if it changed the number of
+ * rules (EAGAIN); our chains are then spliced into the newer table. */
+static int
+rebase_commit(TC_HANDLE_T *handle)
+{
+	TC_HANDLE_T fresh;
+	unsigned int tries;
+	int locked = lockfd != -1, ret = 0, err;
+
+	if (!locked && !TC_LOCK(ARPTC_LOCK_WAIT_FOREVER, REBASE_LOCK_INTERVAL))
+		return 0;
+	arptc_fn = TC_COMMIT;
+
+	for (tries = 0; tries < REBASE_RETRIES; tries++) {
+		if (!(fresh = TC_INIT((*handle)->info.name)))
+			goto out;
+		/* Spliced rules are queued appends until merged. */
+		if (!splice_owned(*handle, &fresh)
+		    || (fresh->pending && !merge_pending(&fresh))) {
+			TC_FREE(&fresh);
+			goto out;
+		}
+		ret = replace_table(&fresh);
+		err = errno;
+		TC_FREE(&fresh);
+		errno = err;
+		if (ret || errno != EAGAIN)
+			goto out;
+	}
+	arptc_fn = TC_COMMIT;
+	errno = EAGAIN;
+ out:
+	if (!locked) {
+		err = errno;
+		TC_UNLOCK();
+		errno = err;
+	}
+	return ret;
+}
+
+int
+TC_COMMIT(TC_HANDLE_T *handle)
+{
+	int ret;
+
+	/* Splicing works on chains; a plain replace can unpack as it goes. */
+	if ((*handle)->changed && (*handle)->num_owned)
+		UNPACK(handle);
+	else if ((*handle)->pending && !merge_pending(handle))
+		return 0;
+
+	if (!(*handle)->compact)
+		CHECK(*handle);
+#if 0
+	TC_DUMP_ENTRIES(*handle);
+#endif
+
+	/* Don't commit if nothing changed. */
+	if (!(*handle)->changed)
+		goto finished;
+
+	if ((*handle)->num_owned)
+		ret = rebase_commit(handle);
+	else
+		ret = replace_table(handle);
+	if (!ret)
+		return 0;
+
+ finished:
+	TC_FREE(handle);
+	return 1;
+}
+
+/* Binary snapshots: the SO_SET_REPLACE argument just as make_replace()
+ * lays it out, so that restoring one is a single setsockopt() on the
+ * mapped file.  The header gives the hook layout of the image and the
+ * target revisions it needs; the checksum covers everything after the
+ * header.  Entry counters are kept only with SNAPSHOT_COUNTERS. */
+#define SNAPSHOT_MAGIC		"arptcss"
+#define SNAPSHOT_VERSION	1
+#define SNAPSHOT_COUNTERS	0x1
+
+struct snapshot_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t numhooks;	/* RUNTIME_NF_ARP_NUMHOOKS of the image */
+	uint32_t flags;
+	uint32_t num_targets;	/* struct xt_get_revision records */
+	uint64_t repl_len;
+	uint64_t checksum;
+};
+
+/* Offset of the replace: after the target records, 8-byte aligned. */
+#define SNAPSHOT_REPL(n)						\
+	((sizeof(struct snapshot_header)				\
+	  + (n) * sizeof(struct xt_get_revision) + 7) & ~(size_t)7)
+
+/* A field after the hooks in a replace from make_replace(). */
+#define REPL_FIELD(repl, field)						\
+	((void *)(repl) + offsetof(STRUCT_REPLACE, field)		\
+	 - (NF_ARP_NUMHOOKS - RUNTIME_NF_ARP_NUMHOOKS)			\
+	   * 2 * sizeof(unsigned int))
+
+static int
+write_all(int fd, const void *data, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		if ((n = write(fd, data, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		data += n;
+		len -= n;
+	}
+	return 1;
+}
+
+int
+TC_SAVE_SNAPSHOT(int fd, int counters, TC_HANDLE_T *handle)
+{
+	static const char pad[8];
+	struct snapshot_header hdr;
+	struct xt_get_revision *targets = NULL, *more;
+	STRUCT_ENTRY_TARGET *t;
+	STRUCT_REPLACE *repl;
+	STRUCT_ENTRY *e;
+	unsigned int i, j, n = 0;
+	size_t len;
+	int ret = 0;
+
+	arptc_fn = TC_SAVE_SNAPSHOT;
+	if ((*handle)->pending && !merge_pending(handle))
+		return 0;
+	if (counters)
+		FRESH(handle);
+
+	if (!(repl = make_replace(*handle, NULL, &len)))
+		return 0;
+	memset(REPL_FIELD(repl, num_counters), 0, sizeof(repl->num_counters));
+	memset(REPL_FIELD(repl, counters), 0, sizeof(repl->counters));
+
+	e = REPL_FIELD(repl, entries);
+	for (i = 0; i < (*handle)->new_number;
+	     i++, e = (void *)e + e->next_offset) {
+		if (!counters)
+			e->counters = ((STRUCT_COUNTERS){ 0, 0 });
+		t = GET_TARGET(e);
+		if (strcmp(t->u.user.name, STANDARD_TARGET) == 0
+		    || strcmp(t->u.user.name, ERROR_TARGET) == 0)
+			continue;
+		for (j = 0; j < n; j++)
+			if (strcmp(targets[j].name, t->u.user.name) == 0
+			    && targets[j].revision == t->u.user.revision)
+				break;
+		if (j < n)
+			continue;
+		if (!(more = realloc(targets, (n + 1) * sizeof(*targets)))) {
+			errno = ENOMEM;
+			goto out;
+		}
+		targets = more;
+		memset(&targets[n], 0, sizeof(*targets));
+		memcpy(targets[n].name, t->u.user.name,
+		       sizeof(targets[n].name) - 1);
+		targets[n++].revision = t->u.user.revision;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	strcpy(hdr.magic, SNAPSHOT_MAGIC);
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.numhooks = RUNTIME_NF_ARP_NUMHOOKS;
+	hdr.flags = counters ? SNAPSHOT_COUNTERS : 0;
+	hdr.num_targets = n;
+	hdr.repl_len = len;
+	hdr.checksum = hash_bytes(hash_bytes(0xcbf29ce484222325ULL, targets,
+					     n * sizeof(*targets)),
+				  repl, len);
+
+	ret = write_all(fd, &hdr, sizeof(hdr))
+		&& write_all(fd, targets, n * sizeof(*targets))
+		&& write_all(fd, pad, SNAPSHOT_REPL(n) - sizeof(hdr)
+					- n * sizeof(*targets))
+		&& write_all(fd, repl, len);
+ out:
+	free(targets);
+	free(repl);
+	return ret;
+}
+
+/* Check a snapshot against this kernel; returns its replace. */
+static STRUCT_REPLACE *
+check_snapshot(void *image, size_t len, STRUCT_GETINFO *info)
+{
+	struct snapshot_header *hdr = image;
+	struct xt_get_revision *targets, rev;
+	STRUCT_REPLACE *repl;
+	unsigned int i;
+	socklen_t s;
+
+	if (len < sizeof(*hdr)
+	    || memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) != 0
+	    || hdr->version != SNAPSHOT_VERSION
+	    || hdr->num_targets > len / sizeof(*targets)
+	    || len < SNAPSHOT_REPL(hdr->num_targets)
+	    || hdr->repl_len != len - SNAPSHOT_REPL(hdr->num_targets)
+	    || hdr->repl_len < sizeof(*repl)
+			       - (NF_ARP_NUMHOOKS - 2) * 2 * sizeof(int)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	targets = image + sizeof(*hdr);
+	repl = image + SNAPSHOT_REPL(hdr->num_targets);
+	if (hash_bytes(hash_bytes(0xcbf29ce484222325ULL, targets,
+				  hdr->num_targets * sizeof(*targets)),
+		       repl, hdr->repl_len) != hdr->checksum) {
+		errno = EBADMSG;
+		return NULL;
+	}
+	if (!memchr(repl->name, '\0', sizeof(repl->name))) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* This also settles the kernel's hook layout. */
+	if (!open_socket() || !get_info(repl->name, info))
+		return NULL;
+	if (hdr->numhooks != RUNTIME_NF_ARP_NUMHOOKS) {
+		errno = ENOEXEC;
+		return NULL;
+	}
+	if (hdr->repl_len != (size_t)(REPL_FIELD(repl, entries) - (void *)repl)
+			     + repl->size) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	for (i = 0; i < hdr->num_targets; i++) {
+		rev = targets[i];
+		rev.name[sizeof(rev.name) - 1] = '\0';
+		s = sizeof(rev);
+		if (getsockopt(sockfd, TC_IPPROTO, ARPT_SO_GET_REVISION_TARGET,
+			       &rev, &s) < 0)
+			return NULL;
+	}
+	return repl;
+}
+
+int
+TC_CHECK_SNAPSHOT(void *image, size_t len)
+{
+	STRUCT_GETINFO info;
+
+	arptc_fn = TC_CHECK_SNAPSHOT;
+	return check_snapshot(image, len, &info) != NULL;
+}
+
+int
+TC_RESTORE_SNAPSHOT(void *image, size_t len, int counters)
+{
+	struct snapshot_header *hdr = image;
+	STRUCT_COUNTERS_INFO *newcounters = NULL;
+	STRUCT_COUNTERS *oldcounters;
+	STRUCT_REPLACE *repl;
+	STRUCT_GETINFO info;
+	STRUCT_ENTRY *e;
+	unsigned int i;
+	int cached;
+
+	arptc_fn = TC_RESTORE_SNAPSHOT;
+	if (!(repl = check_snapshot(image, len, &info)))
+		return 0;
+
+	/* The kernel hands back the old counters, wanted or not. */
+	oldcounters = malloc(sizeof(STRUCT_COUNTERS) * info.num_entries + 1);
+	if (counters && (hdr->flags & SNAPSHOT_COUNTERS))
+		newcounters = malloc(sizeof(STRUCT_COUNTERS_INFO)
+				     + sizeof(STRUCT_COUNTERS)
+				       * repl->num_entries);
+	if (!oldcounters
+	    || (!newcounters && counters && (hdr->flags & SNAPSHOT_COUNTERS))) {
+		free(oldcounters);
+		free(newcounters);
+		errno = ENOMEM;
+		return 0;
+	}
+	memcpy(REPL_FIELD(repl, num_counters), &info.num_entries,
+	       sizeof(repl->num_counters));
+	memcpy(REPL_FIELD(repl, counters), &oldcounters,
+	       sizeof(repl->counters));
+
+	cached = drop_cache(repl->name);
+	if (setsockopt(sockfd, TC_IPPROTO, SO_SET_REPLACE, repl,
+		       hdr->repl_len) < 0)
+		goto fail;
+
+	if (newcounters) {
+		strcpy(newcounters->name, repl->name);
+		newcounters->num_counters = repl->num_entries;
+		e = REPL_FIELD(repl, entries);
+		for (i = 0; i < repl->num_entries;
+		     i++, e = (void *)e + e->next_offset)
+			newcounters->counters[i] = e->counters;
+		if (setsockopt(sockfd, TC_IPPROTO, SO_SET_ADD_COUNTERS,
+			       newcounters, sizeof(STRUCT_COUNTERS_INFO)
+			       + sizeof(STRUCT_COUNTERS) * repl->num_entries)
+		    < 0)
+			goto fail;
+	}
+
+	free(oldcounters);
+	free(newcounters);
+	refresh_cache(repl->name, cached);
+	return 1;
+
+ fail:
+	free(oldcounters);
+	free(newcounters);
+	return 0;
+}
+
+/* Portable rule sets: the table as chains and rules, with nothing
+ * that depends on the kernel's layout or the host's byte order.
+ * After a header naming the table and listing the chains (with the
+ * policies and policy counters of the built-in ones) comes each
+ * chain's rules, column by column: a varint of the fields each rule
+ * sets, then each field for the rules that set it.  Numbers are
+ * varints; addresses and ARP header fields stay in network order.
+ * Addresses with their masks, MAC addresses, interfaces, ARP header
+ * tests and targets are dictionary-coded: a varint index into the
+ * values seen so far in the stream, or the next index and the new
+ * value.  Standard targets are stored as their label; other targets
+ * as name, revision and their data as the target's codec writes it.
+ * Both sides stream: the encoder writes a chain at a time, the
+ * decoder reads one. */
+#define PF_MAGIC	"arptcpf"
+#define PF_VERSION	2
+#define PF_COUNTERS	0x1
+
+/* Largest target data we take. */
+#define PF_MAX_DATA	65536
+
+#define PF_SRC		(1 << 0)
+#define PF_TGT		(1 << 1)
+#define PF_SRC_DEV	(1 << 2)
+#define PF_TGT_DEV	(1 << 3)
+#define PF_IFACES	(1 << 4)
+#define PF_ARP		(1 << 5)
+#define PF_FLAGS	(1 << 6)
+#define PF_COUNTERS_SET	(1 << 7)
+
+/* Dictionary values. */
+struct pf_addr
+{
+	struct in_addr addr, mask;
+};
+
+/* In network order, as in struct arpt_arp. */
+struct pf_arp
+{
+	uint16_t arpop, arpop_mask, arhrd, arhrd_mask, arpro, arpro_mask;
+	uint8_t arhln, arhln_mask;
+};
+
+enum { PF_DICT_ADDR, PF_DICT_DEV, PF_DICT_IFACE, PF_DICT_ARP,
+       PF_DICT_TARGET, PF_NUM_DICTS };
+
+struct pf_dict
+{
+	struct intern set;	/* encoder only */
+	struct cbuf blobs;
+	unsigned int *off, num;
+};
+
+static void
+free_dicts(struct pf_dict *d)
+{
+	unsigned int i;
+
+	for (i = 0; i < PF_NUM_DICTS; i++) {
+		free(d[i].set.slot);
+		free(d[i].blobs.data);
+		free(d[i].off);
+	}
+}
+
+static int
+put_dict(struct cbuf *out, struct pf_dict *d, const void *blob,
+	 unsigned int len)
+{
+	unsigned int num = d->num;
+	int idx;
+
+	idx = intern_blob(&d->set, &d->blobs, &d->off, &d->num, blob, len);
+	if (idx < 0 || !put_varint(out, idx))
+		return 0;
+	if ((unsigned int)idx == num)
+		return put_varint(out, len) && cbuf_put(out, blob, len);
+	return 1;
+}
+
+static int
+put_string(struct cbuf *out, const char *s)
+{
+	return put_varint(out, strlen(s)) && cbuf_put(out, s, strlen(s));
+}
+
+static int
+by_start(const void *a, const void *b)
+{
+	const struct chain_cache *x = *(const struct chain_cache **)a;
+	const struct chain_cache *y = *(const struct chain_cache **)b;
+
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/* The chain heads of `h' sorted by where they start, for rule_label(). */
+static const struct chain_cache **
+sorted_heads(const TC_HANDLE_T h)
+{
+	const struct chain_cache **heads;
+	unsigned int i;
+
+	if (!(heads = malloc((h->cache_num_chains + 1) * sizeof(*heads)))) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	for (i = 0; i < h->cache_num_chains; i++)
+		heads[i] = &h->cache_chain_heads[i];
+	qsort(heads, h->cache_num_chains, sizeof(*heads), by_start);
+	return heads;
+}
+
+/* target_name() with a binary search for jumps. */
+static const char *
+rule_label(const STRUCT_ENTRY *e, const TC_HANDLE_T h,
+	   const struct chain_cache **heads)
+{
+	const STRUCT_ENTRY_TARGET *t = GET_TARGET((STRUCT_ENTRY *)e);
+	const STRUCT_ENTRY *jumpto;
+	unsigned int lo, hi, mid;
+	int verdict;
+
+	if (strcmp(t->u.user.name, STANDARD_TARGET) != 0)
+		return t->u.user.name;
+
+	verdict = ((const STRUCT_STANDARD_TARGET *)t)->verdict;
+	if (verdict == RETURN)
+		return LABEL_RETURN;
+	else if (verdict == -NF_ACCEPT - 1)
+		return LABEL_ACCEPT;
+	else if (verdict == -NF_DROP - 1)
+		return LABEL_DROP;
+	else if (verdict == -NF_QUEUE - 1)
+		return LABEL_QUEUE;
+	else if (verdict < 0 || (unsigned int)verdict >= h->entries.size)
+		goto bad;
+
+	jumpto = get_entry(h, verdict);
+	if (jumpto == (void *)e + e->next_offset)
+		return "";
+	for (lo = 0, hi = h->cache_num_chains; lo < hi; ) {
+		mid = (lo + hi) / 2;
+		if (heads[mid]->start < jumpto)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < h->cache_num_chains && heads[lo]->start == jumpto)
+		return heads[lo]->name;
+ bad:
+	errno = EINVAL;
+	return NULL;
+}
+
+/* The dictionary value of a target. */
+static int
+pf_target(struct cbuf *b, const STRUCT_ENTRY *e, const TC_HANDLE_T h,
+	  const struct chain_cache **heads,
+	  const struct arptc_target_codec *codec)
+{
+	const STRUCT_ENTRY_TARGET *t = GET_TARGET((STRUCT_ENTRY *)e);
+	const char *label;
+	unsigned char kind;
+	int n;
+
+	b->len = 0;
+	if (strcmp(t->u.user.name, STANDARD_TARGET) != 0) {
+		unsigned char len = strnlen(t->u.user.name,
+					    sizeof(t->u.user.name));
+
+		kind = 1;
+		if (!cbuf_put(b, &kind, 1) || !cbuf_put(b, &len, 1)
+		    || !cbuf_put(b, t->u.user.name, len)
+		    || !cbuf_put(b, &t->u.user.revision, 1)
+		    || !cbuf_room(b, PF_MAX_DATA))
+			return 0;
+		/* Only the target knows what its data holds. */
+		if (!codec
+		    || (n = codec->encode(t, b->data + b->len,
+					  PF_MAX_DATA)) < 0
+		    || n > PF_MAX_DATA) {
+			arptc_fn = TC_ENCODE;
+			errno = EOPNOTSUPP;
+			return 0;
+		}
+		b->len += n;
+		return 1;
+	}
+
+	if (!(label = rule_label(e, h, heads)))
+		return 0;
+	kind = 0;
+	return cbuf_put(b, &kind, 1) && cbuf_put(b, label, strlen(label));
+}
+
+static int
+encode_chain(struct cbuf *out, struct pf_dict *dict, int counters,
+	     const struct chain_cache *c, const TC_HANDLE_T h,
+	     const struct chain_cache **heads,
+	     const struct arptc_target_codec *codec)
+{
+	const STRUCT_ENTRY *e, **rules = NULL, **more;
+	struct cbuf target = { 0, 0, NULL };
+	unsigned int i, n = 0, *bits = NULL, *mbits;
+	struct pf_addr a;
+	struct pf_arp arp;
+	int ret = 0;
+
+	for (e = c->start; e != c->end; e = (void *)e + e->next_offset) {
+		if ((n & (n - 1)) == 0) {
+			more = realloc(rules, (n ? 2 * n : 1) * sizeof(*rules));
+			mbits = realloc(bits, (n ? 2 * n : 1) * sizeof(*bits));
+			if (more)
+				rules = more;
+			if (mbits)
+				bits = mbits;
+			if (!more || !mbits) {
+				errno = ENOMEM;
+				goto out;
+			}
+		}
+		rules[n] = e;
+		bits[n] = 0;
+		if (e->arp.src.s_addr || e->arp.smsk.s_addr)
+			bits[n] |= PF_SRC;
+		if (e->arp.tgt.s_addr || e->arp.tmsk.s_addr)
+			bits[n] |= PF_TGT;
+		if (devaddr_len(&e->arp.src_devaddr))
+			bits[n] |= PF_SRC_DEV;
+		if (devaddr_len(&e->arp.tgt_devaddr))
+			bits[n] |= PF_TGT_DEV;
+		if (e->arp.iniface[0] || e->arp.iniface_mask[0]
+		    || e->arp.outiface[0] || e->arp.outiface_mask[0])
+			bits[n] |= PF_IFACES;
+		if (e->arp.arpop || e->arp.arpop_mask || e->arp.arhrd
+		    || e->arp.arhrd_mask || e->arp.arpro || e->arp.arpro_mask
+		    || e->arp.arhln || e->arp.arhln_mask)
+			bits[n] |= PF_ARP;
+		if (e->arp.flags || e->arp.invflags)
+			bits[n] |= PF_FLAGS;
+		if (counters && (e->counters.pcnt || e->counters.bcnt))
+			bits[n] |= PF_COUNTERS_SET;
+		/* No arptables match has a portable form. */
+		if (e->target_offset != sizeof(STRUCT_ENTRY)) {
+			arptc_fn = TC_ENCODE;
+			errno = EOPNOTSUPP;
+			goto out;
+		}
+		n++;
+	}
+
+	if (!put_varint(out, n))
+		goto out;
+	for (i = 0; i < n; i++)
+		if (!put_varint(out, bits[i]))
+			goto out;
+	for (i = 0; i < n; i++) {
+		if (!(bits[i] & PF_SRC))
+			continue;
+		a.addr = rules[i]->arp.src;
+		a.mask = rules[i]->arp.smsk;
+		if (!put_dict(out, &dict[PF_DICT_ADDR], &a, sizeof(a)))
+			goto out;
+	}
+	for (i = 0; i < n; i++) {
+		if (!(bits[i] & PF_TGT))
+			continue;
+		a.addr = rules[i]->arp.tgt;
+		a.mask = rules[i]->arp.tmsk;
+		if (!put_dict(out, &dict[PF_DICT_ADDR], &a, sizeof(a)))
+			goto out;
+	}
+	for (i = 0; i < n; i++)
+		if ((bits[i] & PF_SRC_DEV)
+		    && !put_dict(out, &dict[PF_DICT_DEV],
+				 &rules[i]->arp.src_devaddr,
+				 sizeof(rules[i]->arp.src_devaddr)))
+			goto out;
+	for (i = 0; i < n; i++)
+		if ((bits[i] & PF_TGT_DEV)
+		    && !put_dict(out, &dict[PF_DICT_DEV],
+				 &rules[i]->arp.tgt_devaddr,
+				 sizeof(rules[i]->arp.tgt_devaddr)))
+			goto out;
+	for (i = 0; i < n; i++) {
+		struct compact_iface in, outif;
+
+		if (!(bits[i] & PF_IFACES))
+			continue;
+		memcpy(in.name, rules[i]->arp.iniface, IFNAMSIZ);
+		memcpy(in.mask, rules[i]->arp.iniface_mask, IFNAMSIZ);
+		memcpy(outif.name, rules[i]->arp.outiface, IFNAMSIZ);
+		memcpy(outif.mask, rules[i]->arp.outiface_mask, IFNAMSIZ);
+		if (!put_dict(out, &dict[PF_DICT_IFACE], &in, sizeof(in))
+		    || !put_dict(out, &dict[PF_DICT_IFACE], &outif,
+				 sizeof(outif)))
+			goto out;
+	}
+	for (i = 0; i < n; i++) {
+		if (!(bits[i] & PF_ARP))
+			continue;
+		memset(&arp, 0, sizeof(arp));
+		arp.arpop = rules[i]->arp.arpop;
+		arp.arpop_mask = rules[i]->arp.arpop_mask;
+		arp.arhrd = rules[i]->arp.arhrd;
+		arp.arhrd_mask = rules[i]->arp.arhrd_mask;
+		arp.arpro = rules[i]->arp.arpro;
+		arp.arpro_mask = rules[i]->arp.arpro_mask;
+		arp.arhln = rules[i]->arp.arhln;
+		arp.arhln_mask = rules[i]->arp.arhln_mask;
+		if (!put_dict(out, &dict[PF_DICT_ARP], &arp, sizeof(arp)))
+			goto out;
+	}
+	for (i = 0; i < n; i++)
+		if ((bits[i] & PF_FLAGS)
+		    && (!cbuf_put(out, &rules[i]->arp.flags, 1)
+			|| !put_varint(out, rules[i]->arp.invflags)))
+			goto out;
+	for (i = 0; i < n; i++)
+		if ((bits[i] & PF_COUNTERS_SET)
+		    && (!put_varint(out, rules[i]->counters.pcnt)
+			|| !put_varint(out, rules[i]->counters.bcnt)))
+			goto out;
+	for (i = 0; i < n; i++)
+		if (!pf_target(&target, rules[i], h, heads, codec)
+		    || !put_dict(out, &dict[PF_DICT_TARGET], target.data,
+				 target.len))
+			goto out;
+	ret = 1;
+ out:
+	free(target.data);
+	free(rules);
+	free(bits);
+	return ret;
+}
+
+int
+TC_ENCODE(int fd, int counters, const struct arptc_target_codec *codec,
+	  TC_HANDLE_T *handle)
+{
+	struct pf_dict dict[PF_NUM_DICTS];
+	const struct chain_cache **heads = NULL;
+	struct cbuf out = { 0, 0, NULL };
+	STRUCT_COUNTERS pol;
+	const char *policy;
+	TC_HANDLE_T h;
+	unsigned int i;
+	int ret = 0;
+
+	if (!TC_FIRST_CHAIN(handle))
+		return 0;
+	arptc_fn = TC_ENCODE;
+	if (counters)
+		FRESH(handle);
+	h = *handle;
+	memset(dict, 0, sizeof(dict));
+
+	if (!(heads = sorted_heads(h)))
+		return 0;
+
+	if (!cbuf_put(&out, PF_MAGIC, sizeof(PF_MAGIC))
+	    || !put_varint(&out, PF_VERSION)
+	    || !put_varint(&out, counters ? PF_COUNTERS : 0)
+	    || !put_string(&out, h->info.name)
+	    || !put_varint(&out, h->cache_num_chains))
+		goto out;
+	for (i = 0; i < h->cache_num_chains; i++) {
+		const char *chain = h->cache_chain_heads[i].name;
+
+		policy = TC_GET_POLICY(chain, &pol, handle);
+		if (!put_string(&out, chain)
+		    || !put_string(&out, policy ? policy : ""))
+			goto out;
+		if (policy && counters
+		    && (!put_varint(&out, pol.pcnt)
+			|| !put_varint(&out, pol.bcnt)))
+			goto out;
+	}
+
+	for (i = 0; i < h->cache_num_chains; i++) {
+		if (!encode_chain(&out, dict, counters,
+				  &h->cache_chain_heads[i], h, heads, codec))
+			goto out;
+		if (out.len >= 65536) {
+			if (!write_all(fd, out.data, out.len))
+				goto out;
+			out.len = 0;
+		}
+	}
+	ret = write_all(fd, out.data, out.len);
+ out:
+	free(out.data);
+	free(heads);
+	free_dicts(dict);
+	return ret;
+}
+
+/* Buffered reading for the decoder. */
+struct pf_reader
+{
+	int fd;
+	unsigned int pos, len;
+	unsigned char buf[65536];
+};
+
+static int
+pf_read(struct pf_reader *r, void *data, size_t len)
+{
+	ssize_t n;
+	size_t chunk;
+
+	while (len) {
+		if (r->pos == r->len) {
+			do
+				n = read(r->fd, r->buf, sizeof(r->buf));
+			while (n < 0 && errno == EINTR);
+			if (n <= 0) {
+				if (n == 0) {
+					arptc_fn = TC_DECODE;
+					errno = EINVAL;
+				}
+				return 0;
+			}
+			r->pos = 0;
+			r->len = n;
+		}
+		chunk = r->len - r->pos < len ? r->len - r->pos : len;
+		memcpy(data, r->buf + r->pos, chunk);
+		r->pos += chunk;
+		data += chunk;
+		len -= chunk;
+	}
+	return 1;
+}
+
+/* Append `len' bytes of the stream to `b'. */
+static int
+pf_read_buf(struct pf_reader *r, struct cbuf *b, unsigned int len)
+{
+	unsigned char tmp[256];
+	unsigned int chunk;
+
+	while (len) {
+		chunk = len < sizeof(tmp) ? len : sizeof(tmp);
+		if (!pf_read(r, tmp, chunk) || !cbuf_put(b, tmp, chunk))
+			return 0;
+		len -= chunk;
+	}
+	return 1;
+}
+
+static int
+pf_varint(struct pf_reader *r, uint64_t *v)
+{
+	unsigned int shift;
+	unsigned char b;
+
+	for (*v = 0, shift = 0; shift < 64; shift += 7) {
+		if (!pf_read(r, &b, 1))
+			return 0;
+		*v |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return 1;
+	}
+	arptc_fn = TC_DECODE;
+	errno = EINVAL;
+	return 0;
+}
+
+/* A varint no bigger than `max'. */
+static int
+pf_uint(struct pf_reader *r, unsigned int *v, unsigned int max)
+{
+	uint64_t u;
+
+	if (!pf_varint(r, &u))
+		return 0;
+	if (u > max) {
+		arptc_fn = TC_DECODE;
+		errno = EINVAL;
+		return 0;
+	}
+	*v = u;
+	return 1;
+}
+
+static int
+pf_string(struct pf_reader *r, char *s, unsigned int size)
+{
+	unsigned int len;
+
+	if (!pf_uint(r, &len, size - 1) || !pf_read(r, s, len))
+		return 0;
+	s[len] = '\0';
+	return 1;
+}
+
+/* A dictionary value of exactly `len' bytes, or of at most `len' if
+   `len_out' is given. */
+static const void *
+get_dict(struct pf_reader *r, struct pf_dict *d, unsigned int len,
+	 unsigned int *len_out)
+{
+	unsigned int idx, n, *off;
+
+	if (!pf_uint(r, &idx, d->num))
+		return NULL;
+	if (idx == d->num) {
+		if (!pf_uint(r, &n, len)
+		    || (!len_out && n != len))
+			goto bad;
+		if ((d->num & (d->num - 1)) == 0) {
+			off = realloc(d->off, (d->num ? 2 * d->num : 1)
+				      * sizeof(*off));
+			if (!off) {
+				errno = ENOMEM;
+				return NULL;
+			}
+			d->off = off;
+		}
+		d->off[d->num++] = d->blobs.len;
+		if (!pf_read_buf(r, &d->blobs, n))
+			return NULL;
+	}
+	n = (idx + 1 < d->num ? d->off[idx + 1] : d->blobs.len)
+		- d->off[idx];
+	if (len_out)
+		*len_out = n;
+	return d->blobs.data + d->off[idx];
+ bad:
+	arptc_fn = TC_DECODE;
+	errno = EINVAL;
+	return NULL;
+}
+
+static int
+decode_chain(struct pf_reader *r, struct pf_dict *dict, int counters,
+	     const char *chain, const struct arptc_target_codec *codec,
+	     TC_HANDLE_T *handle)
+{
+	STRUCT_ENTRY *rules = NULL, *e;
+	unsigned int i, n, len, *bits = NULL, *more;
+	const struct pf_addr *a;
+	const struct pf_arp *arp;
+	const struct compact_iface *iface;
+	const unsigned char *t;
+	STRUCT_ENTRY_TARGET *et;
+	unsigned char *buf = NULL;
+	uint64_t v;
+	int ret = 0;
+
+	if (!pf_uint(r, &n, INT_MAX / sizeof(STRUCT_ENTRY)))
+		return 0;
+	/* Every rule has a byte of field bits at least: size the arrays
+	   by the bits actually read, not by what the count claims. */
+	for (i = 0; i < n; i++) {
+		if ((i & (i - 1)) == 0) {
+			more = realloc(bits, (i ? 2 * i : 1) * sizeof(*bits));
+			if (!more) {
+				errno = ENOMEM;
+				goto out;
+			}
+			bits = more;
+		}
+		if (!pf_uint(r, &bits[i], PF_COUNTERS_SET * 2 - 1))
+			goto out;
+	}
+	rules = calloc(n + 1, sizeof(*rules));
+	buf = malloc(sizeof(STRUCT_ENTRY) + sizeof(STRUCT_ENTRY_TARGET)
+		     + PF_MAX_DATA + ALIGN(sizeof(STRUCT_STANDARD_TARGET)));
+	if (!rules || !buf) {
+		errno = ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < n; i++) {
+		if (!(bits[i] & PF_SRC))
+			continue;
+		if (!(a = get_dict(r, &dict[PF_DICT_ADDR], sizeof(*a), NULL)))
+			goto out;
+		memcpy(&rules[i].arp.src, &a->addr, sizeof(a->addr));
+		memcpy(&rules[i].arp.smsk, &a->mask, sizeof(a->mask));
+	}
+	for (i = 0; i < n; i++) {
+		if (!(bits[i] & PF_TGT))
+			continue;
+		if (!(a = get_dict(r, &dict[PF_DICT_ADDR], sizeof(*a), NULL)))
+			goto out;
+		memcpy(&rules[i].arp.tgt, &a->addr, sizeof(a->addr));
+		memcpy(&rules[i].arp.tmsk, &a->mask, sizeof(a->mask));
+	}
+	for (i = 0; i < n; i++) {
+		if (!(bits[i] & PF_SRC_DEV))
+			continue;
+		if (!(t = get_dict(r, &dict[PF_DICT_DEV],
+				   sizeof(rules[i].arp.src_devaddr), NULL)))
+			goto out;
+		memcpy(&rules[i].arp.src_devaddr, t,
+		       sizeof(rules[i].arp.src_devaddr));
+	}
+	for (i = 0; i < n; i++) {
+		if (!(bits[i] & PF_TGT_DEV))
+			continue;
+		if (!(t = get_dict(r, &dict[PF_DICT_DEV],
+				   sizeof(rules[i].arp.tgt_devaddr), NULL)))
+			goto out;
+		memcpy(&rules[i].arp.tgt_devaddr, t,
+		       sizeof(rules[i].arp.tgt_devaddr));
+	}
+	for (i = 0; i < n; i++) {
+		if (!(bits[i] & PF_IFACES))
+			continue;
+		if (!(iface = get_dict(r, &dict[PF_DICT_IFACE],
+				       sizeof(*iface), NULL)))
+			goto out;
+		memcpy(rules[i].arp.iniface, iface->name, IFNAMSIZ);
+		memcpy(rules[i].arp.iniface_mask, iface->mask, IFNAMSIZ);
+		if (!(iface = get_dict(r, &dict[PF_DICT_IFACE],
+				       sizeof(*iface), NULL)))
+			goto out;
+		memcpy(rules[i].arp.outiface, iface->name, IFNAMSIZ);
+		memcpy(rules[i].arp.outiface_mask, iface->mask, IFNAMSIZ);
+	}
+	for (i = 0; i < n; i++) {
+		if (!(bits[i] & PF_ARP))
+			continue;
+		if (!(arp = get_dict(r, &dict[PF_DICT_ARP], sizeof(*arp),
+				     NULL)))
+			goto out;
+		rules[i].arp.arpop = arp->arpop;
+		rules[i].arp.arpop_mask = arp->arpop_mask;
+		rules[i].arp.arhrd = arp->arhrd;
+		rules[i].arp.arhrd_mask = arp->arhrd_mask;
+		rules[i].arp.arpro = arp->arpro;
+		rules[i].arp.arpro_mask = arp->arpro_mask;
+		rules[i].arp.arhln = arp->arhln;
+		rules[i].arp.arhln_mask = arp->arhln_mask;
+	}
+	for (i = 0; i < n; i++) {
+		if (!(bits[i] & PF_FLAGS))
+			continue;
+		if (!pf_read(r, &rules[i].arp.flags, 1)
+		    || !pf_uint(r, &len, 0xffff))
+			goto out;
+		rules[i].arp.invflags = len;
+	}
+	for (i = 0; i < n; i++) {
+		if (!(bits[i] & PF_COUNTERS_SET))
+			continue;
+		if (!pf_varint(r, &v))
+			goto out;
+		rules[i].counters.pcnt = counters ? v : 0;
+		if (!pf_varint(r, &v))
+			goto out;
+		rules[i].counters.bcnt = counters ? v : 0;
+	}
+
+	/* The targets come last, so each rule can go in as it's read. */
+	for (i = 0; i < n; i++) {
+		e = (STRUCT_ENTRY *)buf;
+		*e = rules[i];
+		e->target_offset = sizeof(STRUCT_ENTRY);
+		et = (STRUCT_ENTRY_TARGET *)(buf + e->target_offset);
+
+		if (!(t = get_dict(r, &dict[PF_DICT_TARGET], PF_MAX_DATA,
+				   &len)))
+			goto out;
+		if (len < 1)
+			goto bad;
+		if (t[0] == 0) {
+			/* Standard: the label. */
+			if (len - 1 >= sizeof(et->u.user.name))
+				goto bad;
+			memset(et, 0, ALIGN(sizeof(STRUCT_STANDARD_TARGET)));
+			et->u.target_size
+				= ALIGN(sizeof(STRUCT_STANDARD_TARGET));
+			memcpy(et->u.user.name, t + 1, len - 1);
+		} else {
+			/* name length, name, revision, data */
+			if (t[0] != 1 || len < 3 || t[1] == 0
+			    || t[1] >= sizeof(et->u.user.name)
+			    || len < 3u + t[1])
+				goto bad;
+			memset(et, 0, sizeof(*et));
+			memcpy(et->u.user.name, t + 2, t[1]);
+			et->u.user.revision = t[2 + t[1]];
+			len -= 3 + t[1];
+			switch (codec ? codec->decode(t + 3 + t[1], len, et,
+						      PF_MAX_DATA) : 0) {
+			case 0:
+				arptc_fn = TC_DECODE;
+				errno = EOPNOTSUPP;
+				goto out;
+			case 1:
+				break;
+			default:
+				goto bad;
+			}
+			if (et->u.target_size < sizeof(*et)
+			    || et->u.target_size > sizeof(*et) + PF_MAX_DATA
+			    || et->u.target_size != ALIGN(et->u.target_size))
+				goto bad;
+		}
+		e->next_offset = e->target_offset + et->u.target_size;
+		if (!TC_APPEND_ENTRY(chain, e, handle))
+			goto out;
+	}
+	ret = 1;
+	goto out;
+ bad:
+	arptc_fn = TC_DECODE;
+	errno = EINVAL;
+ out:
+	free(rules);
+	free(bits);
+	free(buf);
+	return ret;
+}
+
+int
+TC_DECODE(int fd, int counters, const struct arptc_target_codec *codec,
+	  TC_HANDLE_T *handle)
+{
+	struct pf_dict dict[PF_NUM_DICTS];
+	struct pf_reader *r;
+	ARPT_CHAINLABEL *chains = NULL, name;
+	STRUCT_COUNTERS pol;
+	char magic[sizeof(PF_MAGIC)], policy[32];
+	const char *chain;
+	unsigned int i, n, flags, old = 0;
+	uint64_t v;
+	int ret = 0;
+
+	arptc_fn = TC_DECODE;
+	memset(dict, 0, sizeof(dict));
+	if (!(r = malloc(sizeof(*r)))) {
+		errno = ENOMEM;
+		return 0;
+	}
+	r->fd = fd;
+	r->pos = r->len = 0;
+
+	if (!pf_read(r, magic, sizeof(magic)))
+		goto out;
+	if (memcmp(magic, PF_MAGIC, sizeof(magic)) != 0)
+		goto bad;
+	if (!pf_varint(r, &v))
+		goto out;
+	if (v != PF_VERSION) {
+		errno = EPROTONOSUPPORT;
+		goto out;
+	}
+	if (!pf_uint(r, &flags, ~0U) || !pf_string(r, name, sizeof(name)))
+		goto out;
+
+	if (!*handle && !(*handle = TC_INIT(name)))
+		goto out;
+	arptc_fn = TC_DECODE;
+	if (strcmp((*handle)->info.name, name) != 0)
+		goto bad;
+
+	/* Empty the table: rules first, so the chains lose their
+	   references, then the user-defined chains. */
+	for (chain = TC_FIRST_CHAIN(handle); chain;
+	     chain = TC_NEXT_CHAIN(handle), old++) {
+		ARPT_CHAINLABEL *more = realloc(chains, (old + 1)
+						* sizeof(*chains));
+
+		if (!more) {
+			errno = ENOMEM;
+			goto out;
+		}
+		chains = more;
+		strcpy(chains[old], chain);
+	}
+	for (i = 0; i < old; i++)
+		if (!TC_FLUSH_ENTRIES(chains[i], handle))
+			goto out;
+	for (i = 0; i < old; i++)
+		if (!TC_BUILTIN(chains[i], *handle)
+		    && !TC_DELETE_CHAIN(chains[i], handle))
+			goto out;
+	arptc_fn = TC_DECODE;
+
+	if (!pf_uint(r, &n, 65536))
+		goto out;
+	free(chains);
+	if (!(chains = calloc(n + 1, sizeof(*chains)))) {
+		errno = ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < n; i++) {
+		if (!pf_string(r, chains[i], sizeof(chains[i]))
+		    || !pf_string(r, policy, sizeof(policy)))
+			goto out;
+		pol.pcnt = pol.bcnt = 0;
+		if (*policy && (flags & PF_COUNTERS)) {
+			if (!pf_varint(r, &v))
+				goto out;
+			pol.pcnt = v;
+			if (!pf_varint(r, &v))
+				goto out;
+			pol.bcnt = v;
+		}
+		if (*policy) {
+			if (!TC_SET_POLICY(chains[i], policy,
+					   counters ? &pol : NULL, handle))
+				goto out;
+		} else if (!TC_CREATE_CHAIN(chains[i], handle))
+			goto out;
+	}
+
+	for (i = 0; i < n; i++)
+		if (!decode_chain(r, dict, counters, chains[i], codec,
+				  handle))
+			goto out;
+	ret = 1;
+	goto out;
+ bad:
+	arptc_fn = TC_DECODE;
+	errno = EINVAL;
+ out:
+	free(chains);
+	free(r);
+	free_dicts(dict);
+	return ret;
+}
+
+/* The canonical form of a rule: the ARP fields with addresses and
+ * interface names cut to their masks, and the target as its label, or
+ * its name, revision and as much of its data as `userspacesize' says
+ * is compared (all of it if NULL).  Rules that match and do the same
+ * have the same form, wherever they are in whichever table. */
+static int
+canon_rule(struct cbuf *key, const STRUCT_ENTRY *e, const char *label,
+	   unsigned int (*userspacesize)(const char *target))
+{
+	const STRUCT_ENTRY_TARGET *t = GET_TARGET((STRUCT_ENTRY *)e);
+	struct arpt_arp arp;
+	unsigned int i, size;
+
+	memset(&arp, 0, sizeof(arp));
+	arp = e->arp;
+	arp.src.s_addr &= arp.smsk.s_addr;
+	arp.tgt.s_addr &= arp.tmsk.s_addr;
+	for (i = 0; i < ARPT_DEV_ADDR_LEN_MAX; i++) {
+		arp.src_devaddr.addr[i] &= arp.src_devaddr.mask[i];
+		arp.tgt_devaddr.addr[i] &= arp.tgt_devaddr.mask[i];
+	}
+	for (i = 0; i < IFNAMSIZ; i++) {
+		if (!arp.iniface_mask[i])
+			arp.iniface[i] = 0;
+		if (!arp.outiface_mask[i])
+			arp.outiface[i] = 0;
+	}
+
+	key->len = 0;
+	if (!cbuf_put(key, &arp, sizeof(arp))
+	    || !cbuf_put(key, e->elems,
+			 e->target_offset - sizeof(STRUCT_ENTRY))
+	    || !cbuf_put(key, label, strlen(label) + 1))
+		return 0;
+	if (strcmp(t->u.user.name, STANDARD_TARGET) != 0) {
+		size = t->u.target_size - sizeof(*t);
+		if (userspacesize && userspacesize(label) < size)
+			size = userspacesize(label);
+		if (!cbuf_put(key, &t->u.user.revision, 1)
+		    || !cbuf_put(key, t->data, size))
+			return 0;
+	}
+	return 1;
+}
+
+/* Chain hashes.  A chain hashes the hashes of its rules' canonical
+ * forms, in order, and its policy; jumps are part of a rule's form by
+ * the name of the chain they go to, not its offset, so a chain keeps
+ * its hash however the chains around it grow.  Hashes are worked out
+ * for all chains at once, when first asked for, and live as long as
+ * the chain cache. */
+static int
+hash_chains(TC_HANDLE_T h)
+{
+	const struct chain_cache **heads;
+	const STRUCT_ENTRY *e;
+	struct chain_cache *c;
+	struct cbuf key = { 0, 0, NULL };
+	uint64_t hash, rule;
+	const char *label;
+	unsigned int i;
+	int ret = 0;
+
+	if (h->cache_chain_heads == NULL && !populate_cache(h))
+		return 0;
+	if (h->cache_num_chains == 0 || h->cache_chain_heads[0].hash)
+		return 1;
+	if (!(heads = sorted_heads(h)))
+		return 0;
+
+	for (i = 0; i < h->cache_num_chains; i++) {
+		c = &h->cache_chain_heads[i];
+		hash = 0xcbf29ce484222325ULL;
+		for (e = c->start; e != c->end;
+		     e = (void *)e + e->next_offset) {
+			if (!(label = rule_label(e, h, heads))
+			    || !canon_rule(&key, e, label, NULL))
+				goto out;
+			rule = hash_bytes(0xcbf29ce484222325ULL, key.data,
+					  key.len);
+			hash = hash_bytes(hash, &rule, sizeof(rule));
+		}
+		/* The policy, or RETURN for a user chain. */
+		hash = hash_bytes(hash, GET_TARGET(c->end)->data,
+				  sizeof(int));
+		c->hash = hash ? hash : 1;
+	}
+	ret = 1;
+ out:
+	free(key.data);
+	free(heads);
+	return ret;
+}
+
+int
+TC_CHAIN_HASH(const ARPT_CHAINLABEL chain, uint64_t *hash,
+	      TC_HANDLE_T *handle)
+{
+	struct chain_cache *c;
+
+	UNPACK(handle);
+
+	arptc_fn = TC_CHAIN_HASH;
+	if (!hash_chains(*handle))
+		return 0;
+	if (!(c = find_label(chain, *handle))) {
+		errno = ENOENT;
+		return 0;
+	}
+	*hash = c->hash;
+	return 1;
+}
+
+/* Edit scripts: the changes that turn the rules of one handle into
+ * those of another.  Rules are compared by canon_rule().  Chains whose
+ * hashes match are left alone without a look at their rules.  Each
+ * chain is diffed as a sequence of keys with Myers' algorithm in
+ * linear space, so the work grows with the size of the change; a rule
+ * deleted and inserted again in the same chain becomes a move, which
+ * keeps its counters. */
+#define DIFF_KEEP	0
+#define DIFF_DELETE	1
+#define DIFF_INSERT	2
+
+struct diff_ops
+{
+	unsigned int num, size;
+	unsigned char *op;
+};
+
+static int
+diff_put(struct diff_ops *d, unsigned char op, unsigned int count)
+{
+	if (d->num + count > d->size) {
+		unsigned int size = d->size ? d->size : 256;
+		unsigned char *new;
+
+		while (size < d->num + count)
+			size *= 2;
+		if (!(new = realloc(d->op, size))) {
+			errno = ENOMEM;
+			return 0;
+		}
+		d->op = new;
+		d->size = size;
+	}
+	memset(d->op + d->num, op, count);
+	d->num += count;
+	return 1;
+}
+
+/* Find a point (x, y) on a shortest edit path of a and b, searching from
+   both ends at once.  `v' has room for 2 * (n + m + 4) ints. */
+static int
+diff_bisect(const unsigned int *a, int n, const unsigned int *b, int m,
+	    int *v, int *x, int *y)
+{
+	int max_d = (n + m + 1) / 2, off = max_d + 1, len = 2 * max_d + 2;
+	int *v1 = v, *v2 = v + len, delta = n - m, front = delta & 1;
+	int k1start = 0, k1end = 0, k2start = 0, k2end = 0;
+	int d, k1, k2, x1, y1, x2, y2, i;
+
+	for (i = 0; i < len; i++)
+		v1[i] = v2[i] = -1;
+	v1[off + 1] = v2[off + 1] = 0;
+
+	for (d = 0; d < max_d; d++) {
+		for (k1 = -d + k1start; k1 <= d - k1end; k1 += 2) {
+			i = off + k1;
+			if (k1 == -d || (k1 != d && v1[i - 1] < v1[i + 1]))
+				x1 = v1[i + 1];
+			else
+				x1 = v1[i - 1] + 1;
+			y1 = x1 - k1;
+			while (x1 < n && y1 < m && a[x1] == b[y1]) {
+				x1++;
+				y1++;
+			}
+			v1[i] = x1;
+			if (x1 > n)
+				k1end += 2;
+			else if (y1 > m)
+				k1start += 2;
+			else if (front) {
+				i = off + delta - k1;
+				if (i >= 0 && i < len && v2[i] != -1
+				    && x1 >= n - v2[i]) {
+					*x = x1;
+					*y = y1;
+					return 1;
+				}
+			}
+		}
+		for (k2 = -d + k2start; k2 <= d - k2end; k2 += 2) {
+			i = off + k2;
+			if (k2 == -d || (k2 != d && v2[i - 1] < v2[i + 1]))
+				x2 = v2[i + 1];
+			else
+				x2 = v2[i - 1] + 1;
+			y2 = x2 - k2;
+			while (x2 < n && y2 < m
+			       && a[n - x2 - 1] == b[m - y2 - 1]) {
+				x2++;
+				y2++;
+			}
+			v2[i] = x2;
+			if (x2 > n)
+				k2end += 2;
+			else if (y2 > m)
+				k2start += 2;
+			else if (!front) {
+				i = off + delta - k2;
+				if (i >= 0 && i < len && v1[i] != -1
+				    && v1[i] >= n - x2) {
+					*x = v1[i];
+					*y = off + v1[i] - i;
+					return 1;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+static int
+diff_seq(const unsigned int *a, int n, const unsigned int *b, int m,
+	 int *v, struct diff_ops *d)
+{
+	int pre, suf, x, y;
+
+	for (pre = 0; pre < n && pre < m && a[pre] == b[pre]; pre++);
+	if (!diff_put(d, DIFF_KEEP, pre))
+		return 0;
+	a += pre, n -= pre;
+	b += pre, m -= pre;
+	for (suf = 0; suf < n && suf < m
+		     && a[n - suf - 1] == b[m - suf - 1]; suf++);
+	n -= suf;
+	m -= suf;
+
+	if (n && m && diff_bisect(a, n, b, m, v, &x, &y)) {
+		if (!diff_seq(a, x, b, y, v, d)
+		    || !diff_seq(a + x, n - x, b + y, m - y, v, d))
+			return 0;
+	} else if (!diff_put(d, DIFF_DELETE, n)
+		   || !diff_put(d, DIFF_INSERT, m))
+		return 0;
+	return diff_put(d, DIFF_KEEP, suf);
+}
+
+/* The rules of one chain, with the ids of their keys; none if the
+   chain hashes the same on the other side. */
+struct diff_chain
+{
+	const struct chain_cache *c;
+	int same;
+	unsigned int num;
+	const STRUCT_ENTRY **rule;
+	unsigned int *id;
+	const char **label;
+};
+
+struct diff_side
+{
+	TC_HANDLE_T h;
+	const struct chain_cache **heads;
+	struct diff_chain *chain;
+};
+
+struct diff_state
+{
+	unsigned int (*userspacesize)(const char *target);
+	struct intern set;
+	struct cbuf keys, key;
+	unsigned int *off, num_keys;
+	struct arptc_edit *edit;
+	unsigned int num_edits, size_edits;
+};
+
+static struct arptc_edit *
+new_edit(struct diff_state *s, enum arptc_edit_op op, const char *chain)
+{
+	struct arptc_edit *e;
+
+	if (s->num_edits == s->size_edits) {
+		unsigned int size = s->size_edits ? 2 * s->size_edits : 64;
+
+		if (!(e = realloc(s->edit, size * sizeof(*e)))) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		s->edit = e;
+		s->size_edits = size;
+	}
+	e = memset(&s->edit[s->num_edits++], 0, sizeof(*e));
+	e->op = op;
+	strcpy(e->chain, chain);
+	return e;
+}
+
+/* The canonical key of a rule. */
+static int
+diff_key(struct diff_state *s, const STRUCT_ENTRY *e, const char *label)
+{
+	if (!canon_rule(&s->key, e, label, s->userspacesize))
+		return -1;
+	return intern_blob(&s->set, &s->keys, &s->off, &s->num_keys,
+			   s->key.data, s->key.len);
+}
+
+static int
+diff_load(struct diff_state *s, struct diff_side *side, TC_HANDLE_T *handle,
+	  TC_HANDLE_T other)
+{
+	const struct chain_cache *o;
+	const STRUCT_ENTRY *e;
+	struct diff_chain *dc;
+	unsigned int i, n;
+	int id;
+
+	side->h = *handle;
+	if (!(side->heads = sorted_heads(side->h)))
+		return 0;
+	if (!(side->chain = calloc(side->h->cache_num_chains,
+				   sizeof(*side->chain)))) {
+		errno = ENOMEM;
+		return 0;
+	}
+	for (i = 0; i < side->h->cache_num_chains; i++) {
+		dc = &side->chain[i];
+		dc->c = &side->h->cache_chain_heads[i];
+		o = find_label(dc->c->name, other);
+		if ((dc->same = o && o->hash == dc->c->hash))
+			continue;
+		for (n = 0, e = dc->c->start; e != dc->c->end;
+		     e = (void *)e + e->next_offset)
+			n++;
+		dc->rule = malloc((n + 1) * sizeof(*dc->rule));
+		dc->id = malloc((n + 1) * sizeof(*dc->id));
+		dc->label = malloc((n + 1) * sizeof(*dc->label));
+		if (!dc->rule || !dc->id || !dc->label) {
+			errno = ENOMEM;
+			return 0;
+		}
+		for (e = dc->c->start; e != dc->c->end;
+		     e = (void *)e + e->next_offset) {
+			dc->rule[dc->num] = e;
+			if (!(dc->label[dc->num] = rule_label(e, side->h,
+							      side->heads))
+			    || (id = diff_key(s, e, dc->label[dc->num])) < 0)
+				return 0;
+			dc->id[dc->num++] = id;
+		}
+	}
+	return 1;
+}
+
+static void
+diff_free(struct diff_side *side)
+{
+	unsigned int i;
+
+	if (side->chain)
+		for (i = 0; i < side->h->cache_num_chains; i++) {
+			free(side->chain[i].rule);
+			free(side->chain[i].id);
+			free(side->chain[i].label);
+		}
+	free(side->chain);
+	free(side->heads);
+}
+
+static struct diff_chain *
+diff_find(struct diff_side *side, const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < side->h->cache_num_chains; i++)
+		if (strcmp(side->chain[i].c->name, name) == 0)
+			return &side->chain[i];
+	return NULL;
+}
+
+/* (id, index) pairs, to pair deleted rules with inserted ones. */
+struct diff_pair
+{
+	unsigned int id, i;
+};
+
+static int
+pair_cmp(const void *a, const void *b)
+{
+	const struct diff_pair *x = a, *y = b;
+
+	if (x->id != y->id)
+		return x->id < y->id ? -1 : 1;
+	return x->i < y->i ? -1 : x->i > y->i;
+}
+
+/* Turn the edit path `d' from `a' to `b' into edits of chain `name'.
+   Rule numbers are those of the chain as edited so far.  A moved rule
+   is left where it is until the walk reaches its new place; `pend'
+   holds those rules and their positions, `gone' the rules moved
+   forward before the walk reached them. */
+static int
+diff_walk(struct diff_state *s, const char *name, const struct diff_chain *a,
+	  const struct diff_chain *b, const struct diff_ops *d)
+{
+	struct diff_pair *del = NULL, *ins = NULL, *pend = NULL;
+	unsigned int ndel = 0, nins = 0, npend = 0, ngone = 0;
+	unsigned int i, j, k, p, q, pos, *gone = NULL;
+	int *amove = NULL, *bmove = NULL, ret = 0;
+	struct arptc_edit *e;
+
+	amove = malloc((a->num + 1) * sizeof(*amove));
+	bmove = malloc((b->num + 1) * sizeof(*bmove));
+	del = malloc((a->num + 1) * sizeof(*del));
+	ins = malloc((b->num + 1) * sizeof(*ins));
+	if (!amove || !bmove || !del || !ins) {
+		errno = ENOMEM;
+		goto out;
+	}
+	for (i = j = k = 0; k < d->num; k++) {
+		if (d->op[k] != DIFF_INSERT)
+			amove[i] = -1;
+		if (d->op[k] != DIFF_DELETE)
+			bmove[j] = -1;
+		if (d->op[k] == DIFF_DELETE)
+			del[ndel++] = (struct diff_pair){ a->id[i], i };
+		else if (d->op[k] == DIFF_INSERT)
+			ins[nins++] = (struct diff_pair){ b->id[j], j };
+		i += d->op[k] != DIFF_INSERT;
+		j += d->op[k] != DIFF_DELETE;
+	}
+	qsort(del, ndel, sizeof(*del), pair_cmp);
+	qsort(ins, nins, sizeof(*ins), pair_cmp);
+	for (i = j = 0; i < ndel && j < nins; ) {
+		if (del[i].id < ins[j].id)
+			i++;
+		else if (del[i].id > ins[j].id)
+			j++;
+		else {
+			amove[del[i].i] = ins[j].i;
+			bmove[ins[j].i] = del[i].i;
+			i++;
+			j++;
+		}
+	}
+	pend = del;
+	gone = (unsigned int *)ins;
+
+	for (i = j = k = pos = 0; k < d->num; k++) {
+		switch (d->op[k]) {
+		case DIFF_KEEP:
+			i++;
+			j++;
+			pos++;
+			break;
+		case DIFF_DELETE:
+			if (amove[i] < 0) {
+				if (!(e = new_edit(s, ARPTC_EDIT_DELETE, name)))
+					goto out;
+				e->rulenum = pos;
+				e->rule = a->rule[i];
+			} else {
+				for (q = 0; q < ngone && gone[q] != i; q++);
+				if (q == ngone) {
+					pend[npend++] = (struct diff_pair)
+						{ i, pos };
+					pos++;
+				}
+			}
+			i++;
+			break;
+		case DIFF_INSERT:
+			if (bmove[j] < 0) {
+				if (!(e = new_edit(s, ARPTC_EDIT_INSERT, name)))
+					goto out;
+				e->rulenum = pos++;
+				e->rule = b->rule[j];
+				e->target = b->label[j];
+				j++;
+				break;
+			}
+			if (!(e = new_edit(s, ARPTC_EDIT_MOVE, name)))
+				goto out;
+			e->rule = a->rule[bmove[j]];
+			e->target = a->label[bmove[j]];
+			for (q = 0; q < npend && pend[q].id != (unsigned)bmove[j];
+			     q++);
+			if (q < npend) {
+				/* Passed already: it moves back. */
+				e->from = p = pend[q].i;
+				e->rulenum = pos - 1;
+				pend[q] = pend[--npend];
+				for (q = 0; q < npend; q++)
+					if (pend[q].i > p)
+						pend[q].i--;
+			} else {
+				/* Still ahead: it moves forward. */
+				e->from = pos + bmove[j] - i;
+				for (q = 0; q < ngone; q++)
+					if (gone[q] >= i
+					    && gone[q] < (unsigned)bmove[j])
+						e->from--;
+				gone[ngone++] = bmove[j];
+				e->rulenum = pos++;
+			}
+			j++;
+			break;
+		}
+	}
+	ret = 1;
+ out:
+	free(amove);
+	free(bmove);
+	free(del);
+	free(ins);
+	return ret;
+}
+
+int
+TC_DIFF(TC_HANDLE_T *from, TC_HANDLE_T *to,
+	unsigned int (*userspacesize)(const char *target),
+	int (*fn)(const struct arptc_edit *edit, void *data), void *data)
+{
+	struct diff_side a, b;
+	struct diff_state s;
+	struct diff_chain *ac, *bc, none;
+	struct diff_ops d = { 0, 0, NULL };
+	STRUCT_COUNTERS unused;
+	const char *apol, *bpol;
+	struct arptc_edit *e;
+	unsigned int i, max = 0;
+	int *v = NULL, ret = 0;
+
+	memset(&a, 0, sizeof(a));
+	memset(&b, 0, sizeof(b));
+	memset(&s, 0, sizeof(s));
+	memset(&none, 0, sizeof(none));
+	s.userspacesize = userspacesize;
+	if (!TC_FIRST_CHAIN(from) || !TC_FIRST_CHAIN(to)
+	    || !hash_chains(*from) || !hash_chains(*to)
+	    || !diff_load(&s, &a, from, *to) || !diff_load(&s, &b, to, *from))
+		goto out;
+	arptc_fn = TC_DIFF;
+	if (strcmp(a.h->info.name, b.h->info.name) != 0) {
+		errno = EINVAL;
+		goto out;
+	}
+
+	/* New chains first, so rules can jump to them. */
+	for (i = 0; i < b.h->cache_num_chains; i++) {
+		bc = &b.chain[i];
+		if (!(ac = diff_find(&a, bc->c->name))) {
+			if (!new_edit(&s, ARPTC_EDIT_NEW_CHAIN, bc->c->name))
+				goto out;
+			continue;
+		}
+		if (ac->num + bc->num > max)
+			max = ac->num + bc->num;
+		apol = TC_GET_POLICY(ac->c->name, &unused, from);
+		bpol = TC_GET_POLICY(bc->c->name, &unused, to);
+		if (bpol && (!apol || strcmp(apol, bpol) != 0)) {
+			if (!(e = new_edit(&s, ARPTC_EDIT_POLICY,
+					   bc->c->name)))
+				goto out;
+			e->target = bpol;
+		}
+	}
+	arptc_fn = TC_DIFF;
+
+	if (!(v = malloc(2 * (max + 4) * sizeof(*v)))) {
+		errno = ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < b.h->cache_num_chains; i++) {
+		bc = &b.chain[i];
+		if (bc->same)
+			continue;
+		if (!(ac = diff_find(&a, bc->c->name)))
+			ac = &none;
+		d.num = 0;
+		if (!diff_seq(ac->id, ac->num, bc->id, bc->num, v, &d)
+		    || !diff_walk(&s, bc->c->name, ac, bc, &d))
+			goto out;
+	}
+
+	/* Empty the chains that go before deleting any, as they may
+	   jump to each other. */
+	for (i = 0; i < a.h->cache_num_chains; i++)
+		if (!diff_find(&b, a.chain[i].c->name)
+		    && a.chain[i].num
+		    && !new_edit(&s, ARPTC_EDIT_FLUSH, a.chain[i].c->name))
+			goto out;
+	for (i = 0; i < a.h->cache_num_chains; i++)
+		if (!diff_find(&b, a.chain[i].c->name)
+		    && !new_edit(&s, ARPTC_EDIT_DELETE_CHAIN,
+				 a.chain[i].c->name))
+			goto out;
+
+	for (i = 0; i < s.num_edits; i++)
+		if (!fn(&s.edit[i], data))
+			goto out;
+	ret = 1;
+ out:
+	diff_free(&a);
+	diff_free(&b);
+	free(s.set.slot);
+	free(s.keys.data);
+	free(s.key.data);
+	free(s.off);
+	free(s.edit);
+	free(d.op);
+	free(v);
+	return ret;
+}
+
+int
+TC_APPLY_EDIT(const struct arptc_edit *edit, TC_HANDLE_T *handle)
+{
+	STRUCT_ENTRY *e = NULL;
+	const STRUCT_ENTRY *r;
+	const char *label;
+	unsigned int n;
+	int ret = 0;
+
+	switch (edit->op) {
+	case ARPTC_EDIT_NEW_CHAIN:
+		return TC_CREATE_CHAIN(edit->chain, handle);
+	case ARPTC_EDIT_POLICY:
+		return TC_SET_POLICY(edit->chain, edit->target, NULL, handle);
+	case ARPTC_EDIT_DELETE:
+		return TC_DELETE_NUM_ENTRY(edit->chain, edit->rulenum, handle);
+	case ARPTC_EDIT_FLUSH:
+		return TC_FLUSH_ENTRIES(edit->chain, handle);
+	case ARPTC_EDIT_DELETE_CHAIN:
+		return TC_DELETE_CHAIN(edit->chain, handle);
+	case ARPTC_EDIT_INSERT:
+		r = edit->rule;
+		label = edit->target;
+		break;
+	case ARPTC_EDIT_MOVE:
+		/* The rule as it is in this handle, with its counters. */
+		FRESH(handle);
+		for (r = TC_FIRST_RULE(edit->chain, handle), n = 0;
+		     r && n < edit->from; r = TC_NEXT_RULE(r, handle), n++);
+		arptc_fn = TC_APPLY_EDIT;
+		if (!r) {
+			errno = E2BIG;
+			return 0;
+		}
+		label = target_name(*handle, r);
+		break;
+	default:
+		arptc_fn = TC_APPLY_EDIT;
+		errno = EINVAL;
+		return 0;
+	}
+
+	if (!(e = malloc(r->next_offset))) {
+		errno = ENOMEM;
+		return 0;
+	}
+	memcpy(e, r, r->next_offset);
+	if (strcmp(GET_TARGET(e)->u.user.name, STANDARD_TARGET) == 0) {
+		memset(GET_TARGET(e)->u.user.name, 0,
+		       sizeof(GET_TARGET(e)->u.user.name));
+		strncpy(GET_TARGET(e)->u.user.name, label,
+			sizeof(GET_TARGET(e)->u.user.name) - 1);
+	}
+	if (edit->op == ARPTC_EDIT_MOVE
+	    && !TC_DELETE_NUM_ENTRY(edit->chain, edit->from, handle))
+		goto out;
+	ret = TC_INSERT_ENTRY(edit->chain, e, edit->rulenum, handle);
+ out:
+	free(e);
+	return ret;
+}
+
+/* Declare `chain' as owned by this handle. */
+int
+TC_OWN_CHAIN(const ARPT_CHAINLABEL chain, TC_HANDLE_T *handle)
+{
+	ARPT_CHAINLABEL *owned;
+	unsigned int i;
+
+	arptc_fn = TC_OWN_CHAIN;
+
+	if (strlen(chain)+1 > sizeof(ARPT_CHAINLABEL)) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	for (i = 0; i < (*handle)->num_owned; i++)
+		if (strcmp((*handle)->owned[i], chain) == 0)
+			return 1;
+
+	owned = realloc((*handle)->owned,
+			((*handle)->num_owned + 1) * sizeof(ARPT_CHAINLABEL));
+	if (!owned) {
+		errno = ENOMEM;
+		return 0;
+	}
+	memset(owned[(*handle)->num_owned], 0, sizeof(ARPT_CHAINLABEL));
+	strcpy(owned[(*handle)->num_owned], chain);
+	(*handle)->owned = owned;
+	(*handle)->num_owned++;
+	return 1;
+}
+
+/* Frees a handle without committing it. */
+void
+TC_FREE(TC_HANDLE_T *handle)
+{
+	if ((*handle)->cache_chain_heads)
 		free((*handle)->cache_chain_heads);
+	free_query(*handle);
+	free_compact((*handle)->compact);
+	free_pending((*handle)->pending);
+	free_reload((*handle)->reload);
+	free((*handle)->owned);
 	free(*handle);
 	*handle = NULL;
+}
+
+static struct reload *
+dup_reload(const struct reload *r)
+{
+	struct reload *newr;
+
+	if (!(newr = calloc(1, sizeof(*newr))))
+		return NULL;
+	newr->num = r->num;
+	newr->size = r->size;
+	newr->rule = malloc(r->num * sizeof(*r->rule) + 1);
+	newr->rules = malloc(r->size + 1);
+	if (!newr->rule || !newr->rules) {
+		free_reload(newr);
+		return NULL;
+	}
+	memcpy(newr->rule, r->rule, r->num * sizeof(*r->rule));
+	memcpy(newr->rules, r->rules, r->size);
+	return newr;
+}
+
+/* A copy of the handle, changes and all, to go back to. */
+TC_HANDLE_T
+TC_DUP(TC_HANDLE_T *handle)
+{
+	TC_HANDLE_T h, newh;
+
+	arptc_fn = TC_DUP;
+	UNPACK(handle);
+
+	h = *handle;
+	newh = alloc_handle(h->info.name, h->entries.size, h->new_number);
+	if (!newh)
+		return NULL;
+
+	memcpy(newh->entries.entrytable, h->entries.entrytable,
+	       h->entries.size);
+	newh->entries.size = h->entries.size;
+	memcpy(newh->counter_map, h->counter_map,
+	       h->new_number * sizeof(struct counter_map));
+
+	newh->changed = h->changed;
+	newh->info = h->info;
+	newh->hooknames = h->hooknames;
+	newh->init_hash = h->init_hash;
+	newh->stale_counters = h->stale_counters;
+	newh->new_number = h->new_number;
+
+	if (h->num_owned) {
+		newh->owned = malloc(h->num_owned * sizeof(*h->owned));
+		if (!newh->owned)
+			goto nomem;
+		memcpy(newh->owned, h->owned,
+		       h->num_owned * sizeof(*h->owned));
+		newh->num_owned = h->num_owned;
+	}
+	if (h->reload && !(newh->reload = dup_reload(h->reload)))
+		goto nomem;
+	return newh;
+
+ nomem:
+	TC_FREE(&newh);
+	errno = ENOMEM;
+	return NULL;
+}
+
+static int
+chain_start_cmp(const void *a, const void *b)
+{
+	const struct chain_cache *x = *(struct chain_cache * const *)a;
+	const struct chain_cache *y = *(struct chain_cache * const *)b;
+
+	return (x->start > y->start) - (x->start < y->start);
+}
+
+/* Name of a jump target without entry2index(): find the user chain
+ * that starts at the jump destination. */
+static const char *
+query_target(TC_HANDLE_T h, const STRUCT_ENTRY *e,
+	     struct chain_cache **bystart, unsigned int num)
+{
+	STRUCT_ENTRY *jumpto;
+	unsigned int lo = 0, hi = num;
+	int spos;
+
+	if (strcmp(GET_TARGET((STRUCT_ENTRY *)e)->u.user.name,
+		   STANDARD_TARGET) != 0)
+		return GET_TARGET((STRUCT_ENTRY *)e)->u.user.name;
+
+	spos = *(const int *)GET_TARGET((STRUCT_ENTRY *)e)->data;
+	if (spos < 0)
+		return target_name(h, e);
+
+	jumpto = get_entry(h, spos);
+	if (jumpto == (void *)e + e->next_offset)
+		return "";
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (bystart[mid]->start == jumpto)
+			return bystart[mid]->name;
+		if (bystart[mid]->start < jumpto)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return target_name(h, e);
+}
+
+/* Build the rule table the indexes refer to. */
+static int
+query_rules(TC_HANDLE_T h)
+{
+	struct chain_cache **bystart;
+	struct query_cache *q;
+	unsigned int i;
+
+	if (h->cache_chain_heads == NULL && !populate_cache(h))
+		return 0;
+
+	q = calloc(1, sizeof(*q));
+	bystart = malloc(h->cache_num_chains * sizeof(*bystart));
+	if (q)
+		q->rules = malloc(h->new_number * sizeof(*q->rules));
+	if (!q || !bystart || !q->rules) {
+		if (q)
+			free(q->rules);
+		free(q);
+		free(bystart);
+		errno = ENOMEM;
+		return 0;
+	}
+
+	for (i = 0; i < h->cache_num_chains; i++)
+		bystart[i] = &h->cache_chain_heads[i];
+	qsort(bystart, h->cache_num_chains, sizeof(*bystart),
+	      chain_start_cmp);
+
+	for (i = 0; i < h->cache_num_chains; i++) {
+		const STRUCT_ENTRY *e;
+		unsigned int num = 0;
+
+		for (e = bystart[i]->start; e != bystart[i]->end;
+		     e = (void *)e + e->next_offset) {
+			struct query_rule *r = &q->rules[q->num_rules++];
+
+			r->e = e;
+			r->chain = bystart[i]->name;
+			r->target = query_target(h, e, bystart,
+						 h->cache_num_chains);
+			r->rulenum = ++num;
+		}
+	}
+
+	free(bystart);
+	h->query = q;
+	return 1;
+}
+
+static unsigned int
+query_width(unsigned int field)
+{
+	switch (field) {
+	case ARPTC_QUERY_SRC_IP:
+	case ARPTC_QUERY_TGT_IP:
+		return 32;
+	case ARPTC_QUERY_SRC_MAC:
+	case ARPTC_QUERY_TGT_MAC:
+		return 48;
+	case ARPTC_QUERY_OPCODE:
+		return 16;
+	}
+	return 0;
+}
+
+/* Mask of the first `bits' bits of a `width'-bit key. */
+static inline uint64_t
+prefix_mask(unsigned int bits, unsigned int width)
+{
+	if (!bits)
+		return 0;
+	return (~0ULL << (width - bits)) & ((1ULL << width) - 1);
+}
+
+static inline uint64_t
+mac_key(const unsigned char *mac)
+{
+	uint64_t key = 0;
+	unsigned int i;
+
+	for (i = 0; i < ETH_ALEN; i++)
+		key = (key << 8) | mac[i];
+	return key;
+}
+
+/* Numeric key, mask and inversion of `field' in a rule. */
+static void
+rule_num(const STRUCT_ENTRY *e, unsigned int field,
+	 uint64_t *key, uint64_t *mask, int *inv)
+{
+	const struct arpt_arp *arp = &e->arp;
+
+	switch (field) {
+	case ARPTC_QUERY_SRC_IP:
+		*key = ntohl(arp->src.s_addr);
+		*mask = ntohl(arp->smsk.s_addr);
+		*inv = arp->invflags & ARPT_INV_SRCIP;
+		break;
+	case ARPTC_QUERY_TGT_IP:
+		*key = ntohl(arp->tgt.s_addr);
+		*mask = ntohl(arp->tmsk.s_addr);
+		*inv = arp->invflags & ARPT_INV_TGTIP;
+		break;
+	case ARPTC_QUERY_SRC_MAC:
+		*key = mac_key((const unsigned char *)arp->src_devaddr.addr);
+		*mask = mac_key((const unsigned char *)arp->src_devaddr.mask);
+		*inv = arp->invflags & ARPT_INV_SRCDEVADDR;
+		break;
+	case ARPTC_QUERY_TGT_MAC:
+		*key = mac_key((const unsigned char *)arp->tgt_devaddr.addr);
+		*mask = mac_key((const unsigned char *)arp->tgt_devaddr.mask);
+		*inv = arp->invflags & ARPT_INV_TGTDEVADDR;
+		break;
+	case ARPTC_QUERY_OPCODE:
+		*key = ntohs(arp->arpop);
+		*mask = ntohs(arp->arpop_mask);
+		*inv = arp->invflags & ARPT_INV_ARPOP;
+		break;
+	}
+	*key &= *mask;
+}
+
+/* Numeric key and mask of a query term. */
+static void
+term_num(const struct arptc_query_term *t, unsigned int field,
+	 uint64_t *key, uint64_t *mask)
+{
+	unsigned int width = query_width(field);
+	unsigned int prefix = t->prefix > width ? width : t->prefix;
+
+	switch (field) {
+	case ARPTC_QUERY_SRC_IP:
+	case ARPTC_QUERY_TGT_IP:
+		*key = ntohl(t->u.ip.s_addr);
+		break;
+	case ARPTC_QUERY_SRC_MAC:
+	case ARPTC_QUERY_TGT_MAC:
+		*key = mac_key(t->u.mac);
+		break;
+	case ARPTC_QUERY_OPCODE:
+		*key = t->u.opcode;
+		prefix = width;
+		break;
+	}
+	*mask = prefix_mask(prefix, width);
+	*key &= *mask;
+}
+
+/* Interface name, mask and inversion of `field' in a rule. */
+static void
+rule_iface(const STRUCT_ENTRY *e, unsigned int field, const char **name,
+	   const unsigned char **mask, int *inv)
+{
+	if (field == ARPTC_QUERY_IN_IFACE) {
+		*name = e->arp.iniface;
+		*mask = e->arp.iniface_mask;
+		*inv = e->arp.invflags & ARPT_INV_VIA_IN;
+	} else {
+		*name = e->arp.outiface;
+		*mask = e->arp.outiface_mask;
+		*inv = e->arp.invflags & ARPT_INV_VIA_OUT;
+	}
+}
+
+/* The term's interface name, nul padded like the rules' names. */
+static void
+term_iface(const struct arptc_query_term *t, char *iface)
+{
+	memset(iface, 0, IFNAMSIZ);
+	memcpy(iface, t->u.iface, strnlen(t->u.iface, IFNAMSIZ - 1));
+}
+
+/* Does the rule test `field' for something the term matches?  Rules
+ * which don't test the field at all never match. */
+static int
+rule_matches(const struct query_rule *r, unsigned int field,
+	     const struct arptc_query_term *t)
+{
+	const unsigned char *mask;
+	const char *name;
+	char iface[IFNAMSIZ];
+	uint64_t key, rmask, qkey, qmask;
+	unsigned int i;
+	int inv, match;
+
+	switch (field) {
+	case ARPTC_QUERY_TARGET:
+		return strcmp(r->target, t->u.target) == 0;
+	case ARPTC_QUERY_IN_IFACE:
+	case ARPTC_QUERY_OUT_IFACE:
+		rule_iface(r->e, field, &name, &mask, &inv);
+		if (!mask[0])
+			return 0;
+		term_iface(t, iface);
+		for (i = 0; i < IFNAMSIZ; i++)
+			if ((iface[i] ^ name[i]) & mask[i])
+				break;
+		match = i == IFNAMSIZ;
+		return inv ? !match : match;
+	}
+
+	rule_num(r->e, field, &key, &rmask, &inv);
+	if (!rmask)
+		return 0;
+	term_num(t, field, &qkey, &qmask);
+
+	/* Some address of the query is in the rule's set... */
+	if (!inv)
+		return ((key ^ qkey) & rmask & qmask) == 0;
+	/* ...or, inverted, not all of them are. */
+	return (rmask & ~qmask) || ((key ^ qkey) & rmask);
+}
+
+/* Length of the leading run of one bits in `mask', or -1 if the mask
+ * isn't a prefix. */
+static int
+prefix_len(uint64_t mask, unsigned int width)
+{
+	unsigned int bits;
+
+	for (bits = 0; bits < width; bits++)
+		if (!(mask & (1ULL << (width - 1 - bits))))
+			break;
+	return mask == prefix_mask(bits, width) ? (int)bits : -1;
+}
+
+/* Same for an interface mask, in characters. */
+static int
+iface_prefix_len(const unsigned char *mask)
+{
+	unsigned int len, i;
+
+	for (len = 0; len < IFNAMSIZ && mask[len] == 0xFF; len++);
+	for (i = len; i < IFNAMSIZ; i++)
+		if (mask[i])
+			return -1;
+	return len;
+}
+
+static int
+num_key_cmp(const void *a, const void *b)
+{
+	const struct query_key *x = a, *y = b;
+
+	if (x->k.num != y->k.num)
+		return (x->k.num > y->k.num) - (x->k.num < y->k.num);
+	return (x->rule > y->rule) - (x->rule < y->rule);
+}
+
+/* Interface names sort on all IFNAMSIZ bytes, which keeps the names
+ * sharing any given prefix next to each other. */
+static int
+iface_key_cmp(const void *a, const void *b)
+{
+	const struct query_key *x = a, *y = b;
+	int ret;
+
+	ret = memcmp(x->k.str, y->k.str, IFNAMSIZ);
+	if (ret)
+		return ret;
+	return (x->rule > y->rule) - (x->rule < y->rule);
+}
+
+static int
+target_key_cmp(const void *a, const void *b)
+{
+	const struct query_key *x = a, *y = b;
+	int ret;
+
+	ret = strcmp(x->k.str, y->k.str);
+	if (ret)
+		return ret;
+	return (x->rule > y->rule) - (x->rule < y->rule);
+}
+
+static int
+add_key(struct query_index *idx, unsigned int bucket, unsigned int rule,
+	uint64_t num, const char *str)
+{
+	struct query_bucket *b = &idx->bucket[bucket];
+
+	/* Grow by doubling; the counts are powers of two when full. */
+	if ((b->num & (b->num - 1)) == 0) {
+		struct query_key *keys;
+
+		keys = realloc(b->keys, (b->num ? b->num * 2 : 1)
+			       * sizeof(*keys));
+		if (!keys) {
+			errno = ENOMEM;
+			return 0;
+		}
+		b->keys = keys;
+	}
+	if (str)
+		b->keys[b->num].k.str = str;
+	else
+		b->keys[b->num].k.num = num;
+	b->keys[b->num++].rule = rule;
+	return 1;
+}
+
+static int
+add_rest(struct query_index *idx, unsigned int rule)
+{
+	if ((idx->num_rest & (idx->num_rest - 1)) == 0) {
+		unsigned int *rest;
+
+		rest = realloc(idx->rest, (idx->num_rest ? idx->num_rest * 2
+					   : 1) * sizeof(*rest));
+		if (!rest) {
+			errno = ENOMEM;
+			return 0;
+		}
+		idx->rest = rest;
+	}
+	idx->rest[idx->num_rest++] = rule;
+	return 1;
+}
+
+/* Build the index of one field on first use. */
+static int
+build_index(struct query_cache *q, unsigned int field)
+{
+	struct query_index *idx = &q->index[field];
+	unsigned int width = query_width(field);
+	unsigned int i;
+
+	if (idx->built)
+		return 1;
+
+	for (i = 0; i < q->num_rules; i++) {
+		const STRUCT_ENTRY *e = q->rules[i].e;
+		const unsigned char *mask;
+		const char *name;
+		uint64_t key, rmask;
+		int inv, len, ok;
+
+		switch (field) {
+		case ARPTC_QUERY_TARGET:
+			ok = add_key(idx, 0, i, 0, q->rules[i].target);
+			break;
+		case ARPTC_QUERY_IN_IFACE:
+		case ARPTC_QUERY_OUT_IFACE:
+			rule_iface(e, field, &name, &mask, &inv);
+			if (!mask[0])
+				continue;
+			len = iface_prefix_len(mask);
+			if (inv || len < 0)
+				ok = add_rest(idx, i);
+			else
+				ok = add_key(idx, len, i, 0, name);
+			break;
+		default:
+			rule_num(e, field, &key, &rmask, &inv);
+			if (!rmask)
+				continue;
+			len = prefix_len(rmask, width);
+			if (inv || len < 0)
+				ok = add_rest(idx, i);
+			else
+				ok = add_key(idx, len, i, key, NULL);
+			break;
+		}
+		if (!ok)
+			return 0;
+	}
+
+	for (i = 0; i < QUERY_BUCKETS; i++) {
+		if (!idx->bucket[i].num)
+			continue;
+		qsort(idx->bucket[i].keys, idx->bucket[i].num,
+		      sizeof(struct query_key),
+		      width ? num_key_cmp : field == ARPTC_QUERY_TARGET
+		      ? target_key_cmp : iface_key_cmp);
+	}
+	idx->built = 1;
+	return 1;
+}
+
+struct rule_list
+{
+	unsigned int num, size;
+	unsigned int *rule;
+};
+
+static int
+list_add(struct rule_list *l, unsigned int rule)
+{
+	if (l->num == l->size) {
+		unsigned int *r;
+
+		r = realloc(l->rule, (l->size ? l->size * 2 : 16)
+			    * sizeof(*r));
+		if (!r) {
+			errno = ENOMEM;
+			return 0;
+		}
+		l->rule = r;
+		l->size = l->size ? l->size * 2 : 16;
+	}
+	l->rule[l->num++] = rule;
+	return 1;
+}
+
+/* First key in a sorted bucket not below `key'. */
+static unsigned int
+lower_num(const struct query_bucket *b, uint64_t key)
+{
+	unsigned int lo = 0, hi = b->num;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (b->keys[mid].k.num < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* First key in a sorted bucket whose first `len' characters (or the
+ * whole string, for len 0) aren't below `str'. */
+static unsigned int
+lower_str(const struct query_bucket *b, const char *str, unsigned int len,
+	  int upper)
+{
+	unsigned int lo = 0, hi = b->num;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		int cmp = len ? memcmp(b->keys[mid].k.str, str, len)
+			      : strcmp(b->keys[mid].k.str, str);
+
+		if (cmp < 0 || (upper && cmp == 0))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Collect the rules of one field that match a term. */
+static int
+lookup_index(struct query_cache *q, unsigned int field,
+	     const struct arptc_query_term *t, struct rule_list *l)
+{
+	struct query_index *idx = &q->index[field];
+	unsigned int width = query_width(field);
+	char iface[IFNAMSIZ];
+	unsigned int i, j, end;
+
+	if (!build_index(q, field))
+		return 0;
+
+	if (field == ARPTC_QUERY_IN_IFACE || field == ARPTC_QUERY_OUT_IFACE)
+		term_iface(t, iface);
+
+	for (i = 0; i < QUERY_BUCKETS; i++) {
+		const struct query_bucket *b = &idx->bucket[i];
+
+		if (!b->num)
+			continue;
+
+		if (width) {
+			uint64_t qkey, qmask, lo, hi;
+
+			/* Keys agreeing with the term on the bits both
+			 * of them test form one run of the bucket. */
+			term_num(t, field, &qkey, &qmask);
+			qmask &= prefix_mask(i, width);
+			lo = qkey & qmask;
+			hi = lo | (~qmask & prefix_mask(width, width));
+			j = lower_num(b, lo);
+			end = hi == ~0ULL ? b->num : lower_num(b, hi + 1);
+		} else if (field == ARPTC_QUERY_TARGET) {
+			j = lower_str(b, t->u.target, 0, 0);
+			end = lower_str(b, t->u.target, 0, 1);
+		} else {
+			j = lower_str(b, iface, i, 0);
+			end = lower_str(b, iface, i, 1);
+		}
+
+		for (; j < end; j++)
+			if (!list_add(l, b->keys[j].rule))
+				return 0;
+	}
+
+	for (i = 0; i < idx->num_rest; i++)
+		if (rule_matches(&q->rules[idx->rest[i]], field, t)
+		    && !list_add(l, idx->rest[i]))
+			return 0;
+
+	return 1;
+}
+
+static int
+rule_cmp(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+	return (x > y) - (x < y);
+}
+
+static int
+term_matches(const struct query_rule *r, const struct arptc_query_term *t)
+{
+	if (t->field == ARPTC_QUERY_IFACE)
+		return rule_matches(r, ARPTC_QUERY_IN_IFACE, t)
+			|| rule_matches(r, ARPTC_QUERY_OUT_IFACE, t);
+	return rule_matches(r, t->field, t);
+}
+
+/* Find the rules matching all of the given terms. */
+int
+TC_QUERY(const struct arptc_query_term *terms, unsigned int num_terms,
+	 STRUCT_QUERY_RESULT **result, unsigned int *num_results,
+	 TC_HANDLE_T *handle)
+{
+	struct rule_list best = { 0, 0, NULL };
+	struct query_cache *q;
+	unsigned int i, j, n;
+
+	UNPACK(handle);
+
+	arptc_fn = TC_QUERY;
+
+	for (i = 0; i < num_terms; i++)
+		if (terms[i].field > ARPTC_QUERY_IFACE) {
+			errno = EINVAL;
+			return 0;
+		}
+
+	if (!(*handle)->query && !query_rules(*handle))
+		return 0;
+	q = (*handle)->query;
+
+	/* Look every term up, keep the shortest answer... */
+	for (i = 0; i < num_terms; i++) {
+		struct rule_list l = { 0, 0, NULL };
+
+		if (terms[i].field == ARPTC_QUERY_IFACE) {
+			if (!lookup_index(q, ARPTC_QUERY_IN_IFACE, &terms[i], &l)
+			    || !lookup_index(q, ARPTC_QUERY_OUT_IFACE,
+					     &terms[i], &l)) {
+				free(l.rule);
+				free(best.rule);
+				return 0;
+			}
+		} else if (!lookup_index(q, terms[i].field, &terms[i], &l)) {
+			free(l.rule);
+			free(best.rule);
+			return 0;
+		}
+
+		if (i == 0 || l.num < best.num) {
+			free(best.rule);
+			best = l;
+		} else
+			free(l.rule);
+	}
+
+	if (num_terms == 0) {
+		for (i = 0; i < q->num_rules; i++)
+			if (!list_add(&best, i)) {
+				free(best.rule);
+				return 0;
+			}
+	}
+
+	/* ... and check the other terms directly on those rules. */
+	qsort(best.rule, best.num, sizeof(*best.rule), rule_cmp);
+
+	*result = malloc((best.num ? best.num : 1) * sizeof(**result));
+	if (!*result) {
+		free(best.rule);
+		errno = ENOMEM;
+		return 0;
+	}
+
+	for (i = n = 0; i < best.num; i++) {
+		const struct query_rule *r = &q->rules[best.rule[i]];
+
+		if (i && best.rule[i] == best.rule[i-1])
+			continue;
+		for (j = 0; j < num_terms; j++)
+			if (!term_matches(r, &terms[j]))
+				break;
+		if (j < num_terms)
+			continue;
+
+		(*result)[n].chain = r->chain;
+		(*result)[n].rulenum = r->rulenum;
+		(*result)[n].target = r->target;
+		(*result)[n].entry = r->e;
+		n++;
+	}
+	*num_results = n;
+
+	free(best.rule);
 	return 1;
 }
 
+static int
+reload_cmp(const void *a, const void *b)
+{
+	const struct reload_rule *x = a, *y = b;
+
+	if (x->hash != y->hash)
+		return (x->hash > y->hash) - (x->hash < y->hash);
+	return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+/* Flush `chain' for reloading: a rule appended to it later that is
+   identical to a flushed one takes over that rule's counters. */
+int
+TC_RELOAD_CHAIN(const ARPT_CHAINLABEL chain, TC_HANDLE_T *handle)
+{
+	struct chain_cache *c, **bystart;
+	const STRUCT_ENTRY *e;
+	unsigned int i, index, num = 0, size;
+	struct reload *r;
+	TC_HANDLE_T h;
+	void *new;
+
+	UNPACK(handle);
+	h = *handle;
+
+	arptc_fn = TC_RELOAD_CHAIN;
+	if (!(c = find_label(chain, h))) {
+		errno = ENOENT;
+		return 0;
+	}
+
+	for (e = c->start; e != c->end; e = (void *)e + e->next_offset)
+		num++;
+	size = (char *)c->end - (char *)c->start;
+
+	if (!h->reload && !(h->reload = calloc(1, sizeof(*h->reload))))
+		goto nomem;
+	r = h->reload;
+	if (!(new = realloc(r->rule, (r->num + num) * sizeof(*r->rule)
+			    + 1)))
+		goto nomem;
+	r->rule = new;
+	if (!(new = realloc(r->rules, r->size + size + 1)))
+		goto nomem;
+	r->rules = new;
+
+	/* Jump targets by chain start, as for queries. */
+	if (!(bystart = malloc(h->cache_num_chains * sizeof(*bystart))))
+		goto nomem;
+	for (i = 0; i < h->cache_num_chains; i++)
+		bystart[i] = &h->cache_chain_heads[i];
+	qsort(bystart, h->cache_num_chains, sizeof(*bystart),
+	      chain_start_cmp);
+
+	index = entry2index(h, c->start);
+	for (e = c->start; e != c->end;
+	     e = (void *)e + e->next_offset, index++) {
+		struct reload_rule *rr = &r->rule[r->num];
+		STRUCT_ENTRY *copy = (void *)(r->rules + r->size);
+
+		/* Only rules the kernel has counters for. */
+		if (h->counter_map[index].maptype != COUNTER_MAP_NORMAL_MAP
+		    && h->counter_map[index].maptype != COUNTER_MAP_ZEROED)
+			continue;
+
+		memcpy(copy, e, e->next_offset);
+		normalize_rule(copy,
+			       strcmp(GET_TARGET((STRUCT_ENTRY *)e)
+				      ->u.user.name, STANDARD_TARGET) == 0
+			       ? query_target(h, e, bystart,
+					      h->cache_num_chains)
+			       : NULL);
+
+		memset(rr, 0, sizeof(*rr));
+		strncpy(rr->chain, chain, sizeof(rr->chain) - 1);
+		rr->hash = reload_hash(rr->chain, copy);
+		rr->pos = r->size;
+		rr->size = e->next_offset;
+		rr->map = h->counter_map[index];
+		rr->counters = e->counters;
+		r->num++;
+		r->size += e->next_offset;
+	}
+	free(bystart);
+
+	qsort(r->rule, r->num, sizeof(*r->rule), reload_cmp);
+	return TC_FLUSH_ENTRIES(chain, handle);
+
+ nomem:
+	errno = ENOMEM;
+	return 0;
+}
+
 /* Get raw socket. */
 int
 TC_GET_RAW_SOCKET()
@@ -1720,6 +6123,129 @@ TC_GET_RAW_SOCKET()
 	return sockfd;
 }
 
+/* The table lock.
+ *
+ * flock() alone gives no ordering between waiters, so the lock file
+ * doubles as a ticket dispenser: the first eight bytes hold the next
+ * ticket number, and every ticket holder keeps a one-byte record lock
+ * at LOCK_SLOT_BASE + ticket until it is done.  The lock is ours once
+ * no slot below our own is locked any more.  Record locks go away with
+ * the process, so a crashed holder never wedges the queue.
+ */
+#define LOCK_SLOT_BASE	64
+
+static struct timeval lock_taken;
+static STRUCT_LOCK_STATS lock_stats;
+
+static unsigned long long
+usec_since(const struct timeval *since)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - since->tv_sec) * 1000000ULL
+		+ now.tv_usec - since->tv_usec;
+}
+
+static int
+lock_slot(int fd, int cmd, short type, uint64_t start, uint64_t len)
+{
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = LOCK_SLOT_BASE + start;
+	fl.l_len = len;
+	if (fcntl(fd, cmd, &fl) < 0)
+		return -1;
+	return cmd == F_GETLK ? fl.l_type != F_UNLCK : 0;
+}
+
+int
+TC_LOCK(int wait, unsigned int interval)
+{
+	const char *name;
+	struct timeval start;
+	uint64_t ticket, next;
+	int fd, busy;
+
+	arptc_fn = TC_LOCK;
+
+	/* Already ours. */
+	if (lockfd != -1)
+		return 1;
+
+	name = getenv(LOCK_NAME_ENV);
+	if (!name || !*name)
+		name = LOCK_NAME;
+
+	fd = open(name, O_CREAT | O_RDWR | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return 0;
+
+	gettimeofday(&start, NULL);
+
+	/* Take a ticket and claim its slot. */
+	if (flock(fd, LOCK_EX) < 0)
+		goto fail;
+	if (pread(fd, &ticket, sizeof(ticket), 0) != sizeof(ticket))
+		ticket = 0;
+	next = ticket + 1;
+	if (pwrite(fd, &next, sizeof(next), 0) != sizeof(next)
+	    || lock_slot(fd, F_SETLK, F_WRLCK, ticket, 1) < 0) {
+		flock(fd, LOCK_UN);
+		goto fail;
+	}
+	flock(fd, LOCK_UN);
+
+	/* Wait for everybody who queued before us. */
+	while (ticket > 0
+	       && (busy = lock_slot(fd, F_GETLK, F_WRLCK, 0, ticket)) != 0) {
+		if (busy < 0)
+			goto fail;
+		if (wait == 0) {
+			errno = EWOULDBLOCK;
+			goto fail;
+		}
+		if (wait > 0 && usec_since(&start) >= wait * 1000000ULL) {
+			errno = ETIMEDOUT;
+			goto fail;
+		}
+		usleep(interval);
+	}
+
+	lockfd = fd;
+	gettimeofday(&lock_taken, NULL);
+	lock_stats.wait_usec = usec_since(&start);
+	lock_stats.hold_usec = 0;
+	return 1;
+
+fail:
+	busy = errno;
+	close(fd);
+	errno = busy;
+	return 0;
+}
+
+void
+TC_UNLOCK(void)
+{
+	if (lockfd == -1)
+		return;
+
+	lock_stats.hold_usec = usec_since(&lock_taken);
+	/* Closing drops our slot and lets the next ticket in. */
+	close(lockfd);
+	lockfd = -1;
+}
+
+const STRUCT_LOCK_STATS *
+TC_GET_LOCK_STATS(void)
+{
+	return &lock_stats;
+}
+
 /* Translates errno numbers into more human-readable form than strerror. */
 const char *
 TC_STRERROR(int err)
@@ -1734,6 +6260,10 @@ TC_STRERROR(int err)
 	    { TC_INIT, EINVAL, "Module is wrong version" },
 	    { TC_INIT, ENOENT, 
 		    "Table does not exist (do you need to insmod?)" },
+	    { TC_INIT_CACHED, EPERM, "Permission denied (you must be root)" },
+	    { TC_INIT_CACHED, EINVAL, "Module is wrong version" },
+	    { TC_INIT_CACHED, ENOENT,
+		    "Table does not exist (do you need to insmod?)" },
 	    { TC_DELETE_CHAIN, ENOTEMPTY, "Chain is not empty" },
 	    { TC_DELETE_CHAIN, EINVAL, "Can't delete built-in chain" },
 	    { TC_DELETE_CHAIN, EMLINK,
@@ -1758,6 +6288,46 @@ TC_STRERROR(int err)
 	      "Bad built-in chain name" },
 	    { TC_SET_POLICY, EINVAL,
 	      "Bad policy name" },
+	    { TC_COMMIT, EAGAIN,
+	      "Table kept changing while rebasing owned chains" },
+	    { TC_COMMIT, ENOENT,
+	      "Owned chain jumps to a chain that no longer exists" },
+	    { TC_OWN_CHAIN, EINVAL, "Chain name too long" },
+	    { TC_QUERY, EINVAL, "Unknown query field" },
+	    { TC_CHAIN_SPAN, ENOENT, "No chain by that name" },
+	    { TC_REFRESH_COUNTERS, EAGAIN,
+	      "Table changed since it was cached" },
+	    { TC_RESTORE_SNAPSHOT, EINVAL, "Not an arptables snapshot" },
+	    { TC_RESTORE_SNAPSHOT, EBADMSG, "Snapshot is corrupt" },
+	    { TC_RESTORE_SNAPSHOT, ENOEXEC,
+	      "Snapshot is for a kernel with a different number of hooks" },
+	    { TC_RESTORE_SNAPSHOT, ENOENT,
+	      "Snapshot uses a target this kernel lacks" },
+	    { TC_RESTORE_SNAPSHOT, EPROTONOSUPPORT,
+	      "Snapshot uses a target revision this kernel lacks" },
+	    { TC_DECODE, EINVAL, "Not a portable rule set, or a damaged one" },
+	    { TC_DECODE, EPROTONOSUPPORT,
+	      "Portable rule set from another version" },
+	    { TC_DECODE, EOPNOTSUPP,
+	      "Portable rule set has a target that can't be read" },
+	    { TC_ENCODE, EOPNOTSUPP,
+	      "Rule set has a match or target with no portable form" },
+	    { TC_CHAIN_HASH, ENOENT, "No chain by that name" },
+	    { TC_DIFF, EINVAL, "Rule sets of different tables" },
+	    { TC_APPLY_EDIT, E2BIG, "Index of move too big" },
+	    { TC_APPLY_EDIT, EINVAL, "Unknown edit" },
+	    { TC_CHECK_SNAPSHOT, EINVAL, "Not an arptables snapshot" },
+	    { TC_CHECK_SNAPSHOT, EBADMSG, "Snapshot is corrupt" },
+	    { TC_CHECK_SNAPSHOT, ENOEXEC,
+	      "Snapshot is for a kernel with a different number of hooks" },
+	    { TC_CHECK_SNAPSHOT, ENOENT,
+	      "Snapshot uses a target this kernel lacks" },
+	    { TC_CHECK_SNAPSHOT, EPROTONOSUPPORT,
+	      "Snapshot uses a target revision this kernel lacks" },
+	    { TC_LOCK, EWOULDBLOCK,
+	      "Another app is currently holding the arptables lock" },
+	    { TC_LOCK, ETIMEDOUT,
+	      "Timed out waiting for the arptables lock" },
 
 	    { NULL, 0, "Incompatible with this kernel" },
 	    { NULL, ENOPROTOOPT, "arptables who? (do you need to insmod?)" },